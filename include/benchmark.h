@@ -0,0 +1,380 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#if ENABLE_BENCHMARKS
+
+#include <Arduino.h>
+#include "config.h"
+#include "elm327_protocol.h"
+#include "pid_handler.h"
+#include "vehicle_model.h"
+#include "waveform.h"
+
+/**
+ * On-device micro benchmarks (set ENABLE_BENCHMARKS in config.h)
+ *
+ * Runs once from setup() and prints results to Serial. Cycle counts come
+ * from ESP.getCycleCount(); heap figures are sampled before and after each
+ * run so allocation churn shows up as lost free heap / a shrinking largest
+ * free block. Legacy reference implementations are kept here (and only
+ * here) so the numbers always compare against the code they replaced.
+ */
+class Benchmarks {
+private:
+    static const uint16_t ITERATIONS = 1000;
+
+    struct HeapSample {
+        uint32_t freeHeap;
+        uint32_t maxBlock;
+    };
+
+    static HeapSample sampleHeap() {
+        HeapSample s;
+        s.freeHeap = ESP.getFreeHeap();
+        #ifdef ESP01_BUILD
+            s.maxBlock = ESP.getMaxFreeBlockSize();
+        #else
+            s.maxBlock = ESP.getMaxAllocHeap();
+        #endif
+        return s;
+    }
+
+    static void report(const char* name, uint32_t cycles, uint32_t ops,
+                       const HeapSample& before, const HeapSample& after) {
+        Serial.printf("  %-28s %7lu cycles/op  heap %lu -> %lu  max block %lu -> %lu\n",
+                      name, (unsigned long)(cycles / ops),
+                      (unsigned long)before.freeHeap, (unsigned long)after.freeHeap,
+                      (unsigned long)before.maxBlock, (unsigned long)after.maxBlock);
+    }
+
+    // AT commands an app typically sends during init and while polling
+    static const char* const* atCommandSet(uint8_t& count) {
+        static const char* const commands[] = {
+            "ATE0", "ATL0", "ATS0", "ATH1", "ATSP6", "ATST32",
+            "ATAT1", "ATDPN", "ATRV", "ATI", "ATCAF1", "ATM0"
+        };
+        count = sizeof(commands) / sizeof(commands[0]);
+        return commands;
+    }
+
+    // Reference: the String-based if/else chain ELM327Protocol used before
+    // the table-driven parser (only the echo setting is kept, as no reply
+    // to the command set above depends on the others)
+    static String legacyHandleCommand(String cmd) {
+        static bool echo = true;
+
+        cmd.trim();
+        cmd.toUpperCase();
+        cmd.replace(" ", "");
+
+        String response = "";
+        if (echo) {
+            response = cmd + "\r";
+        }
+
+        if (cmd == "ATZ" || cmd == "AT Z") {
+            return response + ELM_DEVICE_DESC "\r\r>";
+        } else if (cmd == "ATI" || cmd == "AT I") {
+            return response + ELM_DEVICE_ID "\r\r>";
+        } else if (cmd == "AT@1") {
+            return response + ELM_DEVICE_DESC "\r\r>";
+        } else if (cmd == "AT@2") {
+            return response + "?\r\r>";
+        } else if (cmd == "ATRV") {
+            return response + ELM_VOLTAGE "\r\r>";
+        } else if (cmd.startsWith("ATE")) {
+            echo = (cmd.charAt(3) == '1');
+            return response + "OK\r\r>";
+        } else if (cmd.startsWith("ATH")) {
+            return response + "OK\r\r>";
+        } else if (cmd.startsWith("ATS")) {
+            return response + "OK\r\r>";
+        } else if (cmd.startsWith("ATL")) {
+            return response + "OK\r\r>";
+        } else if (cmd.startsWith("ATSP")) {
+            return response + "OK\r\r>";
+        } else if (cmd.startsWith("ATTP")) {
+            return response + "OK\r\r>";
+        } else if (cmd.startsWith("ATST")) {
+            return response + "OK\r\r>";
+        } else if (cmd == "ATDPN" || cmd == "ATDP") {
+            if (cmd == "ATDPN") return response + "6\r\r>";
+            return response + "ISO 15765-4 (CAN 11/500)\r\r>";
+        } else if (cmd == "ATAT0" || cmd == "ATAT1" || cmd == "ATAT2") {
+            return response + "OK\r\r>";
+        } else if (cmd.startsWith("ATM")) {
+            return response + "OK\r\r>";
+        } else if (cmd.startsWith("ATCAF")) {
+            return response + "OK\r\r>";
+        } else if (cmd == "ATD") {
+            return response + "OK\r\r>";
+        } else if (cmd.startsWith("ATWS")) {
+            return response + "ELM327 v1.5\r\r>";
+        } else if (cmd.startsWith("ATSW")) {
+            return response + "OK\r\r>";
+        } else if (cmd == "AT" || cmd.length() == 0) {
+            return response + "OK\r\r>";
+        }
+        return response + "?\r\r>";
+    }
+
+    static void benchmarkATParser(ELM327Protocol* elm) {
+        uint8_t count;
+        const char* const* commands = atCommandSet(count);
+        char cmd[MAX_COMMAND_LENGTH];
+        char out[MAX_RESPONSE_LENGTH];
+        uint32_t checksum = 0;
+
+        Serial.println("AT command parser:");
+
+        HeapSample before = sampleHeap();
+        uint32_t start = ESP.getCycleCount();
+        for (uint16_t i = 0; i < ITERATIONS; i++) {
+            for (uint8_t c = 0; c < count; c++) {
+                String response = legacyHandleCommand(commands[c]);
+                checksum += response.length();
+            }
+        }
+        uint32_t cycles = ESP.getCycleCount() - start;
+        report("legacy String chain", cycles, (uint32_t)ITERATIONS * count, before, sampleHeap());
+
+        before = sampleHeap();
+        start = ESP.getCycleCount();
+        for (uint16_t i = 0; i < ITERATIONS; i++) {
+            for (uint8_t c = 0; c < count; c++) {
+                // Copy in like a transport would, then normalize in place
+                strncpy(cmd, commands[c], sizeof(cmd) - 1);
+                cmd[sizeof(cmd) - 1] = '\0';
+                ELM327Protocol::normalizeCommand(cmd);
+                checksum += elm->handleCommand(cmd, out, sizeof(out));
+            }
+        }
+        cycles = ESP.getCycleCount() - start;
+        report("table dispatch (fixed buf)", cycles, (uint32_t)ITERATIONS * count, before, sampleHeap());
+
+        elm->reset();
+        Serial.printf("  (checksum %lu)\n", (unsigned long)checksum);
+    }
+
+    // Polling requests as a dashboard app sends them (ATS1, ATH0)
+    static const char* const* obdRequestSet(uint8_t& count) {
+        static const char* const requests[] = {
+            "010C", "010D", "0105", "010F", "0111", "0110", "0104", "010B"
+        };
+        count = sizeof(requests) / sizeof(requests[0]);
+        return requests;
+    }
+
+    // Reference: the String pipeline PIDHandler used before the fixed
+    // buffer writer - substring/strtol parsing, sprintf per byte and String
+    // concatenation. The ECU data is a constant; only the text churn differs.
+    static String legacyHandleRequest(String request, bool spaces, bool headers) {
+        static const uint8_t data[2] = {0x1A, 0xF8};
+        char buf[4];
+
+        request.trim();
+        request.toUpperCase();
+        request.replace(" ", "");
+        if (request.length() < 4) return "?\r\r>";
+
+        uint8_t mode = strtol(request.substring(0, 2).c_str(), NULL, 16);
+        uint8_t pid = strtol(request.substring(2, 4).c_str(), NULL, 16);
+
+        String response = "";
+        if (headers) {
+            response = "7E8";
+            if (spaces) response += " ";
+            sprintf(buf, spaces ? "%02X " : "%02X", 2 + (int)sizeof(data));
+            response += buf;
+        }
+        sprintf(buf, spaces ? "%02X " : "%02X", mode + 0x40);
+        response += buf;
+        sprintf(buf, spaces ? "%02X " : "%02X", pid);
+        response += buf;
+        for (uint8_t i = 0; i < sizeof(data); i++) {
+            sprintf(buf, (spaces && i < sizeof(data) - 1) ? "%02X " : "%02X", data[i]);
+            response += buf;
+        }
+        response += "\r\r>";
+        return response;
+    }
+
+    static void benchmarkOBDRequest(ELM327Protocol* elm, PIDHandler* pid) {
+        uint8_t count;
+        const char* const* requests = obdRequestSet(count);
+        char cmd[MAX_COMMAND_LENGTH];
+        char out[MAX_RESPONSE_LENGTH];
+        uint32_t checksum = 0;
+
+        Serial.println("OBD request pipeline:");
+
+        HeapSample before = sampleHeap();
+        uint32_t start = ESP.getCycleCount();
+        for (uint16_t i = 0; i < ITERATIONS; i++) {
+            for (uint8_t r = 0; r < count; r++) {
+                String response = legacyHandleRequest(requests[r], true, false);
+                checksum += response.length();
+            }
+        }
+        uint32_t cycles = ESP.getCycleCount() - start;
+        report("legacy String pipeline", cycles, (uint32_t)ITERATIONS * count, before, sampleHeap());
+
+        // Buffered (no client): pace() doesn't wait, so the emulated bus and
+        // ECU delays drop out and only parse, dispatch and encode are timed
+        elm->handleCommand("ATSP6", out, sizeof(out));
+        ResponseWriter writer(out, sizeof(out));
+        pid->handleRequest("0100", writer);  // Connect the bus once
+
+        before = sampleHeap();
+        start = ESP.getCycleCount();
+        for (uint16_t i = 0; i < ITERATIONS; i++) {
+            for (uint8_t r = 0; r < count; r++) {
+                strncpy(cmd, requests[r], sizeof(cmd) - 1);
+                cmd[sizeof(cmd) - 1] = '\0';
+                ELM327Protocol::normalizeCommand(cmd);
+                writer.clear();
+                pid->handleRequest(cmd, writer);
+                checksum += writer.length();
+            }
+        }
+        cycles = ESP.getCycleCount() - start;
+        report("fixed buffer pipeline", cycles, (uint32_t)ITERATIONS * count, before, sampleHeap());
+
+        elm->reset();
+        Serial.printf("  (checksum %lu)\n", (unsigned long)checksum);
+    }
+
+    // Discards streamed output so pace() runs the emulated bus in real time
+    class NullSink : public Print {
+    public:
+        size_t write(uint8_t) override { return 1; }
+        size_t write(const uint8_t*, size_t size) override { return size; }
+    };
+
+    // Time requests with full bus and ECU timing; returns microseconds
+    static uint32_t timeRequests(PIDHandler* pid, const char* const* requests, uint8_t count, uint8_t rounds) {
+        static NullSink sink;
+        char cmd[MAX_COMMAND_LENGTH];
+        char out[MAX_RESPONSE_LENGTH];
+        uint32_t start = micros();
+        for (uint8_t i = 0; i < rounds; i++) {
+            for (uint8_t r = 0; r < count; r++) {
+                strncpy(cmd, requests[r], sizeof(cmd) - 1);
+                cmd[sizeof(cmd) - 1] = '\0';
+                ResponseWriter writer(out, sizeof(out), &sink);
+                pid->handleRequest(cmd, writer);
+            }
+        }
+        return micros() - start;
+    }
+
+    // Effective sample rate: the polling set as one Mode 01 request per
+    // signal versus one service 22 read of a service 2C DID packing all of
+    // them. Wall time includes the emulated bus and ECU latency.
+    static void benchmarkDynamicDid(ELM327Protocol* elm, PIDHandler* pid) {
+        static const uint8_t ROUNDS = 5;
+        static const char* const define[] = {  // Second request appends
+            "2C01F300F40C0102F40D0101F4050101F40F0101",
+            "2C01F300F4110101F4100102F4040101F40B0101"
+        };
+        static const char* const packed[] = {"22F300"};
+        uint8_t count;
+        const char* const* requests = obdRequestSet(count);
+        char out[MAX_RESPONSE_LENGTH];
+
+        Serial.println("Signal packing (8 signals, emulated bus timing):");
+
+        bool stn = elm->isStnEnabled();
+        elm->setStnEnabled(true);
+        elm->handleCommand("ATSP6", out, sizeof(out));
+        elm->handleCommand("ATSH7E0", out, sizeof(out));
+        elm->handleCommand("STCSEGT1", out, sizeof(out));  // The definition is multi-frame
+        timeRequests(pid, define, 2, 1);
+
+        uint32_t single = timeRequests(pid, requests, count, ROUNDS);
+        uint32_t combined = timeRequests(pid, packed, 1, ROUNDS);
+        Serial.printf("  %-28s %7lu us/sample set  %5lu signals/s\n", "Mode 01, one PID each",
+                      (unsigned long)(single / ROUNDS), (unsigned long)(1000000ULL * count * ROUNDS / single));
+        Serial.printf("  %-28s %7lu us/sample set  %5lu signals/s\n", "22 F300 (2C packed)",
+                      (unsigned long)(combined / ROUNDS), (unsigned long)(1000000ULL * count * ROUNDS / combined));
+
+        pid->endSession();
+        elm->reset();
+        elm->setStnEnabled(stn);
+    }
+
+    // Reference: the float noise and signal terms the simulator evaluated
+    // on every loop() pass before the integer waveforms (NORMAL mode)
+    static int32_t legacySignals(float elapsedSec) {
+        float noisePhase = fmod(elapsedSec * 1.5, 6.28);
+        int8_t throttleNoise = (int8_t)(sin(noisePhase) * 3.0);
+        int8_t rpmNoise = (int8_t)(sin(noisePhase * 1.2) * 40);
+        int8_t trim = (int8_t)(sin(elapsedSec) * 3);
+        uint8_t o2 = 90 + (uint8_t)(sin(elapsedSec * 5) * 20);
+        uint16_t battery = 14000 + (uint16_t)(sin(elapsedSec * 0.5) * 300);
+        return throttleNoise + rpmNoise + trim + o2 + battery;
+    }
+
+    static int32_t tableSignals(uint32_t elapsedMs) {
+        int16_t throttleNoise = Waveform::noise(SIM_NOISE_SEED, elapsedMs, 4000, 3);
+        int16_t rpmNoise = Waveform::wave(elapsedMs, 3491, 40);
+        int16_t trim = Waveform::wave(elapsedMs, 6283, 3);
+        uint8_t o2 = 90 + Waveform::wave(elapsedMs, 1257, 20);
+        uint16_t battery = 14000 + Waveform::wave(elapsedMs, 12566, 300);
+        return throttleNoise + rpmNoise + trim + o2 + battery;
+    }
+
+    // One simulator tick's noise and waveform terms, float sin()/fmod()
+    // against the quarter-wave table and hashed noise; then a whole model
+    // step for scale
+    static void benchmarkWaveforms() {
+        int32_t checksum = 0;
+
+        Serial.println("Simulator waveforms (per tick):");
+
+        HeapSample before = sampleHeap();
+        uint32_t start = ESP.getCycleCount();
+        for (uint16_t i = 0; i < ITERATIONS; i++) {
+            checksum += legacySignals(i * (SIM_TICK_MS / 1000.0f));
+        }
+        uint32_t cycles = ESP.getCycleCount() - start;
+        report("legacy sin/fmod (float)", cycles, ITERATIONS, before, sampleHeap());
+
+        before = sampleHeap();
+        start = ESP.getCycleCount();
+        for (uint16_t i = 0; i < ITERATIONS; i++) {
+            checksum += tableSignals((uint32_t)i * SIM_TICK_MS);
+        }
+        cycles = ESP.getCycleCount() - start;
+        report("sine table + noise (int)", cycles, ITERATIONS, before, sampleHeap());
+
+        VehicleModel model;
+        CarState state = DEFAULT_CAR_STATE;
+        model.start(DRIVE_SPORT, 90, state.barometric);
+        before = sampleHeap();
+        start = ESP.getCycleCount();
+        for (uint16_t i = 0; i < ITERATIONS; i++) {
+            model.step();
+        }
+        cycles = ESP.getCycleCount() - start;
+        report("vehicle model step", cycles, ITERATIONS, before, sampleHeap());
+        model.apply(state);
+
+        Serial.printf("  (checksum %ld, %u km/h after %lu ms)\n", (long)checksum, state.speed,
+                      (unsigned long)model.elapsedMs());
+    }
+
+public:
+    static void run(ELM327Protocol* elm, PIDHandler* pid) {
+        Serial.println("\n========== MockStang benchmarks ==========");
+        benchmarkATParser(elm);
+        benchmarkOBDRequest(elm, pid);
+        benchmarkDynamicDid(elm, pid);
+        benchmarkWaveforms();
+        Serial.println("==========================================\n");
+    }
+};
+
+#endif // ENABLE_BENCHMARKS
+
+#endif // BENCHMARK_H
@@ -9,6 +9,8 @@
 #include "pid_handler.h"
 #include "config_manager.h"
 #include "elm327_protocol.h"
+#include "can_monitor.h"
+#include "periodic_scheduler.h"
 
 /**
  * BLE Server Implementation for Vgate/Vlinker ELM327 Profile
@@ -39,9 +41,40 @@ private:
     bool oldDeviceConnected;
     bool obdCharSubscribed;      // Track if client subscribed to main OBD characteristic
     bool customCharSubscribed;   // Track if client subscribed to Custom 0x2AF0
-    String inputBuffer;
+    char inputBuffer[MAX_COMMAND_LENGTH];
+    uint8_t inputLength;
+    char lastRequest[MAX_COMMAND_LENGTH];  // Repeated by an empty line
+    char responseBuffer[MAX_RESPONSE_LENGTH];
     uint8_t connectedClients;
 
+    // Streams OBD responses out as notifications while they are produced
+    class NotifySink : public Print {
+    private:
+        BLEOBDServer* parent;
+    public:
+        NotifySink(BLEOBDServer* server) : parent(server) {}
+        size_t write(uint8_t c) override {
+            return write(&c, 1);
+        }
+        size_t write(const uint8_t* buffer, size_t size) override {
+            parent->sendBLEResponse((const char*)buffer, size);
+            return size;
+        }
+    };
+    NotifySink notifySink;
+
+    // ATMA/ATMR streaming; input arrives on the BLE task, output from loop()
+    CanMonitor monitor;
+    PeriodicScheduler periodic;  // Service 2A frames
+    volatile bool monitorStopRequested;
+
+    // 2A requests accepted on the BLE task, for loop() to hand the
+    // scheduler (it belongs to the loop task), oldest first
+    static const uint8_t PERIODIC_QUEUE = 4 * ECU_COUNT;
+    PeriodicRequest periodicQueue[PERIODIC_QUEUE];
+    uint8_t periodicQueued;
+    portMUX_TYPE periodicQueueLock;
+
     // Server callbacks for connection management
     class ServerCallbacks: public NimBLEServerCallbacks {
         BLEOBDServer* parent;
@@ -72,7 +105,7 @@ private:
             Serial.printf("BLE Client disconnected (remaining: %d)\n", parent->connectedClients);
 
             // Clear input buffer and subscription flags on disconnect
-            parent->inputBuffer = "";
+            parent->inputLength = 0;
             parent->obdCharSubscribed = false;
             parent->customCharSubscribed = false;
         }
@@ -126,18 +159,8 @@ private:
 
                 // Handle incoming data
                 for (char c : rxValue) {
-                    // ELM327 uses \r as terminator
-                    if (c == '\r' || c == '\n') {
-                        if (parent->inputBuffer.length() > 0) {
-                            parent->processCommand(parent->inputBuffer);
-                            parent->inputBuffer = "";
-                        }
-                    } else if (c >= 32 && c < 127) {  // Printable characters
-                        parent->inputBuffer += c;
-                        if (parent->inputBuffer.length() >= MAX_COMMAND_LENGTH) {
-                            Serial.println("BLE: Buffer overflow - clearing");
-                            parent->inputBuffer = "";  // Buffer overflow protection
-                        }
+                    if (!parent->feedInput(c)) {
+                        Serial.println("BLE: Buffer overflow - clearing");
                     }
                 }
             }
@@ -147,9 +170,13 @@ private:
 public:
     BLEOBDServer(PIDHandler* handler, ConfigManager* config, ELM327Protocol* elm)
         : pidHandler(handler), configManager(config), elm327(elm),
-          deviceConnected(false), oldDeviceConnected(false), connectedClients(0),
+          deviceConnected(false), oldDeviceConnected(false), inputLength(0), connectedClients(0),
           obdCharSubscribed(false), customCharSubscribed(false),
-          pOBDCharacteristic(nullptr), pCustomNotifyCharacteristic(nullptr) {}
+          pOBDCharacteristic(nullptr), pCustomNotifyCharacteristic(nullptr), notifySink(this),
+          monitor(elm, handler), periodic(elm, handler), monitorStopRequested(false), periodicQueued(0) {
+        lastRequest[0] = '\0';
+        periodicQueueLock = portMUX_INITIALIZER_UNLOCKED;
+    }
 
     void begin() {
         Serial.println("Initializing BLE (Vgate/Vlinker Profile)...");
@@ -296,17 +323,8 @@ public:
                 Serial.println();
 
                 // Process commands from Custom Service the same way as OBD Service
-                // Handle incoming data
                 for (char c : rxValue) {
-                    // ELM327 uses \r as terminator
-                    if (c == '\r' || c == '\n') {
-                        if (parent->inputBuffer.length() > 0) {
-                            parent->processCommand(parent->inputBuffer);
-                            parent->inputBuffer = "";
-                        }
-                    } else if (c >= 32 && c < 127) {  // Printable characters
-                        parent->inputBuffer += c;
-                    }
+                    parent->feedInput(c);
                 }
             }
         };
@@ -396,6 +414,7 @@ public:
         if (!deviceConnected && oldDeviceConnected) {
             delay(500); // Give the bluetooth stack time to get ready
             pServer->startAdvertising(); // Restart advertising
+            pidHandler->endSession();  // Dynamic DIDs, uploads
             Serial.println("BLE: Restarting advertising");
             oldDeviceConnected = deviceConnected;
         }
@@ -404,29 +423,128 @@ public:
         if (deviceConnected && !oldDeviceConnected) {
             oldDeviceConnected = deviceConnected;
         }
+
+        applyPeriodicRequests();
+
+        // Stream monitor output in notification-sized chunks
+        if (monitor.isActive()) {
+            if (!deviceConnected) {
+                monitor.cancel();
+            } else if (monitorStopRequested) {
+                monitorStopRequested = false;
+                monitor.stop(notifySink);
+            } else {
+                monitor.poll(notifySink, 128);
+            }
+        } else if (periodic.isActive()) {
+            if (!deviceConnected) {
+                periodic.cancel();
+            } else {
+                periodic.poll(notifySink, 128);
+            }
+        }
     }
 
-    void processCommand(String command) {
-        command.trim();
+    // Accumulate one received character; returns false on buffer overflow
+    bool feedInput(char c) {
+        // Any byte ends monitor mode and is discarded, like the real chip
+        if (monitor.isActive()) {
+            monitorStopRequested = true;
+            return true;
+        }
 
-        if (command.length() == 0) {
-            return;
+        // ELM327 uses \r as terminator
+        if (c == '\r' || c == '\n') {
+            // An empty line (bare CR) repeats the last request
+            if (inputLength > 0 || c == '\r') {
+                inputBuffer[inputLength] = '\0';
+                processCommand(inputBuffer);
+                inputLength = 0;
+            }
+        } else if (c >= 32 && c < 127) {  // Printable characters
+            inputBuffer[inputLength++] = c;
+            if (inputLength >= MAX_COMMAND_LENGTH - 1) {
+                inputLength = 0;  // Buffer overflow protection
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Move the 2A requests the last OBD request accepted to the queue
+    void queuePeriodicRequests() {
+        PeriodicRequest request;
+        while (pidHandler->takePeriodicRequest(request)) {
+            bool queued = false;
+            portENTER_CRITICAL(&periodicQueueLock);
+            if (periodicQueued < PERIODIC_QUEUE) {
+                periodicQueue[periodicQueued++] = request;
+                queued = true;
+            }
+            portEXIT_CRITICAL(&periodicQueueLock);
+            if (!queued) Serial.println("BLE: Periodic request queue full - dropped");
+        }
+    }
+
+    // Hand the queued 2A requests to the scheduler (loop task)
+    void applyPeriodicRequests() {
+        while (true) {
+            PeriodicRequest request;
+            bool taken = false;
+            portENTER_CRITICAL(&periodicQueueLock);
+            if (periodicQueued > 0) {
+                request = periodicQueue[0];
+                memmove(&periodicQueue[0], &periodicQueue[1], --periodicQueued * sizeof(periodicQueue[0]));
+                taken = true;
+            }
+            portEXIT_CRITICAL(&periodicQueueLock);
+            if (!taken) return;
+            periodic.applyRequest(request);
+        }
+    }
+
+    void processCommand(char* command) {
+        if (ELM327Protocol::normalizeCommand(command) == 0) {
+            // Bare CR: repeat the last OBD request, like a real ELM327
+            if (lastRequest[0] == '\0') return;
+            strcpy(command, lastRequest);
         }
 
         #if ENABLE_SERIAL_LOGGING
-            Serial.printf("BLE CMD: %s\n", command.c_str());
+            Serial.printf("BLE CMD: %s\n", command);
         #endif
 
         // Process command through ELM327 protocol handler
         // This returns the FULL response including echo (if enabled)
-        String fullResponse;
-        if (command.startsWith("AT") || command.startsWith("at")) {
-            // AT command
-            fullResponse = elm327->handleCommand(command);
-        } else {
-            // OBD-II request - simulate ECU query delay
-            delay(35);
-            fullResponse = pidHandler->handleRequest(command);
+        if (!ELM327Protocol::isATCommand(command) && !ELM327Protocol::isSTCommand(command)) {
+            // OBD-II request - stream the response as the emulated bus
+            // timing produces it (ECU latency, frames, ATST/ATAT wait)
+            strcpy(lastRequest, command);
+            ResponseWriter out(responseBuffer, sizeof(responseBuffer), &notifySink);
+            pidHandler->handleRequest(command, out);
+            out.flush();
+            queuePeriodicRequests();  // Service 2A: frames follow from loop()
+
+            #if ENABLE_SERIAL_LOGGING
+                Serial.printf("BLE RESP (%d bytes): ", out.length());
+                logBytes(out.c_str(), out.length());
+            #endif
+            return;
+        }
+
+        // AT command (ST commands with the STN personality)
+        size_t fullLength = elm327->handleCommand(command, responseBuffer, sizeof(responseBuffer));
+        monitor.startIfRequested();  // ATMA/ATMR: output continues from loop()
+        const char* fullResponse = responseBuffer;
+
+        if (elm327->hasQueuedRequest()) {
+            // STPX: only the echo so far; the replies stream like an OBD request
+            if (fullLength > 0) sendBLEResponse(fullResponse, fullLength);
+            ResponseWriter out(responseBuffer, sizeof(responseBuffer), &notifySink);
+            pidHandler->runQueuedRequest(out);
+            out.flush();
+            queuePeriodicRequests();
+            return;
         }
 
         // Real Vgate adapter sends echo and response as SEPARATE notifications!
@@ -438,66 +556,66 @@ public:
         if (deviceConnected && elm327->isEchoEnabled()) {
             // Echo is enabled - need to split into two notifications
             // Format: "CMD\rRESPONSE\r\r>"
-            int firstCR = fullResponse.indexOf('\r');
+            const char* firstCR = strchr(fullResponse, '\r');
+            int firstCRPos = firstCR ? (int)(firstCR - fullResponse) : -1;
 
             #if ENABLE_SERIAL_LOGGING
-                Serial.printf("BLE: First CR position: %d\n", firstCR);
+                Serial.printf("BLE: First CR position: %d\n", firstCRPos);
             #endif
 
-            if (firstCR > 0) {
-                String echo = fullResponse.substring(0, firstCR + 1);  // "CMD\r"
-                String response = fullResponse.substring(firstCR);  // "\rRESPONSE\r\r>"
+            if (firstCRPos > 0) {
+                size_t echoLength = firstCRPos + 1;  // "CMD\r"
+                const char* response = firstCR;  // "\rRESPONSE\r\r>"
+                size_t responseLength = fullLength - firstCRPos;
 
                 #if ENABLE_SERIAL_LOGGING
-                    Serial.printf("BLE: Sending ECHO (%d bytes): ", echo.length());
-                    for (char c : echo) {
-                        if (c >= 32 && c < 127) Serial.print(c);
-                        else Serial.printf("[0x%02X]", (uint8_t)c);
-                    }
-                    Serial.println();
+                    Serial.printf("BLE: Sending ECHO (%d bytes): ", echoLength);
+                    logBytes(fullResponse, echoLength);
                 #endif
 
                 // Send echo first
-                sendBLEResponse(echo);
+                sendBLEResponse(fullResponse, echoLength);
 
                 // Brief delay between echo and response (like real adapter)
                 delay(10);
 
                 #if ENABLE_SERIAL_LOGGING
-                    Serial.printf("BLE: Sending RESPONSE (%d bytes): ", response.length());
-                    for (char c : response) {
-                        if (c >= 32 && c < 127) Serial.print(c);
-                        else Serial.printf("[0x%02X]", (uint8_t)c);
-                    }
-                    Serial.println();
+                    Serial.printf("BLE: Sending RESPONSE (%d bytes): ", responseLength);
+                    logBytes(response, responseLength);
                 #endif
 
                 // Send actual response
-                sendBLEResponse(response);
+                sendBLEResponse(response, responseLength);
             } else {
                 #if ENABLE_SERIAL_LOGGING
                     Serial.println("BLE: No CR found, sending as single");
                 #endif
-                sendBLEResponse(fullResponse);
+                sendBLEResponse(fullResponse, fullLength);
             }
         } else {
             #if ENABLE_SERIAL_LOGGING
                 Serial.println("BLE: Echo disabled, sending as single");
             #endif
-            sendBLEResponse(fullResponse);
+            sendBLEResponse(fullResponse, fullLength);
         }
 
         #if ENABLE_SERIAL_LOGGING
-            Serial.printf("BLE RESP (%d bytes): ", fullResponse.length());
-            for (char c : fullResponse) {
-                if (c >= 32 && c < 127) Serial.print(c);
-                else Serial.printf("[0x%02X]", (uint8_t)c);
-            }
-            Serial.println();
+            Serial.printf("BLE RESP (%d bytes): ", fullLength);
+            logBytes(fullResponse, fullLength);
         #endif
     }
 
-    void sendBLEResponse(const String& response) {
+    // Print raw bytes to serial, escaping control characters
+    void logBytes(const char* data, size_t length) {
+        for (size_t i = 0; i < length; i++) {
+            char c = data[i];
+            if (c >= 32 && c < 127) Serial.print(c);
+            else Serial.printf("[0x%02X]", (uint8_t)c);
+        }
+        Serial.println();
+    }
+
+    void sendBLEResponse(const char* response, size_t length) {
         if (!deviceConnected) return;
 
         // Send responses to whichever characteristic(s) the client subscribed to
@@ -505,7 +623,7 @@ public:
 
         // Send to main OBD characteristic if subscribed
         if (obdCharSubscribed && pOBDCharacteristic) {
-            pOBDCharacteristic->setValue(response.c_str());
+            pOBDCharacteristic->setValue((const uint8_t*)response, length);
             pOBDCharacteristic->notify();
 
             #if ENABLE_SERIAL_LOGGING
@@ -515,7 +633,7 @@ public:
 
         // Send to Custom 0x2AF0 if subscribed
         if (customCharSubscribed && pCustomNotifyCharacteristic) {
-            pCustomNotifyCharacteristic->setValue(response.c_str());
+            pCustomNotifyCharacteristic->setValue((const uint8_t*)response, length);
             pCustomNotifyCharacteristic->notify();
 
             #if ENABLE_SERIAL_LOGGING
@@ -0,0 +1,391 @@
+#ifndef CAN_MONITOR_H
+#define CAN_MONITOR_H
+
+#include <Arduino.h>
+#include "config.h"
+#include "elm327_protocol.h"
+#include "legacy_encoder.h"
+#include "obd_protocols.h"
+#include "pid_handler.h"
+#include "response_writer.h"
+
+// Synthetic HS-CAN broadcast traffic (Ford-style IDs) shown by ATMA/ATMR.
+// Periods are at 100% bus rate; see CanMonitor::setRatePercent(). On
+// 29-bit CAN the same frames carry MONITOR_EXTENDED_BASE | id; on J1850 and
+// ISO they are messages from the engine ECU to the functional address
+// id & 0xFF, with the first 7 data bytes.
+struct MonitorFrameDef {
+    uint16_t id;
+    uint16_t periodMs;
+};
+
+static constexpr MonitorFrameDef MONITOR_FRAMES[] = {
+    {0x076, 10},    // Brake / steering
+    {0x201, 10},    // Engine RPM, vehicle speed, throttle
+    {0x211, 20},    // MAF, load, MAP, timing
+    {0x230, 50},    // Transmission gear
+    {0x3B3, 100},   // Battery voltage, MIL, DTC count
+    {0x420, 100},   // Temperatures, fuel level, barometric
+    {0x430, 1000},  // Distance since codes cleared
+    {0x4B0, 10},    // Wheel speeds
+};
+
+static constexpr uint8_t MONITOR_FRAME_COUNT = sizeof(MONITOR_FRAMES) / sizeof(MONITOR_FRAMES[0]);
+static constexpr uint32_t MONITOR_EXTENDED_BASE = 0x18FF0000UL;  // Proprietary PGNs, priority 6
+
+/**
+ * ELM327 monitor mode (ATMA / ATMR)
+ *
+ * Generates broadcast frames from the live CarState on a per-ID schedule
+ * and streams them to the client from loop() without blocking. Like the
+ * real chip, frames pass the ATCF/ATCM/ATCRA filter into a small internal
+ * buffer (ELM_BUFFER_SIZE) that drains at the adapter's UART rate
+ * (ELM_UART_BAUD, or setUartBaud()) and no faster than the client accepts.
+ * If the buffer overflows the monitor ends with "BUFFER FULL"; any received
+ * byte ends it with "STOPPED". One instance per transport.
+ *
+ * At 115200 baud the UART carries about 400 unfiltered frames/s, so higher
+ * rates overflow within milliseconds unless ATCRA/ATCM filter most frames
+ * out. With the UART limit off (0) only the client's pace counts.
+ *
+ * Like an OBD request, monitoring first brings the bus up: with no
+ * protocol connected an automatic protocol searches ("SEARCHING...") and
+ * may end with "UNABLE TO CONNECT". On a protocol the car doesn't speak
+ * the adapter hears nothing and prints nothing until it is stopped.
+ */
+class CanMonitor {
+private:
+    static const uint32_t MAX_LAG_US = 100000;  // Catch-up limit after a stall
+
+    ELM327Protocol* elm;
+    PIDHandler* pidHandler;
+
+    volatile bool active;
+    MonitorMode mode;
+    uint8_t receiver;   // ATMR address (low byte of the 11-bit ID)
+    bool full;          // Buffer overflowed; report once drained
+    bool midLine;       // Last byte sent was not the end of a frame line
+    bool connecting;    // Bus not brought up yet (first poll)
+    uint8_t protocol;   // What the adapter listens to (ATSP numbering)
+
+    uint32_t nextDue[MONITOR_FRAME_COUNT];  // micros()
+    uint32_t lastDrain;
+    uint64_t credit;    // UART byte credit in byte-microseconds
+    uint32_t framesQueued;
+
+    // ELM internal receive buffer (ring)
+    char ring[ELM_BUFFER_SIZE];
+    uint16_t head;
+    uint16_t count;
+
+    static uint16_t& ratePercent() {
+        static uint16_t percent = 100;
+        return percent;
+    }
+
+    static uint32_t& uartBaud() {
+        static uint32_t baud = ELM_UART_BAUD;
+        return baud;
+    }
+
+    // ATMR: low byte of the ID (the target address on J1850/ISO); the CAN
+    // receive filter only applies to CAN
+    bool passesFilter(uint16_t canId) {
+        if (mode == MONITOR_RECEIVER && (canId & 0xFF) != receiver) return false;
+        const ObdProtocolDef& proto = OBD_PROTOCOLS[protocol];
+        if (proto.bus != BUS_CAN) return true;
+        return elm->acceptsId(proto.extendedId ? MONITOR_EXTENDED_BASE | canId : canId);
+    }
+
+    // Fill the 8 data bytes of a broadcast frame from the car state
+    static void encodeFrame(uint16_t canId, const CarState& s, uint8_t* d) {
+        memset(d, 0, 8);
+        switch (canId) {
+            case 0x076:  // Brake pressed when coasting down with throttle closed
+                d[0] = (s.throttle == 0 && s.speed > 0) ? 0x01 : 0x00;
+                break;
+            case 0x201: {
+                uint16_t rpm = s.rpm * 4;
+                uint16_t speed = s.speed * 100;
+                d[0] = rpm >> 8;
+                d[1] = rpm & 0xFF;
+                d[2] = speed >> 8;
+                d[3] = speed & 0xFF;
+                d[4] = s.throttle * 2;
+                break;
+            }
+            case 0x211:
+                d[0] = s.maf >> 8;
+                d[1] = s.maf & 0xFF;
+                d[2] = s.map;
+                d[3] = (uint8_t)(s.timing_advance + 64);
+                d[4] = s.egr;
+                break;
+            case 0x230:  // Rough gear estimate from speed
+                d[0] = s.speed == 0 ? 0 : (s.speed < 150 ? 1 + s.speed / 25 : 6);
+                break;
+            case 0x3B3:
+                d[0] = s.battery_voltage >> 8;
+                d[1] = s.battery_voltage & 0xFF;
+                d[2] = s.mil_on ? 0x80 : 0x00;
+                d[3] = s.dtc_count;
+                break;
+            case 0x420:
+                d[0] = s.coolant_temp + 40;
+                d[1] = s.intake_temp + 40;
+                d[2] = s.oil_temp + 40;
+                d[3] = s.ambient_temp + 40;
+                d[4] = s.fuel_level;
+                d[5] = s.barometric;
+                break;
+            case 0x430:
+                d[0] = s.distance_mil_clear >> 8;
+                d[1] = s.distance_mil_clear & 0xFF;
+                break;
+            case 0x4B0: {  // Four wheel speeds, km/h * 100
+                uint16_t speed = s.speed * 100;
+                for (uint8_t i = 0; i < 8; i += 2) {
+                    d[i] = speed >> 8;
+                    d[i + 1] = speed & 0xFF;
+                }
+                break;
+            }
+        }
+    }
+
+    // Format a frame as the ELM prints it and append it to the ring.
+    // Returns false if it doesn't fit (buffer full).
+    bool queueFrame(uint16_t canId, const CarState& state) {
+        char line[48];
+        ResponseWriter text(line, sizeof(line));
+        bool spaces = elm->getSpaces();
+        bool headers = elm->getHeaders();
+        const ObdProtocolDef& proto = OBD_PROTOCOLS[protocol];
+        text.setLinefeeds(elm->getLinefeeds());
+
+        if (proto.bus == BUS_CAN) {
+            uint8_t data[8];
+            encodeFrame(canId, state, data);
+            if (headers && proto.extendedId) {
+                uint32_t id = MONITOR_EXTENDED_BASE | canId;
+                for (int8_t shift = 24; shift >= 0; shift -= 8) {
+                    text.printHex(id >> shift, 2);
+                    if (spaces) text.put(' ');
+                }
+            } else if (headers) {
+                text.printHex(canId, 3);
+                if (spaces) text.put(' ');
+            }
+            text.printHexBytes(data, 8, spaces);
+        } else {
+            // Header as LegacyEncoder writes it, 7 data bytes, checksum
+            uint8_t frame[3 + 8];
+            encodeFrame(canId, state, &frame[3]);
+            frame[0] = proto.headerByte == 0x80 ? 0x87 : proto.headerByte;
+            frame[1] = canId & 0xFF;
+            frame[2] = ECUS[PIDHandler::obdEcu()].address;
+            frame[10] = proto.bus == BUS_J1850 ? LegacyEncoder::j1850Crc(frame, 10)
+                                               : LegacyEncoder::isoChecksum(frame, 10);
+            if (headers) {
+                text.printHexBytes(frame, 11, spaces);
+            } else {
+                text.printHexBytes(&frame[3], 7, spaces);
+            }
+        }
+        text.put('\r');
+
+        if (count + text.length() > ELM_BUFFER_SIZE) return false;
+        for (size_t i = 0; i < text.length(); i++) {
+            ring[(head + count) % ELM_BUFFER_SIZE] = line[i];
+            count++;
+        }
+        framesQueued++;
+        return true;
+    }
+
+    // Queue every frame due by now, earliest first
+    void generate(uint32_t now) {
+        if (protocol != pidHandler->getVehicleProtocol()) return;  // Nothing the adapter can hear
+        const CarState state = pidHandler->getState();
+        uint16_t percent = ratePercent();
+
+        for (uint8_t i = 0; i < MONITOR_FRAME_COUNT; i++) {
+            if ((int32_t)(now - nextDue[i]) > (int32_t)MAX_LAG_US) {
+                nextDue[i] = now - MAX_LAG_US;
+            }
+        }
+
+        while (true) {
+            int8_t next = -1;
+            for (uint8_t i = 0; i < MONITOR_FRAME_COUNT; i++) {
+                if ((int32_t)(now - nextDue[i]) < 0) continue;
+                if (next < 0 || (int32_t)(nextDue[i] - nextDue[next]) < 0) next = i;
+            }
+            if (next < 0) return;
+
+            nextDue[next] += MONITOR_FRAMES[next].periodMs * 100000UL / percent;
+            if (!passesFilter(MONITOR_FRAMES[next].id)) continue;
+            if (!queueFrame(MONITOR_FRAMES[next].id, state)) {
+                full = true;
+                return;
+            }
+        }
+    }
+
+    // Send buffered text at the UART rate, limited to what the client takes
+    void drain(Print& out, size_t room, uint32_t now) {
+        uint32_t elapsed = now - lastDrain;
+        lastDrain = now;
+        if (count == 0) {
+            credit = 0;  // An idle UART doesn't bank time
+            return;
+        }
+
+        uint32_t n = count;
+        if (uartBaud() > 0) {
+            credit += (uint64_t)elapsed * (uartBaud() / 10);  // 8N1
+            n = credit / 1000000ULL;
+            if (n > count) n = count;
+        }
+        if (n > room) n = room;
+        if (uartBaud() > 0) {
+            credit -= (uint64_t)n * 1000000ULL;
+            if (credit > (uint64_t)ELM_BUFFER_SIZE * 1000000ULL) {
+                credit = (uint64_t)ELM_BUFFER_SIZE * 1000000ULL;
+            }
+        }
+
+        while (n > 0) {
+            uint16_t chunk = ELM_BUFFER_SIZE - head;
+            if (chunk > n) chunk = n;
+            out.write((const uint8_t*)&ring[head], chunk);
+            midLine = ring[head + chunk - 1] != lineEnd();
+            head = (head + chunk) % ELM_BUFFER_SIZE;
+            count -= chunk;
+            n -= chunk;
+        }
+    }
+
+    // Last character of a frame line ('\n' with ATL1)
+    char lineEnd() {
+        return elm->getLinefeeds() ? '\n' : '\r';
+    }
+
+    // Bring the bus up as a request would (connectBus), then start the
+    // schedule. False, with the error and prompt printed, if the car can't
+    // be reached.
+    bool connect(Print& out) {
+        connecting = false;
+        uint8_t selected = elm->getProtocol();
+        if (elm->getActiveProtocol() == 0 &&
+            (elm->isProtocolAuto() || selected == pidHandler->getVehicleProtocol())) {
+            char line[48];
+            ResponseWriter text(line, sizeof(line), &out);
+            text.setLinefeeds(elm->getLinefeeds());
+            bool connected = pidHandler->connectBus(text);
+            text.flush();
+            if (!connected) {
+                active = false;
+                #if ENABLE_SERIAL_LOGGING
+                    Serial.println("MONITOR: no bus");
+                #endif
+                return false;
+            }
+        }
+        protocol = elm->getActiveProtocol() ? elm->getActiveProtocol() : selected;
+
+        // Stagger the schedule so frames don't all start together
+        uint32_t now = micros();
+        lastDrain = now;
+        for (uint8_t i = 0; i < MONITOR_FRAME_COUNT; i++) {
+            nextDue[i] = now + i * 250UL;
+        }
+        return true;
+    }
+
+    void finish(Print& out, const char* message) {
+        out.print(message);
+        out.print(elm->getLinefeeds() ? "\r\n\r\n>" : "\r\r>");
+        active = false;
+
+        #if ENABLE_SERIAL_LOGGING
+            Serial.printf("MONITOR: %s after %lu frames\n", message, (unsigned long)framesQueued);
+        #endif
+    }
+
+public:
+    CanMonitor(ELM327Protocol* elmProtocol, PIDHandler* handler)
+        : elm(elmProtocol), pidHandler(handler), active(false), mode(MONITOR_NONE),
+          receiver(0), full(false), midLine(false), connecting(false), protocol(0), lastDrain(0), credit(0),
+          framesQueued(0), head(0), count(0) {}
+
+    // Bus load relative to the nominal schedule (100% is about 400 frames/s)
+    static void setRatePercent(uint16_t percent) {
+        if (percent < MONITOR_RATE_MIN_PERCENT) percent = MONITOR_RATE_MIN_PERCENT;
+        if (percent > MONITOR_RATE_MAX_PERCENT) percent = MONITOR_RATE_MAX_PERCENT;
+        ratePercent() = percent;
+    }
+
+    static uint16_t getRatePercent() { return ratePercent(); }
+
+    // Adapter UART rate the output drains at; 0 = no UART limit, as on
+    // adapters whose WiFi/BLE side isn't behind a 115200 baud link
+    static void setUartBaud(uint32_t baud) { uartBaud() = baud; }
+    static uint32_t getUartBaud() { return uartBaud(); }
+
+    // Start monitoring if the last AT command asked for it
+    bool startIfRequested() {
+        uint8_t address;
+        MonitorMode requested = elm->takeMonitorRequest(address);
+        if (requested == MONITOR_NONE) return false;
+
+        mode = requested;
+        receiver = address;
+        full = false;
+        midLine = false;
+        head = 0;
+        count = 0;
+        credit = 0;
+        framesQueued = 0;
+        connecting = true;  // On the first poll, after the command's reply
+        active = true;
+        return true;
+    }
+
+    bool isActive() const { return active; }
+
+    // Call from loop() while active; room = bytes the client can take now
+    void poll(Print& out, size_t room) {
+        if (!active) return;
+        if (connecting && !connect(out)) return;
+        uint32_t now = micros();
+        if (!full) generate(now);
+        drain(out, room, now);
+        if (full && count == 0) {
+            finish(out, "BUFFER FULL");
+        }
+    }
+
+    // A byte arrived from the client: finish the line being sent, drop the
+    // rest of the buffer and return to the prompt
+    void stop(Print& out) {
+        if (!active) return;
+        while (count > 0 && midLine) {
+            char c = ring[head];
+            out.write((uint8_t)c);
+            head = (head + 1) % ELM_BUFFER_SIZE;
+            count--;
+            midLine = c != lineEnd();
+        }
+        count = 0;
+        finish(out, "STOPPED");
+    }
+
+    // Client went away
+    void cancel() {
+        active = false;
+        count = 0;
+    }
+};
+
+#endif // CAN_MONITOR_H
@@ -24,20 +24,150 @@
 // Use Vgate-compatible device ID for OBD app recognition
 #define ELM_DEVICE_ID "OBDII to RS232 Interpreter"
 #define ELM_VOLTAGE "11.8V"  // Typical car accessory voltage (match real adapter)
+#define STN_DEVICE_ID "STN1110 v4.2.1"    // STI, when the STN personality is enabled
+#define STN_HARDWARE_ID "OBDLink r1.7"     // STDI
+#define STN_SERIAL_NUMBER "110012345678"   // STSN
+#define OBD_FUNCTIONAL_ID 0x7DF  // Default 11-bit request ID: broadcast to all emissions ECUs
+#define VEHICLE_PROTOCOL 6       // Protocol the simulated car speaks (ATSP numbering, 1-9/B/C)
+#define ELM_BUFFER_SIZE 256    // ELM327 internal receive buffer (monitor mode)
+#define ELM_UART_BAUD 115200   // Adapter chip UART rate; limits monitor output (0 = no limit)
+
+// Response timing: jitter on each ECU's processing time (see ECUS below),
+// and the margin adaptive timing (ATAT1/ATAT2) keeps above the learned
+// response time
+#define ECU_LATENCY_JITTER_MS 5
+#define ADAPTIVE_AT1_MARGIN_MS 10
+#define ADAPTIVE_AT2_MARGIN_MS 4
+
+// Monitor mode (ATMA) broadcast rate, percent of the nominal ~400 frames/s.
+// Above ~100% unfiltered output outruns the ELM_UART_BAUD cap (BUFFER FULL)
+#define MONITOR_RATE_MIN_PERCENT 10
+#define MONITOR_RATE_MAX_PERCENT 2000
 
 // Serial Debugging
 #define ENABLE_SERIAL_LOGGING true  // Enable/disable CMD/RESP logging to serial
 
-// Maximum number of stored DTCs
-#define MAX_DTCS 8
+// On-device benchmarks (see benchmark.h) - printed to serial once at boot
+// Can also be enabled per build with -DENABLE_BENCHMARKS=true
+#ifndef ENABLE_BENCHMARKS
+#define ENABLE_BENCHMARKS false
+#endif
+
+// Maximum PIDs in one Mode 01 request (SAE J1979 limit, fits one CAN frame)
+#define MAX_PIDS_PER_REQUEST 6
+
+// DTC lifecycle (dtc_store.h): passing drive cycles until a confirmed code
+// turns the MIL off and stops being permanent, and until it is forgotten.
+// The table size, DTC_TABLE_BITS, is in platform_config.h.
+#define DTC_HEAL_CYCLES 3
+#define DTC_AGING_CYCLES 40
+
+// Driving simulator time step: the model (vehicle_model.h) steps on its own
+// task where there is one (SIM_TASK, platform_config.h), otherwise it
+// catches up when something reads the state, at most SIM_MAX_CATCHUP_TICKS
+// steps at a time
+#define SIM_TICK_MS 10
+#define SIM_MAX_CATCHUP_TICKS 1000
+#define SIM_NOISE_SEED 0x4D535447UL  // Pedal noise (waveform.h): same seed, same drive
+
+// Mode 02 freeze frames: snapshots recorded per DTC and their spacing. The
+// ring size, FREEZE_FRAME_SLOTS, is in platform_config.h.
+#define FREEZE_FRAMES_PER_DTC 4
+#define FREEZE_FRAME_INTERVAL_MS 500
+#define FREEZE_FRAME_BURSTS 4  // DTCs recording at once; another drops the oldest burst
+
+// Service 22 DID table on LittleFS (see did_registry.h)
+#define DID_TABLE_PATH "/dids.csv"
+
+// Service 2A periodic DIDs: send interval per transmission mode (slow,
+// medium, fast) and how many one client session can schedule
+#define PERIODIC_SLOW_MS 1000
+#define PERIODIC_MEDIUM_MS 100
+#define PERIODIC_FAST_MS 10
+#define PERIODIC_MAX_IDS 16
+
+// Service 2C: most source slices in one dynamically defined DID (the
+// number of definitions, DYNAMIC_DIDS, is in platform_config.h)
+#define DYNAMIC_DID_MAX_SOURCES 16
+
+// Simulated ECU memory for services 23, 35/36/37 and 2C 02 (ecu_image.h).
+// The pattern image size used without the file, ECU_IMAGE_DEFAULT_SIZE, is
+// in platform_config.h.
+#define ECU_IMAGE_PATH "/ecu_image.bin"
+#define ECU_IMAGE_ECU 0                  // Index into ECUS: the PCM
+#define ECU_RAM_BASE 0x40000000UL        // Live CarState appears here
+#define ECU_IMAGE_CACHE_BYTES 64         // File read block
+#define ECU_IMAGE_READ_US_PER_KB 20000   // Flash read time of the simulated ECU
+#define MEMORY_TRANSFER_BLOCK 2048       // Data bytes per TransferData (36) reply
+
+// Recorded drive for DRIVE_REPLAY (trace_replay.h), CSV or binary, uploaded
+// from the web interface. The seek index size and file read block,
+// TRACE_INDEX_ENTRIES and TRACE_CHUNK_BYTES, are in platform_config.h.
+#define TRACE_PATH "/trace.dat"
+#define TRACE_UPLOAD_PATH "/trace.tmp"   // Written while an upload is under way
+#define TRACE_MAX_COLUMNS 24             // Columns after the time, known or not
+#define TRACE_LINE_MAX 192               // Longest CSV line
+#define TRACE_SPEED_MIN_PERCENT 10
+#define TRACE_SPEED_MAX_PERCENT 2000
+
+// Scripted drives for DRIVE_SCENARIO (scenario.h), uploaded from the web
+// interface or picked from the built-in presets. The bytecode buffer,
+// SCENARIO_MAX_BYTES, is in platform_config.h.
+#define SCENARIO_PATH "/scenario.txt"
+#define SCENARIO_UPLOAD_PATH "/scenario.tmp"  // Checked before it replaces the old one
+#define SCENARIO_LINE_MAX 64                  // Longest script line
+#define SCENARIO_MAX_DEPTH 4                  // Nested repeat loops
+#define SCENARIO_STEPS_PER_TICK 16            // Statements run in one SIM_TICK_MS at most
+
+// Server response timing (ISO 14229-2): an ECU that needs longer than P2
+// answers 7F xx 78 (response pending) and repeats it every P2* until done
+#define ECU_P2_MS 50
+#define ECU_P2_STAR_MS 2000
+
+// Largest single ECU response message (Mode 09 calibration IDs)
+#define MAX_ECU_PAYLOAD 64
+
+// Simulated ECUs on the bus. Each answers functional (7DF) requests and
+// physical ones sent to responseId - 8 (e.g. ATSH7E0 reaches 7E8 only).
+// On 29-bit CAN, J1850 and ISO/KWP the ECU is known by its address
+// (18DAF110, "48 6B 10") and reached physically with e.g. ATSH18DA10F1 or
+// ATSH6810F1. pids lists the Mode 01 PIDs an ECU answers (nullptr = every
+// PID in MODE01_PIDS); its "PIDs supported" bitmaps are generated from that
+// in pid_registry.h. mode09Mask is the Mode 09 PID 00 bitmap.
+struct EcuDef {
+    const char* name;       // Mode 09 PID 0A
+    uint16_t responseId;    // 11-bit CAN ID the ECU replies on
+    uint8_t address;        // Node address on 29-bit CAN and pre-CAN protocols
+    uint16_t latencyMs;     // Typical processing time, +/- ECU_LATENCY_JITTER_MS
+    const uint8_t* pids;
+    uint8_t pidCount;
+    uint32_t mode09Mask;
+    bool emissionsDtcs;     // Answers Modes 03/04/07 from the stored DTCs
+};
+
+static constexpr uint8_t TCM_PIDS[] = {0x0C, 0x0D};  // RPM and speed
+static constexpr uint8_t ABS_PIDS[] = {0x0D, 0x42};  // Speed and module voltage
+
+static constexpr EcuDef ECUS[] = {
+    // Engine: every PID the simulator provides, VIN/CALID/CVN/name
+    {ELM_DEVICE_ID, 0x7E8, 0x10, 35, nullptr, 0, 0x54400000, true},
+    {"TCM-TransmissionCtrl", 0x7E9, 0x18, 38, TCM_PIDS, sizeof(TCM_PIDS), 0x00400000, false},
+    {"ABS-AntiLockBrake", 0x7EA, 0x28, 45, ABS_PIDS, sizeof(ABS_PIDS), 0x00400000, false},
+};
+
+static constexpr uint8_t ECU_COUNT = sizeof(ECUS) / sizeof(ECUS[0]);
 
 // Driving Simulator Modes
+// Each is a driver profile (DRIVER_PROFILES, vehicle_model.h), except the
+// replay of a recorded drive and the scripted one
 enum DriveMode {
     DRIVE_OFF = 0,       // Manual control only
-    DRIVE_GENTLE = 1,    // Gentle acceleration, warming up (0-50 km/h in 5s)
-    DRIVE_NORMAL = 2,    // Normal driving (0-80 km/h in 7s)
-    DRIVE_SPORT = 3,     // Sporty driving (0-120 km/h in 8s)
-    DRIVE_DRAG = 4       // Drag race (0-180 km/h in 12s, full throttle)
+    DRIVE_GENTLE = 1,    // 30% throttle to 50 km/h and hold, cold engine warming up
+    DRIVE_NORMAL = 2,    // 50% to 80 km/h, cruise, brake to a stop at 17s
+    DRIVE_SPORT = 3,     // 85% to 120 km/h, late shifts, hard braking at 16s
+    DRIVE_DRAG = 4,      // Launch at full throttle for 12s, then hard braking
+    DRIVE_REPLAY = 5,    // Play back TRACE_PATH (trace_replay.h)
+    DRIVE_SCENARIO = 6   // Run the loaded script (scenario.h)
 };
 
 // Default PID Values (adjustable via web interface)
@@ -69,8 +199,7 @@ struct CarState {
 
     // MIL and DTC management
     bool mil_on;            // MIL (Check Engine Light) status
-    uint8_t dtc_count;      // Number of stored DTCs
-    uint16_t dtcs[MAX_DTCS]; // Stored DTCs (P0xxx format as 16-bit values)
+    uint8_t dtc_count;      // Confirmed DTCs of the OBD ECU (codes live in dtc_store.h)
 };
 
 // Default car state (typical idle conditions)
@@ -100,13 +229,12 @@ const CarState DEFAULT_CAR_STATE = {
     .oil_temp = 95,          // 95°C normal oil temp
     // MIL and DTC management
     .mil_on = false,         // MIL off by default
-    .dtc_count = 0,          // No DTCs
-    .dtcs = {0}              // Empty DTC array
+    .dtc_count = 0           // No DTCs
 };
 
 // Memory optimization (platform-specific in platform_config.h)
 #define MAX_COMMAND_LENGTH 64
-#define MAX_RESPONSE_LENGTH 128
+#define MAX_RESPONSE_LENGTH 256  // Streamed responses may be longer; this keeps the log copy
 // WEBSOCKET_BUFFER_SIZE is defined in platform_config.h (256 for ESP-01, 512 for ESP32)
 
 #endif // CONFIG_H
@@ -6,7 +6,7 @@
 #include <IPAddress.h>
 
 #define CONFIG_MAGIC "MOCK"
-#define CONFIG_VERSION 1
+#define CONFIG_VERSION 2
 #define EEPROM_SIZE 512  // Reserve 512 bytes for config
 
 // Persistent configuration structure
@@ -27,6 +27,9 @@ struct PersistentConfig {
     char vin[18];               // Vehicle VIN (17 chars + null terminator)
     char deviceId[32];          // Custom device ID for AT@1 command
 
+    // Adapter settings
+    bool stnPersonality;        // Answer STN/OBDLink ST commands (STI, STPX, ...)
+
     // Default PID values (optional - for custom defaults)
     uint16_t defaultRPM;
     uint8_t defaultSpeed;
@@ -70,7 +73,7 @@ private:
             return false;
         }
 
-        // Check version (for now, only version 1)
+        // Check version (older layouts fall back to defaults)
         if (cfg->version != CONFIG_VERSION) {
             return false;
         }
@@ -108,6 +111,9 @@ public:
         strcpy(config.vin, "1ZVBP8AM5D5123456");  // Example Mustang VIN
         strcpy(config.deviceId, "MockStang ESP-01S");
 
+        // Adapter defaults: plain ELM327
+        config.stnPersonality = false;
+
         // PID defaults
         config.defaultRPM = 850;
         config.defaultSpeed = 0;
@@ -163,6 +169,7 @@ public:
     IPAddress getGateway() { return IPAddress(config.gateway[0], config.gateway[1], config.gateway[2], config.gateway[3]); }
     const char* getVIN() { return config.vin; }
     const char* getDeviceId() { return config.deviceId; }
+    bool getStnPersonality() { return config.stnPersonality; }
 
     uint16_t getDefaultRPM() { return config.defaultRPM; }
     uint8_t getDefaultSpeed() { return config.defaultSpeed; }
@@ -192,6 +199,7 @@ public:
     }
     void setVIN(const char* vin) { strncpy(config.vin, vin, 17); config.vin[17] = 0; }
     void setDeviceId(const char* id) { strncpy(config.deviceId, id, 31); config.deviceId[31] = 0; }
+    void setStnPersonality(bool enable) { config.stnPersonality = enable; }
 
     void setDefaultRPM(uint16_t rpm) { config.defaultRPM = rpm; }
     void setDefaultSpeed(uint8_t speed) { config.defaultSpeed = speed; }
@@ -217,6 +225,7 @@ public:
                 + String(config.gateway[2]) + "." + String(config.gateway[3]) + "\",";
         json += "\"vin\":\"" + String(config.vin) + "\",";
         json += "\"deviceId\":\"" + String(config.deviceId) + "\",";
+        json += "\"stnPersonality\":" + String(config.stnPersonality ? "true" : "false") + ",";
         json += "\"defaultRPM\":" + String(config.defaultRPM) + ",";
         json += "\"defaultSpeed\":" + String(config.defaultSpeed) + ",";
         json += "\"defaultCoolantTemp\":" + String(config.defaultCoolantTemp) + ",";
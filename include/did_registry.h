@@ -0,0 +1,380 @@
+#ifndef DID_REGISTRY_H
+#define DID_REGISTRY_H
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include "config.h"
+#include "pid_registry.h"
+
+/**
+ * Service 22 (ReadDataByIdentifier) DID table
+ *
+ * The enhanced DIDs each ECU answers are listed in a text file on LittleFS
+ * (DID_TABLE_PATH, uploaded from data/ with "pio run -t uploadfs"), one
+ * entry per line:
+ *
+ *   7E9,1E1C,trans_temp         ECU (response ID), DID, encoder
+ *   7E8,03EC,knock,3            ... and an encoder parameter (cylinder 3)
+ *   7E8,F401-F4FF,mode01        DID range; DIDs an encoder can't answer
+ *                               (unregistered Mode 01 PIDs) are skipped
+ *
+ * Encoders are the functions in DID_ENCODERS, bound to the simulator state
+ * like the Mode 01 ones; the file only names them. Without the file the
+ * built-in DEFAULT_DIDS are loaded.
+ *
+ * The table is an open-addressing hash (linear probing, Fibonacci hashing
+ * of ECU + DID) of 6-byte slots, 2^DID_TABLE_BITS per platform, filled to
+ * at most 3/4: a lookup is O(1) and no strings are kept in RAM. The slots
+ * are allocated on their own when the table is first loaded, in PSRAM on
+ * boards that have it, so the large ESP32 table isn't part of PIDHandler.
+ */
+
+// Writes a DID's data bytes; returns their count, 0 if it can't be answered
+typedef uint8_t (*DidEncoder)(const CarState& state, uint16_t did, uint8_t param, uint8_t* data);
+
+struct DidEncoderDef {
+    char name[12];
+    DidEncoder encode;
+};
+
+// ---- Encoders ------------------------------------------------------------
+
+// DIDs F4xx mirror Mode 01 PID xx (ISO 27145); also used for periodic F2xx
+static uint8_t didMode01(const CarState& s, uint16_t did, uint8_t param, uint8_t* d) {
+    const PidDef* def = findMode01Pid(did & 0xFF);
+    if ((did & 0x1F) == 0 || def == nullptr) return 0;
+    PidEncoder encode = (PidEncoder)pgm_read_ptr(&def->encode);
+    encode(s, d);
+    return pgm_read_byte(&def->length);
+}
+
+// Fixed byte (configuration and status DIDs)
+static uint8_t didConstant(const CarState& s, uint16_t did, uint8_t param, uint8_t* d) {
+    d[0] = param;
+    return 1;
+}
+
+// Transmission fluid temperature, degC * 16 signed: runs below coolant
+// temperature and rises with load
+static uint8_t didTransTemp(const CarState& s, uint16_t did, uint8_t param, uint8_t* d) {
+    int16_t celsius = (int16_t)s.coolant_temp - 15 + s.throttle / 5;
+    putUint16(d, (uint16_t)(celsius * 16));
+    return 2;
+}
+
+static uint8_t didGear(const CarState& s, uint16_t did, uint8_t param, uint8_t* d) {
+    d[0] = transmissionGear(s);
+    return 1;
+}
+
+// Manifold pressure above atmospheric, 0.1 kPa signed (vacuum is negative)
+static uint8_t didBoost(const CarState& s, uint16_t did, uint8_t param, uint8_t* d) {
+    putUint16(d, (uint16_t)(((int16_t)s.map - s.barometric) * 10));
+    return 2;
+}
+
+// Knock retard of cylinder param (1-8; 0 = largest), 0.5 degree steps.
+// Cylinders 3 and 7 run hottest and pull timing at high load and speed.
+static uint8_t knockRetard(const CarState& s, uint8_t cylinder) {
+    if (s.throttle <= 80 || s.rpm <= 4500) return 0;
+    if (cylinder != 0 && cylinder != 3 && cylinder != 7) return 0;
+    return 4 + (s.o2_voltage & 3);
+}
+
+static uint8_t didKnock(const CarState& s, uint16_t did, uint8_t param, uint8_t* d) {
+    if (param > 8) return 0;
+    d[0] = knockRetard(s, param);
+    return 1;
+}
+
+// Spark advance of cylinder param after knock retard, 0.5 degrees signed
+static uint8_t didSpark(const CarState& s, uint16_t did, uint8_t param, uint8_t* d) {
+    if (param < 1 || param > 8) return 0;
+    d[0] = (uint8_t)(s.timing_advance * 2 - knockRetard(s, param));
+    return 1;
+}
+
+// Injector pulse width, microseconds: fuel per intake stroke at about
+// 5.9 mg/ms flow, plus 500 us dead time
+static uint8_t didInjectorPulse(const CarState& s, uint16_t did, uint8_t param, uint8_t* d) {
+    if (param < 1 || param > 8) return 0;
+    uint32_t microseconds = 0;
+    if (s.rpm > 0) {
+        uint32_t mgPerStroke1000 = fuelMgPerSec(s) * 60 * 1000 / ((uint32_t)s.rpm * 4);
+        microseconds = 500 + mgPerStroke1000 * 169 / 1000;
+    }
+    putUint16(d, microseconds > 0xFFFF ? 0xFFFF : microseconds);
+    return 2;
+}
+
+// Oil pressure, kPa / 4: rises with engine speed, drops as the oil thins
+static uint8_t didOilPressure(const CarState& s, uint16_t did, uint8_t param, uint8_t* d) {
+    int16_t kpa = 0;
+    if (s.rpm > 0) kpa = 140 + s.rpm / 25 - ((int16_t)s.oil_temp - 90) / 2;
+    if (kpa < 0) kpa = 0;
+    d[0] = kpa / 4 > 255 ? 255 : kpa / 4;
+    return 1;
+}
+
+// Clutch pedal switch: down while rolling out of gear
+static uint8_t didClutch(const CarState& s, uint16_t did, uint8_t param, uint8_t* d) {
+    d[0] = s.speed > 0 && transmissionGear(s) == 0 ? 1 : 0;
+    return 1;
+}
+
+// Brake pedal switch: on while slowing with the throttle closed
+static uint8_t didBrake(const CarState& s, uint16_t did, uint8_t param, uint8_t* d) {
+    d[0] = s.speed > 0 && s.throttle == 0 ? 1 : 0;
+    return 1;
+}
+
+// Wheel speed param (0 = FL, 1 = FR, 2 = RL, 3 = RR), 0.01 km/h; the
+// driven rear wheels slip 3 % at wide open throttle
+static uint8_t didWheelSpeed(const CarState& s, uint16_t did, uint8_t param, uint8_t* d) {
+    if (param > 3) return 0;
+    uint32_t speed = s.speed * 100UL;
+    if (param >= 2 && s.throttle > 80) speed += speed * 3 / 100;
+    putUint16(d, speed);
+    return 2;
+}
+
+// Total distance, km (3 bytes)
+static uint8_t didOdometer(const CarState& s, uint16_t did, uint8_t param, uint8_t* d) {
+    uint32_t km = ODOMETER_BASE_KM + s.distance_mil_clear;
+    d[0] = km >> 16;
+    putUint16(&d[1], km & 0xFFFF);
+    return 3;
+}
+
+static constexpr DidEncoderDef DID_ENCODERS[] PROGMEM = {
+    {"mode01", didMode01},
+    {"const", didConstant},
+    {"trans_temp", didTransTemp},
+    {"gear", didGear},
+    {"boost", didBoost},
+    {"knock", didKnock},
+    {"spark", didSpark},
+    {"injector_pw", didInjectorPulse},
+    {"oil_press", didOilPressure},
+    {"clutch", didClutch},
+    {"brake", didBrake},
+    {"wheel_speed", didWheelSpeed},
+    {"odometer", didOdometer},
+};
+
+static constexpr uint8_t DID_ENCODER_COUNT = sizeof(DID_ENCODERS) / sizeof(DID_ENCODERS[0]);
+static constexpr uint8_t DID_MAX_DATA = MODE01_MAX_DATA;  // Longest encoder output
+
+// Used when DID_TABLE_PATH is missing: the Mode 01 mirror, the DIDs
+// most apps poll and a few service 2A periodic identifiers
+static const char DEFAULT_DIDS[] PROGMEM =
+    "7E8,F401-F4FF,mode01\n"
+    "7E8,F204-F211,mode01\n"
+    "7E8,0461,boost\n"
+    "7E8,03EC,knock,0\n"
+    "7E8,1165,oil_press\n"
+    "7E8,DD01,odometer\n"
+    "7E9,1E1C,trans_temp\n"
+    "7E9,1E12,gear\n";
+
+static constexpr uint16_t DID_TABLE_SLOTS = 1U << DID_TABLE_BITS;
+static_assert(DID_TABLE_BITS >= 4 && DID_TABLE_BITS <= 15, "DID_TABLE_BITS out of range");
+
+// ---- Table ---------------------------------------------------------------
+
+struct DidSlot {
+    uint16_t did;
+    uint8_t ecu;       // Index into ECUS
+    uint8_t encoder;   // Index into DID_ENCODERS, DID_SLOT_EMPTY if free
+    uint8_t param;
+};
+
+static constexpr uint8_t DID_SLOT_EMPTY = 0xFF;
+
+class DidTable {
+private:
+    DidSlot* slots;   // DID_TABLE_SLOTS, nullptr until load()
+    uint16_t count;
+    uint16_t ecuDids[ECU_COUNT];  // Entries per ECU (0 = no service 22)
+
+    // Fibonacci hashing: the top bits of key * 2^32 / golden ratio
+    static uint16_t home(uint8_t ecu, uint16_t did) {
+        uint32_t key = ((uint32_t)ecu << 16) | did;
+        return (uint32_t)(key * 2654435769UL) >> (32 - DID_TABLE_BITS);
+    }
+
+    static int8_t findEncoder(const char* name) {
+        for (uint8_t i = 0; i < DID_ENCODER_COUNT; i++) {
+            if (strcmp_P(name, DID_ENCODERS[i].name) == 0) return i;
+        }
+        return -1;
+    }
+
+    static int8_t findEcu(uint16_t responseId) {
+        for (uint8_t e = 0; e < ECU_COUNT; e++) {
+            if (ECUS[e].responseId == responseId) return e;
+        }
+        return -1;
+    }
+
+    // Add one DID (or replace its entry); false when the table is full
+    bool insert(uint8_t ecu, uint16_t did, uint8_t encoder, uint8_t param) {
+        uint16_t i = home(ecu, did);
+        while (slots[i].encoder != DID_SLOT_EMPTY && !(slots[i].did == did && slots[i].ecu == ecu)) {
+            i = (i + 1) & (DID_TABLE_SLOTS - 1);
+        }
+        if (slots[i].encoder == DID_SLOT_EMPTY) {
+            if (count >= DID_TABLE_SLOTS / 4 * 3) return false;
+            count++;
+            ecuDids[ecu]++;
+        }
+        slots[i] = {did, ecu, encoder, param};
+        return true;
+    }
+
+    // Next comma-separated field of line (trimmed), nullptr at the end
+    static char* nextField(char*& line) {
+        if (line == nullptr) return nullptr;
+        while (*line == ' ' || *line == '\t') line++;
+        char* field = line;
+        char* comma = strchr(line, ',');
+        if (comma) {
+            *comma = '\0';
+            line = comma + 1;
+        } else {
+            line = nullptr;
+        }
+        char* end = field + strlen(field);
+        while (end > field && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) *--end = '\0';
+        return field;
+    }
+
+    static bool parseHex(const char* text, uint16_t& value) {
+        char* end;
+        unsigned long parsed = strtoul(text, &end, 16);
+        if (*text == '\0' || *end != '\0' || parsed > 0xFFFF) return false;
+        value = parsed;
+        return true;
+    }
+
+    // Add the DIDs of one line. Returns false if the line is malformed or
+    // the table is full; blank lines and '#' comments are fine.
+    bool loadLine(char* line, uint16_t lineNumber) {
+        char* rest = line;
+        char* ecuField = nextField(rest);
+        if (ecuField == nullptr || *ecuField == '\0' || *ecuField == '#') return true;
+        char* didField = nextField(rest);
+        char* encoderField = nextField(rest);
+        char* paramField = nextField(rest);
+
+        uint16_t responseId, first, last, param = 0;
+        int8_t ecu = parseHex(ecuField, responseId) ? findEcu(responseId) : -1;
+        int8_t encoder = encoderField ? findEncoder(encoderField) : -1;
+        char* dash = didField ? strchr(didField, '-') : nullptr;
+        if (dash) *dash = '\0';
+        bool valid = ecu >= 0 && encoder >= 0 && didField && parseHex(didField, first) &&
+                     (dash ? parseHex(dash + 1, last) && last >= first : (last = first, true)) &&
+                     (paramField == nullptr || (parseHex(paramField, param) && param <= 0xFF));
+        if (!valid) {
+            Serial.printf("DIDs line %u: invalid entry\n", lineNumber);
+            return false;
+        }
+
+        // Keep only DIDs the encoder answers
+        DidEncoder encode = (DidEncoder)pgm_read_ptr(&DID_ENCODERS[encoder].encode);
+        uint8_t data[DID_MAX_DATA];
+        for (uint32_t did = first; did <= last; did++) {
+            if (encode(DEFAULT_CAR_STATE, did, param, data) == 0) continue;
+            if (!insert(ecu, did, encoder, param)) {
+                Serial.printf("DIDs line %u: table full (%u entries)\n", lineNumber, count);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool allocate() {
+        if (slots != nullptr) return true;
+        #if HAS_PSRAM
+            slots = (DidSlot*)ps_malloc(DID_TABLE_SLOTS * sizeof(DidSlot));
+        #endif
+        if (slots == nullptr) slots = (DidSlot*)malloc(DID_TABLE_SLOTS * sizeof(DidSlot));
+        return slots != nullptr;
+    }
+
+public:
+    DidTable() : slots(nullptr) {
+        clear();
+    }
+
+    void clear() {
+        if (slots != nullptr) {
+            for (uint16_t i = 0; i < DID_TABLE_SLOTS; i++) slots[i].encoder = DID_SLOT_EMPTY;
+        }
+        count = 0;
+        memset(ecuDids, 0, sizeof(ecuDids));
+    }
+
+    uint16_t size() const { return count; }
+    bool ecuHasDids(const EcuDef& ecu) const { return ecuDids[&ecu - ECUS] > 0; }
+
+    // Load the table from LittleFS, or the defaults if the file is missing.
+    // Malformed lines are reported and skipped.
+    void load() {
+        if (!allocate()) {
+            Serial.printf("No memory for %u DID slots, service 22 disabled\n", DID_TABLE_SLOTS);
+            return;
+        }
+        clear();
+        char line[64];
+        uint16_t lineNumber = 0;
+
+        File file;
+        if (LittleFS.begin()) file = LittleFS.open(DID_TABLE_PATH, "r");
+        if (file) {
+            uint8_t length = 0;
+            while (true) {
+                int c = file.read();
+                if (c < 0 || c == '\n') {
+                    line[length] = '\0';
+                    loadLine(line, ++lineNumber);
+                    length = 0;
+                    if (c < 0) break;
+                } else if (length < sizeof(line) - 1) {
+                    line[length++] = c;
+                }
+            }
+            file.close();
+            Serial.printf("Loaded %u DIDs from %s\n", count, DID_TABLE_PATH);
+            return;
+        }
+
+        const char* p = DEFAULT_DIDS;
+        while (pgm_read_byte(p)) {
+            uint8_t length = 0;
+            char c;
+            while ((c = pgm_read_byte(p++)) != '\n') line[length++] = c;
+            line[length] = '\0';
+            loadLine(line, ++lineNumber);
+        }
+        Serial.printf("%s not found, loaded %u default DIDs\n", DID_TABLE_PATH, count);
+    }
+
+    // Entry for an ECU's DID, nullptr if it has none
+    const DidSlot* find(const EcuDef& ecu, uint16_t did) const {
+        uint8_t e = &ecu - ECUS;
+        if (slots == nullptr) return nullptr;
+        for (uint16_t i = home(e, did); slots[i].encoder != DID_SLOT_EMPTY; i = (i + 1) & (DID_TABLE_SLOTS - 1)) {
+            if (slots[i].did == did && slots[i].ecu == e) return &slots[i];
+        }
+        return nullptr;
+    }
+
+    // Write a DID's data for the given state; returns its length
+    static uint8_t encode(const DidSlot& slot, const CarState& state, uint8_t* data) {
+        DidEncoder encode = (DidEncoder)pgm_read_ptr(&DID_ENCODERS[slot.encoder].encode);
+        return encode(state, slot.did, slot.param, data);
+    }
+};
+
+#endif // DID_REGISTRY_H
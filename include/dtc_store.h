@@ -0,0 +1,324 @@
+#ifndef DTC_STORE_H
+#define DTC_STORE_H
+
+#include <Arduino.h>
+#include "config.h"
+
+/**
+ * Diagnostic trouble code memory (Modes 03/04/07/0A, UDS service 19)
+ *
+ * Every ECU keeps its codes in one open-addressing hash table keyed by ECU
+ * and DTC (DTC_TABLE_BITS in platform_config.h), so setting, finding and
+ * removing a code take constant time however many are stored. Each entry
+ * is a DTC and its ISO 14229 status byte, plus the permanent flag and a
+ * count of passing cycles.
+ *
+ * A code goes through the J1979 lifecycle:
+ *
+ *   fail()                  testFailed; pending, or confirmed right away
+ *   fails again next cycle  confirmed, MIL on; permanent on the OBD ECU
+ *   DTC_HEAL_CYCLES passing MIL off, no longer permanent
+ *   DTC_AGING_CYCLES        confirmed code forgotten
+ *   Mode 04                 everything but the permanent flag cleared; that
+ *                           goes after one passing cycle
+ *
+ * Lists are never built: a DtcCursor walks the table and writes 2-byte
+ * (OBD) or 4-byte (UDS DTC + status) records straight into the outgoing
+ * ISO-TP frames.
+ */
+
+// UDS DTC status bits (ISO 14229-1 D.2)
+static constexpr uint8_t DTC_TEST_FAILED = 0x01;
+static constexpr uint8_t DTC_FAILED_THIS_CYCLE = 0x02;
+static constexpr uint8_t DTC_PENDING = 0x04;
+static constexpr uint8_t DTC_CONFIRMED = 0x08;
+static constexpr uint8_t DTC_FAILED_SINCE_CLEAR = 0x20;
+static constexpr uint8_t DTC_WARNING_INDICATOR = 0x80;
+
+// Status bits the simulated ECUs support (DTCStatusAvailabilityMask)
+static constexpr uint8_t DTC_STATUS_AVAILABLE = 0xAF;
+
+// List filters beyond a status mask
+static constexpr uint16_t DTC_FILTER_PERMANENT = 0x100;  // Mode 0A, 19 15
+static constexpr uint16_t DTC_FILTER_ALL = 0x200;        // 19 0A
+
+static constexpr uint16_t DTC_TABLE_SLOTS = 1U << DTC_TABLE_BITS;
+static constexpr uint16_t DTC_TABLE_MAX = DTC_TABLE_SLOTS / 4 * 3;  // Load factor 0.75
+
+struct DtcSlot {
+    uint16_t dtc;
+    uint8_t ecu;      // Index into ECUS, DTC_SLOT_EMPTY if free
+    uint8_t status;   // UDS status byte
+    uint8_t flags;    // Permanent, pending carried over, passing cycle count
+};
+
+static constexpr uint8_t DTC_SLOT_EMPTY = 0xFF;
+
+class DtcStore;
+
+// Reads one ECU's matching DTCs as a stream of records (PayloadReader)
+struct DtcCursor {
+    const DtcStore* store;
+    uint8_t ecu;
+    uint16_t filter;        // Status mask and DTC_FILTER_*
+    uint8_t recordSize;     // 2: DTC (OBD), 4: DTC, FTB, status (UDS)
+    uint16_t limit;         // Records in the stream
+
+    uint16_t slot;          // Next slot to look at
+    uint16_t records;       // Records started
+    uint16_t offset;        // Stream offset of the next byte
+    uint8_t record[4];
+    uint8_t recordPos;
+};
+
+class DtcStore {
+private:
+    static const uint8_t FLAG_PERMANENT = 0x80;
+    static const uint8_t FLAG_CARRIED = 0x40;      // Pending from an earlier cycle
+    static const uint8_t PASS_COUNT_MASK = 0x3F;
+
+    DtcSlot slots[DTC_TABLE_SLOTS];
+    uint16_t count;
+
+    // Fibonacci hashing, as in the DID table
+    static uint16_t home(uint8_t ecu, uint16_t dtc) {
+        uint32_t key = ((uint32_t)ecu << 16) | dtc;
+        return (uint32_t)(key * 2654435769UL) >> (32 - DTC_TABLE_BITS);
+    }
+
+    int16_t lookup(uint8_t ecu, uint16_t dtc) const {
+        uint16_t i = home(ecu, dtc);
+        while (slots[i].ecu != DTC_SLOT_EMPTY) {
+            if (slots[i].dtc == dtc && slots[i].ecu == ecu) return i;
+            i = (i + 1) & (DTC_TABLE_SLOTS - 1);
+        }
+        return -1;
+    }
+
+    // Free a slot, moving later entries of the probe run back so lookups
+    // never stop at a hole (no tombstones). True if a run wrapping past
+    // the end of the table moved an entry into a slot before i, which a
+    // scan going up from 0 has already passed.
+    bool erase(uint16_t i) {
+        uint16_t hole = i;
+        uint16_t j = i;
+        bool wrapped = false;
+        while (true) {
+            j = (j + 1) & (DTC_TABLE_SLOTS - 1);
+            if (slots[j].ecu == DTC_SLOT_EMPTY) break;
+            uint16_t h = home(slots[j].ecu, slots[j].dtc);
+            // Move j into the hole unless its home lies cyclically in (hole, j]
+            bool stays = hole <= j ? (h > hole && h <= j) : (h > hole || h <= j);
+            if (stays) continue;
+            slots[hole] = slots[j];
+            if (hole < i) wrapped = true;
+            hole = j;
+        }
+        slots[hole].ecu = DTC_SLOT_EMPTY;
+        count--;
+        return wrapped;
+    }
+
+    static bool matches(const DtcSlot& slot, uint8_t ecu, uint16_t filter) {
+        if (slot.ecu != ecu) return false;
+        if (filter & DTC_FILTER_ALL) return true;
+        if (filter & DTC_FILTER_PERMANENT) return slot.flags & FLAG_PERMANENT;
+        return slot.status & filter & DTC_STATUS_AVAILABLE;
+    }
+
+    static bool obdEcu(uint8_t ecu) { return ECUS[ecu].emissionsDtcs; }
+
+public:
+    DtcStore() {
+        clear();
+    }
+
+    void clear() {
+        for (uint16_t i = 0; i < DTC_TABLE_SLOTS; i++) slots[i].ecu = DTC_SLOT_EMPTY;
+        count = 0;
+    }
+
+    uint16_t size() const { return count; }
+
+    // Status byte of a DTC, 0 if the ECU doesn't have it
+    uint8_t status(uint8_t ecu, uint16_t dtc) const {
+        int16_t i = lookup(ecu, dtc);
+        return i < 0 ? 0 : slots[i].status;
+    }
+
+    bool contains(uint8_t ecu, uint16_t dtc) const { return lookup(ecu, dtc) >= 0; }
+
+    bool isPermanent(uint8_t ecu, uint16_t dtc) const {
+        int16_t i = lookup(ecu, dtc);
+        return i >= 0 && (slots[i].flags & FLAG_PERMANENT);
+    }
+
+    // A monitor failed: the code becomes pending, or confirmed (MIL on,
+    // permanent on the OBD ECU) right away. Returns 1 for a new code, 2 for
+    // one already stored, 0 if the table is full.
+    uint8_t fail(uint8_t ecu, uint16_t dtc, bool confirm) {
+        int16_t i = lookup(ecu, dtc);
+        uint8_t result = 2;
+        if (i < 0) {
+            if (count >= DTC_TABLE_MAX) return 0;
+            i = home(ecu, dtc);
+            while (slots[i].ecu != DTC_SLOT_EMPTY) i = (i + 1) & (DTC_TABLE_SLOTS - 1);
+            slots[i] = {dtc, ecu, 0, 0};
+            count++;
+            result = 1;
+        }
+
+        DtcSlot& slot = slots[i];
+        slot.status |= DTC_TEST_FAILED | DTC_FAILED_THIS_CYCLE | DTC_PENDING | DTC_FAILED_SINCE_CLEAR;
+        slot.flags &= ~PASS_COUNT_MASK;
+        if (confirm) {
+            slot.status |= DTC_CONFIRMED | DTC_WARNING_INDICATOR;
+            if (obdEcu(ecu)) slot.flags |= FLAG_PERMANENT;
+        }
+        return result;
+    }
+
+    // Forget a code entirely, permanent or not; false if it isn't stored
+    bool remove(uint8_t ecu, uint16_t dtc) {
+        int16_t i = lookup(ecu, dtc);
+        if (i < 0) return false;
+        erase(i);
+        return true;
+    }
+
+    // Mode 04: clear all of an ECU's codes. Permanent codes stay
+    // (keepPermanent) until the monitor passes a cycle.
+    void clearEcu(uint8_t ecu, bool keepPermanent) {
+        for (uint16_t i = 0; i < DTC_TABLE_SLOTS;) {
+            DtcSlot& slot = slots[i];
+            if (slot.ecu != ecu) {
+                i++;
+            } else if (keepPermanent && (slot.flags & FLAG_PERMANENT)) {
+                slot.status = 0;
+                slot.flags = FLAG_PERMANENT;
+                i++;
+            } else {
+                // Refills slot i, so look at it again; start over if an
+                // entry wrapped behind the scan
+                if (erase(i)) i = 0;
+            }
+        }
+    }
+
+    // End of a drive (operation) cycle: codes that failed in it move on
+    // (pending -> confirmed), the others count one passing cycle
+    void endOperationCycle() {
+        for (uint16_t i = 0; i < DTC_TABLE_SLOTS; i++) {
+            DtcSlot& slot = slots[i];
+            if (slot.ecu == DTC_SLOT_EMPTY) continue;
+
+            if (slot.status & DTC_FAILED_THIS_CYCLE) {
+                if (slot.flags & FLAG_CARRIED) {
+                    slot.status |= DTC_CONFIRMED | DTC_WARNING_INDICATOR;
+                    if (obdEcu(slot.ecu)) slot.flags |= FLAG_PERMANENT;
+                }
+                slot.flags |= FLAG_CARRIED;
+                slot.status &= ~DTC_FAILED_THIS_CYCLE;
+                continue;
+            }
+
+            slot.status &= ~(DTC_TEST_FAILED | DTC_PENDING);
+            slot.flags &= ~FLAG_CARRIED;
+            uint8_t passes = slot.flags & PASS_COUNT_MASK;
+            if (passes < PASS_COUNT_MASK) passes++;
+            slot.flags = (slot.flags & ~PASS_COUNT_MASK) | passes;
+
+            if (!(slot.status & DTC_CONFIRMED)) {
+                slot.flags &= ~FLAG_PERMANENT;  // Cleared by Mode 04, now passed
+            } else if (passes >= DTC_HEAL_CYCLES) {
+                slot.status &= ~DTC_WARNING_INDICATOR;
+                slot.flags &= ~FLAG_PERMANENT;
+                if (passes >= DTC_AGING_CYCLES) slot.status &= ~DTC_CONFIRMED;
+            }
+        }
+
+        // Erasing moves entries, so drop the forgotten codes in a second pass
+        for (uint16_t i = 0; i < DTC_TABLE_SLOTS;) {
+            const DtcSlot& slot = slots[i];
+            if (slot.ecu != DTC_SLOT_EMPTY && !(slot.status & (DTC_PENDING | DTC_CONFIRMED)) &&
+                !(slot.flags & FLAG_PERMANENT)) {
+                // Refills slot i, so look at it again; start over if an
+                // entry wrapped behind the scan
+                if (erase(i)) i = 0;
+            } else {
+                i++;
+            }
+        }
+    }
+
+    // Number of an ECU's codes a filter selects
+    uint16_t countOf(uint8_t ecu, uint16_t filter) const {
+        uint16_t n = 0;
+        for (uint16_t i = 0; i < DTC_TABLE_SLOTS; i++) {
+            if (matches(slots[i], ecu, filter)) n++;
+        }
+        return n;
+    }
+
+    // Whether any of an ECU's codes asks for the warning lamp
+    bool warningIndicator(uint8_t ecu) const {
+        return countOf(ecu, DTC_WARNING_INDICATOR) > 0;
+    }
+
+    // nth (0-based) code a filter selects, in table order; false past the end
+    bool nth(uint8_t ecu, uint16_t filter, uint16_t n, uint16_t& dtc) const {
+        for (uint16_t i = 0; i < DTC_TABLE_SLOTS; i++) {
+            if (!matches(slots[i], ecu, filter)) continue;
+            if (n-- == 0) {
+                dtc = slots[i].dtc;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Start a cursor over up to limit matching codes
+    void openCursor(DtcCursor& cursor, uint8_t ecu, uint16_t filter, uint8_t recordSize, uint16_t limit) const {
+        cursor.store = this;
+        cursor.ecu = ecu;
+        cursor.filter = filter;
+        cursor.recordSize = recordSize;
+        cursor.limit = limit;
+        cursor.slot = 0;
+        cursor.records = 0;
+        cursor.offset = 0;
+        cursor.recordPos = recordSize;
+    }
+
+    // PayloadReader over a DtcCursor: stream bytes [offset, offset + count).
+    // Reads normally move forward; going back restarts the walk.
+    static void readCursor(void* context, uint16_t offset, uint8_t* data, uint8_t count) {
+        DtcCursor& cursor = *(DtcCursor*)context;
+        const DtcStore& store = *cursor.store;
+        if (offset < cursor.offset) {
+            store.openCursor(cursor, cursor.ecu, cursor.filter, cursor.recordSize, cursor.limit);
+        }
+
+        while (cursor.offset < offset + count) {
+            if (cursor.recordPos == cursor.recordSize) {
+                // Next record; zeros if the codes changed since the length was set
+                memset(cursor.record, 0, sizeof(cursor.record));
+                while (cursor.records < cursor.limit && cursor.slot < DTC_TABLE_SLOTS) {
+                    const DtcSlot& slot = store.slots[cursor.slot++];
+                    if (!matches(slot, cursor.ecu, cursor.filter)) continue;
+                    cursor.record[0] = slot.dtc >> 8;
+                    cursor.record[1] = slot.dtc & 0xFF;
+                    cursor.record[3] = slot.status & DTC_STATUS_AVAILABLE;  // FTB [2] is 00
+                    break;
+                }
+                cursor.records++;
+                cursor.recordPos = 0;
+            }
+            uint8_t value = cursor.record[cursor.recordPos++];
+            if (cursor.offset >= offset) data[cursor.offset - offset] = value;
+            cursor.offset++;
+        }
+    }
+};
+
+#endif // DTC_STORE_H
@@ -0,0 +1,172 @@
+#ifndef DYNAMIC_DID_H
+#define DYNAMIC_DID_H
+
+#include <Arduino.h>
+#include "config.h"
+#include "did_registry.h"
+#include "ecu_image.h"
+
+/**
+ * Service 2C dynamically defined DIDs
+ *
+ * A tester packs several signals into one DID (F200-F3FF) so a single
+ * service 22 read, or one periodic 2A frame, returns them all. Each
+ * definition is a list of sources: a slice (1-based position, size) of
+ * another DID's data (2C 01), or a range of ECU memory (2C 02, see
+ * ecu_image.h). Defining an existing DID again appends sources, as ISO
+ * 14229 specifies.
+ *
+ * Sources keep a copy of their DidSlot, so reading a dynamic DID runs the
+ * encoders directly with no table lookups; consecutive slices of one
+ * source DID share one encode. Definitions live for the client session
+ * (DYNAMIC_DIDS of them, per platform) and are cleared on disconnect.
+ */
+
+static constexpr uint16_t DYNAMIC_DID_FIRST = 0xF200;
+static constexpr uint16_t DYNAMIC_DID_LAST = 0xF3FF;
+
+// Composite data has to fit a 62 DID ... response
+static constexpr uint8_t DYNAMIC_DID_MAX_DATA = MAX_ECU_PAYLOAD - 3;
+
+struct DynamicDidSource {
+    DidSlot slot;       // Encoder DID_SLOT_EMPTY: memory at address
+    uint32_t address;
+    uint8_t position;   // First byte of the source data, 1-based
+    uint8_t size;
+};
+
+struct DynamicDid {
+    uint16_t did;
+    uint8_t ecu;        // Index into ECUS
+    uint8_t length;     // Sum of the source sizes
+    uint8_t sourceCount;  // 0 = unused
+    DynamicDidSource sources[DYNAMIC_DID_MAX_SOURCES];
+};
+
+class DynamicDidTable {
+private:
+    DynamicDid entries[DYNAMIC_DIDS];
+
+    DynamicDid* lookup(uint8_t ecu, uint16_t did) {
+        for (uint8_t i = 0; i < DYNAMIC_DIDS; i++) {
+            if (entries[i].sourceCount > 0 && entries[i].did == did && entries[i].ecu == ecu) {
+                return &entries[i];
+            }
+        }
+        return nullptr;
+    }
+
+    // Append a source, creating the dynamic DID if needed
+    bool add(const EcuDef& ecu, uint16_t did, const DidSlot& source, uint32_t address,
+             uint8_t position, uint8_t size) {
+        uint8_t e = &ecu - ECUS;
+        DynamicDid* entry = lookup(e, did);
+        if (entry == nullptr) {
+            for (uint8_t i = 0; i < DYNAMIC_DIDS && entry == nullptr; i++) {
+                if (entries[i].sourceCount == 0) entry = &entries[i];
+            }
+            if (entry == nullptr) return false;
+            entry->did = did;
+            entry->ecu = e;
+            entry->length = 0;
+        }
+        if (entry->sourceCount >= DYNAMIC_DID_MAX_SOURCES || entry->length + size > DYNAMIC_DID_MAX_DATA) {
+            return false;
+        }
+
+        DynamicDidSource& added = entry->sources[entry->sourceCount++];
+        added.slot = source;
+        added.address = address;
+        added.position = position;
+        added.size = size;
+        entry->length += size;
+        return true;
+    }
+
+public:
+    DynamicDidTable() {
+        clear();
+    }
+
+    static bool inRange(uint16_t did) {
+        return did >= DYNAMIC_DID_FIRST && did <= DYNAMIC_DID_LAST;
+    }
+
+    void clear() {
+        for (uint8_t i = 0; i < DYNAMIC_DIDS; i++) entries[i].sourceCount = 0;
+    }
+
+    // Clear one ECU's dynamic DID; false if it isn't defined
+    bool remove(const EcuDef& ecu, uint16_t did) {
+        DynamicDid* entry = lookup(&ecu - ECUS, did);
+        if (entry == nullptr) return false;
+        entry->sourceCount = 0;
+        return true;
+    }
+
+    // Drop the sources after the first sourceCount (undo a failed append;
+    // 0 clears the DID)
+    void truncate(const EcuDef& ecu, uint16_t did, uint8_t sourceCount) {
+        DynamicDid* entry = lookup(&ecu - ECUS, did);
+        if (entry == nullptr || sourceCount >= entry->sourceCount) return;
+        for (uint8_t i = sourceCount; i < entry->sourceCount; i++) entry->length -= entry->sources[i].size;
+        entry->sourceCount = sourceCount;
+    }
+
+    // Clear all of an ECU's dynamic DIDs
+    void removeAll(const EcuDef& ecu) {
+        uint8_t e = &ecu - ECUS;
+        for (uint8_t i = 0; i < DYNAMIC_DIDS; i++) {
+            if (entries[i].ecu == e) entries[i].sourceCount = 0;
+        }
+    }
+
+    // Append a slice of a source DID to a dynamic DID, creating it if
+    // needed. False if the slice isn't within the source data or there's no
+    // room (entries, sources or data length).
+    bool append(const EcuDef& ecu, uint16_t did, const DidSlot& source, uint8_t position, uint8_t size) {
+        uint8_t data[DID_MAX_DATA];
+        uint8_t sourceLength = DidTable::encode(source, DEFAULT_CAR_STATE, data);
+        if (position == 0 || size == 0 || position - 1 + size > sourceLength) return false;
+        return add(ecu, did, source, 0, position, size);
+    }
+
+    // Append a memory range (already checked against the image)
+    bool appendMemory(const EcuDef& ecu, uint16_t did, uint32_t address, uint8_t size) {
+        DidSlot memory;
+        memory.did = 0;
+        memory.ecu = &ecu - ECUS;
+        memory.encoder = DID_SLOT_EMPTY;
+        memory.param = 0;
+        return size > 0 && add(ecu, did, memory, address, 1, size);
+    }
+
+    // Definition of an ECU's dynamic DID, nullptr if it has none
+    const DynamicDid* find(const EcuDef& ecu, uint16_t did) {
+        return lookup(&ecu - ECUS, did);
+    }
+
+    // Write a dynamic DID's data for the given state; returns its length
+    static uint8_t encode(const DynamicDid& entry, const CarState& state, EcuImage& image, uint8_t* data) {
+        uint8_t source[DID_MAX_DATA];
+        const DidSlot* encoded = nullptr;
+        uint8_t length = 0;
+        for (uint8_t i = 0; i < entry.sourceCount; i++) {
+            const DynamicDidSource& s = entry.sources[i];
+            if (s.slot.encoder == DID_SLOT_EMPTY) {
+                image.read(s.address, &data[length], s.size, state);
+                length += s.size;
+                continue;
+            }
+            if (encoded == nullptr || encoded->did != s.slot.did || encoded->ecu != s.slot.ecu) {
+                DidTable::encode(s.slot, state, source);
+                encoded = &s.slot;
+            }
+            memcpy(&data[length], &source[s.position - 1], s.size);
+            length += s.size;
+        }
+        return length;
+    }
+};
+
+#endif // DYNAMIC_DID_H
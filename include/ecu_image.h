@@ -0,0 +1,143 @@
+#ifndef ECU_IMAGE_H
+#define ECU_IMAGE_H
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include "config.h"
+
+/**
+ * Simulated ECU memory (services 23, 35/36/37 and 2C 02)
+ *
+ * The PCM (ECU_IMAGE_ECU) has two address ranges:
+ *
+ *   0 .. size-1          flash image: ECU_IMAGE_PATH on LittleFS (upload
+ *                        with "pio run -t uploadfs"), copied to PSRAM when
+ *                        the board has it. Without the file the image is
+ *                        ECU_IMAGE_DEFAULT_SIZE bytes of a fixed pattern,
+ *                        byte(a) = (a * 2654435761) >> 24, so a reader can
+ *                        check what it got.
+ *   ECU_RAM_BASE ..      RAM: the live CarState, byte for byte
+ *
+ * Reads never buffer a whole transfer. A file-backed image is read through
+ * a small aligned block cache (ECU_IMAGE_CACHE_BYTES), so the frame-sized
+ * reads of an ISO-TP transfer cost one file read per block.
+ */
+
+static_assert((ECU_IMAGE_CACHE_BYTES & (ECU_IMAGE_CACHE_BYTES - 1)) == 0,
+              "ECU_IMAGE_CACHE_BYTES must be a power of two");
+
+// Service 35 (RequestUpload) transfer in progress
+struct UploadState {
+    bool active;
+    uint32_t address;       // Next byte to send
+    uint32_t remaining;
+    uint8_t sequence;       // Block sequence counter expected next
+    uint32_t lastAddress;   // Last block sent, resent if its counter repeats
+    uint16_t lastLength;
+};
+
+class EcuImage {
+private:
+    File file;
+    bool fromFile;
+    uint32_t imageSize;
+    uint8_t* psram;      // Whole image in PSRAM, nullptr if not used
+
+    uint8_t cache[ECU_IMAGE_CACHE_BYTES];
+    uint32_t cacheBase;  // Address of cache[0]
+    bool cacheValid;
+
+    static uint8_t patternByte(uint32_t address) {
+        return (uint32_t)(address * 2654435761UL) >> 24;
+    }
+
+    uint8_t flashByte(uint32_t address) {
+        if (psram) return psram[address];
+        if (!fromFile) return patternByte(address);
+
+        uint32_t base = address & ~(uint32_t)(ECU_IMAGE_CACHE_BYTES - 1);
+        if (!cacheValid || base != cacheBase) {
+            file.seek(base);
+            file.read(cache, ECU_IMAGE_CACHE_BYTES);
+            cacheBase = base;
+            cacheValid = true;
+        }
+        return cache[address - base];
+    }
+
+public:
+    EcuImage() : fromFile(false), imageSize(ECU_IMAGE_DEFAULT_SIZE), psram(nullptr),
+                 cacheBase(0), cacheValid(false) {}
+
+    // Open the image file (call after LittleFS is available), or fall back
+    // to the pattern
+    void load() {
+        if (LittleFS.begin()) file = LittleFS.open(ECU_IMAGE_PATH, "r");
+        if (!file) {
+            Serial.printf("%s not found, using a %lu byte pattern image\n", ECU_IMAGE_PATH,
+                          (unsigned long)imageSize);
+            return;
+        }
+        fromFile = true;
+        imageSize = file.size();
+        cacheValid = false;
+
+        #if HAS_PSRAM
+            psram = (uint8_t*)ps_malloc(imageSize);
+            if (psram && file.read(psram, imageSize) == imageSize) {
+                file.close();
+                Serial.printf("Loaded %lu byte ECU image into PSRAM\n", (unsigned long)imageSize);
+                return;
+            }
+            free(psram);
+            psram = nullptr;
+        #endif
+        Serial.printf("ECU image %s: %lu bytes\n", ECU_IMAGE_PATH, (unsigned long)imageSize);
+    }
+
+    uint32_t size() const { return imageSize; }
+
+    // Whether [address, address + count) lies within one range
+    bool contains(uint32_t address, uint32_t count) const {
+        if (count == 0) return false;
+        if (address < imageSize) return count <= imageSize - address;
+        if (address >= ECU_RAM_BASE && address - ECU_RAM_BASE < sizeof(CarState)) {
+            return count <= sizeof(CarState) - (address - ECU_RAM_BASE);
+        }
+        return false;
+    }
+
+    // Time the simulated ECU takes to fetch count bytes (flash only; RAM is
+    // immediate)
+    static uint32_t readTimeUs(uint32_t address, uint32_t count) {
+        return address >= ECU_RAM_BASE ? 0 : count * (uint32_t)ECU_IMAGE_READ_US_PER_KB / 1024;
+    }
+
+    // Copy memory that contains() accepted
+    void read(uint32_t address, uint8_t* data, uint16_t count, const CarState& state) {
+        if (address >= ECU_RAM_BASE) {
+            memcpy(data, (const uint8_t*)&state + (address - ECU_RAM_BASE), count);
+            return;
+        }
+        for (uint16_t i = 0; i < count; i++) data[i] = flashByte(address + i);
+    }
+
+    // Parse an addressAndLengthFormatIdentifier and the address and size
+    // fields after it. Returns the bytes used, 0 if the format is invalid
+    // or the request is too short.
+    static uint8_t parseAddress(const uint8_t* request, uint8_t length, uint32_t& address, uint32_t& size) {
+        if (length < 1) return 0;
+        uint8_t sizeBytes = request[0] >> 4;
+        uint8_t addressBytes = request[0] & 0x0F;
+        if (sizeBytes < 1 || sizeBytes > 4 || addressBytes < 1 || addressBytes > 4) return 0;
+        if (length < 1 + addressBytes + sizeBytes) return 0;
+
+        address = 0;
+        size = 0;
+        for (uint8_t i = 0; i < addressBytes; i++) address = (address << 8) | request[1 + i];
+        for (uint8_t i = 0; i < sizeBytes; i++) size = (size << 8) | request[1 + addressBytes + i];
+        return 1 + addressBytes + sizeBytes;
+    }
+};
+
+#endif // ECU_IMAGE_H
@@ -3,6 +3,183 @@
 
 #include <Arduino.h>
 #include "config.h"
+#include "obd_protocols.h"
+#include "response_writer.h"
+
+// AT command identifiers (dispatched by ELM327Protocol::executeATCommand)
+enum ATCommandId : uint8_t {
+    AT_DEVICE_DESC,      // @1
+    AT_DEVICE_ID_UNSUP,  // @2
+    AT_ADAPTIVE_TIMING,  // ATn
+    AT_CAN_AUTOFORMAT,   // CAFn
+    AT_CAN_FILTER,       // CF hhh / hhhhhhhh
+    AT_CAN_MASK,         // CM hhh / hhhhhhhh
+    AT_CAN_RX_ADDRESS,   // CRA [hhh] (X = don't care)
+    AT_DEFAULTS,         // D
+    AT_DESCRIBE_PROTO,   // DP
+    AT_DESCRIBE_PROTO_N, // DPN
+    AT_ECHO,             // En
+    AT_FC_SET_DATA,      // FCSD hh[hh..]
+    AT_FC_SET_HEADER,    // FCSH hhh / hhhhhhhh
+    AT_FC_SET_MODE,      // FCSM h
+    AT_HEADERS,          // Hn
+    AT_IDENTIFY,         // I
+    AT_LINEFEEDS,        // Ln
+    AT_MEMORY,           // Mn
+    AT_MONITOR_ALL,      // MA
+    AT_MONITOR_RECEIVER, // MR hh
+    AT_PROTOCOL_CLOSE,   // PC
+    AT_READ_VOLTAGE,     // RV
+    AT_SPACES,           // Sn
+    AT_SET_HEADER,       // SH hhh / hhhhhh / hhhhhhhh
+    AT_SET_PROTOCOL,     // SP [A]h
+    AT_SET_TIMEOUT,      // ST hh
+    AT_SET_WAKEUP,       // SW hh
+    AT_TRY_PROTOCOL,     // TP [A]h
+    AT_WARM_START,       // WS
+    AT_RESET             // Z
+};
+
+// STN (OBDLink) extended commands, enabled by the STN personality
+enum STCommandId : uint8_t {
+    ST_CAN_SEG_RX,       // CSEGR n
+    ST_CAN_SEG_TX,       // CSEGT n
+    ST_DEVICE_HW_ID,     // DI
+    ST_IDENTIFY,         // I
+    ST_PASS_THROUGH,     // PX H:hhh, D:hh.., R:n, T:ms
+    ST_PROTOCOL_TIMEOUT, // PTO ms
+    ST_SERIAL_NUMBER     // SN
+};
+
+// How the characters following an AT keyword are parsed
+enum ATArgType : uint8_t {
+    ARG_NONE,      // Nothing may follow the keyword
+    ARG_BOOL,      // Exactly '0' or '1'
+    ARG_DIGIT,     // A single decimal digit
+    ARG_HEX_BYTE,  // Exactly two hex digits
+    ARG_PROTOCOL,  // Optional 'A' followed by one hex digit
+    ARG_HEX,       // 1-16 hex digits; the command checks the count
+    ARG_HEX_MASK,  // Optional hex digits where 'X' matches anything
+    ARG_DECIMAL,   // 1-5 decimal digits, at most 65535
+    ARG_TEXT       // Anything; the command parses it
+};
+
+struct ATArgs {
+    uint32_t value;    // Parsed numeric argument (ARG_HEX: last 8 digits)
+    bool flag;         // ARG_PROTOCOL: 'A' (automatic fallback) prefix present
+    uint8_t digits;    // ARG_HEX/ARG_HEX_MASK: number of digits
+    uint32_t mask;     // ARG_HEX_MASK: 0 nibbles where an 'X' was given
+    uint8_t bytes[8];  // ARG_HEX: digits packed as bytes (even counts only)
+    const char* text;  // ARG_TEXT: everything after the keyword
+};
+
+// One OBD request as it goes on the bus: a plain hex line with ATSH in
+// effect, or an STPX with its own header, response count and timeout
+struct ObdRequest {
+    uint8_t data[MAX_COMMAND_LENGTH / 2];
+    uint8_t length;
+    uint8_t expectedReplies;  // Stop after this many replies, 0 = wait for the timeout
+    bool headerSet;           // False: the protocol's functional header
+    uint32_t header;
+    uint16_t timeoutMs;       // 0 = ATST / adaptive timing
+};
+
+// Flow control the ELM sends after an ECU's first frame (ATFCSM/FCSH/FCSD)
+struct FlowControlConfig {
+    uint8_t mode;       // 0 = automatic, 1 = user header and data, 2 = user data
+    uint32_t header;    // ATFCSH value
+    bool headerSet;
+    uint8_t data[5];    // ATFCSD bytes: flow status, block size, STmin, ...
+    uint8_t dataLen;    // 0 = not set
+};
+
+// Monitor requested by the last AT command (started by the transport)
+enum MonitorMode : uint8_t {
+    MONITOR_NONE,
+    MONITOR_ALL,       // ATMA
+    MONITOR_RECEIVER   // ATMR hh
+};
+
+// Keyword follows the "AT" (or "ST") prefix. MUST stay sorted (checked
+// below) so lookups can binary search; the longest matching keyword wins.
+struct ATCommandDef {
+    const char* name;
+    uint8_t id;
+    uint8_t arg;
+};
+
+static constexpr ATCommandDef AT_COMMANDS[] = {
+    {"@1",   AT_DEVICE_DESC,       ARG_NONE},
+    {"@2",   AT_DEVICE_ID_UNSUP,   ARG_NONE},
+    {"AT",   AT_ADAPTIVE_TIMING,   ARG_DIGIT},
+    {"CAF",  AT_CAN_AUTOFORMAT,    ARG_BOOL},
+    {"CF",   AT_CAN_FILTER,        ARG_HEX},
+    {"CM",   AT_CAN_MASK,          ARG_HEX},
+    {"CRA",  AT_CAN_RX_ADDRESS,    ARG_HEX_MASK},
+    {"D",    AT_DEFAULTS,          ARG_NONE},
+    {"DP",   AT_DESCRIBE_PROTO,    ARG_NONE},
+    {"DPN",  AT_DESCRIBE_PROTO_N,  ARG_NONE},
+    {"E",    AT_ECHO,              ARG_BOOL},
+    {"FCSD", AT_FC_SET_DATA,       ARG_HEX},
+    {"FCSH", AT_FC_SET_HEADER,     ARG_HEX},
+    {"FCSM", AT_FC_SET_MODE,       ARG_DIGIT},
+    {"H",    AT_HEADERS,           ARG_BOOL},
+    {"I",    AT_IDENTIFY,          ARG_NONE},
+    {"L",    AT_LINEFEEDS,         ARG_BOOL},
+    {"M",    AT_MEMORY,            ARG_BOOL},
+    {"MA",   AT_MONITOR_ALL,       ARG_NONE},
+    {"MR",   AT_MONITOR_RECEIVER,  ARG_HEX_BYTE},
+    {"PC",   AT_PROTOCOL_CLOSE,    ARG_NONE},
+    {"RV",   AT_READ_VOLTAGE,      ARG_NONE},
+    {"S",    AT_SPACES,            ARG_BOOL},
+    {"SH",   AT_SET_HEADER,        ARG_HEX},
+    {"SP",   AT_SET_PROTOCOL,      ARG_PROTOCOL},
+    {"ST",   AT_SET_TIMEOUT,       ARG_HEX_BYTE},
+    {"SW",   AT_SET_WAKEUP,        ARG_HEX_BYTE},
+    {"TP",   AT_TRY_PROTOCOL,      ARG_PROTOCOL},
+    {"WS",   AT_WARM_START,        ARG_NONE},
+    {"Z",    AT_RESET,             ARG_NONE},
+};
+
+static constexpr size_t AT_COMMAND_COUNT = sizeof(AT_COMMANDS) / sizeof(AT_COMMANDS[0]);
+
+static constexpr ATCommandDef ST_COMMANDS[] = {
+    {"CSEGR", ST_CAN_SEG_RX,       ARG_BOOL},
+    {"CSEGT", ST_CAN_SEG_TX,       ARG_BOOL},
+    {"DI",    ST_DEVICE_HW_ID,     ARG_NONE},
+    {"I",     ST_IDENTIFY,         ARG_NONE},
+    {"PTO",   ST_PROTOCOL_TIMEOUT, ARG_DECIMAL},
+    {"PX",    ST_PASS_THROUGH,     ARG_TEXT},
+    {"SN",    ST_SERIAL_NUMBER,    ARG_NONE},
+};
+
+static constexpr size_t ST_COMMAND_COUNT = sizeof(ST_COMMANDS) / sizeof(ST_COMMANDS[0]);
+
+// Compile-time helpers (single-expression constexpr for C++11 toolchains)
+constexpr int atKeywordCompare(const char* a, const char* b) {
+    return (*a != *b || *a == '\0') ? (int)(uint8_t)*a - (int)(uint8_t)*b
+                                     : atKeywordCompare(a + 1, b + 1);
+}
+
+constexpr bool atTableSorted(const ATCommandDef* table, size_t count, size_t i) {
+    return i + 1 >= count ||
+           (atKeywordCompare(table[i].name, table[i + 1].name) < 0 && atTableSorted(table, count, i + 1));
+}
+
+constexpr size_t atKeywordLength(const char* s) {
+    return *s ? 1 + atKeywordLength(s + 1) : 0;
+}
+
+constexpr size_t atMaxKeywordLength(const ATCommandDef* table, size_t count, size_t i, size_t longest) {
+    return i >= count ? longest
+         : atMaxKeywordLength(table, count, i + 1, atKeywordLength(table[i].name) > longest
+                                                       ? atKeywordLength(table[i].name) : longest);
+}
+
+static_assert(atTableSorted(AT_COMMANDS, AT_COMMAND_COUNT, 0), "AT_COMMANDS must be sorted by keyword");
+static_assert(atTableSorted(ST_COMMANDS, ST_COMMAND_COUNT, 0), "ST_COMMANDS must be sorted by keyword");
+static constexpr size_t AT_MAX_KEYWORD = atMaxKeywordLength(AT_COMMANDS, AT_COMMAND_COUNT, 0, 0);
+static constexpr size_t ST_MAX_KEYWORD = atMaxKeywordLength(ST_COMMANDS, ST_COMMAND_COUNT, 0, 0);
 
 class ELM327Protocol {
 private:
@@ -10,20 +187,381 @@ private:
     bool headers;
     bool spaces;
     bool linefeed;
-    uint8_t protocol;
-    uint16_t timeout;
+    bool canAutoFormat;
+    uint8_t protocol;          // ATSP/ATTP number, 0 = search
+    bool protocolAuto;         // Search if the set protocol fails (0 or 'A')
+    uint8_t activeProtocol;    // Protocol the bus was found on, 0 = not connected
+    uint16_t timeout;          // ATST, ms
+    uint8_t adaptiveTiming;    // ATAT0/1/2
+    uint16_t latencyEstimate;  // Learned ECU response time (ms), 0 = none yet
+    uint32_t txHeader;         // ATSH: CAN ID or 3-byte header requests are sent with
+    bool txHeaderSet;          // False: the protocol's functional (broadcast) header
+    FlowControlConfig flowControl;
+    uint32_t rxFilter;  // Receive filter (ATCF/ATCRA), compared under rxMask
+    uint32_t rxMask;    // ATCM/ATCRA; 0 = receive everything
+    MonitorMode monitorRequest;
+    uint8_t monitorAddress;
+    bool stnEnabled;           // STN personality: ST commands are answered
+    bool stnSegmentRx;         // STCSEGR: show multi-frame replies reassembled
+    bool stnSegmentTx;         // STCSEGT: allow requests longer than one frame
+    ObdRequest queuedRequest;  // STPX waiting for the transport to run it
+    bool requestQueued;
+
+    // Compare the first len characters of key against a table keyword
+    static int compareKeyword(const char* name, const char* key, size_t len) {
+        for (size_t i = 0; i < len; i++) {
+            if (name[i] != key[i]) return (int)(uint8_t)name[i] - (int)(uint8_t)key[i];
+        }
+        return name[len] == '\0' ? 0 : 1;
+    }
 
-    // Helper to format hex bytes
-    void formatHexByte(char* buf, uint8_t value, bool addSpace) {
-        static const char hex[] = "0123456789ABCDEF";
-        *buf++ = hex[value >> 4];
-        *buf++ = hex[value & 0x0F];
-        if (addSpace && spaces) *buf++ = ' ';
-        *buf = '\0';
+    // Longest-prefix lookup: binary search for each candidate keyword length
+    static const ATCommandDef* findCommand(const ATCommandDef* table, size_t count,
+                                           size_t maxKeyword, const char* key) {
+        size_t keyLen = strlen(key);
+        size_t len = keyLen < maxKeyword ? keyLen : maxKeyword;
+        for (; len > 0; len--) {
+            size_t lo = 0, hi = count;
+            while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                int cmp = compareKeyword(table[mid].name, key, len);
+                if (cmp == 0) return &table[mid];
+                if (cmp < 0) lo = mid + 1;
+                else hi = mid;
+            }
+        }
+        return nullptr;
+    }
+
+    static bool parseDecimal(const char* p, size_t len, uint32_t& value) {
+        value = 0;
+        if (len == 0 || len > 5) return false;
+        for (size_t i = 0; i < len; i++) {
+            if (p[i] < '0' || p[i] > '9') return false;
+            value = value * 10 + (p[i] - '0');
+        }
+        return value <= 0xFFFF;
+    }
+
+    static bool parseATArgs(ATArgType type, const char* p, ATArgs& args) {
+        args.value = 0;
+        args.flag = false;
+        args.digits = 0;
+        args.mask = 0;
+        args.text = p;
+        switch (type) {
+            case ARG_NONE:
+                return *p == '\0';
+            case ARG_BOOL:
+                if ((p[0] != '0' && p[0] != '1') || p[1] != '\0') return false;
+                args.value = p[0] - '0';
+                return true;
+            case ARG_DIGIT:
+                if (p[0] < '0' || p[0] > '9' || p[1] != '\0') return false;
+                args.value = p[0] - '0';
+                return true;
+            case ARG_HEX_BYTE: {
+                int8_t hi = hexValue(p[0]);
+                int8_t lo = hi < 0 ? -1 : hexValue(p[1]);
+                if (lo < 0 || p[2] != '\0') return false;
+                args.value = (hi << 4) | lo;
+                return true;
+            }
+            case ARG_PROTOCOL: {
+                // A lone 'A' is protocol A (J1939), not the automatic prefix
+                if (p[0] == 'A' && p[1] != '\0') {
+                    args.flag = true;
+                    p++;
+                }
+                int8_t digit = hexValue(p[0]);
+                if (digit < 0 || p[1] != '\0') return false;
+                args.value = digit;
+                return true;
+            }
+            case ARG_HEX:
+                for (; *p; p++) {
+                    int8_t digit = hexValue(*p);
+                    if (digit < 0 || args.digits >= 16) return false;
+                    args.value = (args.value << 4) | digit;
+                    if (args.digits & 1) {
+                        args.bytes[args.digits / 2] = (args.bytes[args.digits / 2] << 4) | digit;
+                    } else {
+                        args.bytes[args.digits / 2] = digit;
+                    }
+                    args.digits++;
+                }
+                return args.digits > 0;
+            case ARG_HEX_MASK:
+                for (; *p; p++) {
+                    int8_t digit = *p == 'X' ? 0 : hexValue(*p);
+                    if (digit < 0 || args.digits >= 8) return false;
+                    args.value = (args.value << 4) | digit;
+                    args.mask = (args.mask << 4) | (*p == 'X' ? 0x0 : 0xF);
+                    args.digits++;
+                }
+                return true;
+            case ARG_DECIMAL:
+                return parseDecimal(p, strlen(p), args.value);
+            case ARG_TEXT:
+                return true;
+        }
+        return false;
+    }
+
+    // Run a matched AT command. Returns false to answer with '?'.
+    bool executeATCommand(ATCommandId id, const ATArgs& args, ResponseWriter& out) {
+        switch (id) {
+            case AT_RESET:
+                reset();
+                delay(100);
+                out.print(ELM_DEVICE_DESC);
+                return true;
+
+            case AT_IDENTIFY:
+                // Device info - returns device identifier
+                out.print(ELM_DEVICE_ID);
+                return true;
+
+            case AT_DEVICE_DESC:
+                // Device description - returns version string
+                out.print(ELM_DEVICE_DESC);
+                return true;
+
+            case AT_DEVICE_ID_UNSUP:
+                // Not supported by real Vgate iCar2 - return error
+                return false;
+
+            case AT_READ_VOLTAGE:
+                out.print(ELM_VOLTAGE);
+                return true;
+
+            case AT_ECHO:
+                echo = args.value;
+                break;
+
+            case AT_HEADERS:
+                headers = args.value;
+                break;
+
+            case AT_SPACES:
+                spaces = args.value;
+                break;
+
+            case AT_LINEFEEDS:
+                linefeed = args.value;
+                break;
+
+            case AT_SET_PROTOCOL:
+            case AT_TRY_PROTOCOL:
+                if (args.value >= OBD_PROTOCOL_COUNT) return false;
+                protocol = args.value;
+                protocolAuto = args.flag || args.value == 0;
+                activeProtocol = 0;  // Connects on the next request
+                latencyEstimate = 0;
+                break;
+
+            case AT_PROTOCOL_CLOSE:
+                activeProtocol = 0;
+                break;
+
+            case AT_SET_TIMEOUT:
+                // Input is in increments of 4ms; 00 restores the default
+                timeout = (args.value ? args.value : 0x32) * 4;
+                latencyEstimate = 0;
+                break;
+
+            case AT_DESCRIBE_PROTO:
+                // Don't include "AUTO, " prefix - that suggests protocol not confirmed.
+                // Before the first request only the setting is known.
+                out.print(OBD_PROTOCOLS[activeProtocol ? activeProtocol : protocol].name);
+                return true;
+
+            case AT_DESCRIBE_PROTO_N: {
+                uint8_t number = activeProtocol ? activeProtocol : protocol;
+                if (protocolAuto && number != 0) out.put('A');
+                out.printHex(number, 1);
+                return true;
+            }
+
+            case AT_ADAPTIVE_TIMING:
+                if (args.value > 2) return false;
+                adaptiveTiming = args.value;
+                latencyEstimate = 0;
+                break;
+
+            case AT_CAN_AUTOFORMAT:
+                canAutoFormat = args.value;
+                break;
+
+            case AT_CAN_FILTER:
+                if (args.digits != 3 && args.digits != 8) return false;
+                rxFilter = args.value;
+                break;
+
+            case AT_CAN_MASK:
+                if (args.digits != 3 && args.digits != 8) return false;
+                rxMask = args.value;
+                break;
+
+            case AT_CAN_RX_ADDRESS:
+                // No address restores "receive everything"
+                if (args.digits != 0 && args.digits != 3 && args.digits != 8) return false;
+                rxFilter = args.value;
+                rxMask = args.digits == 3 ? (args.mask & 0x7FF) : args.mask;
+                break;
+
+            case AT_MONITOR_ALL:
+                // No OK or prompt: the transport streams until a byte arrives
+                monitorRequest = MONITOR_ALL;
+                return true;
+
+            case AT_MONITOR_RECEIVER:
+                monitorRequest = MONITOR_RECEIVER;
+                monitorAddress = args.value;
+                return true;
+
+            case AT_SET_HEADER:
+                // 11-bit CAN ID, 3-byte legacy header, or 29-bit CAN ID
+                if (args.digits != 3 && args.digits != 6 && args.digits != 8) return false;
+                txHeader = args.value;
+                txHeaderSet = true;
+                break;
+
+            case AT_FC_SET_HEADER:
+                // 11-bit (3 digits) or 29-bit (8 digits) CAN ID
+                if (args.digits != 3 && args.digits != 8) return false;
+                flowControl.header = args.value;
+                flowControl.headerSet = true;
+                break;
+
+            case AT_FC_SET_DATA:
+                // 1-5 data bytes
+                if ((args.digits & 1) || args.digits > 10) return false;
+                memcpy(flowControl.data, args.bytes, args.digits / 2);
+                flowControl.dataLen = args.digits / 2;
+                break;
+
+            case AT_FC_SET_MODE:
+                // User-defined modes need their header/data defined first
+                if (args.value > 2) return false;
+                if (args.value == 1 && !flowControl.headerSet) return false;
+                if (args.value >= 1 && flowControl.dataLen == 0) return false;
+                flowControl.mode = args.value;
+                break;
+
+            case AT_MEMORY:
+            case AT_SET_WAKEUP:
+                // Accepted but not emulated
+                break;
+
+            case AT_DEFAULTS:
+                reset();
+                break;
+
+            case AT_WARM_START:
+                out.print("ELM327 v1.5");
+                return true;
+        }
+        out.print("OK");
+        return true;
+    }
+
+    // STPX fields, comma separated: H:header, D:data (required), R:replies,
+    // T:timeout ms. Without H the ATSH header applies.
+    bool parsePassThrough(const char* p, ObdRequest& request) {
+        request.length = 0;
+        request.expectedReplies = 0;
+        request.headerSet = txHeaderSet;
+        request.header = txHeader;
+        request.timeoutMs = 0;
+
+        while (*p) {
+            char field = *p++;
+            if (*p++ != ':') return false;
+            const char* value = p;
+            while (*p && *p != ',') p++;
+            size_t len = p - value;
+            if (*p == ',') p++;
+
+            uint32_t number;
+            switch (field) {
+                case 'H':
+                    if (len != 3 && len != 6 && len != 8) return false;
+                    request.header = 0;
+                    for (size_t i = 0; i < len; i++) {
+                        int8_t digit = hexValue(value[i]);
+                        if (digit < 0) return false;
+                        request.header = (request.header << 4) | digit;
+                    }
+                    request.headerSet = true;
+                    break;
+                case 'D':
+                    if (len == 0 || (len & 1) || len / 2 > sizeof(request.data)) return false;
+                    for (size_t i = 0; i < len; i += 2) {
+                        int8_t hi = hexValue(value[i]);
+                        int8_t lo = hexValue(value[i + 1]);
+                        if (hi < 0 || lo < 0) return false;
+                        request.data[i / 2] = (hi << 4) | lo;
+                    }
+                    request.length = len / 2;
+                    break;
+                case 'R':
+                    if (!parseDecimal(value, len, number) || number > 0xFF) return false;
+                    request.expectedReplies = number;
+                    break;
+                case 'T':
+                    if (!parseDecimal(value, len, number)) return false;
+                    request.timeoutMs = number;
+                    break;
+                default:
+                    return false;
+            }
+        }
+        return request.length > 0;
+    }
+
+    // Run a matched ST command. Returns false to answer with '?'.
+    bool executeSTCommand(STCommandId id, const ATArgs& args, ResponseWriter& out) {
+        switch (id) {
+            case ST_IDENTIFY:
+                out.print(STN_DEVICE_ID);
+                return true;
+
+            case ST_DEVICE_HW_ID:
+                out.print(STN_HARDWARE_ID);
+                return true;
+
+            case ST_SERIAL_NUMBER:
+                out.print(STN_SERIAL_NUMBER);
+                return true;
+
+            case ST_PROTOCOL_TIMEOUT:
+                // Same timeout as ATST, in ms; 0 restores the default
+                timeout = args.value ? args.value : 200;
+                latencyEstimate = 0;
+                break;
+
+            case ST_CAN_SEG_RX:
+                stnSegmentRx = args.value;
+                break;
+
+            case ST_CAN_SEG_TX:
+                stnSegmentTx = args.value;
+                break;
+
+            case ST_PASS_THROUGH:
+                // No OK: the transport sends the request and prints the replies
+                if (!parsePassThrough(args.text, queuedRequest)) return false;
+                requestQueued = true;
+                return true;
+        }
+        out.print("OK");
+        return true;
     }
 
 public:
     ELM327Protocol() {
+        stnEnabled = false;
         reset();
     }
 
@@ -31,175 +569,176 @@ public:
         echo = true;  // Real Vgate iCar2 defaults to echo ON
         headers = false;
         spaces = true;
-        linefeed = true;
+        linefeed = false;  // Vgate iCar2: carriage return only until ATL1
+        canAutoFormat = true;
         protocol = 0;  // Auto
+        protocolAuto = true;
+        activeProtocol = 0;
         timeout = 200;
+        adaptiveTiming = 1;
+        latencyEstimate = 0;
+        txHeader = 0;
+        txHeaderSet = false;
+        flowControl.mode = 0;
+        flowControl.header = 0;
+        flowControl.headerSet = false;
+        flowControl.dataLen = 0;
+        rxFilter = 0;
+        rxMask = 0;
+        monitorRequest = MONITOR_NONE;
+        monitorAddress = 0;
+        stnSegmentRx = false;
+        stnSegmentTx = false;
+        requestQueued = false;
     }
 
     bool isEchoEnabled() const {
         return echo;
     }
 
-    // Parse AT command and return response
-    String handleCommand(String cmd) {
-        cmd.trim();
-        cmd.toUpperCase();
+    // Normalize a raw command line in place: drop spaces and control
+    // characters and upper-case the rest. Returns the new length.
+    static size_t normalizeCommand(char* cmd) {
+        size_t out = 0;
+        for (size_t in = 0; cmd[in] != '\0'; in++) {
+            char c = cmd[in];
+            if (c <= ' ' || c >= 127) continue;
+            if (c >= 'a' && c <= 'z') c -= 'a' - 'A';
+            cmd[out++] = c;
+        }
+        cmd[out] = '\0';
+        return out;
+    }
+
+    static bool isATCommand(const char* cmd) {
+        return cmd[0] == 'A' && cmd[1] == 'T';
+    }
+
+    static bool isSTCommand(const char* cmd) {
+        return cmd[0] == 'S' && cmd[1] == 'T';
+    }
 
-        // Remove spaces from command
-        cmd.replace(" ", "");
+    // Upper-case hex digit (input is normalized), -1 if not one
+    static int8_t hexValue(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
 
-        String response = "";
+    // Parse a normalized AT (or ST) command and write the response into out.
+    // Returns the response length; nothing is allocated on the heap.
+    size_t handleCommand(const char* cmd, char* out, size_t outSize) {
+        ResponseWriter writer(out, outSize);
+        handleCommand(cmd, writer);
+        return writer.length();
+    }
 
+    void handleCommand(const char* cmd, ResponseWriter& out) {
         // Echo command if enabled
+        out.setLinefeeds(linefeed);
         if (echo) {
-            response = cmd + "\r";
+            out.print(cmd);
+            out.put('\r');
         }
 
-        // AT Command Processing
-        if (cmd == "ATZ" || cmd == "AT Z") {
-            // Reset
-            reset();
-            delay(100);
-            return response + ELM_DEVICE_DESC "\r\r>";
-        }
-        else if (cmd == "ATI" || cmd == "AT I") {
-            // Device info - returns device identifier
-            return response + ELM_DEVICE_ID "\r\r>";
-        }
-        else if (cmd == "AT@1") {
-            // Device description - returns version string
-            return response + ELM_DEVICE_DESC "\r\r>";
-        }
-        else if (cmd == "AT@2") {
-            // Not supported by real Vgate iCar2 - return error
-            return response + "?\r\r>";
-        }
-        else if (cmd == "ATRV") {
-            // Read voltage
-            return response + ELM_VOLTAGE "\r\r>";
-        }
-        else if (cmd.startsWith("ATE")) {
-            // Echo on/off
-            echo = (cmd.charAt(3) == '1');
-            return response + "OK\r\r>";
-        }
-        else if (cmd.startsWith("ATH")) {
-            // Headers on/off
-            headers = (cmd.charAt(3) == '1');
-            return response + "OK\r\r>";
+        // Bare "AT" (or an empty line) is just acknowledged
+        bool st = isSTCommand(cmd);
+        const char* key = (st || isATCommand(cmd)) ? cmd + 2 : cmd;
+        if (*key == '\0' && !st) {
+            out.print("OK\r\r>");
+            return;
         }
-        else if (cmd.startsWith("ATS")) {
-            // Spaces on/off
-            spaces = (cmd.charAt(3) == '1');
-            return response + "OK\r\r>";
-        }
-        else if (cmd.startsWith("ATL")) {
-            // Linefeeds on/off
-            linefeed = (cmd.charAt(3) == '1');
-            return response + "OK\r\r>";
-        }
-        else if (cmd.startsWith("ATSP")) {
-            // Set protocol
-            if (cmd.length() > 4) {
-                protocol = cmd.substring(4).toInt();
-            }
-            return response + "OK\r\r>";
-        }
-        else if (cmd.startsWith("ATTP")) {
-            // Try protocol
-            if (cmd.length() > 4) {
-                protocol = cmd.substring(4).toInt();
-            }
-            return response + "OK\r\r>";
-        }
-        else if (cmd.startsWith("ATST")) {
-            // Set timeout
-            if (cmd.length() > 4) {
-                timeout = cmd.substring(4).toInt() * 4; // Input is in increments of 4ms
-            }
-            return response + "OK\r\r>";
-        }
-        else if (cmd == "ATDPN" || cmd == "ATDP") {
-            // Describe current protocol
-            // Don't include "AUTO, " prefix - that suggests protocol not confirmed
-            // We always report as successfully detected CAN protocol
-            if (cmd == "ATDPN") {
-                return response + "6\r\r>";  // Protocol number for ISO 15765-4 CAN 11/500
-            } else {
-                return response + "ISO 15765-4 (CAN 11/500)\r\r>";
-            }
-        }
-        else if (cmd == "ATAT0" || cmd == "ATAT1" || cmd == "ATAT2") {
-            // Adaptive timing
-            return response + "OK\r\r>";
-        }
-        else if (cmd.startsWith("ATM")) {
-            // Memory on/off
-            return response + "OK\r\r>";
-        }
-        else if (cmd.startsWith("ATCAF")) {
-            // CAN auto formatting
-            return response + "OK\r\r>";
-        }
-        else if (cmd == "ATD") {
-            // Set defaults (exact match only)
-            reset();
-            return response + "OK\r\r>";
-        }
-        else if (cmd.startsWith("ATWS")) {
-            // Warm start
-            return response + "ELM327 v1.5\r\r>";
-        }
-        else if (cmd.startsWith("ATSW")) {
-            // Set wakeup message (not commonly used, just acknowledge)
-            return response + "OK\r\r>";
-        }
-        else if (cmd == "AT" || cmd.length() == 0) {
-            // Empty AT command
-            return response + "OK\r\r>";
+
+        // ST commands only exist on an STN chip
+        const ATCommandDef* def = nullptr;
+        if (!st) {
+            def = findCommand(AT_COMMANDS, AT_COMMAND_COUNT, AT_MAX_KEYWORD, key);
+        } else if (stnEnabled) {
+            def = findCommand(ST_COMMANDS, ST_COMMAND_COUNT, ST_MAX_KEYWORD, key);
         }
-        else {
-            // Unknown command
-            return response + "?\r\r>";
+
+        ATArgs args;
+        if (!def || !parseATArgs((ATArgType)def->arg, key + strlen(def->name), args) ||
+            !(st ? executeSTCommand((STCommandId)def->id, args, out)
+                 : executeATCommand((ATCommandId)def->id, args, out))) {
+            // Unknown command or malformed argument
+            out.print("?");
+        } else if (monitorRequest != MONITOR_NONE || requestQueued) {
+            // Monitoring has no prompt until it is stopped; a queued
+            // request ends with the prompt after its replies
+            return;
         }
+        out.setLinefeeds(linefeed);  // ATL takes effect with its own reply
+        out.print("\r\r>");
     }
 
-    // Format OBD response with proper spacing and headers
-    String formatOBDResponse(uint8_t mode, uint8_t pid, uint8_t* data, uint8_t dataLen) {
-        String response = "";
-        char buf[4];
+    bool getSpaces() { return spaces; }
+    bool getLinefeeds() { return linefeed; }
+    bool getHeaders() { return headers; }
+    bool getCanAutoFormat() { return canAutoFormat; }
+    uint16_t getTimeout() { return timeout; }
+    bool getTxHeader(uint32_t& header) {
+        header = txHeader;
+        return txHeaderSet;
+    }
 
-        if (headers) {
-            // Add CAN header (7E8 is typical ECU response)
-            response = "7E8";
-            if (spaces) response += " ";
+    bool getStnSegmentRx() { return stnSegmentRx; }
+    bool getStnSegmentTx() { return stnSegmentTx; }
 
-            // Add length byte (mode + PID + data bytes)
-            uint8_t length = 2 + dataLen;  // 1 byte mode + 1 byte PID + data
-            formatHexByte(buf, length, spaces);
-            response += buf;
-        }
+    // STN personality (STI, STPX, ...); kept across ATZ/ATD
+    void setStnEnabled(bool enabled) { stnEnabled = enabled; }
+    bool isStnEnabled() { return stnEnabled; }
 
-        // Add response mode (request mode + 0x40)
-        formatHexByte(buf, mode + 0x40, spaces);
-        response += buf;
+    uint8_t getProtocol() { return protocol; }
+    bool isProtocolAuto() { return protocolAuto; }
+    uint8_t getActiveProtocol() { return activeProtocol; }
+    void setActiveProtocol(uint8_t number) { activeProtocol = number; }
 
-        // Add PID
-        formatHexByte(buf, pid, spaces);
-        response += buf;
+    // How long (ms) the adapter waits for an ECU reply, and after each reply
+    // for further ones. AT0 always uses ATST. AT1/AT2 learn the ECU response
+    // time and wait only a margin beyond it (AT2 cuts it close), never
+    // longer than ATST.
+    uint16_t getResponseWindow() {
+        if (adaptiveTiming == 0 || latencyEstimate == 0) return timeout;
+        uint16_t window = (adaptiveTiming == 1)
+            ? latencyEstimate + latencyEstimate / 2 + ADAPTIVE_AT1_MARGIN_MS
+            : latencyEstimate + latencyEstimate / 8 + ADAPTIVE_AT2_MARGIN_MS;
+        return window < timeout ? window : timeout;
+    }
 
-        // Add data bytes
-        for (uint8_t i = 0; i < dataLen; i++) {
-            formatHexByte(buf, data[i], (spaces && i < dataLen - 1));
-            response += buf;
-        }
+    void recordResponseTime(uint16_t ms) {
+        // Exponential moving average (1/4 weight on the new sample)
+        latencyEstimate = latencyEstimate ? (latencyEstimate * 3 + ms) / 4 : ms;
+    }
 
-        response += "\r\r>";
-        return response;
+    // A reply was missed: fall back to the full ATST wait until relearned
+    void recordMissedResponse() {
+        latencyEstimate = 0;
     }
+    const FlowControlConfig& getFlowControl() { return flowControl; }
 
-    bool getSpaces() { return spaces; }
-    bool getHeaders() { return headers; }
+    // ATCF/ATCM/ATCRA receive filter
+    bool acceptsId(uint32_t canId) {
+        return (canId & rxMask) == (rxFilter & rxMask);
+    }
+
+    // Monitor requested by ATMA/ATMR; cleared once the transport takes it
+    MonitorMode takeMonitorRequest(uint8_t& address) {
+        MonitorMode mode = monitorRequest;
+        address = monitorAddress;
+        monitorRequest = MONITOR_NONE;
+        return mode;
+    }
+
+    bool hasQueuedRequest() { return requestQueued; }
+
+    // Request queued by STPX; cleared once the transport takes it
+    bool takeQueuedRequest(ObdRequest& request) {
+        if (!requestQueued) return false;
+        request = queuedRequest;
+        requestQueued = false;
+        return true;
+    }
 };
 
 #endif // ELM327_PROTOCOL_H
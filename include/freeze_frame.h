@@ -0,0 +1,289 @@
+#ifndef FREEZE_FRAME_H
+#define FREEZE_FRAME_H
+
+#include <Arduino.h>
+#include <stddef.h>
+#include "config.h"
+
+/**
+ * Freeze frame storage (Mode 02)
+ *
+ * When a DTC is set the ECU records the car state at that moment, then
+ * FREEZE_FRAMES_PER_DTC - 1 more snapshots FREEZE_FRAME_INTERVAL_MS apart,
+ * so a tester sees how the fault developed; DTCs set close together record
+ * their bursts side by side. Snapshots are bit-packed to
+ * FREEZE_FRAME_BYTES (the CarState fields a PID can report, each at the
+ * width its range needs) and kept in a ring of FREEZE_FRAME_SLOTS; when it
+ * is full the oldest snapshot is overwritten.
+ *
+ * Frame numbers count from the oldest stored snapshot, so frame 00 is the
+ * first snapshot of the oldest DTC (the classic J1979 freeze frame) and a
+ * reader can walk 00, 01, ... until the ECU stops answering. A lookup is a
+ * ring index; the last unpacked frame is kept, so reading every PID of one
+ * frame unpacks it once.
+ */
+
+// A CarState member and the bits it is packed into. Values outside the
+// range are saturated.
+struct SnapshotField {
+    uint8_t offset;
+    uint8_t size;      // 1 or 2 bytes in CarState
+    uint8_t bits;
+    bool isSigned;
+};
+
+#define SNAPSHOT_FIELD(member, bits) \
+    {offsetof(CarState, member), sizeof(CarState::member), bits, (decltype(CarState::member))-1 < 0}
+
+static constexpr SnapshotField SNAPSHOT_FIELDS[] PROGMEM = {
+    SNAPSHOT_FIELD(rpm, 14),               // 0-16383
+    SNAPSHOT_FIELD(speed, 8),
+    SNAPSHOT_FIELD(coolant_temp, 8),
+    SNAPSHOT_FIELD(intake_temp, 8),
+    SNAPSHOT_FIELD(throttle, 7),           // 0-127 %
+    SNAPSHOT_FIELD(maf, 16),
+    SNAPSHOT_FIELD(runtime, 16),
+    SNAPSHOT_FIELD(mil_distance, 16),
+    SNAPSHOT_FIELD(fuel_level, 7),
+    SNAPSHOT_FIELD(barometric, 8),
+    SNAPSHOT_FIELD(short_fuel_trim, 8),
+    SNAPSHOT_FIELD(long_fuel_trim, 8),
+    SNAPSHOT_FIELD(map, 8),
+    SNAPSHOT_FIELD(timing_advance, 7),     // -64..63 degrees, as PID 0E
+    SNAPSHOT_FIELD(o2_voltage, 8),
+    SNAPSHOT_FIELD(fuel_pressure, 11),     // 0-2047 kPa
+    SNAPSHOT_FIELD(egr, 7),
+    SNAPSHOT_FIELD(distance_mil_clear, 16),
+    SNAPSHOT_FIELD(battery_voltage, 15),   // 0-32.7 V
+    SNAPSHOT_FIELD(ambient_temp, 8),
+    SNAPSHOT_FIELD(oil_temp, 8),
+    SNAPSHOT_FIELD(mil_on, 1),
+};
+
+#undef SNAPSHOT_FIELD
+
+static constexpr uint8_t SNAPSHOT_FIELD_COUNT = sizeof(SNAPSHOT_FIELDS) / sizeof(SNAPSHOT_FIELDS[0]);
+
+constexpr uint16_t snapshotBits(uint8_t i = 0) {
+    return i >= SNAPSHOT_FIELD_COUNT ? 0 : SNAPSHOT_FIELDS[i].bits + snapshotBits(i + 1);
+}
+
+constexpr bool snapshotFieldsValid(uint8_t i = 0) {
+    return i >= SNAPSHOT_FIELD_COUNT ||
+           (SNAPSHOT_FIELDS[i].bits > 0 && SNAPSHOT_FIELDS[i].bits <= SNAPSHOT_FIELDS[i].size * 8 &&
+            snapshotFieldsValid(i + 1));
+}
+
+static constexpr uint8_t FREEZE_FRAME_BYTES = (snapshotBits() + 7) / 8;
+
+static_assert(snapshotFieldsValid(), "Snapshot fields need 1 to 8 * size bits");
+static_assert(FREEZE_FRAME_SLOTS <= 256, "Mode 02 frame numbers are one byte");
+static_assert(FREEZE_FRAMES_PER_DTC > 0 && FREEZE_FRAMES_PER_DTC <= FREEZE_FRAME_SLOTS,
+              "A DTC's freeze frames must fit the ring");
+static_assert(FREEZE_FRAME_BURSTS > 0, "A newly set DTC needs a burst slot");
+
+// A DTC's snapshots still to take
+struct FreezeFrameBurst {
+    uint16_t dtc;
+    uint8_t remaining;
+    unsigned long nextCaptureMs;
+};
+
+struct FreezeFrame {
+    uint16_t dtc;  // DTC that caused the snapshot (Mode 02 PID 02), 0 = none
+    uint8_t data[FREEZE_FRAME_BYTES];
+};
+
+class FreezeFrameStore {
+private:
+    FreezeFrame frames[FREEZE_FRAME_SLOTS];
+    uint16_t oldest;       // Slot of frame 00
+    uint16_t count;
+
+    // Bursts in progress, oldest first
+    FreezeFrameBurst bursts[FREEZE_FRAME_BURSTS];
+    uint8_t burstCount;
+
+    // Last unpacked frame
+    CarState decoded;
+    int16_t decodedSlot;   // -1 = none
+
+    uint16_t slotOf(uint16_t frameNumber) const {
+        return (oldest + frameNumber) % FREEZE_FRAME_SLOTS;
+    }
+
+    // Write the low `bits` bits of value at bit position pos (LSB first)
+    static void putBits(uint8_t* data, uint16_t pos, uint16_t value, uint8_t bits) {
+        while (bits > 0) {
+            uint8_t shift = pos & 7;
+            uint8_t chunk = 8 - shift < bits ? 8 - shift : bits;
+            uint8_t mask = ((1 << chunk) - 1) << shift;
+            data[pos >> 3] = (data[pos >> 3] & ~mask) | ((value << shift) & mask);
+            value >>= chunk;
+            pos += chunk;
+            bits -= chunk;
+        }
+    }
+
+    static uint16_t getBits(const uint8_t* data, uint16_t pos, uint8_t bits) {
+        uint16_t value = 0;
+        uint8_t done = 0;
+        while (done < bits) {
+            uint8_t shift = pos & 7;
+            uint8_t chunk = 8 - shift < bits - done ? 8 - shift : bits - done;
+            value |= (uint16_t)((data[pos >> 3] >> shift) & ((1 << chunk) - 1)) << done;
+            pos += chunk;
+            done += chunk;
+        }
+        return value;
+    }
+
+    static void pack(const CarState& state, uint8_t* data) {
+        const uint8_t* base = (const uint8_t*)&state;
+        uint16_t pos = 0;
+        for (uint8_t i = 0; i < SNAPSHOT_FIELD_COUNT; i++) {
+            uint8_t offset = pgm_read_byte(&SNAPSHOT_FIELDS[i].offset);
+            uint8_t size = pgm_read_byte(&SNAPSHOT_FIELDS[i].size);
+            uint8_t bits = pgm_read_byte(&SNAPSHOT_FIELDS[i].bits);
+            bool isSigned = pgm_read_byte(&SNAPSHOT_FIELDS[i].isSigned);
+
+            int32_t value;
+            if (size == 2) {
+                uint16_t raw;
+                memcpy(&raw, base + offset, 2);
+                value = isSigned ? (int16_t)raw : raw;
+            } else {
+                value = isSigned ? (int8_t)base[offset] : base[offset];
+            }
+
+            int32_t low = isSigned ? -(1L << (bits - 1)) : 0;
+            int32_t high = isSigned ? (1L << (bits - 1)) - 1 : (1L << bits) - 1;
+            if (value < low) value = low;
+            if (value > high) value = high;
+            putBits(data, pos, (uint16_t)value, bits);
+            pos += bits;
+        }
+    }
+
+    static void unpack(const uint8_t* data, CarState& state) {
+        uint8_t* base = (uint8_t*)&state;
+        uint16_t pos = 0;
+        for (uint8_t i = 0; i < SNAPSHOT_FIELD_COUNT; i++) {
+            uint8_t offset = pgm_read_byte(&SNAPSHOT_FIELDS[i].offset);
+            uint8_t size = pgm_read_byte(&SNAPSHOT_FIELDS[i].size);
+            uint8_t bits = pgm_read_byte(&SNAPSHOT_FIELDS[i].bits);
+            bool isSigned = pgm_read_byte(&SNAPSHOT_FIELDS[i].isSigned);
+
+            uint16_t raw = getBits(data, pos, bits);
+            if (isSigned && (raw & (1U << (bits - 1)))) raw |= 0xFFFF << bits;  // Sign-extend
+            if (size == 2) {
+                memcpy(base + offset, &raw, 2);
+            } else {
+                base[offset] = raw;
+            }
+            pos += bits;
+        }
+    }
+
+    void store(uint16_t dtc, const CarState& state) {
+        uint16_t slot;
+        if (count < FREEZE_FRAME_SLOTS) {
+            slot = slotOf(count++);
+        } else {
+            slot = oldest;  // Full: overwrite the oldest
+            oldest = (oldest + 1) % FREEZE_FRAME_SLOTS;
+        }
+        frames[slot].dtc = dtc;
+        pack(state, frames[slot].data);
+        if (decodedSlot == (int16_t)slot) decodedSlot = -1;
+    }
+
+public:
+    FreezeFrameStore() {
+        clear();
+    }
+
+    void clear() {
+        oldest = 0;
+        count = 0;
+        burstCount = 0;
+        decodedSlot = -1;
+    }
+
+    uint16_t size() const { return count; }
+    bool capturing() const { return burstCount > 0; }
+
+    // Record the snapshot for a newly set DTC and schedule the rest of its
+    // burst. Bursts of DTCs set together run side by side; past
+    // FREEZE_FRAME_BURSTS the oldest one ends early.
+    void trigger(uint16_t dtc, const CarState& state) {
+        store(dtc, state);
+        if (FREEZE_FRAMES_PER_DTC == 1) return;
+        if (burstCount == FREEZE_FRAME_BURSTS) {
+            memmove(&bursts[0], &bursts[1], (FREEZE_FRAME_BURSTS - 1) * sizeof(bursts[0]));
+            burstCount--;
+        }
+        FreezeFrameBurst& burst = bursts[burstCount++];
+        burst.dtc = dtc;
+        burst.remaining = FREEZE_FRAMES_PER_DTC - 1;
+        burst.nextCaptureMs = millis() + FREEZE_FRAME_INTERVAL_MS;
+    }
+
+    // Take every burst's next snapshot when due (call from the main loop)
+    void update(const CarState& state) {
+        unsigned long now = millis();
+        uint8_t kept = 0;
+        for (uint8_t i = 0; i < burstCount; i++) {
+            FreezeFrameBurst burst = bursts[i];
+            if ((long)(now - burst.nextCaptureMs) >= 0) {
+                store(burst.dtc, state);
+                burst.remaining--;
+                burst.nextCaptureMs += FREEZE_FRAME_INTERVAL_MS;
+            }
+            if (burst.remaining > 0) bursts[kept++] = burst;
+        }
+        burstCount = kept;
+    }
+
+    // Drop every snapshot of one DTC, keeping the others in order
+    void remove(uint16_t dtc) {
+        uint16_t kept = 0;
+        for (uint16_t n = 0; n < count; n++) {
+            const FreezeFrame& frame = frames[slotOf(n)];
+            if (frame.dtc == dtc) continue;
+            if (kept != n) frames[slotOf(kept)] = frame;
+            kept++;
+        }
+        count = kept;
+
+        uint8_t running = 0;
+        for (uint8_t i = 0; i < burstCount; i++) {
+            if (bursts[i].dtc != dtc) bursts[running++] = bursts[i];
+        }
+        burstCount = running;
+        decodedSlot = -1;
+    }
+
+    // DTC that caused a frame; false if the frame isn't stored
+    bool dtcOf(uint8_t frameNumber, uint16_t& dtc) const {
+        if (frameNumber >= count) return false;
+        dtc = frames[slotOf(frameNumber)].dtc;
+        return true;
+    }
+
+    // Car state of a frame, nullptr if it isn't stored. Fields a snapshot
+    // doesn't hold (the DTC list) read as empty. Valid until the next call.
+    const CarState* state(uint8_t frameNumber) {
+        if (frameNumber >= count) return nullptr;
+        uint16_t slot = slotOf(frameNumber);
+        if (decodedSlot != (int16_t)slot) {
+            decoded = DEFAULT_CAR_STATE;
+            decoded.dtc_count = 0;
+            unpack(frames[slot].data, decoded);
+            decodedSlot = slot;
+        }
+        return &decoded;
+    }
+};
+
+#endif // FREEZE_FRAME_H
@@ -0,0 +1,314 @@
+#ifndef ISOTP_ENCODER_H
+#define ISOTP_ENCODER_H
+
+#include <Arduino.h>
+#include "config.h"
+#include "elm327_protocol.h"
+#include "obd_protocols.h"
+#include "response_writer.h"
+
+/**
+ * ISO 15765-2 (ISO-TP) segmenter
+ *
+ * Turns one ECU response message (service byte onwards) into CAN frames and
+ * prints them the way an ELM327 shows them for the current ATH/ATS/ATCAF
+ * settings:
+ *
+ *   CAF1, H0:  single frame data only; multi-frame as a 3-digit length line
+ *              followed by "0:", "1:" ... lines (sequence number)
+ *   CAF1, H1:  CAN ID + PCI bytes ("7E8 10 14 ...", "7E8 21 ...";
+ *              29-bit IDs as four bytes, "18 DA F1 10 10 14 ...")
+ *   CAF0:      raw 8-byte frames including PCI and padding
+ *   STCSEGR1:  (CAF1) a multi-frame message as one line once complete
+ *
+ * A long message can be streamed (EcuTransfer::reader) so it is never held
+ * in RAM, and an ECU that needs time to produce it first answers
+ * "7F service 78" (response pending), repeated every ECU_P2_STAR_MS.
+ *
+ * Flow control is emulated from the tester side: after a first frame the
+ * ECU waits for the flow control the ELM would send (ATFCSM/FCSH/FCSD) and
+ * then paces consecutive frames by its block size and STmin. Each message
+ * is an EcuTransfer that reports when its next frame is ready, so the
+ * caller can interleave replies from several ECUs on one bus timeline.
+ */
+
+class IsoTpEncoder {
+private:
+    ELM327Protocol* elm;
+
+    static const uint16_t FC_TURNAROUND_US = 1000;  // Frame -> ELM flow control -> next CF
+    static const uint8_t PADDING_BYTE = 0x00;       // Fill for unused frame bytes
+
+    // STmin as sent in a flow control frame (ISO 15765-2 9.6.5.4)
+    static uint32_t stMinToMicros(uint8_t stMin) {
+        if (stMin <= 0x7F) return stMin * 1000UL;
+        if (stMin >= 0xF1 && stMin <= 0xF9) return (stMin - 0xF0) * 100UL;
+        return 127000UL;  // Reserved values are treated as the maximum
+    }
+
+    // ID the tester sends physical requests (and flow control) to the ECU on:
+    // 7E8 -> 7E0, 18DAF110 -> 18DA10F1
+    static uint32_t physicalRequestId(uint32_t canId) {
+        if (canId <= 0x7FF) return canId - 8;
+        return (canId & 0xFFFF0000UL) | ((canId & 0xFF) << 8) | ((canId >> 8) & 0xFF);
+    }
+
+    // Work out the flow control the ECU receives after its first frame.
+    // Returns false if it never gets a usable "clear to send".
+    bool receiveFlowControl(uint32_t canId, uint8_t& blockSize, uint32_t& stMinUs) {
+        blockSize = 0;
+        stMinUs = 0;
+
+        // The ELM only sends flow control itself while auto formatting is on
+        if (!elm->getCanAutoFormat()) return false;
+
+        const FlowControlConfig& fc = elm->getFlowControl();
+        if (fc.mode == 0) return true;  // Default: 30 00 00 to the physical ID
+
+        // A user-defined header the ECU doesn't listen on is never seen
+        if (fc.mode == 1 && fc.header != physicalRequestId(canId)) return false;
+
+        // Only "continue to send" keeps the ECU going; wait/overflow abort
+        if (fc.data[0] != 0x30) return false;
+        if (fc.dataLen > 1) blockSize = fc.data[1];
+        if (fc.dataLen > 2) stMinUs = stMinToMicros(fc.data[2]);
+        return true;
+    }
+
+    // Copy message bytes [offset, offset + count), buffered or streamed
+    static void copyPayload(const EcuTransfer& t, uint16_t offset, uint8_t* data, uint8_t count) {
+        while (count > 0 && offset < t.buffered) {
+            *data++ = t.payload[offset++];
+            count--;
+        }
+        if (count > 0) t.reader(t.readerContext, offset - t.buffered, data, count);
+    }
+
+    // STCSEGR1 line of a streamed message, read a frame's worth at a time
+    void printStreamed(ResponseWriter& out, const EcuTransfer& t) {
+        bool spaces = elm->getSpaces();
+        uint8_t chunk[7];
+        if (elm->getHeaders()) printId(out, t.id);
+        for (uint16_t offset = 0; offset < t.length; offset += 7) {
+            uint8_t count = t.length - offset < 7 ? t.length - offset : 7;
+            copyPayload(t, offset, chunk, count);
+            if (spaces && offset > 0) out.put(' ');
+            out.printHexBytes(chunk, count, spaces);
+        }
+        out.put('\r');
+    }
+
+    // CAN ID as the ELM shows it with ATH1 ("7E8 ", "18 DA F1 10 ")
+    void printId(ResponseWriter& out, uint32_t canId) {
+        bool spaces = elm->getSpaces();
+        if (canId > 0x7FF) {
+            for (int8_t shift = 24; shift >= 0; shift -= 8) {
+                out.printHex(canId >> shift, 2);
+                if (spaces) out.put(' ');
+            }
+        } else {
+            out.printHex(canId, 3);
+            if (spaces) out.put(' ');
+        }
+    }
+
+    // Print bytes [start, start + count) of a frame as one response line.
+    // lineIndex >= 0 adds the "n:" prefix used for CAF1 multi-frame output.
+    void printFrame(ResponseWriter& out, uint32_t canId, const uint8_t* frame,
+                    uint16_t start, uint16_t count, int8_t lineIndex) {
+        bool spaces = elm->getSpaces();
+
+        if (elm->getHeaders()) {
+            printId(out, canId);
+        } else if (lineIndex >= 0) {
+            out.printHex(lineIndex, 1);
+            out.print(spaces ? ": " : ":");
+        }
+
+        out.printHexBytes(&frame[start], count, spaces);
+        out.put('\r');
+    }
+
+public:
+    IsoTpEncoder(ELM327Protocol* elmProtocol) : elm(elmProtocol) {}
+
+    // Bus time of one (always 8-byte) frame on the active protocol
+    uint32_t frameTimeUs() {
+        return busFrameTimeUs(OBD_PROTOCOLS[elm->getActiveProtocol()], 8);
+    }
+
+    // Bus time of a tester request of length bytes: one single frame, or
+    // (STCSEGT) a first frame, the ECU's flow control and consecutive frames
+    uint32_t requestTimeUs(uint8_t length) {
+        uint32_t frameUs = frameTimeUs();
+        if (length <= 7) return frameUs;
+        uint8_t consecutive = (length - 6 + 6) / 7;
+        return frameUs + FC_TURNAROUND_US + consecutive * frameUs;
+    }
+
+    // Prepare a message from the ECU transmitting on canId; its first frame
+    // is ready at startUs
+    void begin(EcuTransfer& t, uint32_t canId, const uint8_t* payload, uint16_t length,
+               uint32_t startUs) {
+        t.id = canId;
+        t.payload = payload;
+        t.length = length > 0xFFF ? 0xFFF : length;  // 12-bit FF_DL
+        t.buffered = t.length;
+        t.reader = nullptr;
+        t.pendingService = 0;
+        t.offset = 0;
+        t.sequence = 0;
+        t.blockSize = 0;
+        t.framesInBlock = 0;
+        t.gapUs = frameTimeUs();
+        t.nextUs = startUs;
+        t.stalled = false;
+        t.line = nullptr;
+    }
+
+    // Stream bytes beyond the first `buffered` of the message from reader
+    void setReader(EcuTransfer& t, uint16_t buffered, PayloadReader reader, void* context) {
+        t.buffered = buffered;
+        t.reader = reader;
+        t.readerContext = context;
+    }
+
+    // The ECU needs until readyUs to produce the message: it answers
+    // "7F service 78" first (and again every ECU_P2_STAR_MS) if that is
+    // more than ECU_P2_MS after the request (ending at requestUs)
+    void setResponsePending(EcuTransfer& t, uint8_t service, uint32_t requestUs, uint32_t readyUs) {
+        if (readyUs <= requestUs + ECU_P2_MS * 1000UL) {
+            if (readyUs > t.nextUs) t.nextUs = readyUs;
+            return;
+        }
+        t.pendingService = service;
+        t.readyUs = readyUs;
+    }
+
+    // Print the transfer's next frame (seen by the adapter at nowUs) and
+    // work out when the one after it will be ready. Each frame ends with
+    // '\r'; the caller adds the final "\r>" prompt.
+    void writeFrame(ResponseWriter& out, EcuTransfer& t, uint32_t nowUs) {
+        bool caf = elm->getCanAutoFormat();
+        bool headers = elm->getHeaders();
+        bool reassemble = caf && elm->getStnSegmentRx();
+        uint8_t frame[8];
+
+        if (t.pendingService != 0) {
+            // Response pending: a single frame 7F service 78
+            frame[0] = 0x03;
+            frame[1] = 0x7F;
+            frame[2] = t.pendingService;
+            frame[3] = 0x78;
+            memset(&frame[4], PADDING_BYTE, 4);
+            if (!caf) {
+                printFrame(out, t.id, frame, 0, 8, -1);
+            } else if (headers) {
+                printFrame(out, t.id, frame, 0, 4, -1);
+            } else {
+                printFrame(out, t.id, frame, 1, 3, -1);
+            }
+
+            uint32_t repeatUs = nowUs + ECU_P2_STAR_MS * 1000UL;
+            if (repeatUs < t.readyUs) {
+                t.nextUs = repeatUs;
+            } else {
+                t.nextUs = t.readyUs > nowUs ? t.readyUs : nowUs;
+                t.pendingService = 0;
+            }
+            return;
+        }
+
+        if (t.offset == 0 && t.length <= 7) {
+            t.offset = t.length;
+            if (t.line && t.line->length > 0) {
+                out.print(t.line->text, t.line->length);  // Printed before (ResponseCache)
+                return;
+            }
+
+            // Single frame: PCI = length
+            frame[0] = t.length;
+            copyPayload(t, 0, &frame[1], t.length);
+            memset(&frame[1 + t.length], PADDING_BYTE, 7 - t.length);
+
+            // Print into the transfer's line first if it keeps the text
+            // (without ATL1 linefeeds; out adds those)
+            ResponseWriter line(t.line ? t.line->text : nullptr, t.line ? sizeof(t.line->text) : 0);
+            ResponseWriter& text = t.line ? line : out;
+            if (!caf) {
+                printFrame(text, t.id, frame, 0, 8, -1);
+            } else if (headers) {
+                printFrame(text, t.id, frame, 0, 1 + t.length, -1);
+            } else {
+                printFrame(text, t.id, frame, 1, t.length, -1);
+            }
+            if (t.line) {
+                out.print(t.line->text, line.length());
+                if (!line.overflow()) t.line->length = line.length();
+            }
+            return;
+        }
+
+        if (t.offset == 0) {
+            // First frame: 12-bit length, 6 payload bytes
+            frame[0] = 0x10 | (t.length >> 8);
+            frame[1] = t.length & 0xFF;
+            copyPayload(t, 0, &frame[2], 6);
+
+            if (reassemble) {
+                // Shown once the last consecutive frame is in
+            } else if (caf && !headers) {
+                out.printHex(t.length, 3);
+                out.put('\r');
+                printFrame(out, t.id, frame, 2, 6, 0);
+            } else {
+                printFrame(out, t.id, frame, 0, 8, -1);
+            }
+            t.offset = 6;
+            t.sequence = 1;
+
+            uint32_t stMinUs;
+            if (!receiveFlowControl(t.id, t.blockSize, stMinUs)) {
+                t.stalled = true;
+                return;
+            }
+            uint32_t frameUs = frameTimeUs();
+            t.gapUs = stMinUs > frameUs ? stMinUs : frameUs;
+            t.nextUs = nowUs + FC_TURNAROUND_US;
+            return;
+        }
+
+        // Consecutive frame: sequence number 1..F, 0..F, 7 bytes each
+        uint8_t chunk = (t.length - t.offset) < 7 ? (t.length - t.offset) : 7;
+        frame[0] = 0x20 | (t.sequence & 0x0F);
+        copyPayload(t, t.offset, &frame[1], chunk);
+        memset(&frame[1 + chunk], PADDING_BYTE, 7 - chunk);
+
+        if (reassemble) {
+            if (t.offset + chunk >= t.length) {
+                if (t.reader) {
+                    printStreamed(out, t);
+                } else {
+                    printFrame(out, t.id, t.payload, 0, t.length, -1);
+                }
+            }
+        } else if (caf && !headers) {
+            printFrame(out, t.id, frame, 1, 7, t.sequence & 0x0F);
+        } else {
+            printFrame(out, t.id, frame, 0, 8, -1);
+        }
+
+        t.offset += chunk;
+        t.sequence++;
+        t.framesInBlock++;
+        if (t.blockSize > 0 && t.framesInBlock == t.blockSize) {
+            // Block complete: ECU waits for the next flow control
+            t.framesInBlock = 0;
+            t.nextUs = nowUs + FC_TURNAROUND_US;
+        } else {
+            t.nextUs = nowUs + t.gapUs;
+        }
+    }
+};
+
+#endif // ISOTP_ENCODER_H
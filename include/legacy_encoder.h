@@ -0,0 +1,110 @@
+#ifndef LEGACY_ENCODER_H
+#define LEGACY_ENCODER_H
+
+#include <Arduino.h>
+#include "config.h"
+#include "elm327_protocol.h"
+#include "obd_protocols.h"
+#include "response_writer.h"
+
+/**
+ * J1850 / ISO 9141-2 / ISO 14230-4 message output
+ *
+ * Pre-CAN protocols have no transport layer: a reply is one or more short
+ * messages (at most 7 data bytes), each with a 3-byte header and a
+ * checksum. With ATH1 the ELM shows both:
+ *
+ *   J1850 PWM:  41 6B 10 41 0C 1A F8 <CRC>
+ *   VPW / 9141: 48 6B 10 41 0C 1A F8 <CRC/sum>
+ *   KWP2000:    84 F1 10 41 0C 1A F8 <sum>     (format byte = 80 + length)
+ *
+ * With ATH0 only the data bytes are printed. The reply to pace is an
+ * EcuTransfer whose payload is a list of [length][message] entries.
+ */
+class LegacyEncoder {
+private:
+    ELM327Protocol* elm;
+
+    const ObdProtocolDef& protocol() {
+        return OBD_PROTOCOLS[elm->getActiveProtocol()];
+    }
+
+public:
+    // SAE J1850 CRC-8 (polynomial 0x1D, initial 0xFF, inverted)
+    static uint8_t j1850Crc(const uint8_t* data, uint8_t length) {
+        uint8_t crc = 0xFF;
+        for (uint8_t i = 0; i < length; i++) {
+            crc ^= data[i];
+            for (uint8_t bit = 0; bit < 8; bit++) {
+                crc = (crc & 0x80) ? (crc << 1) ^ 0x1D : crc << 1;
+            }
+        }
+        return ~crc;
+    }
+
+    // ISO 9141 / 14230 checksum: sum of all bytes, modulo 256
+    static uint8_t isoChecksum(const uint8_t* data, uint8_t length) {
+        uint8_t sum = 0;
+        for (uint8_t i = 0; i < length; i++) sum += data[i];
+        return sum;
+    }
+
+    LegacyEncoder(ELM327Protocol* elmProtocol) : elm(elmProtocol) {}
+
+    // Bus time of the transfer's next message
+    uint32_t frameTimeUs(const EcuTransfer& t) {
+        return busFrameTimeUs(protocol(), t.payload[t.offset]);
+    }
+
+    // Prepare the messages [length][data]... sent by the ECU at address
+    // source; the first is ready at startUs
+    void begin(EcuTransfer& t, uint8_t source, const uint8_t* messages, uint16_t length,
+               uint32_t startUs) {
+        t.id = source;
+        t.payload = messages;
+        t.length = length;
+        t.buffered = length;
+        t.reader = nullptr;
+        t.pendingService = 0;
+        t.offset = 0;
+        t.sequence = 0;
+        t.blockSize = 0;
+        t.framesInBlock = 0;
+        t.gapUs = protocol().messageGapUs;
+        t.nextUs = startUs;
+        t.stalled = false;
+        t.line = nullptr;
+    }
+
+    // Print the transfer's next message (received at nowUs) as one line
+    void writeFrame(ResponseWriter& out, EcuTransfer& t, uint32_t nowUs) {
+        const ObdProtocolDef& proto = protocol();
+        bool spaces = elm->getSpaces();
+        uint8_t dataLen = t.payload[t.offset];
+        uint8_t frame[3 + 7 + 1];
+        uint8_t length = 0;
+
+        frame[length++] = proto.headerByte == 0x80 ? (0x80 | dataLen) : proto.headerByte;
+        frame[length++] = proto.headerByte == 0x80 ? 0xF1 : 0x6B;  // To the tester
+        frame[length++] = t.id;
+        memcpy(&frame[length], &t.payload[t.offset + 1], dataLen);
+        length += dataLen;
+        frame[length] = proto.bus == BUS_J1850 ? j1850Crc(frame, length) : isoChecksum(frame, length);
+        length++;
+
+        // ATH0 hides header and checksum
+        uint8_t start = 0;
+        uint8_t end = length;
+        if (!elm->getHeaders()) {
+            start = 3;
+            end = length - 1;
+        }
+        out.printHexBytes(&frame[start], end - start, spaces);
+        out.put('\r');
+
+        t.offset += 1 + dataLen;
+        t.nextUs = nowUs + t.gapUs;
+    }
+};
+
+#endif // LEGACY_ENCODER_H
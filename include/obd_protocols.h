@@ -0,0 +1,106 @@
+#ifndef OBD_PROTOCOLS_H
+#define OBD_PROTOCOLS_H
+
+#include <Arduino.h>
+#include "config.h"
+
+// Physical layer family of an OBD protocol
+enum BusFamily : uint8_t {
+    BUS_J1850,  // SAE J1850 PWM/VPW: 3-byte header, CRC
+    BUS_ISO,    // ISO 9141-2 / ISO 14230-4 (KWP2000): 3-byte header, sum checksum
+    BUS_CAN     // ISO 15765-4 and J1939: ISO-TP over CAN
+};
+
+// One ELM327 protocol (ATSP number = index into OBD_PROTOCOLS). Timings are
+// what the simulated bus costs, so legacy protocols are as slow as a real
+// car: a CAN frame takes a quarter of a millisecond at 500 kbit/s, while an
+// ISO 9141 message needs about 2 ms per byte and a 5-baud init of 2.6 s.
+struct ObdProtocolDef {
+    const char* name;         // ATDP text
+    uint8_t bus;              // BusFamily
+    bool extendedId;          // CAN: 29-bit identifiers
+    uint16_t bitRateKbps;     // CAN: bit rate (frame time derives from it)
+    uint16_t byteUs;          // J1850/ISO: time per byte incl. inter-byte gap
+    uint16_t frameOverheadUs; // J1850/ISO: start/end of frame per message
+    uint16_t messageGapUs;    // J1850/ISO: between messages of one reply (P2 for ISO)
+    uint8_t headerByte;       // J1850/ISO: first byte of an ECU response header
+    uint8_t functionalTarget; // J1850/ISO: target byte of a functional request
+    uint16_t initMs;          // Bus initialisation before the first request
+    uint16_t searchMs;        // What a failed attempt costs during the auto search
+};
+
+static constexpr ObdProtocolDef OBD_PROTOCOLS[] = {
+    // name                          bus        ext    kbps  byte  ovh   gap    hdr   tgt   init  search
+    {"AUTO",                        BUS_CAN,   false, 500,  0,    0,    0,     0x00, 0x00, 0,    0},
+    {"SAE J1850 PWM",               BUS_J1850, false, 0,    192,  150,  100,   0x41, 0x6A, 0,    200},
+    {"SAE J1850 VPW",               BUS_J1850, false, 0,    768,  400,  300,   0x48, 0x6A, 0,    200},
+    {"ISO 9141-2",                  BUS_ISO,   false, 0,    1960, 0,    25000, 0x48, 0x6A, 2600, 2600},
+    {"ISO 14230-4 (KWP 5BAUD)",     BUS_ISO,   false, 0,    1960, 0,    25000, 0x80, 0x33, 2600, 0},
+    {"ISO 14230-4 (KWP FAST)",      BUS_ISO,   false, 0,    1960, 0,    25000, 0x80, 0x33, 100,  300},
+    {"ISO 15765-4 (CAN 11/500)",    BUS_CAN,   false, 500,  0,    0,    0,     0x00, 0x00, 0,    100},
+    {"ISO 15765-4 (CAN 29/500)",    BUS_CAN,   true,  500,  0,    0,    0,     0x00, 0x00, 0,    100},
+    {"ISO 15765-4 (CAN 11/250)",    BUS_CAN,   false, 250,  0,    0,    0,     0x00, 0x00, 0,    100},
+    {"ISO 15765-4 (CAN 29/250)",    BUS_CAN,   true,  250,  0,    0,    0,     0x00, 0x00, 0,    100},
+    {"SAE J1939 (CAN 29/250)",      BUS_CAN,   true,  250,  0,    0,    0,     0x00, 0x00, 0,    100},
+    {"USER1 (CAN 11/125)",          BUS_CAN,   false, 125,  0,    0,    0,     0x00, 0x00, 0,    100},
+    {"USER2 (CAN 11/50)",           BUS_CAN,   false, 50,   0,    0,    0,     0x00, 0x00, 0,    100},
+};
+
+static constexpr uint8_t OBD_PROTOCOL_COUNT = sizeof(OBD_PROTOCOLS) / sizeof(OBD_PROTOCOLS[0]);
+
+// Protocols the ELM tries, in order, when searching (ATSP0). J1939 and the
+// user CAN protocols are only used when selected explicitly.
+static constexpr uint8_t OBD_SEARCH_LAST = 9;
+
+// Bits in one CAN data frame with 8 data bytes, including typical stuffing
+static constexpr uint16_t CAN_FRAME_BITS_11 = 125;
+static constexpr uint16_t CAN_FRAME_BITS_29 = 150;
+
+// Time one frame carrying dataBytes (J1850/ISO: header + data + checksum)
+// occupies the bus
+inline uint32_t busFrameTimeUs(const ObdProtocolDef& proto, uint8_t dataBytes) {
+    if (proto.bus == BUS_CAN) {
+        uint16_t bits = proto.extendedId ? CAN_FRAME_BITS_29 : CAN_FRAME_BITS_11;
+        return bits * 1000UL / proto.bitRateKbps;
+    }
+    return proto.frameOverheadUs + (3 + dataBytes + 1) * (uint32_t)proto.byteUs;
+}
+
+// Reads count bytes of a streamed message body, offset from the end of the
+// buffered part, into data
+typedef void (*PayloadReader)(void* context, uint16_t offset, uint8_t* data, uint8_t count);
+
+// Text of a single-frame reply as printed (ResponseCache)
+struct FrameText {
+    uint8_t length;         // 0 = not printed yet
+    char text[40];          // Longest: 29-bit ID and 8 bytes with spaces, "\r"
+};
+
+// One ECU reply being sent on the bus. On CAN this is a single ISO-TP
+// message; on J1850/ISO it is a list of messages, each stored as a length
+// byte followed by the message. A long CAN message can be streamed: the
+// first `buffered` bytes are in payload and the rest come from reader, a
+// frame at a time.
+struct EcuTransfer {
+    uint32_t id;            // CAN ID, or source address on J1850/ISO
+    const uint8_t* payload;
+    uint16_t length;
+    uint16_t buffered;      // Bytes in payload; beyond that, from reader
+    PayloadReader reader;
+    void* readerContext;
+    uint8_t pendingService; // Busy: 7F service 78 until readyUs (0 = ready)
+    uint32_t readyUs;
+    uint16_t offset;        // Payload bytes already sent
+    uint8_t sequence;       // Next consecutive frame sequence number
+    uint8_t blockSize;      // From flow control, 0 = no limit
+    uint8_t framesInBlock;
+    uint32_t gapUs;         // Separation between consecutive frames
+    uint32_t nextUs;        // When the next frame is ready (from request start)
+    bool stalled;           // No usable flow control: ECU gave up after the first frame
+    FrameText* line;        // Single frame: printed from here, or recorded here if empty
+
+    bool done() const { return stalled || offset >= length; }
+    bool complete() const { return !stalled && offset >= length; }
+};
+
+#endif // OBD_PROTOCOLS_H
@@ -0,0 +1,203 @@
+#ifndef PERIODIC_SCHEDULER_H
+#define PERIODIC_SCHEDULER_H
+
+#include <Arduino.h>
+#include "config.h"
+#include "elm327_protocol.h"
+#include "pid_handler.h"
+#include "response_writer.h"
+
+/**
+ * Service 2A periodic transmission (ReadDataByPeriodicIdentifier)
+ *
+ * Keeps the periodic identifiers a client started with 2A and sends each
+ * one from loop() at its rate (PERIODIC_SLOW_MS / MEDIUM / FAST) until it
+ * is stopped (2A 04), the bus closes or the client goes away. Frames are
+ * single CAN frames on the ECU's response ID with no PCI: the identifier
+ * (low byte of DID F2xx) followed by the DID's live data, printed the way
+ * the ELM shows received frames for ATH/ATS/ATCAF and passed through the
+ * ATCF/ATCM/ATCRA filter.
+ *
+ * Nothing waits: each poll sends the frames due so far, earliest first, as
+ * long as the client can take them. A frame that doesn't fit is dropped
+ * like on a busy bus rather than queued. One instance per transport.
+ */
+class PeriodicScheduler {
+private:
+    static const uint32_t MAX_LAG_US = 100000;  // Catch-up limit after a stall
+
+    struct Entry {
+        uint8_t ecu;
+        uint8_t id;
+        uint32_t periodUs;
+        uint32_t nextDue;  // micros()
+    };
+
+    ELM327Protocol* elm;
+    PIDHandler* pidHandler;
+
+    Entry entries[PERIODIC_MAX_IDS];
+    uint8_t entryCount;
+    uint32_t framesSent;
+    uint32_t framesDropped;
+
+    static uint32_t periodUs(uint8_t mode) {
+        switch (mode) {
+            case 1:  return PERIODIC_SLOW_MS * 1000UL;
+            case 2:  return PERIODIC_MEDIUM_MS * 1000UL;
+            default: return PERIODIC_FAST_MS * 1000UL;
+        }
+    }
+
+    int8_t findEntry(uint8_t ecu, uint8_t id) {
+        for (uint8_t i = 0; i < entryCount; i++) {
+            if (entries[i].ecu == ecu && entries[i].id == id) return i;
+        }
+        return -1;
+    }
+
+    void removeEntry(uint8_t i) {
+        entries[i] = entries[--entryCount];
+    }
+
+    void apply(const PeriodicRequest& request, uint32_t now) {
+        if (request.mode == 4) {
+            // Stop the listed identifiers, or all of the ECU's
+            for (uint8_t i = entryCount; i-- > 0;) {
+                if (entries[i].ecu != request.ecu) continue;
+                bool listed = request.count == 0;
+                for (uint8_t n = 0; n < request.count && !listed; n++) {
+                    listed = entries[i].id == request.ids[n];
+                }
+                if (listed) removeEntry(i);
+            }
+            return;
+        }
+
+        // Start, or change the rate of, each identifier
+        for (uint8_t n = 0; n < request.count; n++) {
+            int8_t i = findEntry(request.ecu, request.ids[n]);
+            if (i < 0) {
+                if (entryCount >= PERIODIC_MAX_IDS) continue;  // Session is full
+                i = entryCount++;
+                entries[i].ecu = request.ecu;
+                entries[i].id = request.ids[n];
+            }
+            entries[i].periodUs = periodUs(request.mode);
+            entries[i].nextDue = now + n * 250UL;  // Stagger so they don't all start together
+        }
+    }
+
+    // Format one periodic frame as the ELM prints it; false if the ECU no
+    // longer has the DID
+    bool formatFrame(const Entry& entry, ResponseWriter& text) {
+        uint8_t frame[8] = {0};
+        frame[0] = entry.id;
+        uint8_t length = pidHandler->readDid(entry.ecu, 0xF200 | entry.id, &frame[1]);
+        if (length == 0 || length > 7) return false;
+
+        const ObdProtocolDef& proto = OBD_PROTOCOLS[elm->getActiveProtocol()];
+        uint32_t canId = PIDHandler::ecuResponseId(ECUS[entry.ecu], proto);
+        if (!elm->acceptsId(canId)) return true;  // Filtered out: sent on the bus, not shown
+
+        bool spaces = elm->getSpaces();
+        text.setLinefeeds(elm->getLinefeeds());
+        if (elm->getHeaders()) {
+            if (canId > 0x7FF) {
+                for (int8_t shift = 24; shift >= 0; shift -= 8) {
+                    text.printHex(canId >> shift, 2);
+                    if (spaces) text.put(' ');
+                }
+            } else {
+                text.printHex(canId, 3);
+                if (spaces) text.put(' ');
+            }
+        }
+        // CAF0 shows the whole padded frame
+        text.printHexBytes(frame, elm->getCanAutoFormat() ? length + 1 : 8, spaces);
+        text.put('\r');
+        return true;
+    }
+
+public:
+    PeriodicScheduler(ELM327Protocol* elmProtocol, PIDHandler* handler)
+        : elm(elmProtocol), pidHandler(handler), entryCount(0), framesSent(0), framesDropped(0) {}
+
+    // Take up the 2A requests the last OBD request accepted
+    void applyRequests() {
+        PeriodicRequest request;
+        uint32_t now = micros();
+        while (pidHandler->takePeriodicRequest(request)) {
+            apply(request, now);
+        }
+    }
+
+    // Take up one 2A request queued on another task (BLE)
+    void applyRequest(const PeriodicRequest& request) { apply(request, micros()); }
+
+    bool isActive() const { return entryCount > 0; }
+    uint8_t size() const { return entryCount; }
+    uint32_t getFramesSent() const { return framesSent; }
+    uint32_t getFramesDropped() const { return framesDropped; }
+
+    // Call from loop() while active; room = bytes the client can take now
+    void poll(Print& out, size_t room) {
+        if (entryCount == 0) return;
+
+        // ATZ/ATSP/ATPC close the bus, which ends periodic transmission
+        uint8_t active = elm->getActiveProtocol();
+        if (active == 0 || OBD_PROTOCOLS[active].bus != BUS_CAN) {
+            cancel();
+            return;
+        }
+
+        uint32_t now = micros();
+        for (uint8_t i = 0; i < entryCount; i++) {
+            if ((int32_t)(now - entries[i].nextDue) > (int32_t)MAX_LAG_US) {
+                entries[i].nextDue = now - MAX_LAG_US;
+            }
+        }
+
+        while (true) {
+            int8_t next = -1;
+            for (uint8_t i = 0; i < entryCount; i++) {
+                if ((int32_t)(now - entries[i].nextDue) < 0) continue;
+                if (next < 0 || (int32_t)(entries[i].nextDue - entries[next].nextDue) < 0) next = i;
+            }
+            if (next < 0) return;
+
+            Entry& entry = entries[next];
+            entry.nextDue += entry.periodUs;
+
+            char line[40];
+            ResponseWriter text(line, sizeof(line));
+            if (!formatFrame(entry, text)) {
+                removeEntry(next);  // DID table changed under it
+                continue;
+            }
+            if (text.length() == 0) continue;
+            if (text.length() > room) {
+                framesDropped++;
+                continue;
+            }
+            out.write((const uint8_t*)line, text.length());
+            room -= text.length();
+            framesSent++;
+        }
+    }
+
+    // Client went away
+    void cancel() {
+        #if ENABLE_SERIAL_LOGGING
+            if (entryCount > 0) {
+                Serial.printf("PERIODIC: stopped after %lu frames (%lu dropped)\n",
+                              (unsigned long)framesSent, (unsigned long)framesDropped);
+            }
+        #endif
+        entryCount = 0;
+        framesSent = 0;
+        framesDropped = 0;
+    }
+};
+
+#endif // PERIODIC_SCHEDULER_H
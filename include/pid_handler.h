@@ -3,779 +3,1700 @@
 
 #include <Arduino.h>
 #include "config.h"
+#include "did_registry.h"
+#include "dtc_store.h"
+#include "dynamic_did.h"
+#include "ecu_image.h"
 #include "elm327_protocol.h"
+#include "freeze_frame.h"
+#include "isotp_encoder.h"
+#include "legacy_encoder.h"
+#include "obd_protocols.h"
+#include "pid_registry.h"
+#include "response_cache.h"
+#include "scenario.h"
+#include "state_snapshot.h"
+#include "trace_replay.h"
+#include "vehicle_model.h"
+#include "waveform.h"
 #include "config_manager.h"
 
+// Service 2A (ReadDataByPeriodicIdentifier) request accepted by one ECU:
+// start sending periodic identifiers (DIDs F2xx) at a rate, or stop them.
+// The transport's PeriodicScheduler picks these up after the request.
+struct PeriodicRequest {
+    uint8_t ecu;                    // Index into ECUS
+    uint8_t mode;                   // 1 slow, 2 medium, 3 fast, 4 stop
+    uint8_t ids[PERIODIC_MAX_IDS];  // Low byte of DID F2xx
+    uint8_t count;                  // Stop with no identifiers: stop all
+};
+
+class PIDHandler;
+
+// DTC list being streamed, and the handler whose stores it reads
+struct DtcStream {
+    PIDHandler* handler;
+    DtcCursor cursor;
+};
+
 class PIDHandler {
 private:
-    CarState currentState;
+    CarState currentState;          // Changed inside a StateWrite only
+    #if SIM_TASK
+    StateLock stateLock;            // Writers of currentState take turns
+    StateSnapshot published;        // currentState as readers see it
+    uint8_t writeDepth;             // Nested StateWrite scopes of the lock holder
+    #endif
+    CarState requestState;          // What the request being answered reads
+    FreezeFrameStore freezeFrames;  // Mode 02 snapshots
+    DtcStore dtcs;                  // Every ECU's trouble codes
+    DtcStream dtcStreams[ECU_COUNT];  // DTC lists being streamed
+    DidTable dids;                  // Service 22 identifiers
+    DynamicDidTable dynamicDids;    // Service 2C definitions (client session)
+    EcuImage image;                 // ECU_IMAGE_ECU memory (23, 35-37, 2C 02)
+    UploadState upload;             // Service 35 transfer in progress
+    ResponseCache responseCache;    // Printed Mode 01 replies
+
+    // Set by a handler whose reply continues with streamed data
+    uint16_t streamLength;
+    PayloadReader streamReader;
+    void* streamContext;
+    uint32_t streamAddress;         // Memory being streamed (readStream)
+    int16_t snapshotIdFrame;        // Last 19 03 record built (readSnapshotIds)
+    uint8_t snapshotIdRecord[4];
+    uint32_t processingUs;          // ECU time to produce the reply (0x78 if > P2)
+    bool functionalRequest;         // Request being answered went to all ECUs
+    PeriodicRequest periodicRequests[ECU_COUNT];  // Service 2A, last request
+    uint8_t periodicRequestCount;
     ELM327Protocol* elm;
+    IsoTpEncoder isotp;
+    LegacyEncoder legacy;
+    uint8_t vehicleProtocol;  // What the simulated car speaks (ATSP numbering)
+    uint8_t ecuPayloads[ECU_COUNT][MAX_ECU_PAYLOAD];  // Reply messages being sent
     ConfigManager* config;
     unsigned long startTime;
 
     // Driving simulator state
     DriveMode driveMode;
     unsigned long driveStartTime;
-    uint8_t drivePhase;  // 0=accel, 1=cruise, 2=decel, 3=stopped
+    uint32_t driveTick;  // SIM_TICK_MS steps the model has caught up to
+    VehicleModel vehicle;
+    TraceReplay replay;  // DRIVE_REPLAY's recorded drive
+    Scenario scenario;   // DRIVE_SCENARIO's compiled script
+    DriveMode scenarioDrive;  // Driver profile under the script (DRIVE_OFF = none)
+
+    // Scope of a change to currentState. With the simulator on its own task
+    // the writers (simulator, web callbacks, the request loop) take turns,
+    // and readers see the change once the outermost scope ends: a nested
+    // scope (syncDtcState inside a tick) must not publish a half-done step.
+    class StateWrite {
+    private:
+        PIDHandler& handler;
+
+    public:
+        explicit StateWrite(PIDHandler& owner) : handler(owner) {
+            #if SIM_TASK
+            handler.stateLock.lock();
+            handler.writeDepth++;
+            #endif
+        }
+
+        ~StateWrite() {
+            #if SIM_TASK
+            if (--handler.writeDepth == 0) handler.published.publish(handler.currentState);
+            handler.stateLock.unlock();
+            #endif
+        }
+    };
+
+    // Scope that reads the DTC and freeze frame stores. They change inside
+    // a StateWrite, from the simulator task (scenario events) as well as
+    // web callbacks, so readers take the same lock.
+    class StoreAccess {
+    private:
+        PIDHandler& handler;
+
+    public:
+        explicit StoreAccess(PIDHandler& owner) : handler(owner) {
+            #if SIM_TASK
+            handler.stateLock.lock();
+            #endif
+        }
+
+        ~StoreAccess() {
+            #if SIM_TASK
+            handler.stateLock.unlock();
+            #endif
+        }
+    };
 
 public:
-    PIDHandler(ELM327Protocol* elmProtocol, ConfigManager* configMgr) : elm(elmProtocol), config(configMgr) {
+    PIDHandler(ELM327Protocol* elmProtocol, ConfigManager* configMgr) : elm(elmProtocol), isotp(elmProtocol), legacy(elmProtocol), config(configMgr) {
+        vehicleProtocol = VEHICLE_PROTOCOL;
         currentState = DEFAULT_CAR_STATE;
         startTime = millis();
         driveMode = DRIVE_OFF;
         driveStartTime = 0;
-        drivePhase = 0;
+        driveTick = 0;
+        scenarioDrive = DRIVE_OFF;
+        functionalRequest = true;
+        upload.active = false;
+        streamLength = 0;
+        processingUs = 0;
+        snapshotIdFrame = -1;
+        periodicRequestCount = 0;
+        for (uint8_t e = 0; e < ECU_COUNT; e++) dtcStreams[e].handler = this;
+        #if SIM_TASK
+        writeDepth = 0;
+        #endif
+    }
+
+    // Load the service 22 DID table (LittleFS or built-in defaults)
+    void loadDids() { dids.load(); }
+    uint16_t getDidCount() { return dids.size(); }
+
+    // Open the simulated ECU memory image (LittleFS, PSRAM or pattern)
+    void loadEcuImage() { image.load(); }
+
+    // Open and index the recorded drive for DRIVE_REPLAY (again after an
+    // upload); false if there is none. Indexing reads the whole file, so
+    // it goes into a spare replay first and only the swap holds the lock.
+    bool loadTrace() {
+        TraceReplay* loaded = new TraceReplay();
+        bool ok = loaded->load();
+        {
+            StateWrite write(*this);
+            if (driveMode == DRIVE_REPLAY) driveMode = DRIVE_OFF;
+            loaded->setSpeed(replay.getSpeed(), millis());
+            loaded->setLooping(replay.getLooping(), millis());
+            replay = *loaded;
+        }
+        delete loaded;
+        return ok;
+    }
+
+    // Stop replaying and let go of the trace file before it is replaced
+    void closeTrace() {
+        StateWrite write(*this);
+        if (driveMode == DRIVE_REPLAY) driveMode = DRIVE_OFF;
+        replay.close();
+    }
+
+    uint32_t getTraceDurationMs() { return replay.durationMs(); }
+
+    // Replay controls: speed in percent of real time, looping at the end,
+    // and a jump to a time from the start of the trace
+    void setReplaySpeed(uint16_t percent) {
+        StateWrite write(*this);
+        replay.setSpeed(percent, millis());
+    }
+
+    void setReplayLooping(bool on) {
+        StateWrite write(*this);
+        replay.setLooping(on, millis());
+        refreshReplay();
     }
 
+    void seekReplay(uint32_t ms) {
+        StateWrite write(*this);
+        replay.seek(ms, millis());
+        refreshReplay();
+    }
+
+    // Compile a script for DRIVE_SCENARIO (SCENARIO_PATH). False if it
+    // doesn't compile (getScenarioError()); there is no script then.
+    bool loadScenario(const char* path = SCENARIO_PATH) {
+        Scenario* compiled = new Scenario();
+        bool ok = compiled->load(path);
+        installScenario(*compiled);
+        delete compiled;
+        return ok;
+    }
+
+    // Compile an upload only to find its errors before it replaces
+    // SCENARIO_PATH; the loaded script keeps running either way. No lock:
+    // checking uses only the compiler's fields, which the simulator task
+    // never reads.
+    bool checkScenario(const char* path) { return scenario.check(path); }
+
+    // Compile a built-in script (SCENARIO_PRESETS) instead
+    bool loadScenarioPreset(uint8_t preset) {
+        Scenario* compiled = new Scenario();
+        bool ok = compiled->loadPreset(preset);
+        installScenario(*compiled);
+        delete compiled;
+        return ok;
+    }
+
+    // Put a script compiled outside the lock (reading and compiling take a
+    // while) in place of the running one
+    void installScenario(const Scenario& compiled) {
+        StateWrite write(*this);
+        if (driveMode == DRIVE_SCENARIO) driveMode = DRIVE_OFF;
+        scenario = compiled;
+    }
+
+    const char* getScenarioError() { return scenario.getError(); }
+    uint16_t getScenarioSize() { return scenario.size(); }
+
+    // Client went away: dynamic DIDs and uploads belong to its session
+    void endSession() {
+        dynamicDids.clear();
+        upload.active = false;
+    }
+
+    // Current data of an ECU's DID (static or dynamic); returns its length,
+    // 0 if it has none. data needs DYNAMIC_DID_MAX_DATA bytes for a dynamic DID.
+    uint8_t readDid(uint8_t ecu, uint16_t did, uint8_t* data) {
+        CarState state = getState();
+        if (DynamicDidTable::inRange(did)) {
+            const DynamicDid* dynamic = dynamicDids.find(ECUS[ecu], did);
+            if (dynamic) return DynamicDidTable::encode(*dynamic, state, image, data);
+        }
+        const DidSlot* slot = dids.find(ECUS[ecu], did);
+        return slot ? DidTable::encode(*slot, state, data) : 0;
+    }
+
+    // Next service 2A request the last OBD request left for the transport
+    bool takePeriodicRequest(PeriodicRequest& request) {
+        if (periodicRequestCount == 0) return false;
+        request = periodicRequests[--periodicRequestCount];
+        return true;
+    }
+
+    // Switch the simulated car to another bus protocol (1-9, B, C). The
+    // adapter loses the connection and has to initialise or search again.
+    bool setVehicleProtocol(uint8_t number) {
+        if (number == 0 || number == 0x0A || number >= OBD_PROTOCOL_COUNT) return false;
+        vehicleProtocol = number;
+        elm->setActiveProtocol(0);
+        return true;
+    }
+
+    uint8_t getVehicleProtocol() { return vehicleProtocol; }
+
     // Update a specific car parameter
-    void updateRPM(uint16_t rpm) { currentState.rpm = rpm; }
-    void updateSpeed(uint8_t speed) { currentState.speed = speed; }
-    void updateCoolantTemp(uint8_t temp) { currentState.coolant_temp = temp; }
-    void updateIntakeTemp(uint8_t temp) { currentState.intake_temp = temp; }
-    void updateThrottle(uint8_t throttle) { currentState.throttle = throttle; }
-    void updateMAF(uint16_t maf) { currentState.maf = maf; }
-    void updateFuelLevel(uint8_t level) { currentState.fuel_level = level; }
-    void updateBarometric(uint8_t baro) { currentState.barometric = baro; }
-    void updateMILDistance(uint16_t dist) { currentState.mil_distance = dist; }
+    void updateRPM(uint16_t rpm) { StateWrite write(*this); currentState.rpm = rpm; }
+    void updateSpeed(uint8_t speed) { StateWrite write(*this); currentState.speed = speed; }
+    void updateCoolantTemp(uint8_t temp) { StateWrite write(*this); currentState.coolant_temp = temp; }
+    void updateIntakeTemp(uint8_t temp) { StateWrite write(*this); currentState.intake_temp = temp; }
+    void updateThrottle(uint8_t throttle) { StateWrite write(*this); currentState.throttle = throttle; }
+    void updateMAF(uint16_t maf) { StateWrite write(*this); currentState.maf = maf; }
+    void updateFuelLevel(uint8_t level) { StateWrite write(*this); currentState.fuel_level = level; }
+    void updateBarometric(uint8_t baro) { StateWrite write(*this); currentState.barometric = baro; }
+    void updateMILDistance(uint16_t dist) { StateWrite write(*this); currentState.mil_distance = dist; }
 
     // MIL and DTC management
-    void setMIL(bool on) { currentState.mil_on = on; }
-    bool getMIL() { return currentState.mil_on; }
-
-    // Add a DTC (P0xxx, P2xxx, etc.)
-    bool addDTC(uint16_t dtc) {
-        if (currentState.dtc_count >= MAX_DTCS) return false;
-        // Check if DTC already exists
-        for (uint8_t i = 0; i < currentState.dtc_count; i++) {
-            if (currentState.dtcs[i] == dtc) return false;
-        }
-        currentState.dtcs[currentState.dtc_count++] = dtc;
-        currentState.mil_on = true; // Turn on MIL when DTC added
+    void setMIL(bool on) { StateWrite write(*this); currentState.mil_on = on; }
+    bool getMIL() { return getState().mil_on; }
+
+    // The ECU whose codes Modes 03/04/07/0A report and that keeps freeze
+    // frames (ECUS[...].emissionsDtcs)
+    static uint8_t obdEcu() {
+        for (uint8_t e = 0; e < ECU_COUNT; e++) {
+            if (ECUS[e].emissionsDtcs) return e;
+        }
+        return 0;
+    }
+
+    // Report a failed monitor for a DTC (P0xxx, P2xxx, etc.): pending until
+    // it fails again after endDriveCycle(), or confirmed (MIL on) at once.
+    // Reporting a stored code again is another failure. False if the store
+    // is full.
+    bool addDTC(uint16_t dtc, bool confirmed = true, uint8_t ecu = obdEcu()) {
+        updateRuntime();
+        return addDTC(dtc, confirmed, ecu, getState());
+    }
+
+    // The same with the state its freeze frames record: currentState from
+    // inside a StateWrite (a scenario tick), where getState() is still the
+    // last published state
+    bool addDTC(uint16_t dtc, bool confirmed, uint8_t ecu, const CarState& state) {
+        StateWrite write(*this);
+        uint8_t result = dtcs.fail(ecu, dtc, confirmed);
+        if (result == 0) return false;
+        if (result == 1 && ECUS[ecu].emissionsDtcs) freezeFrames.trigger(dtc, state);
+        syncDtcState();
         return true;
     }
 
-    // Remove a specific DTC
-    bool removeDTC(uint16_t dtc) {
-        for (uint8_t i = 0; i < currentState.dtc_count; i++) {
-            if (currentState.dtcs[i] == dtc) {
-                // Shift remaining DTCs down
-                for (uint8_t j = i; j < currentState.dtc_count - 1; j++) {
-                    currentState.dtcs[j] = currentState.dtcs[j + 1];
-                }
-                currentState.dtc_count--;
-                if (currentState.dtc_count == 0) {
-                    currentState.mil_on = false; // Turn off MIL when no DTCs
-                }
-                return true;
+    // End the drive cycle: pending codes that failed again are confirmed,
+    // the others heal, lose their permanent status and age out
+    void endDriveCycle() {
+        StateWrite write(*this);
+        dtcs.endOperationCycle();
+
+        // Drop the freeze frames of forgotten codes (0 = captured by hand)
+        uint8_t ecu = obdEcu();
+        uint16_t dtc;
+        for (uint16_t n = 0; n < FREEZE_FRAME_SLOTS && freezeFrames.dtcOf(n, dtc);) {
+            if (dtc != 0 && !dtcs.contains(ecu, dtc)) {
+                freezeFrames.remove(dtc);
+            } else {
+                n++;
             }
         }
-        return false;
+        syncDtcState();
+    }
+
+    // Record a burst of freeze frames for a DTC (0 = not caused by one)
+    void captureFreezeFrames(uint16_t dtc) {
+        updateRuntime();
+        CarState state = getState();
+        StateWrite write(*this);
+        freezeFrames.trigger(dtc, state);
+    }
+
+    // Take due freeze frame snapshots (call from main loop)
+    void updateFreezeFrames() {
+        StoreAccess access(*this);
+        if (freezeFrames.capturing()) {
+            updateRuntime();
+            freezeFrames.update(getState());
+        }
+    }
+
+    uint16_t getFreezeFrameCount() {
+        StoreAccess access(*this);
+        return freezeFrames.size();
+    }
+
+    // Remove a specific DTC, permanent or not
+    bool removeDTC(uint16_t dtc, uint8_t ecu = obdEcu()) {
+        StateWrite write(*this);
+        if (!dtcs.remove(ecu, dtc)) return false;
+        if (ECUS[ecu].emissionsDtcs) freezeFrames.remove(dtc);
+        syncDtcState();
+        return true;
     }
 
-    // Clear all DTCs
+    // Clear all DTCs of every ECU, permanent ones too (Mode 04 keeps those)
     void clearDTCs() {
-        currentState.dtc_count = 0;
-        currentState.mil_on = false;
+        StateWrite write(*this);
+        for (uint8_t e = 0; e < ECU_COUNT; e++) dtcs.clearEcu(e, false);
         currentState.mil_distance = 0;
-        for (uint8_t i = 0; i < MAX_DTCS; i++) {
-            currentState.dtcs[i] = 0;
-        }
+        freezeFrames.clear();
+        syncDtcState();
     }
 
-    uint8_t getDTCCount() { return currentState.dtc_count; }
-    uint16_t getDTC(uint8_t index) {
-        if (index < currentState.dtc_count) {
-            return currentState.dtcs[index];
-        }
-        return 0;
+    // Confirmed DTCs of the OBD ECU (Mode 03)
+    uint16_t getDTCCount() {
+        StoreAccess access(*this);
+        return dtcs.countOf(obdEcu(), DTC_CONFIRMED);
+    }
+    uint16_t getDTC(uint16_t index) {
+        StoreAccess access(*this);
+        uint16_t dtc = 0;
+        dtcs.nth(obdEcu(), DTC_CONFIRMED, index, dtc);
+        return dtc;
+    }
+
+    // UDS status byte of a DTC, 0 if the ECU doesn't have it
+    uint8_t getDTCStatus(uint16_t dtc, uint8_t ecu = obdEcu()) {
+        StoreAccess access(*this);
+        return dtcs.status(ecu, dtc);
+    }
+
+    // PID 01's DTC count and MIL follow the OBD ECU's codes
+    void syncDtcState() {
+        StateWrite write(*this);
+        uint16_t confirmed = getDTCCount();
+        currentState.dtc_count = confirmed > 0xFF ? 0xFF : confirmed;
+        currentState.mil_on = dtcs.warningIndicator(obdEcu());
+    }
+
+    // Consistent copy of the current car state, from any task
+    CarState getState() {
+        #if SIM_TASK
+        return published.read();
+        #else
+        advanceSimulator();
+        return currentState;
+        #endif
     }
 
-    // Get current car state (for web interface)
-    CarState getState() { return currentState; }
+    // Mode 01 reply cache statistics
+    uint32_t getCacheHits() const { return responseCache.getHits(); }
+    uint32_t getCacheMisses() const { return responseCache.getMisses(); }
 
     // Update runtime counter
     void updateRuntime() {
+        StateWrite write(*this);
         currentState.runtime = (millis() - startTime) / 1000;
     }
 
     // Reset runtime counter
     void resetRuntime() {
+        StateWrite write(*this);
         startTime = millis();
         currentState.runtime = 0;
     }
 
-    // Driving Simulator Control
-    void setDriveMode(DriveMode mode) {
+    // Driving Simulator Control. False (and no change) for DRIVE_REPLAY
+    // without a trace or DRIVE_SCENARIO without a script.
+    bool setDriveMode(DriveMode mode) {
+        StateWrite write(*this);
+        if (mode == DRIVE_REPLAY && !replay.available()) return false;
+        if (mode == DRIVE_SCENARIO && !scenario.available()) return false;
         driveMode = mode;
         driveStartTime = millis();
-        drivePhase = 0;
+        driveTick = 0;
         if (mode == DRIVE_OFF) {
             // Stop at current state
+        } else if (mode == DRIVE_REPLAY) {
+            replay.start(driveStartTime);
+            applyReplay(0);
+        } else if (mode == DRIVE_SCENARIO) {
+            // The car as it is until the script says otherwise
+            scenarioDrive = DRIVE_OFF;
+            scenario.start();
+            runScenario();
         } else {
-            // Reset to idle state at start
-            currentState.speed = 0;
-            currentState.rpm = 850;
-            currentState.throttle = 0;
-            if (mode == DRIVE_GENTLE) {
-                currentState.coolant_temp = 50;  // Cold engine
-            } else {
-                currentState.coolant_temp = 90;  // Warm engine
-            }
+            // Start from idle, cold for the gentle warm-up drive
+            vehicle.start(mode, mode == DRIVE_GENTLE ? 50 : 90, currentState.barometric);
+            vehicle.apply(currentState);
+            updateDerivedSignals(0);
         }
+        return true;
     }
 
     DriveMode getDriveMode() { return driveMode; }
 
-    // Update driving simulator (call from main loop)
-    void updateDrivingSimulator() {
-        if (driveMode == DRIVE_OFF) return;
+    #if SIM_TASK
+    // Step the driving simulator on its own task (call once from setup()),
+    // every SIM_TICK_MS however busy the transports are
+    void startSimulatorTask() {
+        xTaskCreatePinnedToCore(simulatorTask, "simulator", SIM_TASK_STACK, this, SIM_TASK_PRIORITY, nullptr,
+                                SIM_TASK_CORE);
+    }
 
-        unsigned long elapsed = millis() - driveStartTime;
-        float elapsedSec = elapsed / 1000.0;
-
-        switch (driveMode) {
-            case DRIVE_GENTLE: {
-                // 0-50 km/h in 5s, then hold, engine warming up
-                // Add realistic throttle noise - small variations every 1-2 seconds
-                float noisePhase = fmod(elapsedSec * 2.0, 6.28);  // 0-2π over ~3 seconds
-                int8_t throttleNoise = (int8_t)(sin(noisePhase) * 4.0);  // +/- 4%
-                int8_t rpmNoise = (int8_t)(sin(noisePhase * 1.3) * 50);  // +/- 50 RPM (different phase)
-
-                if (drivePhase == 0) {  // Acceleration
-                    if (elapsedSec < 5.0) {
-                        currentState.speed = (uint8_t)(elapsedSec * 10);  // 0-50 km/h
-                        currentState.rpm = 850 + (uint16_t)(elapsedSec * 400) + rpmNoise;  // 850-2850 RPM + noise
-                        currentState.throttle = 30 + throttleNoise;  // 30% +/- 4%
-                        // Engine warming up
-                        currentState.coolant_temp = 50 + (uint8_t)(elapsedSec * 4);  // 50-70°C
-                    } else {
-                        drivePhase = 1;
-                    }
-                } else if (drivePhase == 1) {  // Cruise
-                    currentState.speed = 50;
-                    currentState.rpm = 2000 + rpmNoise;  // Slight RPM fluctuation
-                    currentState.throttle = 15 + throttleNoise;  // 15% +/- 4%
-                    // Continue warming
-                    if (currentState.coolant_temp < 90) {
-                        currentState.coolant_temp++;
-                    }
+    static void simulatorTask(void* context) {
+        PIDHandler* handler = (PIDHandler*)context;
+        TickType_t wake = xTaskGetTickCount();
+        for (;;) {
+            vTaskDelayUntil(&wake, pdMS_TO_TICKS(SIM_TICK_MS));
+            handler->advanceSimulator();
+        }
+    }
+    #endif
+
+    // Bring the driving simulator up to date. The simulator task calls this
+    // every tick; without one nothing runs from the main loop: getState()
+    // calls it first, and the model catches up in SIM_TICK_MS steps. After
+    // a long time unread it only catches up SIM_MAX_CATCHUP_TICKS; the
+    // drive resumes from there.
+    void advanceSimulator() {
+        StateWrite write(*this);
+        if (driveMode == DRIVE_OFF) return;
+        uint32_t tick = (millis() - driveStartTime) / SIM_TICK_MS;
+        if (tick == driveTick) return;
+        uint32_t steps = tick - driveTick;
+        if (steps > SIM_MAX_CATCHUP_TICKS) steps = SIM_MAX_CATCHUP_TICKS;
+        driveTick = tick;
+        if (driveMode == DRIVE_REPLAY) {
+            // Nothing to step: the trace is read at the time it is wanted
+            replay.update(millis());
+            applyReplay(tick * SIM_TICK_MS);
+            return;
+        }
+        if (driveMode == DRIVE_SCENARIO) {
+            while (steps-- > 0) {
+                scenario.tick();
+                if (scenarioDrive != DRIVE_OFF) {
+                    vehicle.step();
+                    vehicle.apply(currentState);
                 }
-                currentState.maf = 200 + currentState.throttle * 10;
-                break;
+                runScenario();
             }
+            updateDerivedSignals(scenario.elapsedMs());
+            scenario.apply(currentState);
+            return;
+        }
+        while (steps-- > 0) vehicle.step();
+        vehicle.apply(currentState);
+        updateDerivedSignals(vehicle.elapsedMs());
+    }
 
-            case DRIVE_NORMAL: {
-                // 0-80 km/h in 7s, cruise, then slow to stop
-                // Moderate driver adjustments - slower, smoother variations
-                float noisePhase = fmod(elapsedSec * 1.5, 6.28);  // ~4 second cycle
-                int8_t throttleNoise = (int8_t)(sin(noisePhase) * 3.0);  // +/- 3%
-                int8_t rpmNoise = (int8_t)(sin(noisePhase * 1.2) * 40);  // +/- 40 RPM
-
-                if (drivePhase == 0) {  // Acceleration
-                    if (elapsedSec < 7.0) {
-                        currentState.speed = (uint8_t)(elapsedSec * 11.4);  // 0-80 km/h
-                        currentState.rpm = 850 + (uint16_t)(elapsedSec * 500) + rpmNoise;  // 850-4350 RPM
-                        currentState.throttle = 50 + throttleNoise;
-                    } else {
-                        drivePhase = 1;
-                    }
-                } else if (drivePhase == 1) {  // Cruise for 10s
-                    if (elapsedSec < 17.0) {
-                        currentState.speed = 80;
-                        currentState.rpm = 2500 + rpmNoise;
-                        currentState.throttle = 25 + throttleNoise;
-                    } else {
-                        drivePhase = 2;
-                    }
-                } else if (drivePhase == 2) {  // Deceleration
-                    float decelTime = elapsedSec - 17.0;
-                    if (decelTime < 5.0) {
-                        currentState.speed = 80 - (uint8_t)(decelTime * 16);  // 80-0 km/h
-                        currentState.rpm = 2500 - (uint16_t)(decelTime * 330);  // 2500-850 RPM
-                        currentState.throttle = 0;
-                    } else {
-                        drivePhase = 3;
-                    }
-                } else {  // Stopped
-                    currentState.speed = 0;
-                    currentState.rpm = 850 + (rpmNoise / 2);  // Small idle fluctuation
-                    currentState.throttle = 0;
-                }
-                currentState.maf = 200 + currentState.throttle * 8;
-                break;
-            }
+    // Show a jump in the replay now rather than at the next tick
+    void refreshReplay() {
+        if (driveMode != DRIVE_REPLAY) return;
+        replay.update(millis());
+        applyReplay(millis() - driveStartTime);
+    }
 
-            case DRIVE_SPORT: {
-                // 0-120 km/h in 8s, hard acceleration
-                // Aggressive driver - sharper, faster variations
-                float noisePhase = fmod(elapsedSec * 3.0, 6.28);  // ~2 second cycle (faster)
-                int8_t throttleNoise = (int8_t)(sin(noisePhase) * 5.0);  // +/- 5% (more aggressive)
-                int8_t rpmNoise = (int8_t)(sin(noisePhase * 1.4) * 80);  // +/- 80 RPM
-
-                if (drivePhase == 0) {  // Acceleration
-                    if (elapsedSec < 8.0) {
-                        currentState.speed = (uint8_t)(elapsedSec * 15);  // 0-120 km/h
-                        currentState.rpm = 1500 + (uint16_t)(elapsedSec * 625) + rpmNoise;  // 1500-6500 RPM
-                        currentState.throttle = 85 + throttleNoise;
-                    } else {
-                        drivePhase = 1;
+    // Run the script up to its clock. It sees its own fields as they are
+    // now, and what it asks for (DTCs, MIL, drive cycle, driver) is done
+    // on the spot, so the statements after it see the result. A DTC's
+    // freeze frame is the state at its statement, which readers haven't
+    // been shown yet.
+    void runScenario() {
+        ScenarioEvent event;
+        scenario.apply(currentState);
+        while (scenario.run(currentState, event)) {
+            switch (event.op) {
+                case SCENARIO_DRIVE:
+                    scenarioDrive = (DriveMode)event.arg;
+                    if (scenarioDrive != DRIVE_OFF) {
+                        vehicle.start(scenarioDrive, currentState.coolant_temp, currentState.barometric);
+                        vehicle.apply(currentState);
                     }
-                } else if (drivePhase == 1) {  // Cruise for 8s
-                    if (elapsedSec < 16.0) {
-                        currentState.speed = 120;
-                        currentState.rpm = 3500 + rpmNoise;
-                        currentState.throttle = 40 + throttleNoise;
+                    break;
+                case SCENARIO_DTC:
+                    updateRuntime();
+                    addDTC(event.code, event.arg, obdEcu(), currentState);
+                    break;
+                case SCENARIO_CLEAR:
+                    if (event.code == 0) {
+                        clearDTCs();
                     } else {
-                        drivePhase = 2;
+                        removeDTC(event.code);
                     }
-                } else if (drivePhase == 2) {  // Hard braking
-                    float decelTime = elapsedSec - 16.0;
-                    if (decelTime < 4.0) {
-                        currentState.speed = 120 - (uint8_t)(decelTime * 30);  // 120-0 km/h
-                        currentState.rpm = 3500 - (uint16_t)(decelTime * 662);  // 3500-850 RPM
-                        currentState.throttle = 0;
-                    } else {
-                        drivePhase = 3;
-                    }
-                } else {  // Stopped
-                    currentState.speed = 0;
-                    currentState.rpm = 850 + rpmNoise;  // Even at idle, sporty engine fluctuates more
-                    currentState.throttle = 0;
-                }
-                currentState.maf = 200 + currentState.throttle * 10;
-                break;
+                    break;
+                case SCENARIO_MIL:
+                    currentState.mil_on = event.arg;
+                    break;
+                case SCENARIO_CYCLE:
+                    endDriveCycle();
+                    break;
+                default:
+                    break;
             }
+        }
+        scenario.apply(currentState);
+    }
 
-            case DRIVE_DRAG: {
-                // Drag race: 0-180 km/h in 12s flat out, then hard brake
-                // High frequency vibration at launch, then power delivery variations
-                float noisePhase = fmod(elapsedSec * 5.0, 6.28);  // ~1.2 second cycle (very fast)
-
-                if (drivePhase == 0) {  // Launch and acceleration
-                    if (elapsedSec < 12.0) {
-                        currentState.speed = (uint8_t)(elapsedSec * 15);  // 0-180 km/h
-                        if (elapsedSec < 1.0) {
-                            // Launch - wheel spin, high frequency vibration
-                            int16_t launchNoise = (int16_t)(sin(noisePhase) * 200);  // +/- 200 RPM (wheel spin)
-                            currentState.rpm = 3000 + (uint16_t)(elapsedSec * 2000) + launchNoise;  // 3000-5000 RPM
-                            currentState.throttle = 100;  // Floored
-                        } else {
-                            // Full acceleration - power delivery variations
-                            int16_t rpmNoise = (int16_t)(sin(noisePhase * 1.1) * 100);  // +/- 100 RPM
-                            currentState.rpm = 2000 + (uint16_t)((elapsedSec - 1.0) * 454) + rpmNoise;  // 2000-7000 RPM
-                            currentState.throttle = 100;  // Throttle pinned
-                        }
-                    } else {
-                        drivePhase = 1;
-                    }
-                } else if (drivePhase == 1) {  // Hard braking
-                    float brakeTime = elapsedSec - 12.0;
-                    if (brakeTime < 6.0) {
-                        currentState.speed = 180 - (uint8_t)(brakeTime * 30);  // 180-0 km/h
-                        currentState.rpm = 7000 - (uint16_t)(brakeTime * 1025);  // 7000-850 RPM
-                        currentState.throttle = 0;
-                    } else {
-                        drivePhase = 2;
-                    }
-                } else {  // Stopped
-                    currentState.speed = 0;
-                    currentState.rpm = 850;
-                    currentState.throttle = 0;
-                }
-                currentState.maf = 200 + currentState.throttle * 12;
-                break;
-            }
+    // The trace's fields at the play position. Derived signals fill in
+    // what it didn't record; what it did wins.
+    void applyReplay(uint32_t elapsedMs) {
+        replay.apply(currentState);
+        updateDerivedSignals(elapsedMs);
+        replay.apply(currentState);
+    }
 
-            default:
-                break;
+    // Signals that follow the model's (timing, trims, O2, EGR, battery, oil)
+    void updateDerivedSignals(uint32_t elapsedMs) {
+        // Timing advance: varies with RPM and load
+        // Idle: ~15°, cruise: ~30°, WOT: ~20°
+        if (currentState.throttle > 80) {
+            currentState.timing_advance = 15 + (currentState.rpm / 400);  // Less advance at WOT
+        } else {
+            currentState.timing_advance = 15 + (currentState.rpm / 250);  // More advance during cruise
+        }
+        if (currentState.timing_advance > 35) currentState.timing_advance = 35;
+
+        // Fuel trims: slight variation based on throttle
+        currentState.short_fuel_trim = Waveform::wave(elapsedMs, 6283, 3);  // ±3% variation
+        // Long fuel trim stays relatively constant (set in defaults)
+
+        // O2 sensor voltage: cycles around 0.45V (stoichiometric)
+        // 0.45V = 90 units (0.005V per unit)
+        currentState.o2_voltage = 90 + Waveform::wave(elapsedMs, 1257, 20);  // 0.35-0.55V cycling
+
+        // EGR: active during cruise, off at idle and WOT
+        if (currentState.speed > 30 && currentState.throttle > 10 && currentState.throttle < 60) {
+            currentState.egr = 15 + (currentState.throttle / 4);  // 15-30% during cruise
+        } else {
+            currentState.egr = 0;  // Off at idle or WOT
         }
 
-        // Calculate common PIDs for all drive modes
-        if (driveMode != DRIVE_OFF) {
-            // MAP (Manifold Absolute Pressure): vacuum at idle, increases with throttle
-            // Idle: ~35 kPa, WOT: ~100 kPa (atmospheric)
-            currentState.map = 35 + (currentState.throttle * 65 / 100);
+        // Battery voltage: slight variation during operation
+        currentState.battery_voltage = 14000 + Waveform::wave(elapsedMs, 12566, 300);  // 13.7-14.3V
 
-            // Timing advance: varies with RPM and load
-            // Idle: ~15°, cruise: ~30°, WOT: ~20°
-            if (currentState.throttle > 80) {
-                currentState.timing_advance = 15 + (currentState.rpm / 400);  // Less advance at WOT
+        // Oil temperature: follows coolant but ~5° higher
+        currentState.oil_temp = currentState.coolant_temp + 5;
+        if (currentState.oil_temp > 100) currentState.oil_temp = 100;
+
+        // Fuel pressure stays relatively constant (set in defaults)
+        // Distance tracking would increment here if we tracked actual movement
+    }
+
+    // "PIDs supported" word `range` of an ECU (PID 00 -> 0, 20 -> 1, ...)
+    static uint32_t ecuPidBitmap(const EcuDef& ecu, uint8_t range) {
+        return pgm_read_dword(&ECU_PID_BITMAPS[&ecu - ECUS][range]);
+    }
+
+    // Whether an ECU's PID bitmaps include a Mode 01 PID (00 always is)
+    static bool ecuSupportsPID(const EcuDef& ecu, uint8_t pid) {
+        if (pid == 0x00) return true;
+        return ecuPidBitmap(ecu, (pid - 1) / 32) & pidBit(pid);
+    }
+
+    static void putUint32(uint8_t* data, uint32_t value) {
+        data[0] = value >> 24;
+        data[1] = value >> 16;
+        data[2] = value >> 8;
+        data[3] = value;
+    }
+
+    // Data bytes of a registered PID for the given state; returns the length
+    static uint8_t encodePid(uint8_t pid, const CarState& state, uint8_t* data) {
+        const PidDef* def = findMode01Pid(pid);
+        PidEncoder encode = (PidEncoder)pgm_read_ptr(&def->encode);
+        encode(state, data);
+        return pgm_read_byte(&def->length);
+    }
+
+    // Handle OBD-II mode 01 request for up to MAX_PIDS_PER_REQUEST PIDs.
+    // Like a real CAN ECU, every supported PID is answered in one message
+    // (41 PID data PID data ...) and unsupported ones are silently omitted.
+    // Returns the message length, 0 if the ECU stays silent.
+    uint8_t handleMode01(const EcuDef& ecu, const uint8_t* pids, uint8_t pidCount, uint8_t* payload) {
+        uint8_t length = 0;
+
+        payload[length++] = 0x41;
+        for (uint8_t i = 0; i < pidCount; i++) {
+            uint8_t pid = pids[i];
+            if (!ecuSupportsPID(ecu, pid)) continue;
+
+            uint8_t dataLen;
+            if ((pid & 0x1F) == 0) {
+                // Supported PID bitmaps are generated from the registry
+                putUint32(&payload[length + 1], ecuPidBitmap(ecu, pid / 32));
+                dataLen = 4;
             } else {
-                currentState.timing_advance = 15 + (currentState.rpm / 250);  // More advance during cruise
+                dataLen = encodePid(pid, requestState, &payload[length + 1]);
             }
-            if (currentState.timing_advance > 35) currentState.timing_advance = 35;
+            payload[length] = pid;
+            length += 1 + dataLen;
+        }
 
-            // Fuel trims: slight variation based on throttle
-            currentState.short_fuel_trim = (int8_t)(sin(elapsedSec) * 3);  // ±3% variation
-            // Long fuel trim stays relatively constant (set in defaults)
+        return length == 1 ? 0 : length;
+    }
 
-            // O2 sensor voltage: cycles around 0.45V (stoichiometric)
-            // 0.45V = 90 units (0.005V per unit)
-            currentState.o2_voltage = 90 + (uint8_t)(sin(elapsedSec * 5) * 20);  // 0.35-0.55V cycling
+    // Freeze frame "PIDs supported" word: the ECU's Mode 01 PIDs plus 02
+    // (the DTC that caused the frame), without the monitor status PIDs
+    // 01 and 41, which J1979 doesn't allow in a freeze frame
+    static uint32_t freezeFramePidBitmap(const EcuDef& ecu, uint8_t range) {
+        uint32_t bits = ecuPidBitmap(ecu, range);
+        if (range == 0) bits = (bits & ~pidBit(0x01)) | pidBit(0x02);
+        if (range == 2) bits &= ~pidBit(0x41);
+        return bits;
+    }
 
-            // EGR: active during cruise, off at idle and WOT
-            if (currentState.speed > 30 && currentState.throttle > 10 && currentState.throttle < 60) {
-                currentState.egr = 15 + (currentState.throttle / 4);  // 15-30% during cruise
+    // Handle OBD-II mode 02 request (freeze frame data): PID/frame pairs,
+    // 42 PID frame data ... in one message. Frames are numbered from the
+    // oldest snapshot; with none stored, frame 00 still answers its bitmaps
+    // and PID 02 (0000). Returns 0 if nothing can be answered.
+    uint8_t handleMode02(const EcuDef& ecu, const uint8_t* request, uint8_t requestLength, uint8_t* payload) {
+        if (!ecu.emissionsDtcs) return 0;  // Only the ECU that stores DTCs
+        uint8_t length = 0;
+
+        payload[length++] = 0x42;
+        for (uint8_t i = 0; i + 1 < requestLength; i += 2) {
+            uint8_t pid = request[i];
+            uint8_t frame = request[i + 1];
+            uint16_t dtc = 0;
+            bool stored = freezeFrames.dtcOf(frame, dtc);
+            if (!stored && frame != 0) continue;
+
+            uint8_t* data = &payload[length + 2];
+            uint8_t dataLen;
+            if ((pid & 0x1F) == 0) {
+                uint32_t bitmap = freezeFramePidBitmap(ecu, pid / 32);
+                if (pid != 0x00 && !(freezeFramePidBitmap(ecu, (pid - 1) / 32) & pidBit(pid))) continue;
+                putUint32(data, bitmap);
+                dataLen = 4;
+            } else if (pid == 0x02) {
+                putUint16(data, dtc);
+                dataLen = 2;
             } else {
-                currentState.egr = 0;  // Off at idle or WOT
+                if (!stored || !(freezeFramePidBitmap(ecu, (pid - 1) / 32) & pidBit(pid))) continue;
+                dataLen = encodePid(pid, *freezeFrames.state(frame), data);
             }
+            payload[length] = pid;
+            payload[length + 1] = frame;
+            length += 2 + dataLen;
+        }
 
-            // Battery voltage: slight variation during operation
-            currentState.battery_voltage = 14000 + (uint16_t)(sin(elapsedSec * 0.5) * 300);  // 13.7-14.3V
+        return length == 1 ? 0 : length;
+    }
 
-            // Oil temperature: follows coolant but ~5° higher
-            currentState.oil_temp = currentState.coolant_temp + 5;
-            if (currentState.oil_temp > 100) currentState.oil_temp = 100;
+    // ISO 14229 negative response. A functionally addressed request gets
+    // no "service/DID not supported" reply (NRC 11, 12, 31).
+    uint8_t negativeResponse(uint8_t service, uint8_t code, uint8_t* payload) {
+        if (functionalRequest && (code == 0x11 || code == 0x12 || code == 0x31)) return 0;
+        payload[0] = 0x7F;
+        payload[1] = service;
+        payload[2] = code;
+        return 3;
+    }
 
-            // Fuel pressure stays relatively constant (set in defaults)
-            // Distance tracking would increment here if we tracked actual movement
+    // Handle service 22 (ReadDataByIdentifier): DID DID ... -> 62 DID data
+    // DID data ... for the DIDs the ECU has, NRC 31 if it has none of them
+    uint8_t handleMode22(const EcuDef& ecu, const uint8_t* request, uint8_t requestLength, uint8_t* payload) {
+        if (!dids.ecuHasDids(ecu)) return negativeResponse(0x22, 0x11, payload);
+        if (requestLength == 0 || (requestLength & 1)) return negativeResponse(0x22, 0x13, payload);
+
+        uint8_t length = 0;
+        payload[length++] = 0x62;
+        for (uint8_t i = 0; i + 1 < requestLength; i += 2) {
+            uint16_t did = (request[i] << 8) | request[i + 1];
+            const DynamicDid* dynamic = DynamicDidTable::inRange(did) ? dynamicDids.find(ecu, did) : nullptr;
+            const DidSlot* slot = dynamic ? nullptr : dids.find(ecu, did);
+            if (dynamic == nullptr && slot == nullptr) continue;
+            uint8_t dataLength = dynamic ? dynamic->length : DID_MAX_DATA;
+            if (length + 2 + dataLength > MAX_ECU_PAYLOAD) return negativeResponse(0x22, 0x14, payload);
+
+            payload[length] = request[i];
+            payload[length + 1] = request[i + 1];
+            length += 2 + (dynamic ? DynamicDidTable::encode(*dynamic, requestState, image, &payload[length + 2])
+                                   : DidTable::encode(*slot, requestState, &payload[length + 2]));
         }
+
+        return length == 1 ? negativeResponse(0x22, 0x31, payload) : length;
     }
 
-    // Handle OBD-II mode 01 request
-    String handleMode01(uint8_t pid) {
-        uint8_t data[4];
-        uint8_t dataLen = 0;
+    // Handle service 2A (ReadDataByPeriodicIdentifier): mode, then periodic
+    // identifiers (DID F2xx low bytes). Accepted requests are queued for the
+    // transport, which sends the frames; the reply is just 6A. CAN only, as
+    // periodic frames are single unsegmented frames.
+    uint8_t handleMode2A(const EcuDef& ecu, const uint8_t* request, uint8_t requestLength, uint8_t* payload) {
+        if (OBD_PROTOCOLS[elm->getActiveProtocol()].bus != BUS_CAN || !dids.ecuHasDids(ecu)) {
+            return negativeResponse(0x2A, 0x11, payload);
+        }
+        if (requestLength == 0 || requestLength - 1 > PERIODIC_MAX_IDS) return negativeResponse(0x2A, 0x13, payload);
+        uint8_t mode = request[0];
+        if (mode < 1 || mode > 4) return negativeResponse(0x2A, 0x31, payload);
+        if (mode != 4 && requestLength < 2) return negativeResponse(0x2A, 0x13, payload);
+
+        PeriodicRequest& pending = periodicRequests[periodicRequestCount];
+        pending.ecu = &ecu - ECUS;
+        pending.mode = mode;
+        pending.count = 0;
+        for (uint8_t i = 1; i < requestLength; i++) {
+            // Data must fit one frame after the identifier byte
+            uint8_t data[DYNAMIC_DID_MAX_DATA];
+            uint8_t length = mode == 4 ? 1 : readDid(pending.ecu, 0xF200 | request[i], data);
+            if (length == 0 || length > 7) continue;
+            pending.ids[pending.count++] = request[i];
+        }
+        if (mode != 4 && pending.count == 0) return negativeResponse(0x2A, 0x31, payload);
 
-        switch (pid) {
-            case 0x00:  // PIDs supported [01-20]
-                // Bitmap of supported PIDs
-                // We support: 0x01, 0x03, 0x04, 0x05, 0x06, 0x07, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10, 0x11, 0x13, 0x14, 0x1F
-                data[0] = 0b10111100;  // 01-08: 0x01, 0x03, 0x04, 0x05, 0x06, 0x07
-                data[1] = 0b00111111;  // 09-10: 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10
-                data[2] = 0b10110000;  // 11-18: 0x11, 0x13, 0x14
-                data[3] = 0b00000011;  // 19-20: 0x1F, 0x20 (supports next range)
-                dataLen = 4;
-                break;
+        periodicRequestCount++;
+        payload[0] = 0x6A;
+        return 1;
+    }
 
-            case 0x01: {  // Monitor status since DTCs cleared
-                // Byte A: MIL status and DTC count
-                // Bit 7: MIL status (0=off, 1=on)
-                // Bits 6-0: Number of DTCs (0-127)
-                uint8_t dtcCount = currentState.dtc_count > 127 ? 127 : currentState.dtc_count;
-                data[0] = (currentState.mil_on ? 0x80 : 0x00) | dtcCount;
-                data[1] = 0x07;  // Test available flags
-                data[2] = 0x65;  // Test complete flags
-                data[3] = 0x04;  // Additional flags
-                dataLen = 4;
-                break;
+    // Handle service 2C (DynamicallyDefineDataIdentifier):
+    //   01 DID (source DID, position, size)...  define / append by identifier
+    //   02 DID format (address, size)...        define / append by memory
+    //                                           address (ECU_IMAGE_ECU only)
+    //   03 [DID]                                clear one, or all of the ECU's
+    // Dynamic DIDs are F200-F3FF and can't shadow a static DID.
+    uint8_t handleMode2C(const EcuDef& ecu, const uint8_t* request, uint8_t requestLength, uint8_t* payload) {
+        if (!dids.ecuHasDids(ecu)) return negativeResponse(0x2C, 0x11, payload);
+        if (requestLength == 0) return negativeResponse(0x2C, 0x13, payload);
+        uint8_t subfunction = request[0];
+
+        if (subfunction == 0x03) {
+            if (requestLength != 1 && requestLength != 3) return negativeResponse(0x2C, 0x13, payload);
+            if (requestLength == 1) {
+                dynamicDids.removeAll(ecu);
+            } else {
+                uint16_t did = (request[1] << 8) | request[2];
+                if (!DynamicDidTable::inRange(did)) return negativeResponse(0x2C, 0x31, payload);
+                dynamicDids.remove(ecu, did);  // Clearing an undefined DID is not an error
+            }
+        } else if (subfunction == 0x01) {
+            if (requestLength < 7 || (requestLength - 3) % 4 != 0) return negativeResponse(0x2C, 0x13, payload);
+            uint16_t did = (request[1] << 8) | request[2];
+            if (!DynamicDidTable::inRange(did) || dids.find(ecu, did)) return negativeResponse(0x2C, 0x31, payload);
+
+            // All sources are checked before any is added
+            for (uint8_t i = 3; i < requestLength; i += 4) {
+                if (!dids.find(ecu, (request[i] << 8) | request[i + 1])) return negativeResponse(0x2C, 0x31, payload);
+            }
+            const DynamicDid* existing = dynamicDids.find(ecu, did);
+            uint8_t previousSources = existing ? existing->sourceCount : 0;
+            for (uint8_t i = 3; i < requestLength; i += 4) {
+                const DidSlot* source = dids.find(ecu, (request[i] << 8) | request[i + 1]);
+                if (!dynamicDids.append(ecu, did, *source, request[i + 2], request[i + 3])) {
+                    dynamicDids.truncate(ecu, did, previousSources);  // All or nothing
+                    return negativeResponse(0x2C, 0x31, payload);
+                }
             }
+        } else if (subfunction == 0x02 && hasImage(ecu)) {
+            // One addressAndLengthFormatIdentifier for all the ranges
+            if (requestLength < 4) return negativeResponse(0x2C, 0x13, payload);
+            uint8_t entryLength = (request[3] >> 4) + (request[3] & 0x0F);
+            uint32_t address, size;
+            if (EcuImage::parseAddress(&request[3], requestLength - 3, address, size) == 0 ||
+                (requestLength - 4) % entryLength != 0) {
+                return negativeResponse(0x2C, 0x13, payload);
+            }
+            uint16_t did = (request[1] << 8) | request[2];
+            if (!DynamicDidTable::inRange(did) || dids.find(ecu, did)) return negativeResponse(0x2C, 0x31, payload);
+
+            uint8_t entry[1 + 8];
+            entry[0] = request[3];
+            const DynamicDid* existing = dynamicDids.find(ecu, did);
+            uint8_t previousSources = existing ? existing->sourceCount : 0;
+            for (uint8_t i = 4; i < requestLength; i += entryLength) {
+                memcpy(&entry[1], &request[i], entryLength);
+                EcuImage::parseAddress(entry, 1 + entryLength, address, size);
+                if (size > 0xFF || !image.contains(address, size) ||
+                    !dynamicDids.appendMemory(ecu, did, address, size)) {
+                    dynamicDids.truncate(ecu, did, previousSources);  // All or nothing
+                    return negativeResponse(0x2C, 0x31, payload);
+                }
+            }
+        } else {
+            return negativeResponse(0x2C, 0x12, payload);
+        }
 
-            case 0x03:  // Fuel system status
-                // Closed loop, using O2 sensor
-                data[0] = 0x02;  // System 1: Closed loop
-                data[1] = 0x00;  // System 2: Not available
-                dataLen = 2;
-                break;
+        uint8_t length = 0;
+        payload[length++] = 0x6C;
+        for (uint8_t i = 0; i < requestLength && i < 3; i++) payload[length++] = request[i];
+        return length;
+    }
 
-            case 0x04:  // Calculated engine load
-                // Return 20% load (arbitrary)
-                data[0] = (20 * 255) / 100;
-                dataLen = 1;
-                break;
+    // Whether the ECU has the simulated memory image
+    static bool hasImage(const EcuDef& ecu) {
+        return &ecu == &ECUS[ECU_IMAGE_ECU];
+    }
 
-            case 0x05:  // Engine coolant temperature
-                data[0] = currentState.coolant_temp + 40;  // °C + 40
-                dataLen = 1;
-                break;
+    // Reply continues with count bytes of memory from address (CAN only),
+    // which the ECU needs time to fetch
+    void streamMemory(uint32_t address, uint16_t count) {
+        streamAddress = address;
+        streamLength = count;
+        streamReader = readStream;
+        streamContext = this;
+        processingUs = EcuImage::readTimeUs(address, count);
+    }
 
-            case 0x06:  // Short term fuel trim - Bank 1
-                // Formula: ((A-128) * 100) / 128 = percent
-                // Range: -100% (lean) to +99.2% (rich)
-                data[0] = ((int16_t)currentState.short_fuel_trim * 128 / 100) + 128;
-                dataLen = 1;
-                break;
+    // PayloadReader for streamed memory replies
+    static void readStream(void* context, uint16_t offset, uint8_t* data, uint8_t count) {
+        PIDHandler* handler = (PIDHandler*)context;
+        handler->image.read(handler->streamAddress + offset, data, count, handler->requestState);
+    }
 
-            case 0x07:  // Long term fuel trim - Bank 1
-                // Formula: ((A-128) * 100) / 128 = percent
-                // Range: -100% (lean) to +99.2% (rich)
-                data[0] = ((int16_t)currentState.long_fuel_trim * 128 / 100) + 128;
-                dataLen = 1;
-                break;
+    // Memory services stream multi-frame replies, so they need CAN
+    bool memoryAvailable(const EcuDef& ecu) {
+        return hasImage(ecu) && OBD_PROTOCOLS[elm->getActiveProtocol()].bus == BUS_CAN;
+    }
 
-            case 0x0B:  // Intake manifold absolute pressure
-                // Direct kPa value (0-255)
-                data[0] = currentState.map;
-                dataLen = 1;
-                break;
+    // Handle service 23 (ReadMemoryByAddress): format, address, size ->
+    // 63 data, streamed from the image
+    uint8_t handleMode23(const EcuDef& ecu, const uint8_t* request, uint8_t requestLength, uint8_t* payload) {
+        if (!memoryAvailable(ecu)) return negativeResponse(0x23, 0x11, payload);
+        uint32_t address, size;
+        uint8_t used = EcuImage::parseAddress(request, requestLength, address, size);
+        if (used == 0 || used != requestLength) return negativeResponse(0x23, 0x13, payload);
+        if (size > 0xFFF - 1 || !image.contains(address, size)) return negativeResponse(0x23, 0x31, payload);
+
+        payload[0] = 0x63;
+        streamMemory(address, size);
+        return 1;
+    }
 
-            case 0x0C: {  // Engine RPM
-                // RPM is encoded as (RPM * 4) as 16-bit big-endian
-                // Formula: RPM = ((A * 256) + B) / 4
-                uint16_t encodedRPM = currentState.rpm * 4;
-                data[0] = encodedRPM >> 8;
-                data[1] = encodedRPM & 0xFF;
-                dataLen = 2;
-                break;
-            }
+    // Handle service 35 (RequestUpload): data format (00, no compression or
+    // encryption), format, address, size -> 75 20 and the largest
+    // TransferData reply (MEMORY_TRANSFER_BLOCK data bytes + 76 and counter)
+    uint8_t handleMode35(const EcuDef& ecu, const uint8_t* request, uint8_t requestLength, uint8_t* payload) {
+        if (!memoryAvailable(ecu)) return negativeResponse(0x35, 0x11, payload);
+        uint32_t address, size;
+        uint8_t used = requestLength > 0 ? EcuImage::parseAddress(&request[1], requestLength - 1, address, size) : 0;
+        if (used == 0 || 1 + used != requestLength) return negativeResponse(0x35, 0x13, payload);
+        if (request[0] != 0x00 || !image.contains(address, size)) return negativeResponse(0x35, 0x31, payload);
+        if (upload.active) return negativeResponse(0x35, 0x70, payload);  // uploadDownloadNotAccepted
+
+        upload.active = true;
+        upload.address = address;
+        upload.remaining = size;
+        upload.sequence = 1;
+        upload.lastLength = 0;
+
+        uint16_t maxBlock = MEMORY_TRANSFER_BLOCK + 2;
+        payload[0] = 0x75;
+        payload[1] = 0x20;  // Block length as 2 bytes
+        payload[2] = maxBlock >> 8;
+        payload[3] = maxBlock & 0xFF;
+        return 4;
+    }
 
-            case 0x0D:  // Vehicle speed
-                data[0] = currentState.speed;
-                dataLen = 1;
-                break;
+    // Handle service 36 (TransferData) during an upload: counter -> 76
+    // counter and the next block. Repeating the last counter sends the last
+    // block again (the tester missed it).
+    uint8_t handleMode36(const EcuDef& ecu, const uint8_t* request, uint8_t requestLength, uint8_t* payload) {
+        if (!memoryAvailable(ecu)) return negativeResponse(0x36, 0x11, payload);
+        if (requestLength != 1) return negativeResponse(0x36, 0x13, payload);
+        if (!upload.active) return negativeResponse(0x36, 0x24, payload);
+
+        uint8_t sequence = request[0];
+        if (upload.lastLength > 0 && sequence == (uint8_t)(upload.sequence - 1)) {
+            payload[0] = 0x76;
+            payload[1] = sequence;
+            streamMemory(upload.lastAddress, upload.lastLength);
+            return 2;
+        }
+        if (sequence != upload.sequence) return negativeResponse(0x36, 0x73, payload);  // wrongBlockSequenceCounter
+        if (upload.remaining == 0) return negativeResponse(0x36, 0x24, payload);
+
+        uint16_t block = upload.remaining < MEMORY_TRANSFER_BLOCK ? upload.remaining : MEMORY_TRANSFER_BLOCK;
+        upload.lastAddress = upload.address;
+        upload.lastLength = block;
+        upload.address += block;
+        upload.remaining -= block;
+        upload.sequence++;  // Wraps FF -> 00
+
+        payload[0] = 0x76;
+        payload[1] = sequence;
+        streamMemory(upload.lastAddress, block);
+        return 2;
+    }
 
-            case 0x0E:  // Timing advance
-                // Formula: A/2 - 64 = degrees
-                // Range: -64° to +63.5°
-                data[0] = ((int16_t)currentState.timing_advance + 64) * 2;
-                dataLen = 1;
-                break;
+    // Handle service 37 (RequestTransferExit): ends a completed upload
+    uint8_t handleMode37(const EcuDef& ecu, const uint8_t* request, uint8_t requestLength, uint8_t* payload) {
+        if (!memoryAvailable(ecu)) return negativeResponse(0x37, 0x11, payload);
+        if (!upload.active || upload.remaining > 0) return negativeResponse(0x37, 0x24, payload);
+        upload.active = false;
+        payload[0] = 0x77;
+        return 1;
+    }
 
-            case 0x0F:  // Intake air temperature
-                data[0] = currentState.intake_temp + 40;  // °C + 40
-                dataLen = 1;
-                break;
+    // Handle OBD-II modes 03 (confirmed DTCs), 07 (pending) and 0A
+    // (permanent): 43/47/4A, DTC count, then 2 bytes per DTC. On CAN the
+    // list is streamed from the store, up to 255 codes (the count byte);
+    // a pre-CAN reply carries as many as its messages hold.
+    uint8_t handleDtcList(const EcuDef& ecu, uint8_t mode, uint16_t filter, uint8_t* payload) {
+        static const uint8_t LEGACY_MAX_DTCS = MAX_ECU_PAYLOAD / 8 * 3;  // 3 per 7-byte message
+
+        uint8_t e = &ecu - ECUS;
+        uint16_t count = dtcs.countOf(e, filter);
+        if (count == 0) return 0;
+        if (count > 0xFF) count = 0xFF;
+
+        bool canBus = OBD_PROTOCOLS[elm->getActiveProtocol()].bus == BUS_CAN;
+        if (!canBus && count > LEGACY_MAX_DTCS) count = LEGACY_MAX_DTCS;
+        payload[0] = 0x40 | mode;
+        payload[1] = count;
+        dtcs.openCursor(dtcStreams[e].cursor, e, filter, 2, count);
+        if (canBus) {
+            streamDtcs(dtcStreams[e], count * 2);
+            return 2;
+        }
+        DtcStore::readCursor(&dtcStreams[e].cursor, 0, &payload[2], count * 2);
+        return 2 + count * 2;
+    }
 
-            case 0x10:  // MAF air flow rate
-                data[0] = currentState.maf >> 8;
-                data[1] = currentState.maf & 0xFF;
-                dataLen = 2;
-                break;
+    // Handle OBD-II mode 04 request (clear DTCs). Permanent DTCs stay
+    // until their monitor passes a drive cycle.
+    uint8_t handleMode04(uint8_t* payload) {
+        StateWrite write(*this);
+        dtcs.clearEcu(obdEcu(), true);
+        currentState.mil_distance = 0;
+        freezeFrames.clear();
+        syncDtcState();
+        payload[0] = 0x44;
+        return 1;
+    }
 
-            case 0x11:  // Throttle position
-                data[0] = (currentState.throttle * 255) / 100;
-                dataLen = 1;
-                break;
+    // Reply continues with a DTC list read through a cursor (CAN only)
+    void streamDtcs(DtcStream& stream, uint16_t count) {
+        streamLength = count;
+        streamReader = readDtcStream;
+        streamContext = &stream;
+    }
 
-            case 0x13:  // O2 sensors present
-                // 2 banks × 4 sensors per bank bitmap
-                // We'll indicate bank 1 sensor 1 is present (bit 0)
-                data[0] = 0x01;  // Bank 1 - Sensor 1 present
-                dataLen = 1;
-                break;
+    // PayloadReader over a DtcStream: the cursor, with the stores locked
+    static void readDtcStream(void* context, uint16_t offset, uint8_t* data, uint8_t count) {
+        DtcStream& stream = *(DtcStream*)context;
+        StoreAccess access(*stream.handler);
+        DtcStore::readCursor(&stream.cursor, offset, data, count);
+    }
 
-            case 0x14:  // O2 Sensor 1 (Bank 1, Sensor 1)
-                // Byte A: O2 sensor voltage (0-1.275V in 0.005V increments)
-                // Byte B: Short term fuel trim (same as PID 0x06)
-                data[0] = currentState.o2_voltage;  // Already scaled (*200)
-                data[1] = ((int16_t)currentState.short_fuel_trim * 128 / 100) + 128;
-                dataLen = 2;
+    // Handle service 19 (ReadDTCInformation), streamed on CAN:
+    //   01 mask       number of DTCs matching a status mask
+    //                 -> 59 01 availability format count(2)
+    //   02 mask       DTCs matching a status mask -> 59 02 availability
+    //                 (DTC(3) status)...
+    //   03            snapshot identification -> 59 03 (DTC(3) record)...
+    //   04 DTC(3) n   snapshot records of a DTC (n = FF: all) -> 59 04
+    //                 DTC(3) status (record 03 (identifier value)...)...
+    //   0A            all stored DTCs, as 02
+    //   15            permanent DTCs, as 02
+    // DTCs are the 2-byte J2012 code and a failure type byte (00).
+    // Snapshots are the freeze frames, so only the OBD ECU has them.
+    uint8_t handleMode19(const EcuDef& ecu, const uint8_t* request, uint8_t requestLength, uint8_t* payload) {
+        static const uint16_t MAX_LIST = (0xFFF - 3) / 4;  // DTCs in one ISO-TP message
+
+        if (!dids.ecuHasDids(ecu) || OBD_PROTOCOLS[elm->getActiveProtocol()].bus != BUS_CAN) {
+            return negativeResponse(0x19, 0x11, payload);
+        }
+        if (requestLength == 0) return negativeResponse(0x19, 0x13, payload);
+        uint8_t e = &ecu - ECUS;
+        uint8_t subfunction = request[0];
+
+        uint16_t filter;
+        uint8_t expected = 1;
+        switch (subfunction) {
+            case 0x01:
+            case 0x02:
+                filter = requestLength > 1 ? request[1] : 0;
+                expected = 2;
                 break;
-
-            case 0x1F:  // Run time since engine start
-                updateRuntime();
-                data[0] = currentState.runtime >> 8;
-                data[1] = currentState.runtime & 0xFF;
-                dataLen = 2;
+            case 0x0A:
+                filter = DTC_FILTER_ALL;
                 break;
-
-            case 0x20:  // PIDs supported [21-40]
-                // We support: 0x21, 0x23, 0x2C, 0x2F, 0x31, 0x33
-                data[0] = 0b10100000;  // 21-28: 0x21, 0x23
-                data[1] = 0b00001010;  // 29-30: 0x2C, 0x2F
-                data[2] = 0b10100000;  // 31-38: 0x31, 0x33
-                data[3] = 0b00000001;  // 39-40: 0x40 (supports next range)
-                dataLen = 4;
+            case 0x15:
+                filter = DTC_FILTER_PERMANENT;
                 break;
+            case 0x03:
+                return requestLength == 1 ? snapshotIdentification(ecu, payload) : negativeResponse(0x19, 0x13, payload);
+            case 0x04:
+                return requestLength == 5 ? snapshotRecords(ecu, &request[1], payload) : negativeResponse(0x19, 0x13, payload);
+            default:
+                return negativeResponse(0x19, 0x12, payload);
+        }
+        if (requestLength != expected) return negativeResponse(0x19, 0x13, payload);
+
+        uint16_t count = dtcs.countOf(e, filter);
+        payload[0] = 0x59;
+        payload[1] = subfunction;
+        payload[2] = DTC_STATUS_AVAILABLE;
+        if (subfunction == 0x01) {
+            payload[3] = 0x00;  // ISO 15031-6 DTC format
+            payload[4] = count >> 8;
+            payload[5] = count & 0xFF;
+            return 6;
+        }
+        if (count > MAX_LIST) count = MAX_LIST;
+        dtcs.openCursor(dtcStreams[e].cursor, e, filter, 4, count);
+        streamDtcs(dtcStreams[e], count * 4);
+        return 3;
+    }
 
-            case 0x21:  // Distance traveled with MIL on
-                data[0] = currentState.mil_distance >> 8;
-                data[1] = currentState.mil_distance & 0xFF;
-                dataLen = 2;
-                break;
+    // Freeze frames recorded for the OBD ECU's DTCs, numbered from 1 per
+    // DTC in the order they were taken
+    uint8_t snapshotIdentification(const EcuDef& ecu, uint8_t* payload) {
+        payload[0] = 0x59;
+        payload[1] = 0x03;
+        if (!ecu.emissionsDtcs) return 2;
+        streamLength = freezeFrames.size() * 4;
+        streamReader = readSnapshotIds;
+        streamContext = this;
+        snapshotIdFrame = -1;
+        return 2;
+    }
 
-            case 0x23: {  // Fuel rail pressure
-                // Formula: ((A*256)+B) * 0.079 = kPa
-                // We store in kPa, need to encode as value * 0.079 = stored
-                // So stored value = kPa / 0.079 ≈ kPa * 12.7
-                uint16_t encoded = currentState.fuel_pressure * 10 / 79;  // Approximate conversion
-                data[0] = encoded >> 8;
-                data[1] = encoded & 0xFF;
-                dataLen = 2;
-                break;
-            }
+    // Record number of a freeze frame: 1 + earlier frames of the same DTC
+    uint8_t snapshotRecordNumber(uint16_t frame) {
+        uint16_t dtc, other;
+        freezeFrames.dtcOf(frame, dtc);
+        uint8_t record = 1;
+        for (uint16_t n = 0; n < frame; n++) {
+            if (freezeFrames.dtcOf(n, other) && other == dtc && record < 0xFE) record++;
+        }
+        return record;
+    }
 
-            case 0x2C:  // Commanded EGR
-                // 0-100% encoded as 0-255
-                data[0] = (currentState.egr * 255) / 100;
-                dataLen = 1;
-                break;
+    // PayloadReader for 19 03: 4 bytes (DTC, FTB, record) per freeze frame
+    static void readSnapshotIds(void* context, uint16_t offset, uint8_t* data, uint8_t count) {
+        PIDHandler* handler = (PIDHandler*)context;
+        StoreAccess access(*handler);
+        for (uint8_t i = 0; i < count; i++) {
+            uint16_t frame = (offset + i) / 4;
+            if (handler->snapshotIdFrame != (int16_t)frame) {
+                uint16_t dtc = 0;
+                handler->freezeFrames.dtcOf(frame, dtc);
+                handler->snapshotIdRecord[0] = dtc >> 8;
+                handler->snapshotIdRecord[1] = dtc & 0xFF;
+                handler->snapshotIdRecord[2] = 0x00;
+                handler->snapshotIdRecord[3] = handler->snapshotRecordNumber(frame);
+                handler->snapshotIdFrame = frame;
+            }
+            data[i] = handler->snapshotIdRecord[(offset + i) % 4];
+        }
+    }
 
-            case 0x2F:  // Fuel tank level input
-                data[0] = (currentState.fuel_level * 255) / 100;
-                dataLen = 1;
-                break;
+    // 19 04: the freeze frames of one DTC as snapshot records of
+    // identifiers F40C (RPM), F40D (speed) and F405 (coolant), the Mode 01
+    // PIDs as ISO 15031 DIDs
+    uint8_t snapshotRecords(const EcuDef& ecu, const uint8_t* request, uint8_t* payload) {
+        static const uint8_t SNAPSHOT_PIDS[] = {0x0C, 0x0D, 0x05};
+
+        uint16_t dtc = (request[0] << 8) | request[1];
+        uint8_t wanted = request[3];
+        uint8_t e = &ecu - ECUS;
+        if (request[2] != 0x00 || !dtcs.contains(e, dtc)) return negativeResponse(0x19, 0x31, payload);
+
+        uint8_t length = 0;
+        payload[length++] = 0x59;
+        payload[length++] = 0x04;
+        memcpy(&payload[length], request, 3);
+        length += 3;
+        payload[length++] = dtcs.status(e, dtc) & DTC_STATUS_AVAILABLE;
+
+        uint8_t record = 0;
+        bool found = false;
+        uint16_t frameDtc;
+        for (uint16_t n = 0; ecu.emissionsDtcs && freezeFrames.dtcOf(n, frameDtc); n++) {
+            if (frameDtc != dtc) continue;
+            if (record < 0xFE) record++;
+            if (wanted != 0xFF && wanted != record) continue;
+            found = true;
+
+            const CarState* state = freezeFrames.state(n);
+            uint8_t data[4];
+            if (length + 2 + sizeof(SNAPSHOT_PIDS) * 4 > MAX_ECU_PAYLOAD) {
+                return negativeResponse(0x19, 0x14, payload);  // responseTooLong
+            }
+            payload[length++] = record;
+            payload[length++] = sizeof(SNAPSHOT_PIDS);
+            for (uint8_t i = 0; i < sizeof(SNAPSHOT_PIDS); i++) {
+                uint8_t dataLength = encodePid(SNAPSHOT_PIDS[i], *state, data);
+                payload[length++] = 0xF4;
+                payload[length++] = SNAPSHOT_PIDS[i];
+                memcpy(&payload[length], data, dataLength);
+                length += dataLength;
+            }
+        }
+        if (wanted != 0xFF && !found) return negativeResponse(0x19, 0x31, payload);
+        return length;
+    }
 
-            case 0x31:  // Distance traveled since codes cleared
-                data[0] = currentState.distance_mil_clear >> 8;
-                data[1] = currentState.distance_mil_clear & 0xFF;
-                dataLen = 2;
-                break;
+    // Handle OBD-II mode 09 request (vehicle information)
+    // CAN format: 49, PID, number of data items, then the items
+    uint8_t handleMode09(const EcuDef& ecu, uint8_t pid, uint8_t* payload) {
+        // Calibration IDs (16 chars, zero padded) and their verification numbers
+        static const char* const calibrationIds[] = {"FR3A-14C204-AHC", "FR3A-14C336-AB"};
+        static const uint8_t calibrationCount = sizeof(calibrationIds) / sizeof(calibrationIds[0]);
+        static const uint8_t cvns[calibrationCount][4] = {
+            {0x5E, 0x1F, 0xA3, 0x07},
+            {0x9C, 0x42, 0x0D, 0xB6}
+        };
+
+        if (pid != 0x00 && (pid > 0x20 || !(ecu.mode09Mask & (0x80000000UL >> (pid - 1))))) {
+            return 0;
+        }
 
-            case 0x33:  // Barometric pressure
-                data[0] = currentState.barometric;
-                dataLen = 1;
-                break;
+        uint8_t length = 0;
+        payload[length++] = 0x49;
+        payload[length++] = pid;
 
-            case 0x40:  // PIDs supported [41-60]
-                // We support: 0x42, 0x45, 0x46, 0x51, 0x5C
-                data[0] = 0b01011000;  // 41-48: 0x42, 0x45, 0x46
-                data[1] = 0b10000000;  // 49-50: 0x51
-                data[2] = 0b00010000;  // 51-58: 0x5C
-                data[3] = 0b00000000;  // 59-60: none (no further ranges)
-                dataLen = 4;
+        switch (pid) {
+            case 0x00:  // Supported PIDs [01-20]
+                putUint32(&payload[length], ecu.mode09Mask);
+                length += 4;
                 break;
 
-            case 0x42: {  // Control module voltage
-                // Formula: ((A*256)+B)/1000 = Volts
-                // We store in millivolts, encode as-is
-                data[0] = currentState.battery_voltage >> 8;
-                data[1] = currentState.battery_voltage & 0xFF;
-                dataLen = 2;
+            case 0x02: {  // VIN (17 characters)
+                const char* vin = config->getVIN();
+                if (strlen(vin) != 17) {
+                    return 0;
+                }
+                payload[length++] = 0x01;
+                memcpy(&payload[length], vin, 17);
+                length += 17;
                 break;
             }
 
-            case 0x45:  // Relative throttle position
-                // Same as absolute throttle for simplicity
-                data[0] = (currentState.throttle * 255) / 100;
-                dataLen = 1;
-                break;
-
-            case 0x46:  // Ambient air temperature
-                data[0] = currentState.ambient_temp + 40;  // °C + 40
-                dataLen = 1;
+            case 0x04:  // Calibration IDs
+                payload[length++] = calibrationCount;
+                for (uint8_t i = 0; i < calibrationCount; i++) {
+                    memset(&payload[length], 0x00, 16);
+                    memcpy(&payload[length], calibrationIds[i], strlen(calibrationIds[i]));
+                    length += 16;
+                }
                 break;
 
-            case 0x51:  // Fuel Type
-                // 01 = Gasoline, 02 = Methanol, 03 = Ethanol, 04 = Diesel, etc.
-                data[0] = 0x01;  // Gasoline
-                dataLen = 1;
+            case 0x06:  // Calibration verification numbers
+                payload[length++] = calibrationCount;
+                for (uint8_t i = 0; i < calibrationCount; i++) {
+                    memcpy(&payload[length], cvns[i], 4);
+                    length += 4;
+                }
                 break;
 
-            case 0x5C:  // Engine oil temperature
-                data[0] = currentState.oil_temp + 40;  // °C + 40
-                dataLen = 1;
+            case 0x0A: {  // ECU Name (20 bytes, zero padded)
+                size_t nameLen = strlen(ecu.name);
+                if (nameLen > 20) nameLen = 20;  // Limit to 20 chars
+                payload[length++] = 0x01;
+                memset(&payload[length], 0x00, 20);
+                memcpy(&payload[length], ecu.name, nameLen);
+                length += 20;
                 break;
+            }
 
             default:
-                // Unsupported PID
-                return "NO DATA\r\r>";
+                return 0;
         }
 
-        return elm->formatOBDResponse(0x01, pid, data, dataLen);
+        return length;
     }
 
-    // Handle OBD request string (e.g., "01 0C" for RPM)
-    // Handle OBD-II mode 03 request (read DTCs)
-    String handleMode03() {
-        if (currentState.dtc_count == 0) {
-            return "NO DATA\r\r>";
-        }
-
-        String response = "";
-        char buf[8];
+    // Simulated processing time of one ECU for one request
+    static uint16_t ecuLatencyMs(const EcuDef& ecu) {
+        return ecu.latencyMs + random(-ECU_LATENCY_JITTER_MS, ECU_LATENCY_JITTER_MS + 1);
+    }
 
-        // First byte: number of DTCs
-        sprintf(buf, "%02X", currentState.dtc_count);
-        response += buf;
+    // Whether an ECU receives a request sent with its header (ATSH or STPX
+    // H:). Without one requests go to the protocol's functional address.
+    static bool ecuAddressed(const EcuDef& ecu, const ObdProtocolDef& proto, const ObdRequest& request) {
+        if (!request.headerSet) return true;
+        uint32_t header = request.header;
 
-        // Return all DTCs (2 bytes each)
-        for (uint8_t i = 0; i < currentState.dtc_count; i++) {
-            uint16_t dtc = currentState.dtcs[i];
-            if (elm->getSpaces()) response += " ";
-            sprintf(buf, "%02X", (dtc >> 8) & 0xFF);
-            response += buf;
-            if (elm->getSpaces()) response += " ";
-            sprintf(buf, "%02X", dtc & 0xFF);
-            response += buf;
+        if (proto.bus != BUS_CAN) {
+            // 3-byte header: priority, target, source (e.g. 68 6A F1)
+            uint8_t target = header >> 8;
+            return target == proto.functionalTarget || target == ecu.address;
         }
-
-        response += "\r\r>";
-        return response;
+        if (proto.extendedId) {
+            // 18DB33F1 functional, 18DAxxF1 physical
+            uint8_t target = header >> 8;
+            return target == 0x33 || target == ecu.address;
+        }
+        header &= 0x7FF;
+        return header == OBD_FUNCTIONAL_ID || header == (uint32_t)(ecu.responseId - 8);
     }
 
-    // Handle OBD-II mode 04 request (clear DTCs)
-    String handleMode04() {
-        clearDTCs();
-        return "44\r\r>";  // Mode 04 response
+    // Whether a request goes to the functional address (all ECUs) rather
+    // than one ECU
+    static bool isFunctional(const ObdProtocolDef& proto, const ObdRequest& request) {
+        if (!request.headerSet) return true;
+        if (proto.bus != BUS_CAN) return (uint8_t)(request.header >> 8) == proto.functionalTarget;
+        if (proto.extendedId) return (uint8_t)(request.header >> 8) == 0x33;
+        return (request.header & 0x7FF) == OBD_FUNCTIONAL_ID;
     }
 
-    // Handle OBD-II mode 07 request (pending DTCs)
-    String handleMode07() {
-        // For simplicity, we'll report no pending DTCs
-        // (Real systems would track pending vs confirmed DTCs separately)
-        return "NO DATA\r\r>";
+    // CAN ID an ECU replies on for the given protocol
+    static uint32_t ecuResponseId(const EcuDef& ecu, const ObdProtocolDef& proto) {
+        return proto.extendedId ? (0x18DAF100UL | ecu.address) : ecu.responseId;
     }
 
-    // Handle OBD-II mode 09 request (vehicle information)
-    String handleMode09(uint8_t pid) {
-        char buf[16];  // Increased buffer size to handle spaced output
-        String response = "";
+    // Bring the bus up before the first request after ATZ/ATSP/ATPC, as the
+    // ELM does. A fixed protocol is initialised directly. Automatic search
+    // ("SEARCHING...") tries protocols 1-9 in order and pays the timeout or
+    // failed init of each before the right one answers. Prints the error
+    // and prompt and returns false if the car can't be reached.
+    bool connectBus(ResponseWriter& out) {
+        uint8_t selected = elm->getProtocol();
+
+        if (selected != 0) {
+            const ObdProtocolDef& proto = OBD_PROTOCOLS[selected];
+            if (proto.bus == BUS_ISO) out.print("BUS INIT: ...");
+            if (selected == vehicleProtocol) {
+                out.pace(proto.initMs * 1000UL);
+                if (proto.bus == BUS_ISO) out.print("OK\r");
+                elm->setActiveProtocol(selected);
+                return true;
+            }
 
-        switch (pid) {
-            case 0x00: {  // Supported PIDs [01-20]
-                // We support: 0x02 (VIN), 0x0A (ECU name)
-                if (elm->getHeaders()) {
-                    response = "7E8";
-                    if (elm->getSpaces()) response += " ";
-                    sprintf(buf, "06");
-                    response += buf;
-                }
-                if (elm->getSpaces()) response += " ";
-                sprintf(buf, "49");
-                response += buf;
-                if (elm->getSpaces()) response += " ";
-                sprintf(buf, "00");
-                response += buf;
-                if (elm->getSpaces()) response += " ";
-                sprintf(buf, "54");  // 0x02 and 0x0A supported
-                response += buf;
-                if (elm->getSpaces()) response += " ";
-                sprintf(buf, "00");
-                response += buf;
-                if (elm->getSpaces()) response += " ";
-                sprintf(buf, "00");
-                response += buf;
-                if (elm->getSpaces()) response += " ";
-                sprintf(buf, "00");
-                response += buf;
-                response += "\r\r>";
-                return response;
+            out.pace((proto.searchMs ? proto.searchMs : proto.initMs) * 1000UL);
+            const ObdProtocolDef& car = OBD_PROTOCOLS[vehicleProtocol];
+            const char* error = "NO DATA";
+            if (proto.bus == BUS_ISO) {
+                error = "ERROR";
+            } else if (proto.bus == BUS_CAN && (car.bus != BUS_CAN || car.bitRateKbps != proto.bitRateKbps)) {
+                error = "CAN ERROR";  // Nobody acknowledges at this bit rate
             }
+            if (!elm->isProtocolAuto()) {
+                out.print(error);
+                out.print("\r\r>");
+                return false;
+            }
+            if (proto.bus == BUS_ISO) out.print("ERROR\r");
+        }
 
-            case 0x02: {  // VIN (17 characters, multi-line response)
-                // VIN is sent as multi-line CAN messages
-                // Line 1: 49 02 01 XX XX XX XX (message count + first 5 chars)
-                // Line 2: 49 02 02 XX XX XX XX (next 7 chars)
-                // Line 3: 49 02 03 XX XX XX XX (last 5 chars)
+        out.print("SEARCHING...\r");
+        for (uint8_t number = 1; number <= OBD_SEARCH_LAST; number++) {
+            if (number == selected) continue;  // Already tried
 
-                const char* vin = config->getVIN();
-                int vinLen = strlen(vin);
-                if (vinLen != 17) {
-                    return "NO DATA\r\r>";
-                }
+            // The ISO 9141 5-baud init also identifies KWP 5-baud by its key bytes
+            if (number == vehicleProtocol || (number == 3 && vehicleProtocol == 4)) {
+                out.pace(OBD_PROTOCOLS[vehicleProtocol].initMs * 1000UL);
+                elm->setActiveProtocol(vehicleProtocol);
+                return true;
+            }
+            out.pace(OBD_PROTOCOLS[number].searchMs * 1000UL);
+        }
 
-                // Message 1: byte count (01) + first 5 VIN chars
-                if (elm->getHeaders()) {
-                    response = "7E8";
-                    if (elm->getSpaces()) response += " ";
-                }
-                sprintf(buf, "%s49%s02%s01",
-                        elm->getSpaces() ? "06 " : "06",
-                        elm->getSpaces() ? " " : "",
-                        elm->getSpaces() ? " " : "");
-                response += buf;
-                for (int i = 0; i < 5 && i < vinLen; i++) {
-                    if (elm->getSpaces()) response += " ";
-                    sprintf(buf, "%02X", (uint8_t)vin[i]);
-                    response += buf;
-                }
-                response += "\r";
+        out.print("UNABLE TO CONNECT\r\r>");
+        return false;
+    }
 
-                // Message 2: sequence 02 + next 7 VIN chars
-                if (elm->getHeaders()) {
-                    response += "7E8";
-                    if (elm->getSpaces()) response += " ";
+    // Pre-CAN protocols carry at most 7 data bytes per message, so J1979
+    // splits replies differently: one message per Mode 01 PID, three DTCs
+    // per Mode 03/07/0A message (no count byte), and Mode 09 data in 4-byte
+    // messages numbered from 1 (the VIN padded to 20 bytes). Builds the
+    // [length][message]... list; returns its size, 0 if the ECU is silent.
+    uint8_t buildLegacyReply(const EcuDef& ecu, const uint8_t* request, uint8_t length, uint8_t* messages) {
+        StoreAccess access(*this);
+        uint8_t total = 0;
+
+        if (request[0] == 0x01) {
+            for (uint8_t i = 1; i < length; i++) {
+                uint8_t messageLength = handleMode01(ecu, &request[i], 1, &messages[total + 1]);
+                if (messageLength > 0) {
+                    messages[total] = messageLength;
+                    total += 1 + messageLength;
                 }
-                sprintf(buf, "%s49%s02%s02",
-                        elm->getSpaces() ? "08 " : "08",
-                        elm->getSpaces() ? " " : "",
-                        elm->getSpaces() ? " " : "");
-                response += buf;
-                for (int i = 5; i < 12 && i < vinLen; i++) {
-                    if (elm->getSpaces()) response += " ";
-                    sprintf(buf, "%02X", (uint8_t)vin[i]);
-                    response += buf;
-                }
-                response += "\r";
+            }
+            return total;
+        }
 
-                // Message 3: sequence 03 + last 5 VIN chars
-                if (elm->getHeaders()) {
-                    response += "7E8";
-                    if (elm->getSpaces()) response += " ";
+        if (request[0] == 0x02) {
+            // One message per PID/frame pair; 5-byte PIDs don't fit one
+            for (uint8_t i = 1; i + 1 < length; i += 2) {
+                uint8_t messageLength = handleMode02(ecu, &request[i], 2, &messages[total + 1]);
+                if (messageLength > 0 && messageLength <= 7) {
+                    messages[total] = messageLength;
+                    total += 1 + messageLength;
                 }
-                sprintf(buf, "%s49%s02%s03",
-                        elm->getSpaces() ? "06 " : "06",
-                        elm->getSpaces() ? " " : "",
-                        elm->getSpaces() ? " " : "");
-                response += buf;
-                for (int i = 12; i < 17 && i < vinLen; i++) {
-                    if (elm->getSpaces()) response += " ";
-                    sprintf(buf, "%02X", (uint8_t)vin[i]);
-                    response += buf;
+            }
+            return total;
+        }
+
+        if (request[0] == 0x22) {
+            // One DID per message (Ford on J1850); longer ones don't fit
+            for (uint8_t i = 1; i + 1 < length; i += 2) {
+                uint8_t messageLength = handleMode22(ecu, &request[i], 2, &messages[total + 1]);
+                if (messageLength > 0 && messageLength <= 7 && messages[total + 1] == 0x62) {
+                    messages[total] = messageLength;
+                    total += 1 + messageLength;
                 }
-                response += "\r\r>";
-                return response;
             }
+            if (total > 0) return total;
 
-            case 0x0A: {  // ECU Name
-                const char* ecuName = ELM_DEVICE_ID;
-                int nameLen = strlen(ecuName);
-                if (nameLen > 20) nameLen = 20;  // Limit to 20 chars
+            // Nothing answered: the negative response, if any
+            uint8_t messageLength = handleMode22(ecu, &request[1], length - 1, &messages[1]);
+            if (messageLength == 0 || messages[1] != 0x7F) return 0;
+            messages[0] = messageLength;
+            return 1 + messageLength;
+        }
 
-                if (elm->getHeaders()) {
-                    response = "7E8";
-                    if (elm->getSpaces()) response += " ";
+        uint8_t message[MAX_ECU_PAYLOAD];
+        uint8_t messageLength = dispatchRequest(ecu, request, length, message);
+        if (messageLength == 0) return 0;
+
+        if (message[0] == 0x43 || message[0] == 0x47 || message[0] == 0x4A) {
+            uint8_t dtcBytes = message[1] * 2;
+            for (uint8_t first = 0; first < dtcBytes; first += 6) {
+                messages[total++] = 7;
+                messages[total++] = message[0];
+                for (uint8_t i = first; i < first + 6; i++) {
+                    messages[total++] = i < dtcBytes ? message[2 + i] : 0x00;
                 }
+            }
+            return total;
+        }
 
-                // Length byte
-                uint8_t length = 2 + nameLen;  // mode + PID + name bytes
-                sprintf(buf, "%02X", length);
-                response += buf;
-                if (elm->getSpaces()) response += " ";
-
-                // Mode + PID
-                sprintf(buf, "49%s0A", elm->getSpaces() ? " " : "");
-                response += buf;
-
-                // ECU name as ASCII bytes
-                for (int i = 0; i < nameLen; i++) {
-                    if (elm->getSpaces()) response += " ";
-                    sprintf(buf, "%02X", (uint8_t)ecuName[i]);
-                    response += buf;
+        if (message[0] == 0x49) {
+            // CAN form: 49 PID [item count] data; PID 00 has no item count
+            uint8_t dataStart = message[1] == 0x00 ? 2 : 3;
+            uint8_t dataBytes = messageLength - dataStart;
+            uint8_t padding = message[1] == 0x02 ? 3 : 0;
+            uint8_t count = (padding + dataBytes + 3) / 4;
+            for (uint8_t n = 0; n < count; n++) {
+                messages[total++] = 7;
+                messages[total++] = 0x49;
+                messages[total++] = message[1];
+                messages[total++] = n + 1;
+                for (uint8_t i = 0; i < 4; i++) {
+                    int16_t index = n * 4 + i - padding;
+                    messages[total++] = (index >= 0 && index < dataBytes) ? message[dataStart + index] : 0x00;
                 }
-                response += "\r\r>";
-                return response;
             }
+            return total;
+        }
+
+        messages[0] = messageLength;
+        memcpy(&messages[1], message, messageLength);
+        return 1 + messageLength;
+    }
+
+    // Run one service request on one ECU and build its reply message.
+    // Returns the message length, 0 if the ECU doesn't reply (unsupported
+    // service/PID, nothing to report).
+    uint8_t dispatchRequest(const EcuDef& ecu, const uint8_t* request, uint8_t length, uint8_t* payload) {
+        StoreAccess access(*this);
+        switch (request[0]) {
+            case 0x01:  // Current data
+                return handleMode01(ecu, &request[1], length - 1, payload);
+
+            case 0x02:  // Freeze frame data
+                return handleMode02(ecu, &request[1], length - 1, payload);
+
+            case 0x03:  // Show stored DTCs
+                return ecu.emissionsDtcs ? handleDtcList(ecu, 0x03, DTC_CONFIRMED, payload) : 0;
+
+            case 0x04:  // Clear DTCs and MIL
+                return ecu.emissionsDtcs ? handleMode04(payload) : 0;
+
+            case 0x07:  // Show pending DTCs
+                return ecu.emissionsDtcs ? handleDtcList(ecu, 0x07, DTC_PENDING, payload) : 0;
+
+            case 0x0A:  // Show permanent DTCs
+                return ecu.emissionsDtcs ? handleDtcList(ecu, 0x0A, DTC_FILTER_PERMANENT, payload) : 0;
+
+            case 0x09:  // Vehicle information
+                return handleMode09(ecu, request[1], payload);
+
+            case 0x19:  // Read DTC information
+                return handleMode19(ecu, &request[1], length - 1, payload);
+
+            case 0x22:  // Read data by identifier (enhanced DIDs)
+                return handleMode22(ecu, &request[1], length - 1, payload);
+
+            case 0x2A:  // Read data by periodic identifier
+                return handleMode2A(ecu, &request[1], length - 1, payload);
+
+            case 0x2C:  // Dynamically define data identifier
+                return handleMode2C(ecu, &request[1], length - 1, payload);
+
+            case 0x23:  // Read memory by address
+                return handleMode23(ecu, &request[1], length - 1, payload);
+
+            case 0x35:  // Request upload
+                return handleMode35(ecu, &request[1], length - 1, payload);
+
+            case 0x36:  // Transfer data
+                return handleMode36(ecu, &request[1], length - 1, payload);
+
+            case 0x37:  // Request transfer exit
+                return handleMode37(ecu, &request[1], length - 1, payload);
 
             default:
-                return "NO DATA\r\r>";
+                return 0;
         }
     }
 
-    String handleRequest(String request) {
-        request.trim();
-        request.toUpperCase();
-        request.replace(" ", "");
+    // Handle a normalized OBD request line (e.g. "010C" for RPM) and write
+    // the complete response, including the final prompt, to out. The
+    // request goes out with the current ATSH header.
+    void handleRequest(const char* request, ResponseWriter& out) {
+        out.setLinefeeds(elm->getLinefeeds());
+        size_t digits = strlen(request);
+
+        // At least a service byte; all hex, and no more than fits in a request
+        bool valid = digits >= 2 && digits <= 2 * sizeof(ObdRequest::data) + 1;
+        for (size_t i = 0; valid && i < digits; i++) {
+            valid = ELM327Protocol::hexValue(request[i]) >= 0;
+        }
 
-        // Must be at least 2 characters (mode)
-        if (request.length() < 2) {
-            return "?\r\r>";
+        // Trailing single hex digit: number of replies to wait for
+        ObdRequest obd;
+        obd.expectedReplies = 0;
+        if (valid && (digits & 1)) {
+            obd.expectedReplies = ELM327Protocol::hexValue(request[--digits]);
+            valid = digits >= 2 && obd.expectedReplies > 0;
+        }
+        if (!valid) {
+            out.print("?\r\r>");
+            return;
         }
 
-        // Parse mode
-        uint8_t mode = strtol(request.substring(0, 2).c_str(), NULL, 16);
+        obd.length = digits / 2;
+        for (uint8_t i = 0; i < obd.length; i++) {
+            obd.data[i] = (ELM327Protocol::hexValue(request[2 * i]) << 4) |
+                          ELM327Protocol::hexValue(request[2 * i + 1]);
+        }
+        obd.headerSet = elm->getTxHeader(obd.header);
+        obd.timeoutMs = 0;
+        handleRequest(obd, out);
+    }
 
-        // Handle different modes
-        switch (mode) {
-            case 0x01:  // Current data
-                // Parse PID (if present)
-                if (request.length() >= 4) {
-                    uint8_t pid = strtol(request.substring(2, 4).c_str(), NULL, 16);
-                    return handleMode01(pid);
-                }
-                return "?\r\r>";
+    // Run the request an STPX queued, if any, and write its replies and the
+    // prompt to out
+    bool runQueuedRequest(ResponseWriter& out) {
+        ObdRequest request;
+        if (!elm->takeQueuedRequest(request)) return false;
+        handleRequest(request, out);
+        return true;
+    }
 
-            case 0x03:  // Show stored DTCs
-                return handleMode03();
+    // Send one request on the bus and write the replies and the prompt.
+    //
+    // Every ECU addressed by the header (all of them for the functional 7DF)
+    // answers after its own latency, so replies to a broadcast arrive
+    // staggered and multi-frame ones interleave. The adapter listens for one
+    // response window (ATST / adaptive timing, or the STPX timeout) and
+    // restarts it after every frame; replies later than that are missed, and
+    // NO DATA follows if nothing arrived. With a response count ("010C1",
+    // STPX R:) it returns as soon as that many complete replies have arrived.
+    void handleRequest(const ObdRequest& request, ResponseWriter& out) {
+        // Answered from one snapshot of the state, however long it takes
+        updateRuntime();
+        requestState = getState();
+        out.setLinefeeds(elm->getLinefeeds());
+        const uint8_t* service = request.data;
+        uint8_t length = request.length;
+
+        // With ATCAF0 the request carries its own PCI byte (e.g. "02010C");
+        // an ECU ignores anything that isn't a valid single frame
+        bool ecuListens = true;
+        if (!elm->getCanAutoFormat()) {
+            uint8_t pci = request.data[0];
+            if (length < 2 || pci == 0 || pci > 7 || length - 1 < pci) {
+                ecuListens = false;
+            } else {
+                service = &request.data[1];
+                length = pci;
+            }
+        }
 
-            case 0x04:  // Clear DTCs and MIL
-                return handleMode04();
+        // Syntax checks happen in the adapter, before anything is sent. A
+        // request longer than one frame needs STCSEGT.
+        if (ecuListens && length > 7 && !elm->getStnSegmentTx()) {
+            out.print("?\r\r>");
+            return;
+        }
+        if (ecuListens && service[0] == 0x01 && (length < 2 || length - 1 > MAX_PIDS_PER_REQUEST)) {
+            out.print("?\r\r>");
+            return;
+        }
+        if (ecuListens && service[0] == 0x02 &&
+            (length < 3 || !(length & 1) || (length - 1) / 2 > MAX_PIDS_PER_REQUEST / 2)) {
+            out.print("?\r\r>");
+            return;
+        }
+        if (ecuListens && service[0] == 0x09 && length < 2) {
+            out.print("?\r\r>");
+            return;
+        }
 
-            case 0x07:  // Show pending DTCs
-                return handleMode07();
+        if (elm->getActiveProtocol() == 0 && !connectBus(out)) {
+            return;
+        }
+        const ObdProtocolDef& proto = OBD_PROTOCOLS[elm->getActiveProtocol()];
+        bool canBus = proto.bus == BUS_CAN;
+
+        // The car only answers on its own protocol (J1939 never carries
+        // J1979); only CAN can segment a long request
+        if (elm->getActiveProtocol() != vehicleProtocol) ecuListens = false;
+        if (!canBus && length > 7) ecuListens = false;
+
+        // Every addressed ECU builds its reply once the request is on the
+        // bus; on CAN the receive filter (ATCF/ATCM/ATCRA) hides replies
+        uint32_t requestUs = canBus ? isotp.requestTimeUs(length) : busFrameTimeUs(proto, length);
+        EcuTransfer transfers[ECU_COUNT];
+        uint8_t replyCount = 0;
+        functionalRequest = isFunctional(proto, request);
+        periodicRequestCount = 0;
+
+        // Repeated Mode 01 polls are answered from the reply cache while
+        // the fields they read are unchanged
+        bool cacheable = canBus && ecuListens && ResponseCache::cacheable(service, length);
+        uint8_t format = 0;
+        FrameText lines[ECU_COUNT];
+        uint8_t lineEcus[ECU_COUNT];  // ECU of each reply whose line is to be stored, else 0xFF
+        if (cacheable) {
+            responseCache.track(requestState);
+            format = ResponseCache::format(elm->getCanAutoFormat(), elm->getHeaders(), elm->getSpaces(),
+                                           elm->getActiveProtocol());
+        }
 
-            case 0x09:  // Vehicle information
-                // Parse PID (if present)
-                if (request.length() >= 4) {
-                    uint8_t pid = strtol(request.substring(2, 4).c_str(), NULL, 16);
-                    return handleMode09(pid);
+        for (uint8_t e = 0; ecuListens && e < ECU_COUNT; e++) {
+            const EcuDef& ecu = ECUS[e];
+            if (!ecuAddressed(ecu, proto, request)) continue;
+
+            uint8_t* payload = ecuPayloads[replyCount];
+            uint32_t startUs = requestUs + ecuLatencyMs(ecu) * 1000UL;
+            if (canBus) {
+                uint32_t canId = ecuResponseId(ecu, proto);
+                streamLength = 0;
+                processingUs = 0;
+                uint8_t replyLength;
+                const ResponseCacheEntry* cached = cacheable ? responseCache.find(e, format, service, length) : nullptr;
+                lineEcus[replyCount] = 0xFF;
+                if (cached) {
+                    replyLength = cached->payloadLength;
+                    memcpy(payload, cached->payload, replyLength);
+                    lines[replyCount] = cached->line;
+                    if (cached->line.length == 0) lineEcus[replyCount] = e;
+                } else {
+                    replyLength = dispatchRequest(ecu, service, length, payload);
+                    lines[replyCount].length = 0;
+                    if (cacheable) {
+                        if (replyLength == 0) {
+                            responseCache.store(e, format, service, length, payload, 0, lines[replyCount]);
+                        } else {
+                            lineEcus[replyCount] = e;
+                        }
+                    }
+                }
+                if (replyLength == 0 || !elm->acceptsId(canId)) continue;
+                isotp.begin(transfers[replyCount], canId, payload, replyLength + streamLength, startUs);
+                if (cacheable && replyLength <= 7) transfers[replyCount].line = &lines[replyCount];
+                if (streamLength > 0) {
+                    isotp.setReader(transfers[replyCount], replyLength, streamReader, streamContext);
+                }
+                if (processingUs > 0) {
+                    isotp.setResponsePending(transfers[replyCount], service[0], requestUs, startUs + processingUs);
                 }
-                return "?\r\r>";
+            } else {
+                uint8_t replyLength = buildLegacyReply(ecu, service, length, payload);
+                if (replyLength == 0) continue;
+                legacy.begin(transfers[replyCount], ecu.address, payload, replyLength, startUs);
+            }
+            replyCount++;
+        }
 
-            default:
-                return "NO DATA\r\r>";
+        // Put the frames on the bus in time order, one at a time; ties go to
+        // the lower ID as in arbitration. The adapter gives up once a whole
+        // response window passes with nothing received.
+        out.pace(requestUs);
+        uint32_t nowUs = requestUs;
+        uint32_t busFreeUs = requestUs;
+        uint32_t windowUs = (request.timeoutMs ? request.timeoutMs : elm->getResponseWindow()) * 1000UL;
+        uint32_t deadlineUs = requestUs + windowUs;
+        uint8_t completed = 0;
+        bool received = false;
+        bool countReached = false;
+
+        while (!countReached) {
+            int8_t next = -1;
+            for (uint8_t i = 0; i < replyCount; i++) {
+                if (transfers[i].done()) continue;
+                if (next < 0 || transfers[i].nextUs < transfers[next].nextUs ||
+                    (transfers[i].nextUs == transfers[next].nextUs && transfers[i].id < transfers[next].id)) {
+                    next = i;
+                }
+            }
+            if (next < 0) break;
+
+            EcuTransfer& t = transfers[next];
+            uint32_t startUs = t.nextUs > busFreeUs ? t.nextUs : busFreeUs;
+            if (startUs > deadlineUs) break;  // Arrives after the adapter stopped listening
+
+            // The adapter has the frame once it is completely on the bus
+            uint32_t endUs = startUs + (canBus ? isotp.frameTimeUs() : legacy.frameTimeUs(t));
+            out.pace(endUs - nowUs);
+            nowUs = endUs;
+            if (!received) {
+                received = true;
+                elm->recordResponseTime(nowUs / 1000);
+                if (request.timeoutMs == 0) windowUs = elm->getResponseWindow() * 1000UL;
+            }
+            // After "response pending" the adapter waits up to P2* for more
+            bool pending = t.pendingService != 0;
+            if (canBus) {
+                isotp.writeFrame(out, t, nowUs);
+            } else {
+                legacy.writeFrame(out, t, nowUs);
+            }
+            busFreeUs = nowUs;
+            deadlineUs = nowUs + (pending ? ECU_P2_STAR_MS * 1000UL : windowUs);
+
+            if (t.complete() && ++completed == request.expectedReplies) {
+                countReached = true;
+            }
+        }
+
+        if (!countReached && deadlineUs > nowUs) {
+            out.pace(deadlineUs - nowUs);
+        }
+        for (uint8_t i = 0; cacheable && i < replyCount; i++) {
+            if (lineEcus[i] == 0xFF || !transfers[i].complete()) continue;
+            responseCache.store(lineEcus[i], format, service, length, ecuPayloads[i], transfers[i].length,
+                                lines[i]);
+        }
+        if (!received) {
+            if (replyCount > 0) elm->recordMissedResponse();
+            out.print("NO DATA\r");
         }
+        out.print("\r>");
     }
 };
 
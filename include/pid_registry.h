@@ -0,0 +1,704 @@
+#ifndef PID_REGISTRY_H
+#define PID_REGISTRY_H
+
+#include <Arduino.h>
+#include "config.h"
+
+/**
+ * Mode 01 PID registry
+ *
+ * Every PID the simulator can answer is one descriptor (PID, data length,
+ * encoder) in MODE01_PIDS. Everything else derives from that table at
+ * compile time and lives in flash:
+ *
+ *   MODE01_SLOT          PID -> descriptor index (O(1) lookup, 256 bytes)
+ *   ECU_PID_BITMAPS      "PIDs supported" words for 00, 20, ... E0 per ECU,
+ *                        from the ECU's PID list (ECUS) and the table
+ *
+ * Adding a PID is one encoder and one table line; the static_asserts at
+ * the end check the table and that the bitmaps agree with it.
+ */
+
+// Writes a PID's data bytes (the descriptor's length) from the car state
+typedef void (*PidEncoder)(const CarState& state, uint8_t* data);
+
+struct PidDef {
+    uint8_t pid;
+    uint8_t length;       // Data bytes (A, B, ...)
+    PidEncoder encode;
+};
+
+// Signed percentage (fuel trims) as (A - 128) * 100 / 128
+static inline uint8_t encodeTrimPercent(int8_t percent) {
+    return ((int16_t)percent * 128 / 100) + 128;
+}
+
+static inline void putUint16(uint8_t* data, uint16_t value) {
+    data[0] = value >> 8;
+    data[1] = value & 0xFF;
+}
+
+static void pidMonitorStatus(const CarState& s, uint8_t* d) {
+    // Byte A: MIL (bit 7) and DTC count; B-D: test available/complete flags
+    uint8_t dtcCount = s.dtc_count > 127 ? 127 : s.dtc_count;
+    d[0] = (s.mil_on ? 0x80 : 0x00) | dtcCount;
+    d[1] = 0x07;
+    d[2] = 0x65;
+    d[3] = 0x04;
+}
+
+static void pidFuelSystemStatus(const CarState& s, uint8_t* d) {
+    d[0] = 0x02;  // System 1: closed loop, using O2 sensor
+    d[1] = 0x00;  // System 2: not available
+}
+
+static void pidCoolantTemp(const CarState& s, uint8_t* d) {
+    d[0] = s.coolant_temp + 40;  // °C + 40
+}
+
+static void pidShortFuelTrim(const CarState& s, uint8_t* d) {
+    d[0] = encodeTrimPercent(s.short_fuel_trim);
+}
+
+static void pidLongFuelTrim(const CarState& s, uint8_t* d) {
+    d[0] = encodeTrimPercent(s.long_fuel_trim);
+}
+
+static void pidIntakePressure(const CarState& s, uint8_t* d) {
+    d[0] = s.map;  // kPa
+}
+
+static void pidEngineRpm(const CarState& s, uint8_t* d) {
+    putUint16(d, s.rpm * 4);  // RPM = ((A * 256) + B) / 4
+}
+
+static void pidVehicleSpeed(const CarState& s, uint8_t* d) {
+    d[0] = s.speed;
+}
+
+static void pidTimingAdvance(const CarState& s, uint8_t* d) {
+    d[0] = ((int16_t)s.timing_advance + 64) * 2;  // A/2 - 64 = degrees
+}
+
+static void pidIntakeTemp(const CarState& s, uint8_t* d) {
+    d[0] = s.intake_temp + 40;
+}
+
+static void pidMafRate(const CarState& s, uint8_t* d) {
+    putUint16(d, s.maf);
+}
+
+static void pidThrottle(const CarState& s, uint8_t* d) {
+    d[0] = (s.throttle * 255) / 100;
+}
+
+static void pidO2SensorsPresent(const CarState& s, uint8_t* d) {
+    d[0] = 0x33;  // Banks 1 and 2, sensors 1 (upstream) and 2 (downstream)
+}
+
+static void pidRunTime(const CarState& s, uint8_t* d) {
+    putUint16(d, s.runtime);
+}
+
+static void pidDistanceWithMil(const CarState& s, uint8_t* d) {
+    putUint16(d, s.mil_distance);
+}
+
+static void pidFuelRailPressure(const CarState& s, uint8_t* d) {
+    putUint16(d, s.fuel_pressure * 10 / 79);  // 0.079 kPa per bit
+}
+
+static void pidCommandedEgr(const CarState& s, uint8_t* d) {
+    d[0] = (s.egr * 255) / 100;
+}
+
+static void pidFuelLevel(const CarState& s, uint8_t* d) {
+    d[0] = (s.fuel_level * 255) / 100;
+}
+
+static void pidDistanceSinceClear(const CarState& s, uint8_t* d) {
+    putUint16(d, s.distance_mil_clear);
+}
+
+static void pidBarometric(const CarState& s, uint8_t* d) {
+    d[0] = s.barometric;
+}
+
+static void pidModuleVoltage(const CarState& s, uint8_t* d) {
+    putUint16(d, s.battery_voltage);  // mV
+}
+
+static void pidRelativeThrottle(const CarState& s, uint8_t* d) {
+    d[0] = (s.throttle * 255) / 100;  // Same as absolute throttle
+}
+
+static void pidAmbientTemp(const CarState& s, uint8_t* d) {
+    d[0] = s.ambient_temp + 40;
+}
+
+static void pidFuelType(const CarState& s, uint8_t* d) {
+    d[0] = 0x01;  // Gasoline
+}
+
+static void pidOilTemp(const CarState& s, uint8_t* d) {
+    d[0] = s.oil_temp + 40;
+}
+
+// ---- Values derived from the simulator state -----------------------------
+// The car is a 5.0 V8 with two banks, an upstream wideband and a downstream
+// narrowband O2 sensor per bank, running E10 in closed loop except at wide
+// open throttle. Nothing below adds RAM: fixed figures are code constants.
+
+static constexpr uint16_t REFERENCE_TORQUE_NM = 569;
+static constexpr uint32_t ODOMETER_BASE_KM = 48000;
+
+// Commanded equivalence ratio (lambda * 32768): rich at wide open throttle
+static uint16_t commandedLambda(const CarState& s) {
+    return s.throttle > 80 ? 27853 : 32768;  // 0.85 / 1.00
+}
+
+// Lambda (* 32768) seen by an O2 sensor (index as in PID 13: bank * 4 +
+// position). Upstream sensors follow the switching narrowband signal, in
+// opposite phase on bank 2; downstream sensors sit at the commanded value.
+static uint16_t sensorLambda(const CarState& s, uint8_t sensor) {
+    if (sensor % 4 != 0) return commandedLambda(s);
+    int16_t ripple = (int16_t)s.o2_voltage - 90;  // About +/- 20 around 0.45 V
+    if (sensor >= 4) ripple = -ripple;
+    return commandedLambda(s) - ripple * 64;
+}
+
+// Narrowband voltage in 0.005 V steps: upstream switches, downstream steady
+static uint8_t sensorVoltage(const CarState& s, uint8_t sensor) {
+    if (sensor % 4 != 0) return 140;  // 0.70 V behind a working catalyst
+    return sensor >= 4 ? 180 - s.o2_voltage : s.o2_voltage;
+}
+
+// Air mass in g/s * 100 (MAF) to fuel in g/s * 1000 at the commanded lambda
+static uint32_t fuelMgPerSec(const CarState& s) {
+    return (uint32_t)s.maf * 100 / 147 * 32768 / commandedLambda(s);
+}
+
+// 6-speed gearbox ratios (* 1000)
+static const uint16_t GEAR_RATIOS[6] = {3660, 2430, 1690, 1320, 1000, 650};
+
+// Gear engaged (0 = neutral / clutch down), from the engine speed per km/h
+// (3.55 final drive, 2.1 m tyres: about 28.2 rpm per km/h per unit of gear
+// ratio)
+static uint8_t transmissionGear(const CarState& s) {
+    if (s.speed == 0 || s.rpm == 0) return 0;
+    uint32_t ratio = (uint32_t)s.rpm * 1000 * 10 / ((uint32_t)s.speed * 282);
+    uint32_t best = 0xFFFFFFFF;
+    uint8_t gear = 0;
+    for (uint8_t i = 0; i < 6; i++) {
+        uint32_t error = ratio > GEAR_RATIOS[i] ? ratio - GEAR_RATIOS[i] : GEAR_RATIOS[i] - ratio;
+        if (error < best) {
+            best = error;
+            gear = i + 1;
+        }
+    }
+    return gear;
+}
+
+// Air the engine draws at a manifold pressure, in g/s * 100: 2.5 L per
+// revolution at 1.184 g/L, less about 20 kPa of residual exhaust gas. The
+// driving simulator (vehicle_model.h) sets MAF from this too.
+static constexpr uint8_t RESIDUAL_KPA = 20;
+
+static uint16_t engineAirflow(uint16_t rpm, uint8_t map, uint8_t baro) {
+    if (map <= RESIDUAL_KPA || baro == 0) return 0;
+    uint32_t airflow = (uint32_t)rpm * 4933 / 1000 * (map - RESIDUAL_KPA) / baro;
+    return airflow > 0xFFFF ? 0xFFFF : airflow;
+}
+
+// Full-load torque curve, Nm at 0, 1000, ... 7000 rpm (the points of PID 64
+// are 4000-7000); the rev limiter cuts fuel at 7000
+static const uint16_t WOT_TORQUE_NM[8] = {300, 400, 480, 520, 545, 569, 530, 455};
+static constexpr uint16_t REV_LIMIT_RPM = 7000;
+
+static uint16_t wotTorqueNm(uint16_t rpm) {
+    if (rpm >= REV_LIMIT_RPM) return WOT_TORQUE_NM[7];
+    uint8_t i = rpm / 1000;
+    uint16_t within = rpm % 1000;
+    return WOT_TORQUE_NM[i] + ((int32_t)WOT_TORQUE_NM[i + 1] - WOT_TORQUE_NM[i]) * within / 1000;
+}
+
+// Indicated torque in Nm: the full-load curve scaled by the air charge
+static uint16_t engineTorqueNm(const CarState& s) {
+    if (s.rpm == 0 || s.map <= RESIDUAL_KPA || s.barometric <= RESIDUAL_KPA) return 0;
+    uint8_t charge = s.map < s.barometric ? s.map - RESIDUAL_KPA : s.barometric - RESIDUAL_KPA;
+    return (uint32_t)wotTorqueNm(s.rpm) * charge / (s.barometric - RESIDUAL_KPA);
+}
+
+// Engine torque in percent of the reference (idle is about 14)
+static uint8_t torquePercent(const CarState& s) {
+    return (uint32_t)engineTorqueNm(s) * 100 / REFERENCE_TORQUE_NM;
+}
+
+static void pidEngineLoad(const CarState& s, uint8_t* d) {
+    // Calculated load: airflow over the full-load airflow at this speed
+    uint16_t peak = engineAirflow(s.rpm, s.barometric, s.barometric);
+    uint32_t load = peak ? (uint32_t)s.maf * 255 / peak : 0;
+    d[0] = load > 255 ? 255 : load;
+}
+
+static void pidShortFuelTrimBank2(const CarState& s, uint8_t* d) {
+    d[0] = encodeTrimPercent(-s.short_fuel_trim);
+}
+
+static void pidLongFuelTrimBank2(const CarState& s, uint8_t* d) {
+    d[0] = encodeTrimPercent(s.long_fuel_trim - 1);
+}
+
+static void pidFuelPressureGauge(const CarState& s, uint8_t* d) {
+    uint16_t value = s.fuel_pressure / 3;  // 3 kPa per bit
+    d[0] = value > 255 ? 255 : value;
+}
+
+// PIDs 14-1B: narrowband voltage and the short term trim it feeds
+// (FF = not used for trim)
+template <uint8_t Sensor>
+static void pidO2Narrowband(const CarState& s, uint8_t* d) {
+    d[0] = sensorVoltage(s, Sensor);
+    d[1] = Sensor % 4 == 0 ? encodeTrimPercent(Sensor >= 4 ? -s.short_fuel_trim : s.short_fuel_trim) : 0xFF;
+}
+
+// PIDs 24-2B: wideband lambda and voltage (8 V / 65536)
+template <uint8_t Sensor>
+static void pidO2WidebandVoltage(const CarState& s, uint8_t* d) {
+    putUint16(d, sensorLambda(s, Sensor));
+    putUint16(&d[2], sensorVoltage(s, Sensor) * 41);
+}
+
+// PIDs 34-3B: wideband lambda and pump current (C + D/256 - 128 mA),
+// about 1 mA per 0.05 away from stoichiometric
+template <uint8_t Sensor>
+static void pidO2WidebandCurrent(const CarState& s, uint8_t* d) {
+    uint16_t lambda = sensorLambda(s, Sensor);
+    putUint16(d, lambda);
+    putUint16(&d[2], 32768 + ((int32_t)lambda - 32768) * 256 / 1638);
+}
+
+// PIDs 3C-3F: catalyst temperature ((AB / 10) - 40 degC); heats with speed
+// and load, downstream brick cooler, bank 2 a little hotter
+template <uint8_t Sensor>
+static void pidCatalystTemp(const CarState& s, uint8_t* d) {
+    uint16_t celsius = s.rpm == 0 ? s.coolant_temp : 350 + s.rpm / 10 + s.throttle * 3;
+    if (Sensor >= 2) celsius -= celsius / 6;
+    if (Sensor & 1) celsius += 10;
+    putUint16(d, (celsius + 40) * 10);
+}
+
+static void pidObdStandard(const CarState& s, uint8_t* d) {
+    d[0] = 0x01;  // OBD-II as defined by CARB
+}
+
+static void pidAuxInputStatus(const CarState& s, uint8_t* d) {
+    d[0] = 0x00;  // Power take-off inactive
+}
+
+static void pidFuelRailRelative(const CarState& s, uint8_t* d) {
+    // Gauge pressure plus manifold vacuum, 0.079 kPa per bit
+    putUint16(d, (s.fuel_pressure + s.barometric - s.map) * 1000UL / 79);
+}
+
+static void pidEgrError(const CarState& s, uint8_t* d) {
+    d[0] = 128;  // 0 %
+}
+
+static void pidEvapPurge(const CarState& s, uint8_t* d) {
+    d[0] = s.coolant_temp > 70 && s.rpm > 0 ? (30 * 255) / 100 : 0;
+}
+
+static void pidWarmupsSinceClear(const CarState& s, uint8_t* d) {
+    d[0] = 12;
+}
+
+static void pidEvapVaporPressure(const CarState& s, uint8_t* d) {
+    putUint16(d, (uint16_t)(-300 * 4));  // -300 Pa, signed 0.25 Pa
+}
+
+static void pidMonitorStatusDriveCycle(const CarState& s, uint8_t* d) {
+    d[0] = 0x00;
+    d[1] = 0x07;  // Misfire, fuel system, components enabled and complete
+    d[2] = 0x65;  // Catalyst, evap, O2, O2 heater enabled
+    d[3] = s.runtime > 600 ? 0x00 : 0x25;  // Complete after 10 minutes
+}
+
+static void pidAbsoluteLoad(const CarState& s, uint8_t* d) {
+    // Air charge relative to a full cylinder, approximated by MAP / baro
+    putUint16(d, s.barometric ? (uint32_t)s.map * 255 / s.barometric : 0);
+}
+
+static void pidCommandedLambda(const CarState& s, uint8_t* d) {
+    putUint16(d, commandedLambda(s));  // 2 / 65536 per bit
+}
+
+static void pidPedalD(const CarState& s, uint8_t* d) {
+    d[0] = (15 + s.throttle * 70 / 100) * 255 / 100;
+}
+
+static void pidPedalE(const CarState& s, uint8_t* d) {
+    d[0] = (15 + s.throttle * 70 / 100) * 255 / 200;  // Second track at half
+}
+
+static void pidTimeWithMil(const CarState& s, uint8_t* d) {
+    putUint16(d, s.mil_on ? s.runtime / 60 : 0);  // Minutes
+}
+
+static void pidTimeSinceClear(const CarState& s, uint8_t* d) {
+    putUint16(d, s.distance_mil_clear * 3 / 2);  // Minutes, about 40 km/h
+}
+
+static void pidMaximumValues(const CarState& s, uint8_t* d) {
+    d[0] = 2;    // Lambda
+    d[1] = 8;    // O2 sensor voltage, V
+    d[2] = 128;  // O2 sensor current, mA
+    d[3] = 26;   // MAP, 10 kPa
+}
+
+static void pidMaximumMaf(const CarState& s, uint8_t* d) {
+    d[0] = 30;  // 300 g/s
+    d[1] = 0;
+    d[2] = 0;
+    d[3] = 0;
+}
+
+static void pidEthanolPercent(const CarState& s, uint8_t* d) {
+    d[0] = (10 * 255) / 100;  // E10
+}
+
+static void pidEvapAbsolutePressure(const CarState& s, uint8_t* d) {
+    putUint16(d, s.barometric * 200);  // 1/200 kPa
+}
+
+static void pidEvapVaporPressureWide(const CarState& s, uint8_t* d) {
+    putUint16(d, (uint16_t)-300);  // Pa, signed
+}
+
+// PIDs 55-58: secondary O2 trims, A = bank 1/2, B = bank 3/4 (not fitted)
+static void pidSecondaryTrim(const CarState& s, uint8_t* d) {
+    d[0] = 128;
+    d[1] = 128;
+}
+
+static void pidFuelRailAbsolute(const CarState& s, uint8_t* d) {
+    putUint16(d, (s.fuel_pressure + s.barometric) / 10);  // 10 kPa per bit
+}
+
+static void pidRelativePedal(const CarState& s, uint8_t* d) {
+    d[0] = (s.throttle * 255) / 100;
+}
+
+static void pidEngineFuelRate(const CarState& s, uint8_t* d) {
+    // L/h * 20; gasoline at 745 g/L
+    putUint16(d, fuelMgPerSec(s) * 3600 / 745 * 20 / 1000);
+}
+
+static void pidDemandTorque(const CarState& s, uint8_t* d) {
+    d[0] = 125 + torquePercent(s) + 2;
+}
+
+static void pidActualTorque(const CarState& s, uint8_t* d) {
+    d[0] = 125 + torquePercent(s);
+}
+
+static void pidReferenceTorque(const CarState& s, uint8_t* d) {
+    putUint16(d, REFERENCE_TORQUE_NM);
+}
+
+static void pidTorqueCurve(const CarState& s, uint8_t* d) {
+    static const uint8_t points[5] = {14, 95, 100, 93, 80};  // Idle, points 1-4 (%)
+    for (uint8_t i = 0; i < 5; i++) d[i] = 125 + points[i];
+}
+
+static void pidMafSensor(const CarState& s, uint8_t* d) {
+    d[0] = 0x01;  // Sensor A only
+    putUint16(&d[1], (uint32_t)s.maf * 32 / 100);  // 1/32 g/s
+    putUint16(&d[3], 0);
+}
+
+static void pidAuxInputs(const CarState& s, uint8_t* d) {
+    d[0] = 0x04;                      // Manual gearbox neutral switch fitted
+    d[1] = s.speed == 0 ? 0x04 : 0x00;  // In neutral while stopped
+}
+
+static void pidCoolantSensors(const CarState& s, uint8_t* d) {
+    d[0] = 0x01;  // Sensor 1 only
+    d[1] = s.coolant_temp + 40;
+    d[2] = 0;
+}
+
+static void pidFrictionTorque(const CarState& s, uint8_t* d) {
+    d[0] = 125 + 10;
+}
+
+static void pidFuelRateGramsPerSec(const CarState& s, uint8_t* d) {
+    // Engine and vehicle fuel rate, 0.02 g/s
+    uint16_t rate = fuelMgPerSec(s) / 20;
+    putUint16(d, rate);
+    putUint16(&d[2], rate);
+}
+
+static void pidExhaustFlow(const CarState& s, uint8_t* d) {
+    // Air plus fuel, 0.2 kg/h
+    uint32_t gramsPerSec1000 = (uint32_t)s.maf * 10 + fuelMgPerSec(s);
+    putUint16(d, gramsPerSec1000 * 36 / 2000);
+}
+
+static void pidCylinderFuelRate(const CarState& s, uint8_t* d) {
+    // mg per intake stroke (8 cylinders, 4 intake strokes per revolution),
+    // 1/32 mg per bit
+    putUint16(d, s.rpm ? fuelMgPerSec(s) * 60 * 32 / ((uint32_t)s.rpm * 4) : 0);
+}
+
+static void pidTransmissionGear(const CarState& s, uint8_t* d) {
+    uint8_t gear = transmissionGear(s);
+    d[0] = 0x02;  // Actual gear supported
+    d[1] = gear << 4;
+    putUint16(&d[2], gear ? GEAR_RATIOS[gear - 1] : 0);
+}
+
+static void pidOdometer(const CarState& s, uint8_t* d) {
+    uint32_t tenths = (ODOMETER_BASE_KM + s.distance_mil_clear) * 10;
+    putUint16(d, tenths >> 16);
+    putUint16(&d[2], tenths & 0xFFFF);
+}
+
+// MUST stay sorted by PID (checked below). Bitmap PIDs (00, 20, ...) are
+// not listed; they are generated.
+static constexpr PidDef MODE01_PIDS[] PROGMEM = {
+    {0x01, 4, pidMonitorStatus},
+    {0x03, 2, pidFuelSystemStatus},
+    {0x04, 1, pidEngineLoad},
+    {0x05, 1, pidCoolantTemp},
+    {0x06, 1, pidShortFuelTrim},
+    {0x07, 1, pidLongFuelTrim},
+    {0x08, 1, pidShortFuelTrimBank2},
+    {0x09, 1, pidLongFuelTrimBank2},
+    {0x0A, 1, pidFuelPressureGauge},
+    {0x0B, 1, pidIntakePressure},
+    {0x0C, 2, pidEngineRpm},
+    {0x0D, 1, pidVehicleSpeed},
+    {0x0E, 1, pidTimingAdvance},
+    {0x0F, 1, pidIntakeTemp},
+    {0x10, 2, pidMafRate},
+    {0x11, 1, pidThrottle},
+    {0x13, 1, pidO2SensorsPresent},
+    {0x14, 2, pidO2Narrowband<0>},
+    {0x15, 2, pidO2Narrowband<1>},
+    {0x18, 2, pidO2Narrowband<4>},
+    {0x19, 2, pidO2Narrowband<5>},
+    {0x1C, 1, pidObdStandard},
+    {0x1E, 1, pidAuxInputStatus},
+    {0x1F, 2, pidRunTime},
+    {0x21, 2, pidDistanceWithMil},
+    {0x22, 2, pidFuelRailRelative},
+    {0x23, 2, pidFuelRailPressure},
+    {0x24, 4, pidO2WidebandVoltage<0>},
+    {0x25, 4, pidO2WidebandVoltage<1>},
+    {0x28, 4, pidO2WidebandVoltage<4>},
+    {0x29, 4, pidO2WidebandVoltage<5>},
+    {0x2C, 1, pidCommandedEgr},
+    {0x2D, 1, pidEgrError},
+    {0x2E, 1, pidEvapPurge},
+    {0x2F, 1, pidFuelLevel},
+    {0x30, 1, pidWarmupsSinceClear},
+    {0x31, 2, pidDistanceSinceClear},
+    {0x32, 2, pidEvapVaporPressure},
+    {0x33, 1, pidBarometric},
+    {0x34, 4, pidO2WidebandCurrent<0>},
+    {0x35, 4, pidO2WidebandCurrent<1>},
+    {0x38, 4, pidO2WidebandCurrent<4>},
+    {0x39, 4, pidO2WidebandCurrent<5>},
+    {0x3C, 2, pidCatalystTemp<0>},
+    {0x3D, 2, pidCatalystTemp<1>},
+    {0x3E, 2, pidCatalystTemp<2>},
+    {0x3F, 2, pidCatalystTemp<3>},
+    {0x41, 4, pidMonitorStatusDriveCycle},
+    {0x42, 2, pidModuleVoltage},
+    {0x43, 2, pidAbsoluteLoad},
+    {0x44, 2, pidCommandedLambda},
+    {0x45, 1, pidRelativeThrottle},
+    {0x46, 1, pidAmbientTemp},
+    {0x47, 1, pidThrottle},
+    {0x49, 1, pidPedalD},
+    {0x4A, 1, pidPedalE},
+    {0x4C, 1, pidThrottle},
+    {0x4D, 2, pidTimeWithMil},
+    {0x4E, 2, pidTimeSinceClear},
+    {0x4F, 4, pidMaximumValues},
+    {0x50, 4, pidMaximumMaf},
+    {0x51, 1, pidFuelType},
+    {0x52, 1, pidEthanolPercent},
+    {0x53, 2, pidEvapAbsolutePressure},
+    {0x54, 2, pidEvapVaporPressureWide},
+    {0x55, 2, pidSecondaryTrim},
+    {0x56, 2, pidSecondaryTrim},
+    {0x57, 2, pidSecondaryTrim},
+    {0x58, 2, pidSecondaryTrim},
+    {0x59, 2, pidFuelRailAbsolute},
+    {0x5A, 1, pidRelativePedal},
+    {0x5C, 1, pidOilTemp},
+    {0x5E, 2, pidEngineFuelRate},
+    {0x61, 1, pidDemandTorque},
+    {0x62, 1, pidActualTorque},
+    {0x63, 2, pidReferenceTorque},
+    {0x64, 5, pidTorqueCurve},
+    {0x65, 2, pidAuxInputs},
+    {0x66, 5, pidMafSensor},
+    {0x67, 3, pidCoolantSensors},
+    {0x8E, 1, pidFrictionTorque},
+    {0x9D, 4, pidFuelRateGramsPerSec},
+    {0x9E, 2, pidExhaustFlow},
+    {0xA2, 2, pidCylinderFuelRate},
+    {0xA4, 4, pidTransmissionGear},
+    {0xA6, 4, pidOdometer},
+};
+
+static constexpr uint8_t MODE01_PID_COUNT = sizeof(MODE01_PIDS) / sizeof(MODE01_PIDS[0]);
+static constexpr uint8_t MODE01_MAX_DATA = 5;   // Longest PID data (fits one pre-CAN message)
+static constexpr uint8_t MODE01_RANGES = 8;     // Bitmap words: 01-20 ... E1-FF
+static constexpr uint8_t PID_NONE = 0xFF;       // Slot of an unregistered PID
+
+// Compile-time helpers (single-expression constexpr for C++11 toolchains)
+constexpr uint8_t pidSlot(uint16_t pid, uint8_t i = 0) {
+    return i >= MODE01_PID_COUNT ? PID_NONE
+         : MODE01_PIDS[i].pid == pid ? i
+         : pidSlot(pid, i + 1);
+}
+
+constexpr bool pidRegistered(uint16_t pid) {
+    return pidSlot(pid) != PID_NONE;
+}
+
+// Bit of a PID in its range's word (PID 01 = bit 31, PID 20 = bit 0)
+constexpr uint32_t pidBit(uint16_t pid) {
+    return 0x80000000UL >> ((pid - 1) % 32);
+}
+
+// Whether an ECU answers a registered PID (no PID list = all of them)
+constexpr bool ecuListsPid(const EcuDef& ecu, uint16_t pid, uint8_t i = 0) {
+    return ecu.pids == nullptr ? true
+         : i < ecu.pidCount && (ecu.pids[i] == pid || ecuListsPid(ecu, pid, i + 1));
+}
+
+constexpr bool ecuHasPid(const EcuDef& ecu, uint16_t pid) {
+    return pidRegistered(pid) && ecuListsPid(ecu, pid);
+}
+
+// Any PID in [lo, hi] the ECU answers. Ranges are split in halves to keep
+// the constexpr recursion depth logarithmic.
+constexpr bool ecuHasPidIn(const EcuDef& ecu, uint16_t lo, uint16_t hi) {
+    return lo > hi ? false
+         : lo == hi ? ecuHasPid(ecu, lo)
+         : ecuHasPidIn(ecu, lo, (lo + hi) / 2) || ecuHasPidIn(ecu, (lo + hi) / 2 + 1, hi);
+}
+
+// Any PID above `after` (sets the next-range bit)
+constexpr bool ecuHasPidAbove(const EcuDef& ecu, uint16_t after) {
+    return ecuHasPidIn(ecu, after + 1, 0xFF);
+}
+
+// Bits of PIDs base+1 .. base+n
+constexpr uint32_t ecuRangeBits(const EcuDef& ecu, uint16_t base, uint8_t n) {
+    return n == 0 ? 0 : (ecuHasPid(ecu, base + n) ? pidBit(base + n) : 0) | ecuRangeBits(ecu, base, n - 1);
+}
+
+// "PIDs supported" word for range r (PIDs r*32+1 .. r*32+32)
+constexpr uint32_t ecuPidBitmap(const EcuDef& ecu, uint8_t range) {
+    return ecuRangeBits(ecu, range * 32, 31) |
+           (ecuHasPidAbove(ecu, range * 32 + 32) ? pidBit(range * 32 + 32) : 0);
+}
+
+#define PID_SLOTS_16(n) \
+    pidSlot(n + 0x0), pidSlot(n + 0x1), pidSlot(n + 0x2), pidSlot(n + 0x3), \
+    pidSlot(n + 0x4), pidSlot(n + 0x5), pidSlot(n + 0x6), pidSlot(n + 0x7), \
+    pidSlot(n + 0x8), pidSlot(n + 0x9), pidSlot(n + 0xA), pidSlot(n + 0xB), \
+    pidSlot(n + 0xC), pidSlot(n + 0xD), pidSlot(n + 0xE), pidSlot(n + 0xF)
+
+static constexpr uint8_t MODE01_SLOT[256] PROGMEM = {
+    PID_SLOTS_16(0x00), PID_SLOTS_16(0x10), PID_SLOTS_16(0x20), PID_SLOTS_16(0x30),
+    PID_SLOTS_16(0x40), PID_SLOTS_16(0x50), PID_SLOTS_16(0x60), PID_SLOTS_16(0x70),
+    PID_SLOTS_16(0x80), PID_SLOTS_16(0x90), PID_SLOTS_16(0xA0), PID_SLOTS_16(0xB0),
+    PID_SLOTS_16(0xC0), PID_SLOTS_16(0xD0), PID_SLOTS_16(0xE0), PID_SLOTS_16(0xF0),
+};
+
+#define ECU_PID_BITMAPS_ROW(e) { \
+    ecuPidBitmap(ECUS[e], 0), ecuPidBitmap(ECUS[e], 1), ecuPidBitmap(ECUS[e], 2), \
+    ecuPidBitmap(ECUS[e], 3), ecuPidBitmap(ECUS[e], 4), ecuPidBitmap(ECUS[e], 5), \
+    ecuPidBitmap(ECUS[e], 6), ecuPidBitmap(ECUS[e], 7)}
+
+// One row per entry in ECUS
+static constexpr uint32_t ECU_PID_BITMAPS[][MODE01_RANGES] PROGMEM = {
+    ECU_PID_BITMAPS_ROW(0),
+    ECU_PID_BITMAPS_ROW(1),
+    ECU_PID_BITMAPS_ROW(2),
+};
+
+#undef PID_SLOTS_16
+#undef ECU_PID_BITMAPS_ROW
+
+// Table checks
+constexpr bool mode01TableValid(uint8_t i = 0) {
+    return i >= MODE01_PID_COUNT ||
+           ((MODE01_PIDS[i].pid & 0x1F) != 0 &&
+            MODE01_PIDS[i].length > 0 && MODE01_PIDS[i].length <= MODE01_MAX_DATA &&
+            MODE01_PIDS[i].encode != nullptr &&
+            (i == 0 || MODE01_PIDS[i - 1].pid < MODE01_PIDS[i].pid) &&
+            mode01TableValid(i + 1));
+}
+
+constexpr bool ecuPidsRegistered(const EcuDef& ecu, uint8_t i = 0) {
+    return ecu.pids == nullptr || i >= ecu.pidCount ||
+           (pidRegistered(ecu.pids[i]) && ecuPidsRegistered(ecu, i + 1));
+}
+
+// Expected words rebuilt independently of ecuPidBitmap: walk the PIDs an
+// ECU answers (its list, or MODE01_PIDS) and OR in each one's bit, plus
+// the next-range bit of every range below it
+constexpr uint32_t answeredPidBits(uint16_t pid, uint8_t range) {
+    return (pid - 1) / 32 == range ? pidBit(pid)
+         : pid > range * 32 + 32 ? pidBit(range * 32 + 32)
+         : 0;
+}
+
+constexpr uint32_t tablePidWord(uint8_t range, uint8_t i = 0) {
+    return i >= MODE01_PID_COUNT ? 0
+         : answeredPidBits(MODE01_PIDS[i].pid, range) | tablePidWord(range, i + 1);
+}
+
+constexpr uint32_t listedPidWord(const EcuDef& ecu, uint8_t range, uint8_t i = 0) {
+    return i >= ecu.pidCount ? 0
+         : answeredPidBits(ecu.pids[i], range) | listedPidWord(ecu, range, i + 1);
+}
+
+constexpr bool bitmapWordsCorrect(uint8_t e, uint8_t range = 0) {
+    return range >= MODE01_RANGES ||
+           (ECU_PID_BITMAPS[e][range] ==
+                (ECUS[e].pids == nullptr ? tablePidWord(range) : listedPidWord(ECUS[e], range)) &&
+            bitmapWordsCorrect(e, range + 1));
+}
+
+constexpr bool bitmapsMatchTable(uint8_t e = 0) {
+    return e >= ECU_COUNT ||
+           (ecuPidsRegistered(ECUS[e]) && bitmapWordsCorrect(e) && bitmapsMatchTable(e + 1));
+}
+
+static_assert(mode01TableValid(), "MODE01_PIDS must be sorted, without bitmap PIDs, 1-5 data bytes");
+static_assert(sizeof(ECU_PID_BITMAPS) / sizeof(ECU_PID_BITMAPS[0]) == ECU_COUNT,
+              "ECU_PID_BITMAPS needs one row per ECU");
+static_assert(bitmapsMatchTable(), "PID bitmaps disagree with MODE01_PIDS / ECU PID lists");
+// Known words, so a change to the PID table shows up here: PCM 0100, TCM
+// 0100 (RPM, speed), ABS 0100/0120/0140 (speed, then 0142)
+static_assert(ECU_PID_BITMAPS[0][0] == 0xBFFFB997UL, "PCM PIDs 01-20 changed");
+static_assert(ECU_PID_BITMAPS[1][0] == 0x00180000UL, "TCM PIDs 01-20 changed");
+static_assert(ECU_PID_BITMAPS[2][0] == 0x00080001UL && ECU_PID_BITMAPS[2][1] == 0x00000001UL &&
+              ECU_PID_BITMAPS[2][2] == 0x40000000UL, "ABS PIDs changed");
+
+// Descriptor of a registered PID, nullptr if not registered
+static inline const PidDef* findMode01Pid(uint8_t pid) {
+    uint8_t slot = pgm_read_byte(&MODE01_SLOT[pid]);
+    return slot == PID_NONE ? nullptr : &MODE01_PIDS[slot];
+}
+
+#endif // PID_REGISTRY_H
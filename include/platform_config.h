@@ -20,6 +20,16 @@
     #define MAX_CONNECTIONS 2
     #define WEB_BUFFER_SIZE 256
     #define MAX_WS_CLIENTS 2
+    #define FREEZE_FRAME_SLOTS 32    // Mode 02 snapshots (~30 bytes each)
+    #define DID_TABLE_BITS 9         // Service 22 table: 512 slots (3 KB), 384 DIDs
+    #define DYNAMIC_DIDS 4           // Service 2C definitions (~200 bytes each)
+    #define DTC_TABLE_BITS 7         // DTC store: 128 slots (768 bytes), 96 codes
+    #define RESPONSE_CACHE_SLOTS 32  // Mode 01 reply cache (~68 bytes each)
+    #define ECU_IMAGE_DEFAULT_SIZE 0x10000UL  // Pattern image without a file (no RAM)
+    #define SIM_TASK false           // Simulator steps when the state is read (single core)
+    #define TRACE_INDEX_ENTRIES 32   // Trace replay seek points (8 bytes each)
+    #define TRACE_CHUNK_BYTES 64     // Trace file read block
+    #define SCENARIO_MAX_BYTES 512   // Compiled script (2-8 bytes a statement)
 
     // Memory optimization
     #define COMPACT_WEB_INTERFACE true
@@ -55,6 +65,27 @@
     #define MAX_CONNECTIONS 4
     #define WEB_BUFFER_SIZE 512
     #define MAX_WS_CLIENTS 4
+    #define FREEZE_FRAME_SLOTS 256   // Mode 02 snapshots (~30 bytes each)
+    #if HAS_PSRAM
+        #define DID_TABLE_BITS 13    // Service 22 table in PSRAM: 8192 slots (48 KB), 6144 DIDs
+    #else
+        #define DID_TABLE_BITS 10    // Service 22 table: 1024 slots (6 KB), 768 DIDs
+    #endif
+    #define DYNAMIC_DIDS 32          // Service 2C definitions (~200 bytes each)
+    #define DTC_TABLE_BITS 10        // DTC store: 1024 slots (6 KB), 768 codes
+    #define RESPONSE_CACHE_SLOTS 256 // Mode 01 reply cache (~68 bytes each)
+    #define ECU_IMAGE_DEFAULT_SIZE 0x100000UL // Pattern image without a file (no RAM)
+    #define TRACE_INDEX_ENTRIES 512  // Trace replay seek points (8 bytes each)
+    #define TRACE_CHUNK_BYTES 512    // Trace file read block
+    #define SCENARIO_MAX_BYTES 4096  // Compiled script (2-8 bytes a statement)
+
+    // Driving simulator on its own FreeRTOS task (state_snapshot.h): above
+    // the Arduino loop task (priority 1) on its core, so transport load
+    // doesn't slow the SIM_TICK_MS steps
+    #define SIM_TASK true
+    #define SIM_TASK_CORE 1
+    #define SIM_TASK_PRIORITY 2
+    #define SIM_TASK_STACK 4096
 
     // Full features
     #define COMPACT_WEB_INTERFACE false
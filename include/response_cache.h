@@ -0,0 +1,224 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <Arduino.h>
+#include <stddef.h>
+#include "config.h"
+#include "obd_protocols.h"
+#include "pid_registry.h"
+
+/**
+ * Reply cache for repeated Mode 01 polling
+ *
+ * Apps poll the same few PIDs over and over, mostly while nothing has
+ * changed. Each ECU's single-frame reply to a Mode 01 request is kept with
+ * the text it was printed as, per output format (ATCAF/ATH/ATS and the
+ * protocol), in a direct-mapped table of RESPONSE_CACHE_SLOTS
+ * (platform_config.h). A repeat of the request is answered from there, with
+ * no encoding or hex formatting; the bus timing is simulated as before.
+ *
+ * Every CarState field has a version: the change counter's value when the
+ * field last changed. track() compares the state with a shadow copy once
+ * per request, so only real changes count, whoever made them (setters, the
+ * simulator, DTCs). Which fields a PID reads is found at startup by
+ * changing each field, from a set of probe states, and watching the PID's
+ * encoder. A cached reply is valid while none of its PIDs' fields is newer
+ * than the reply.
+ */
+
+// A CarState member tracked for changes
+struct StateField {
+    uint8_t offset;
+    uint8_t size;
+};
+
+#define STATE_FIELD(member) {offsetof(CarState, member), sizeof(CarState::member)}
+
+// Every CarState member (keep in step with the struct)
+static constexpr StateField STATE_FIELDS[] PROGMEM = {
+    STATE_FIELD(rpm), STATE_FIELD(speed), STATE_FIELD(coolant_temp), STATE_FIELD(intake_temp),
+    STATE_FIELD(throttle), STATE_FIELD(maf), STATE_FIELD(runtime), STATE_FIELD(mil_distance),
+    STATE_FIELD(fuel_level), STATE_FIELD(barometric), STATE_FIELD(short_fuel_trim),
+    STATE_FIELD(long_fuel_trim), STATE_FIELD(map), STATE_FIELD(timing_advance),
+    STATE_FIELD(o2_voltage), STATE_FIELD(fuel_pressure), STATE_FIELD(egr),
+    STATE_FIELD(distance_mil_clear), STATE_FIELD(battery_voltage), STATE_FIELD(ambient_temp),
+    STATE_FIELD(oil_temp), STATE_FIELD(mil_on), STATE_FIELD(dtc_count),
+};
+
+#undef STATE_FIELD
+
+static constexpr uint8_t STATE_FIELD_COUNT = sizeof(STATE_FIELDS) / sizeof(STATE_FIELDS[0]);
+
+constexpr uint8_t stateFieldBytes(uint8_t i = 0) {
+    return i >= STATE_FIELD_COUNT ? 0 : STATE_FIELDS[i].size + stateFieldBytes(i + 1);
+}
+
+static_assert(STATE_FIELD_COUNT <= 32, "PID field masks are 32 bits");
+static_assert(stateFieldBytes() <= sizeof(CarState) && sizeof(CarState) - stateFieldBytes() < 4,
+              "STATE_FIELDS must list every CarState member");
+static constexpr uint8_t RESPONSE_CACHE_PROBES = 16;  // States findPidFields() starts from
+
+static_assert((RESPONSE_CACHE_SLOTS & (RESPONSE_CACHE_SLOTS - 1)) == 0,
+              "RESPONSE_CACHE_SLOTS must be a power of two");
+
+struct ResponseCacheEntry {
+    uint32_t stamp;         // Change counter when the reply was built
+    uint8_t ecu;            // Index into ECUS
+    uint8_t format;         // ResponseCache::format(), 0 = unused
+    uint8_t requestLength;
+    uint8_t request[7];
+    uint8_t payloadLength;  // 0: the ECU stays silent
+    uint8_t payload[7];
+    FrameText line;         // Printed reply, empty until it has been sent
+};
+
+class ResponseCache {
+private:
+    ResponseCacheEntry entries[RESPONSE_CACHE_SLOTS];
+    CarState shadow;                        // State as of the last track()
+    uint32_t changes;                       // Change counter
+    uint32_t fieldVersions[STATE_FIELD_COUNT];
+    uint32_t pidFields[MODE01_PID_COUNT];   // Fields each PID's encoder reads
+    uint32_t hits;
+    uint32_t misses;
+
+    static uint16_t slotOf(uint8_t ecu, uint8_t format, const uint8_t* request, uint8_t length) {
+        uint32_t hash = 2166136261UL;  // FNV-1a
+        hash = (hash ^ ecu) * 16777619UL;
+        hash = (hash ^ format) * 16777619UL;
+        for (uint8_t i = 0; i < length; i++) hash = (hash ^ request[i]) * 16777619UL;
+        return hash & (RESPONSE_CACHE_SLOTS - 1);
+    }
+
+    // A state to probe the encoders from: the defaults, every field at its
+    // maximum, all zero, then pseudo-random (xorshift)
+    static void probeState(uint8_t n, CarState& state) {
+        if (n == 0) {
+            state = DEFAULT_CAR_STATE;
+            return;
+        }
+        uint32_t x = 0x9E3779B9UL * n;
+        uint8_t* bytes = (uint8_t*)&state;
+        for (uint8_t i = 0; i < sizeof(CarState); i++) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            bytes[i] = n == 1 ? 0xFF : n == 2 ? 0 : (uint8_t)x;
+        }
+        // Signed fields at their maximum too; bools only 0 or 1
+        if (n == 1) state.short_fuel_trim = state.long_fuel_trim = state.timing_advance = 127;
+        state.mil_on = n == 1 || (n > 2 && (x & 1));
+    }
+
+    // Which fields each registered PID reads: starting from each probe
+    // state, give a field the value it has in the next one and see whether
+    // the PID's data changes. The max/zero pair catches conditions that
+    // combine fields ("warm and running"), the random states the rest.
+    void findPidFields() {
+        memset(pidFields, 0, sizeof(pidFields));
+        for (uint8_t n = 0; n < RESPONSE_CACHE_PROBES; n++) {
+            CarState base, donor;
+            probeState(n, base);
+            probeState((n + 1) % RESPONSE_CACHE_PROBES, donor);
+            for (uint8_t p = 0; p < MODE01_PID_COUNT; p++) {
+                PidEncoder encode = (PidEncoder)pgm_read_ptr(&MODE01_PIDS[p].encode);
+                uint8_t length = pgm_read_byte(&MODE01_PIDS[p].length);
+                uint8_t before[MODE01_MAX_DATA], after[MODE01_MAX_DATA];
+                encode(base, before);
+                for (uint8_t f = 0; f < STATE_FIELD_COUNT; f++) {
+                    if (pidFields[p] & (1UL << f)) continue;
+                    uint8_t offset = pgm_read_byte(&STATE_FIELDS[f].offset);
+                    uint8_t size = pgm_read_byte(&STATE_FIELDS[f].size);
+                    CarState changed = base;
+                    memcpy((uint8_t*)&changed + offset, (const uint8_t*)&donor + offset, size);
+                    encode(changed, after);
+                    if (memcmp(before, after, length) != 0) pidFields[p] |= 1UL << f;
+                }
+            }
+        }
+    }
+
+    // Newest version among the fields a Mode 01 request's PIDs read
+    uint32_t newestField(const uint8_t* request, uint8_t length) const {
+        uint32_t fields = 0;
+        for (uint8_t i = 1; i < length; i++) {
+            uint8_t slot = pgm_read_byte(&MODE01_SLOT[request[i]]);
+            if (slot != PID_NONE) fields |= pidFields[slot];
+        }
+        uint32_t newest = 0;
+        for (uint8_t f = 0; fields != 0; f++, fields >>= 1) {
+            if ((fields & 1) && fieldVersions[f] > newest) newest = fieldVersions[f];
+        }
+        return newest;
+    }
+
+public:
+    ResponseCache() : changes(0), hits(0), misses(0) {
+        shadow = DEFAULT_CAR_STATE;
+        memset(fieldVersions, 0, sizeof(fieldVersions));
+        findPidFields();
+        clear();
+    }
+
+    void clear() {
+        for (uint16_t i = 0; i < RESPONSE_CACHE_SLOTS; i++) entries[i].format = 0;
+    }
+
+    // Output format a printed reply depends on; never 0, as the protocol
+    // (1-C) isn't
+    static uint8_t format(bool caf, bool headers, bool spaces, uint8_t protocol) {
+        return (caf ? 0x80 : 0) | (headers ? 0x40 : 0) | (spaces ? 0x20 : 0) | (protocol & 0x0F);
+    }
+
+    // Whether replies to this request are kept (Mode 01 in one frame)
+    static bool cacheable(const uint8_t* request, uint8_t length) {
+        return length >= 2 && length <= 7 && request[0] == 0x01;
+    }
+
+    // Bump the version of every field that changed since the last call
+    void track(const CarState& state) {
+        if (memcmp(&state, &shadow, sizeof(CarState)) == 0) return;
+        const uint8_t* now = (const uint8_t*)&state;
+        const uint8_t* before = (const uint8_t*)&shadow;
+        for (uint8_t f = 0; f < STATE_FIELD_COUNT; f++) {
+            uint8_t offset = pgm_read_byte(&STATE_FIELDS[f].offset);
+            uint8_t size = pgm_read_byte(&STATE_FIELDS[f].size);
+            if (memcmp(now + offset, before + offset, size) != 0) fieldVersions[f] = ++changes;
+        }
+        shadow = state;
+    }
+
+    // Cached reply of an ECU to a request, if still valid; nullptr counts
+    // a miss
+    const ResponseCacheEntry* find(uint8_t ecu, uint8_t format, const uint8_t* request, uint8_t length) {
+        const ResponseCacheEntry& entry = entries[slotOf(ecu, format, request, length)];
+        if (entry.format == format && entry.ecu == ecu && entry.requestLength == length &&
+            memcmp(entry.request, request, length) == 0 && newestField(request, length) <= entry.stamp) {
+            hits++;
+            return &entry;
+        }
+        misses++;
+        return nullptr;
+    }
+
+    // Keep an ECU's reply (built from the current state) and, once it has
+    // been sent, its text
+    void store(uint8_t ecu, uint8_t format, const uint8_t* request, uint8_t length,
+               const uint8_t* payload, uint8_t payloadLength, const FrameText& line) {
+        if (payloadLength > sizeof(ResponseCacheEntry::payload)) return;
+        ResponseCacheEntry& entry = entries[slotOf(ecu, format, request, length)];
+        entry.stamp = changes;
+        entry.ecu = ecu;
+        entry.format = format;
+        entry.requestLength = length;
+        memcpy(entry.request, request, length);
+        entry.payloadLength = payloadLength;
+        memcpy(entry.payload, payload, payloadLength);
+        entry.line = line;
+    }
+
+    uint32_t getHits() const { return hits; }
+    uint32_t getMisses() const { return misses; }
+};
+
+#endif // RESPONSE_CACHE_H
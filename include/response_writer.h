@@ -0,0 +1,129 @@
+#ifndef RESPONSE_WRITER_H
+#define RESPONSE_WRITER_H
+
+#include <Arduino.h>
+
+static const char HEX_DIGITS[] = "0123456789ABCDEF";
+
+/**
+ * Fixed-buffer response builder
+ *
+ * Appends response text into a caller-supplied char buffer without touching
+ * the heap. The buffer is always kept null-terminated.
+ *
+ * Without a sink, anything that does not fit is dropped and reported through
+ * overflow(). With a sink (the client connection), text is streamed out on
+ * flush()/pace() and a full buffer is flushed and reused, so responses of any
+ * length fit; the buffer then holds the most recent part of the response.
+ *
+ * ATL1 is applied here: with linefeeds on, every '\r' is followed by '\n',
+ * so callers only ever write '\r'.
+ */
+class ResponseWriter {
+private:
+    char* buf;
+    size_t capacity;
+    size_t len;
+    size_t sent;     // Bytes already written to the sink
+    Print* sink;
+    bool overflowed;
+    bool linefeeds;  // ATL1: '\r' becomes "\r\n"
+
+    // Make room for n more characters; false if they don't fit (no sink)
+    bool reserve(size_t n) {
+        if (len + n < capacity) return true;
+        if (!sink || n >= capacity) {
+            overflowed = true;
+            return false;
+        }
+        flush();
+        len = 0;
+        sent = 0;
+        return true;
+    }
+
+    void append(char c) {
+        if (!reserve(1)) return;
+        buf[len++] = c;
+        buf[len] = '\0';
+    }
+
+public:
+    ResponseWriter(char* buffer, size_t size, Print* out = nullptr)
+        : buf(buffer), capacity(size), len(0), sent(0), sink(out), overflowed(false),
+          linefeeds(false) {
+        if (capacity > 0) buf[0] = '\0';
+    }
+
+    void setLinefeeds(bool enabled) { linefeeds = enabled; }
+
+    void clear() {
+        len = 0;
+        sent = 0;
+        overflowed = false;
+        if (capacity > 0) buf[0] = '\0';
+    }
+
+    void put(char c) {
+        append(c);
+        if (c == '\r' && linefeeds) append('\n');
+    }
+
+    void print(const char* str) {
+        while (*str) put(*str++);
+    }
+
+    void print(const char* str, size_t count) {
+        for (size_t i = 0; i < count; i++) put(str[i]);
+    }
+
+    // Upper-case hex, fixed number of digits (1-8)
+    void printHex(uint32_t value, uint8_t digits) {
+        if (!reserve(digits)) return;
+        while (digits > 0) {
+            digits--;
+            buf[len++] = HEX_DIGITS[(value >> (digits * 4)) & 0x0F];
+        }
+        buf[len] = '\0';
+    }
+
+    // A run of data bytes as "41 0C 1A F8" (ATS1) or "410C1AF8" (ATS0)
+    void printHexBytes(const uint8_t* data, size_t count, bool spaces) {
+        for (size_t i = 0; i < count; i++) {
+            size_t width = (spaces && i > 0) ? 3 : 2;
+            if (!reserve(width)) return;
+            if (width == 3) buf[len++] = ' ';
+            buf[len++] = HEX_DIGITS[data[i] >> 4];
+            buf[len++] = HEX_DIGITS[data[i] & 0x0F];
+        }
+        buf[len] = '\0';
+    }
+
+    // Send everything not yet written to the sink
+    void flush() {
+        if (sink && len > sent) {
+            sink->write((const uint8_t*)buf + sent, len - sent);
+            sent = len;
+        }
+    }
+
+    // Emulate bus timing: push out what has been produced so far, then wait.
+    // Only applies when streaming to a sink; buffered callers get no delay.
+    void pace(uint32_t us) {
+        if (!sink) return;
+        flush();
+        if (us >= 1000) {
+            delay(us / 1000);  // Yields to WiFi stack on ESP8266
+            us %= 1000;
+        }
+        if (us > 0) delayMicroseconds(us);
+    }
+
+    bool isStreaming() const { return sink != nullptr; }
+
+    const char* c_str() const { return buf; }
+    size_t length() const { return len; }
+    bool overflow() const { return overflowed; }
+};
+
+#endif // RESPONSE_WRITER_H
@@ -0,0 +1,727 @@
+#ifndef SCENARIO_H
+#define SCENARIO_H
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include "config.h"
+#include "trace_replay.h"
+
+/**
+ * Scripted test drives (DRIVE_SCENARIO)
+ *
+ * A scenario is a text script, one statement per line, compiled when it is
+ * loaded into bytecode of a few bytes a statement (SCENARIO_MAX_BYTES, no
+ * heap). Fields are the trace columns (TRACE_COLUMNS) in the same units.
+ *
+ *   set <field> <value>         Keyframe: the field takes the value now
+ *   ramp <field> <value> <ms>   Move there linearly; the script goes on meanwhile
+ *   release <field>             Hand the field back (drive profile, web sliders)
+ *   hold <ms>                   Let time pass (ms, or seconds with an s: 2500, 3s)
+ *   wait <field> <op> <value>   Until the condition holds: < <= > >= == !=
+ *   repeat <n> ... end          n times, 0 for ever (SCENARIO_MAX_DEPTH deep)
+ *   drive <profile>             Driver underneath: gentle, normal, sport, drag, off
+ *   dtc <code> [pending]        Failed monitor (P0420...), confirmed unless pending
+ *   clear [<code>]              Clear one DTC, or all of them
+ *   mil on|off
+ *   cycle                       End the drive cycle
+ *
+ * Text after # is a comment. A field the script has set or ramped stays
+ * the script's until released; the others follow the drive profile, if
+ * there is one, or keep their values.
+ *
+ * The script runs on a clock of its own, SIM_TICK_MS a tick, so it plays
+ * out the same every time. A hold ends at its exact ms and what follows
+ * starts there (ramps are computed from that ms, holds don't drift); waits
+ * look at the state once a tick. A tick runs at most
+ * SCENARIO_STEPS_PER_TICK statements, so a loop without a hold can't stall
+ * the simulator; it goes on next tick. After the last statement the car
+ * carries on as it is.
+ */
+
+// Bytecode: the opcode, then its operands, little-endian
+enum ScenarioOp : uint8_t {
+    SCENARIO_END = 0,
+    SCENARIO_SET,        // Field, value16
+    SCENARIO_RAMP,       // Field, value16, ms32
+    SCENARIO_RELEASE,    // Field
+    SCENARIO_HOLD,       // ms32
+    SCENARIO_WAIT,       // Field, comparison, value16
+    SCENARIO_REPEAT,     // Count16
+    SCENARIO_NEXT,       // Offset16 of the loop's first statement
+    SCENARIO_DRIVE,      // DriveMode
+    SCENARIO_DTC,        // Code16, confirmed
+    SCENARIO_CLEAR,      // Code16, 0 = all
+    SCENARIO_MIL,        // On
+    SCENARIO_CYCLE
+};
+
+// Statement length per opcode
+static constexpr uint8_t SCENARIO_OP_SIZE[] PROGMEM = {1, 4, 8, 2, 5, 5, 3, 3, 2, 4, 3, 2, 1};
+
+enum ScenarioCompare : uint8_t {
+    SCENARIO_LT = 0,
+    SCENARIO_LE,
+    SCENARIO_GT,
+    SCENARIO_GE,
+    SCENARIO_EQ,
+    SCENARIO_NE
+};
+
+static constexpr char SCENARIO_COMPARE_NAMES[][3] PROGMEM = {"<", "<=", ">", ">=", "==", "!="};
+
+struct ScenarioKeyword {
+    char name[8];
+    ScenarioOp op;
+};
+
+// "end" closes a repeat (SCENARIO_NEXT)
+static constexpr ScenarioKeyword SCENARIO_KEYWORDS[] PROGMEM = {
+    {"set", SCENARIO_SET},
+    {"ramp", SCENARIO_RAMP},
+    {"release", SCENARIO_RELEASE},
+    {"hold", SCENARIO_HOLD},
+    {"wait", SCENARIO_WAIT},
+    {"repeat", SCENARIO_REPEAT},
+    {"end", SCENARIO_NEXT},
+    {"drive", SCENARIO_DRIVE},
+    {"dtc", SCENARIO_DTC},
+    {"clear", SCENARIO_CLEAR},
+    {"mil", SCENARIO_MIL},
+    {"cycle", SCENARIO_CYCLE},
+};
+
+// Driver profiles by DriveMode number
+static constexpr char SCENARIO_PROFILE_NAMES[][8] PROGMEM = {"off", "gentle", "normal", "sport", "drag"};
+
+// Built-in scripts (the presets of the web interface)
+static const char SCENARIO_IDLE[] PROGMEM =
+    "set rpm 850\nset speed 0\nset throttle 0\nset coolant 90\n";
+static const char SCENARIO_CRUISING[] PROGMEM =
+    "set rpm 2500\nset speed 100\nset throttle 20\nset coolant 90\n";
+static const char SCENARIO_HIGHWAY[] PROGMEM =
+    "set rpm 3000\nset speed 120\nset throttle 30\nset coolant 90\n";
+static const char SCENARIO_ACCELERATION[] PROGMEM =
+    "set speed 0\nset rpm 850\n"
+    "repeat 0\n"
+    "ramp throttle 80 1000\nramp rpm 6000 8000\nramp speed 140 8000\nhold 8s\n"
+    "ramp throttle 0 500\nramp rpm 850 4000\nramp speed 0 4000\nhold 5s\n"
+    "end\n";
+static const char SCENARIO_COLD_START[] PROGMEM =
+    "set coolant 0\nset intake 40\nset rpm 1200\nset speed 0\n"
+    "ramp rpm 850 60s\nramp coolant 90 300s\nramp intake 25 300s\n";
+static const char SCENARIO_HOT_IDLE[] PROGMEM =
+    "set rpm 850\nset speed 0\nset throttle 0\nset coolant 105\n";
+static const char SCENARIO_FAULT[] PROGMEM =
+    "clear\ndrive normal\nwait speed > 60\ndtc P0420 pending\nwait speed == 0\n"
+    "cycle\ndrive normal\nwait speed > 60\ndtc P0420\n";
+static const char SCENARIO_MULTIPLE_FAULTS[] PROGMEM =
+    "clear\ndtc P0171\ndtc P0174\ndtc P0300\nset speed 0\n"
+    "repeat 0\nramp rpm 700 300\nhold 300\nramp rpm 950 300\nhold 300\nend\n";
+
+struct ScenarioPreset {
+    char name[16];
+    const char* script;
+};
+
+static const ScenarioPreset SCENARIO_PRESETS[] PROGMEM = {
+    {"Idle", SCENARIO_IDLE},
+    {"Cruising", SCENARIO_CRUISING},
+    {"Highway", SCENARIO_HIGHWAY},
+    {"Acceleration", SCENARIO_ACCELERATION},
+    {"Cold Start", SCENARIO_COLD_START},
+    {"Hot Idle", SCENARIO_HOT_IDLE},
+    {"Fault P0420", SCENARIO_FAULT},
+    {"Multiple Faults", SCENARIO_MULTIPLE_FAULTS},
+};
+
+static constexpr uint8_t SCENARIO_PRESET_COUNT = sizeof(SCENARIO_PRESETS) / sizeof(SCENARIO_PRESETS[0]);
+static constexpr uint8_t SCENARIO_KEYWORD_COUNT = sizeof(SCENARIO_KEYWORDS) / sizeof(SCENARIO_KEYWORDS[0]);
+
+static_assert(sizeof(SCENARIO_OP_SIZE) == SCENARIO_CYCLE + 1, "SCENARIO_OP_SIZE must cover every opcode");
+static_assert(sizeof(SCENARIO_PROFILE_NAMES) / sizeof(SCENARIO_PROFILE_NAMES[0]) == DRIVE_DRAG + 1,
+              "SCENARIO_PROFILE_NAMES must name every driver profile");
+static_assert(TRACE_COLUMN_COUNT <= 32, "Scripted fields must fit a 32-bit mask");
+static_assert(SCENARIO_MAX_BYTES <= 0xFFFF, "Loop offsets are 16-bit");
+
+// What the script asks of the rest of the emulator (DTCs, MIL, driver)
+struct ScenarioEvent {
+    ScenarioOp op;
+    uint16_t code;   // DTC
+    uint8_t arg;     // Confirmed, MIL on, or DriveMode
+};
+
+class Scenario {
+private:
+    uint8_t code[SCENARIO_MAX_BYTES];
+    uint16_t length;
+    bool loaded;
+
+    // Compiler: the line being assembled and the loops still open
+    uint16_t compiled;                       // Bytes of the script so far
+    bool checking;                           // Only looking for errors (check())
+    char line[SCENARIO_LINE_MAX];
+    uint8_t lineLength;
+    bool lineTooLong;
+    uint16_t lineNumber;
+    uint16_t openLoops[SCENARIO_MAX_DEPTH];  // Offset of each loop's first statement
+    uint8_t openCount;
+    char error[48];                          // Empty while compiling went well
+
+    // A scripted field: where a ramp (or a set, taking no time) goes from
+    // and to
+    struct Keyframe {
+        int32_t from;
+        int32_t to;
+        uint32_t startMs;
+        uint32_t durationMs;
+    };
+
+    Keyframe fields[TRACE_COLUMN_COUNT];
+    uint32_t scripted;                       // Bit per TRACE_COLUMNS field
+
+    // Interpreter
+    uint16_t pc;
+    uint32_t nowMs;                          // Scenario clock
+    uint32_t atMs;                           // Time of the statement being run
+    uint32_t holdUntil;
+    bool holding;
+    uint8_t budget;                          // Statements left this tick
+    uint16_t loopsLeft[SCENARIO_MAX_DEPTH];  // 0 = for ever
+    uint8_t depth;
+
+    static uint16_t word(const uint8_t* p) { return p[0] | (p[1] << 8); }
+    static uint32_t dword(const uint8_t* p) {
+        return p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+    static void putDword(uint8_t* p, uint32_t value) {
+        for (uint8_t i = 0; i < 4; i++) p[i] = value >> (8 * i);
+    }
+
+    // A field value as stored in the bytecode (two's complement for signed
+    // fields)
+    static int32_t fieldValue(uint8_t column, const uint8_t* p) {
+        uint16_t raw = word(p);
+        return pgm_read_byte(&TRACE_COLUMNS[column].isSigned) ? (int32_t)(int16_t)raw : (int32_t)raw;
+    }
+
+    int32_t valueAt(uint8_t column, uint32_t ms) const {
+        const Keyframe& key = fields[column];
+        uint32_t into = ms - key.startMs;
+        if ((int32_t)into <= 0) return key.from;
+        if (into >= key.durationMs) return key.to;
+        return key.from + (int64_t)(key.to - key.from) * into / key.durationMs;
+    }
+
+    // ---- Compiler ----
+
+    void fail(const char* what, const char* token = nullptr) {
+        if (error[0] != '\0') return;
+        if (token != nullptr) {
+            snprintf(error, sizeof(error), "line %u: %s %s", lineNumber, what, token);
+        } else {
+            snprintf(error, sizeof(error), "line %u: %s", lineNumber, what);
+        }
+    }
+
+    // Append a statement, keeping room for the final SCENARIO_END
+    void emit(const uint8_t* bytes, uint8_t size) {
+        if (compiled + size >= SCENARIO_MAX_BYTES) {
+            fail("script too long");
+            return;
+        }
+        if (!checking) memcpy(&code[compiled], bytes, size);
+        compiled += size;
+    }
+
+    static bool parseNumber(const char* text, int32_t& value) {
+        if (text == nullptr) return false;
+        char* end;
+        value = strtol(text, &end, 10);
+        return end != text && *end == '\0';
+    }
+
+    // A time in ms, or in seconds with an s
+    bool parseDuration(const char* text, uint32_t& ms) {
+        if (text == nullptr) {
+            fail("missing time");
+            return false;
+        }
+        char* end;
+        ms = strtoul(text, &end, 10);
+        if (end != text && *end == 's' && end[1] == '\0' && ms <= 0xFFFFFFFFUL / 1000) {
+            ms *= 1000;
+            return true;
+        }
+        if (end == text || *end != '\0' || *text == '-') {
+            fail("bad time", text);
+            return false;
+        }
+        return true;
+    }
+
+    bool parseField(const char* text, uint8_t& column) {
+        if (text == nullptr) {
+            fail("missing field");
+            return false;
+        }
+        for (uint8_t i = 0; i < TRACE_COLUMN_COUNT; i++) {
+            if (strcmp_P(text, TRACE_COLUMNS[i].name) == 0) {
+                column = i;
+                return true;
+            }
+        }
+        fail("unknown field", text);
+        return false;
+    }
+
+    // A value in the field's range, as 16 bits
+    bool parseValue(uint8_t column, const char* text, uint16_t& raw) {
+        int32_t value;
+        if (!parseNumber(text, value)) {
+            fail("bad value", text);
+            return false;
+        }
+        int32_t low = 0, high = 0xFF;
+        if (pgm_read_byte(&TRACE_COLUMNS[column].size) == 2) {
+            high = 0xFFFF;
+        } else if (pgm_read_byte(&TRACE_COLUMNS[column].isSigned)) {
+            low = -128;
+            high = 127;
+        }
+        if (value < low || value > high) {
+            fail("value out of range", text);
+            return false;
+        }
+        raw = (uint16_t)value;
+        return true;
+    }
+
+    // SAE J2012 code (P0420, C1234...) as Mode 03 reports it
+    bool parseDtc(const char* text, uint16_t& dtc) {
+        static const char systems[] = "PCBU";
+        const char* system = text != nullptr ? strchr(systems, toupper(text[0])) : nullptr;
+        if (system == nullptr || text[0] == '\0' || strlen(text) != 5 || text[1] < '0' || text[1] > '3') {
+            fail("bad DTC", text);
+            return false;
+        }
+        dtc = ((system - systems) << 14) | ((text[1] - '0') << 12);
+        for (uint8_t i = 2; i < 5; i++) {
+            char c = toupper(text[i]);
+            if (!isxdigit(c)) {
+                fail("bad DTC", text);
+                return false;
+            }
+            dtc |= (c <= '9' ? c - '0' : c - 'A' + 10) << (4 * (4 - i));
+        }
+        return true;
+    }
+
+    void compileLine() {
+        lineNumber++;
+        line[lineLength] = '\0';
+        lineLength = 0;
+        if (lineTooLong) {
+            lineTooLong = false;
+            fail("line too long");
+            return;
+        }
+        char* comment = strchr(line, '#');
+        if (comment != nullptr) *comment = '\0';
+
+        char* save;
+        char* words[5] = {nullptr};
+        uint8_t count = 0;
+        for (char* word = strtok_r(line, " \t", &save); word != nullptr; word = strtok_r(nullptr, " \t", &save)) {
+            if (count == 5) {
+                fail("too many words");
+                return;
+            }
+            words[count++] = word;
+        }
+        if (count == 0) return;
+
+        int8_t keyword = -1;
+        for (uint8_t i = 0; i < SCENARIO_KEYWORD_COUNT; i++) {
+            if (strcmp_P(words[0], SCENARIO_KEYWORDS[i].name) == 0) keyword = i;
+        }
+        if (keyword < 0) {
+            fail("unknown statement", words[0]);
+            return;
+        }
+
+        ScenarioOp op = (ScenarioOp)pgm_read_byte(&SCENARIO_KEYWORDS[keyword].op);
+        uint8_t size = pgm_read_byte(&SCENARIO_OP_SIZE[op]);
+        uint8_t bytes[8] = {op};
+        uint8_t expected = 1;  // Words the statement takes
+        uint8_t column;
+        uint16_t raw;
+        uint32_t ms;
+        int32_t number;
+        switch (op) {
+            case SCENARIO_SET:
+            case SCENARIO_RAMP:
+                if (!parseField(words[1], column) || !parseValue(column, words[2], raw)) return;
+                bytes[1] = column;
+                bytes[2] = raw;
+                bytes[3] = raw >> 8;
+                expected = 3;
+                if (op == SCENARIO_RAMP) {
+                    if (!parseDuration(words[3], ms)) return;
+                    putDword(&bytes[4], ms);
+                    expected = 4;
+                }
+                break;
+
+            case SCENARIO_RELEASE:
+                if (!parseField(words[1], column)) return;
+                bytes[1] = column;
+                expected = 2;
+                break;
+
+            case SCENARIO_HOLD:
+                if (!parseDuration(words[1], ms)) return;
+                putDword(&bytes[1], ms);
+                expected = 2;
+                break;
+
+            case SCENARIO_WAIT: {
+                if (!parseField(words[1], column)) return;
+                int8_t compare = -1;
+                for (uint8_t i = 0; i <= SCENARIO_NE && words[2] != nullptr; i++) {
+                    if (strcmp_P(words[2], SCENARIO_COMPARE_NAMES[i]) == 0) compare = i;
+                }
+                if (compare < 0) {
+                    fail("bad comparison", words[2]);
+                    return;
+                }
+                if (!parseValue(column, words[3], raw)) return;
+                bytes[1] = column;
+                bytes[2] = compare;
+                bytes[3] = raw;
+                bytes[4] = raw >> 8;
+                expected = 4;
+                break;
+            }
+
+            case SCENARIO_REPEAT:
+                if (!parseNumber(words[1], number) || number < 0 || number > 0xFFFF) {
+                    fail("bad count", words[1]);
+                    return;
+                }
+                if (openCount == SCENARIO_MAX_DEPTH) {
+                    fail("loops nested too deep");
+                    return;
+                }
+                bytes[1] = number;
+                bytes[2] = number >> 8;
+                openLoops[openCount++] = compiled + size;
+                expected = 2;
+                break;
+
+            case SCENARIO_NEXT:
+                if (openCount == 0) {
+                    fail("end without repeat");
+                    return;
+                }
+                openCount--;
+                bytes[1] = openLoops[openCount];
+                bytes[2] = openLoops[openCount] >> 8;
+                break;
+
+            case SCENARIO_DRIVE:
+                number = -1;
+                for (uint8_t i = 0; i <= DRIVE_DRAG && words[1] != nullptr; i++) {
+                    if (strcmp_P(words[1], SCENARIO_PROFILE_NAMES[i]) == 0) number = i;
+                }
+                if (number < 0) {
+                    fail("unknown profile", words[1]);
+                    return;
+                }
+                bytes[1] = number;
+                expected = 2;
+                break;
+
+            case SCENARIO_DTC:
+                if (!parseDtc(words[1], raw)) return;
+                bytes[1] = raw;
+                bytes[2] = raw >> 8;
+                bytes[3] = 1;
+                expected = 2;
+                if (words[2] != nullptr && strcmp(words[2], "pending") == 0) {
+                    bytes[3] = 0;
+                    expected = 3;
+                }
+                break;
+
+            case SCENARIO_CLEAR:
+                raw = 0;
+                if (words[1] != nullptr) {
+                    if (!parseDtc(words[1], raw)) return;
+                    expected = 2;
+                }
+                bytes[1] = raw;
+                bytes[2] = raw >> 8;
+                break;
+
+            case SCENARIO_MIL:
+                if (words[1] == nullptr || (strcmp(words[1], "on") != 0 && strcmp(words[1], "off") != 0)) {
+                    fail("mil on or off");
+                    return;
+                }
+                bytes[1] = strcmp(words[1], "on") == 0;
+                expected = 2;
+                break;
+
+            default:
+                break;
+        }
+        if (count != expected) {
+            fail(count < expected ? "incomplete" : "unexpected", words[count < expected ? 0 : expected]);
+            return;
+        }
+        emit(bytes, size);
+    }
+
+public:
+    Scenario() : length(0), loaded(false), compiled(0), checking(false), lineLength(0), lineTooLong(false), lineNumber(0), openCount(0),
+                 scripted(0), pc(0), nowMs(0), atMs(0), holdUntil(0), holding(false), budget(0), depth(0) {
+        error[0] = '\0';
+        code[0] = SCENARIO_END;
+    }
+
+    // ---- Compiling ----
+
+    // Start a new script; unless only checking, the old one is gone
+    void beginCompile() {
+        if (!checking) {
+            loaded = false;
+            length = 0;
+        }
+        compiled = 0;
+        lineLength = 0;
+        lineTooLong = false;
+        lineNumber = 0;
+        openCount = 0;
+        error[0] = '\0';
+    }
+
+    // Compile the next piece of the script text, in pieces of any size;
+    // false once there is an error
+    bool feed(const char* data, size_t len) {
+        for (size_t i = 0; i < len && error[0] == '\0'; i++) {
+            if (data[i] == '\n') {
+                compileLine();
+            } else if (data[i] != '\r') {
+                if (lineLength < SCENARIO_LINE_MAX - 1) {
+                    line[lineLength++] = data[i];
+                } else {
+                    lineTooLong = true;
+                }
+            }
+        }
+        return error[0] == '\0';
+    }
+
+    // After the last piece; false if the script doesn't compile (getError())
+    bool endCompile() {
+        if (lineLength > 0 || lineTooLong) compileLine();
+        if (openCount > 0) fail("repeat without end");
+        if (error[0] != '\0') return false;
+        compiled++;  // SCENARIO_END
+        if (checking) return true;
+        code[compiled - 1] = SCENARIO_END;
+        length = compiled;
+        loaded = true;
+        return true;
+    }
+
+    // Compile a script file
+    bool load(const char* path) {
+        beginCompile();
+        File file;
+        if (LittleFS.begin()) file = LittleFS.open(path, "r");
+        if (!file) {
+            snprintf(error, sizeof(error), "%s not found", path);
+            Serial.printf("%s not found, no scenario to run\n", path);
+            return false;
+        }
+        uint8_t block[SCENARIO_LINE_MAX];
+        size_t got;
+        while ((got = file.read(block, sizeof(block))) > 0 && feed((const char*)block, got)) {}
+        file.close();
+        if (!endCompile()) {
+            Serial.printf("Scenario %s: %s\n", path, error);
+            return false;
+        }
+        Serial.printf("Scenario %s: %u lines, %u bytes of bytecode\n", path, lineNumber, compiled);
+        return true;
+    }
+
+    // Compile a script file only to find its errors (getError()); the
+    // loaded script stays, and keeps running
+    bool check(const char* path) {
+        checking = true;
+        bool ok = load(path);
+        checking = false;
+        return ok;
+    }
+
+    // Compile a built-in script (SCENARIO_PRESETS)
+    bool loadPreset(uint8_t preset) {
+        beginCompile();
+        if (preset >= SCENARIO_PRESET_COUNT) {
+            snprintf(error, sizeof(error), "no preset %u", preset);
+            return false;
+        }
+        const char* script = (const char*)pgm_read_ptr(&SCENARIO_PRESETS[preset].script);
+        size_t left = strlen_P(script);
+        char block[SCENARIO_LINE_MAX];
+        while (left > 0) {
+            size_t size = left < sizeof(block) ? left : sizeof(block);
+            memcpy_P(block, script, size);
+            if (!feed(block, size)) break;
+            script += size;
+            left -= size;
+        }
+        return endCompile();
+    }
+
+    bool available() const { return loaded; }
+    uint16_t size() const { return loaded ? length : 0; }
+    const char* getError() const { return error; }
+
+    // ---- Running ----
+
+    // From the first statement, nothing scripted yet
+    void start() {
+        pc = 0;
+        nowMs = 0;
+        atMs = 0;
+        holding = false;
+        depth = 0;
+        scripted = 0;
+        budget = SCENARIO_STEPS_PER_TICK;
+    }
+
+    // Advance the clock by SIM_TICK_MS
+    void tick() {
+        nowMs += SIM_TICK_MS;
+        budget = SCENARIO_STEPS_PER_TICK;
+    }
+
+    uint32_t elapsedMs() const { return nowMs; }
+    bool finished() const { return !loaded || code[pc] == SCENARIO_END; }
+
+    // Run statements until the script waits, this tick's budget is spent,
+    // or it has something for the caller to do: then true, with the event,
+    // and the next call goes on from there
+    bool run(const CarState& state, ScenarioEvent& event) {
+        if (!loaded) return false;
+        while (budget > 0) {
+            if (holding) {
+                if ((int32_t)(nowMs - holdUntil) < 0) return false;
+                atMs = holdUntil;
+                holding = false;
+            }
+            const uint8_t* statement = &code[pc];
+            ScenarioOp op = (ScenarioOp)statement[0];
+            if (op == SCENARIO_END) return false;
+            uint16_t next = pc + pgm_read_byte(&SCENARIO_OP_SIZE[op]);
+            uint8_t column = statement[1];
+            budget--;
+
+            switch (op) {
+                case SCENARIO_SET:
+                case SCENARIO_RAMP: {
+                    Keyframe& key = fields[column];
+                    int32_t target = fieldValue(column, &statement[2]);
+                    key.from = op == SCENARIO_SET ? target
+                             : scripted & (1UL << column) ? valueAt(column, atMs) : readTraceField(state, column);
+                    key.to = target;
+                    key.startMs = atMs;
+                    key.durationMs = op == SCENARIO_SET ? 0 : dword(&statement[4]);
+                    scripted |= 1UL << column;
+                    break;
+                }
+
+                case SCENARIO_RELEASE:
+                    scripted &= ~(1UL << column);
+                    break;
+
+                case SCENARIO_HOLD:
+                    holdUntil = atMs + dword(&statement[1]);
+                    holding = true;
+                    break;
+
+                case SCENARIO_WAIT: {
+                    int32_t value = readTraceField(state, column);
+                    int32_t limit = fieldValue(column, &statement[3]);
+                    bool met;
+                    switch (statement[2]) {
+                        case SCENARIO_LT: met = value < limit; break;
+                        case SCENARIO_LE: met = value <= limit; break;
+                        case SCENARIO_GT: met = value > limit; break;
+                        case SCENARIO_GE: met = value >= limit; break;
+                        case SCENARIO_EQ: met = value == limit; break;
+                        default: met = value != limit; break;
+                    }
+                    if (!met) {
+                        budget++;  // Checked again next tick
+                        return false;
+                    }
+                    atMs = nowMs;
+                    break;
+                }
+
+                case SCENARIO_REPEAT:
+                    loopsLeft[depth++] = word(&statement[1]);
+                    break;
+
+                case SCENARIO_NEXT:
+                    if (loopsLeft[depth - 1] == 0 || --loopsLeft[depth - 1] > 0) {
+                        next = word(&statement[1]);
+                    } else {
+                        depth--;
+                    }
+                    break;
+
+                default:
+                    // DTCs, MIL, drive cycle and driver are the caller's.
+                    // Only read the operands the statement has: a cycle
+                    // has none and may be the last byte but one.
+                    event.op = op;
+                    event.code = 0;
+                    event.arg = 0;
+                    switch (op) {
+                        case SCENARIO_DTC:
+                            event.code = word(&statement[1]);
+                            event.arg = statement[3];
+                            break;
+                        case SCENARIO_CLEAR:
+                            event.code = word(&statement[1]);
+                            break;
+                        case SCENARIO_DRIVE:
+                        case SCENARIO_MIL:
+                            event.arg = statement[1];
+                            break;
+                        default:  // SCENARIO_CYCLE
+                            break;
+                    }
+                    pc = next;
+                    return true;
+            }
+            pc = next;
+        }
+        return false;
+    }
+
+    // Write the scripted fields at the scenario clock
+    void apply(CarState& state) const {
+        for (uint8_t column = 0; column < TRACE_COLUMN_COUNT; column++) {
+            if (scripted & (1UL << column)) writeTraceField(state, column, valueAt(column, nowMs));
+        }
+    }
+};
+
+#endif // SCENARIO_H
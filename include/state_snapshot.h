@@ -0,0 +1,78 @@
+#ifndef STATE_SNAPSHOT_H
+#define STATE_SNAPSHOT_H
+
+#include <Arduino.h>
+#include "config.h"
+
+#if SIM_TASK
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+/**
+ * Consistent CarState for readers on any core (ESP32)
+ *
+ * The simulator task, web callbacks (AsyncTCP) and the request loop all
+ * change the car state; requests, broadcasts and the display read it. A
+ * multi-PID reply built while the simulator is half way through a step
+ * would mix two moments.
+ *
+ * Writers take turns on a recursive mutex (StateLock) and publish the
+ * result when they are done. Readers never lock: they copy the published
+ * state under a sequence counter (a seqlock), which is odd while a publish
+ * is under way, and copy again if it changed meanwhile. The publish itself
+ * is a short critical section, so a reader never waits on a writer that
+ * was preempted half way.
+ */
+
+class StateLock {
+private:
+    SemaphoreHandle_t mutex;
+
+public:
+    StateLock() : mutex(xSemaphoreCreateRecursiveMutex()) {}
+
+    void lock() { xSemaphoreTakeRecursive(mutex, portMAX_DELAY); }
+    void unlock() { xSemaphoreGiveRecursive(mutex); }
+};
+
+class StateSnapshot {
+private:
+    CarState state;
+    volatile uint32_t sequence;  // Odd while publishing
+    portMUX_TYPE publishing;
+
+public:
+    StateSnapshot() : sequence(0) {
+        state = DEFAULT_CAR_STATE;
+        publishing = portMUX_INITIALIZER_UNLOCKED;
+    }
+
+    // Make a state the one readers see (one writer at a time: hold the
+    // StateLock)
+    void publish(const CarState& next) {
+        portENTER_CRITICAL(&publishing);
+        __atomic_store_n(&sequence, sequence + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(&state, &next, sizeof(CarState));
+        __atomic_store_n(&sequence, sequence + 1, __ATOMIC_RELEASE);
+        portEXIT_CRITICAL(&publishing);
+    }
+
+    // Copy of the last published state; never blocks
+    CarState read() const {
+        CarState copy;
+        uint32_t before, after;
+        do {
+            before = __atomic_load_n(&sequence, __ATOMIC_ACQUIRE);
+            memcpy(&copy, &state, sizeof(CarState));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            after = __atomic_load_n(&sequence, __ATOMIC_RELAXED);
+        } while ((before & 1) || before != after);
+        return copy;
+    }
+};
+
+#endif // SIM_TASK
+
+#endif // STATE_SNAPSHOT_H
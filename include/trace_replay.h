@@ -0,0 +1,425 @@
+#ifndef TRACE_REPLAY_H
+#define TRACE_REPLAY_H
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <stddef.h>
+#include "config.h"
+
+/**
+ * Replay of a recorded drive (DRIVE_REPLAY)
+ *
+ * TRACE_PATH on LittleFS holds samples of the car state over time, as
+ * text or binary. Both start with a header line naming the columns; the
+ * first is the time in ms, the others CarState fields in its units
+ * (TRACE_COLUMNS). Columns of other names are read and ignored.
+ *
+ *   ms,rpm,speed,throttle,coolant,lat
+ *   0,850,0,0,88,52.5123
+ *   100,910,0,4,88,52.5123
+ *
+ * Binary traces start with "MSTR" and the same header line, followed by
+ * fixed records: the time as uint32 and every column as a 16-bit value,
+ * little-endian (two's complement for signed fields).
+ *
+ * The file is never loaded as a whole. Only the two samples around the
+ * play position are held, read through a TRACE_CHUNK_BYTES block, and
+ * values are interpolated between them when the state is read. Loading
+ * reads the file once and builds a sparse seek index, at most
+ * TRACE_INDEX_ENTRIES (time, file offset) points evenly spaced by sample
+ * count. Seeking, looping back and long jumps start from the nearest
+ * index point; normal play reads on from where it was.
+ *
+ * Timestamps must not go backwards; a trace ends at the first one that
+ * does. Malformed CSV lines are skipped.
+ */
+
+// A CarState field a trace can set
+struct TraceColumnDef {
+    char name[14];
+    uint8_t offset;
+    uint8_t size;      // 1 or 2
+    bool isSigned;
+};
+
+#define TRACE_COLUMN(name, member, isSigned) {name, offsetof(CarState, member), sizeof(CarState::member), isSigned}
+
+// Names as in the web interface; runtime, MIL and DTC count stay the
+// emulator's own
+static constexpr TraceColumnDef TRACE_COLUMNS[] PROGMEM = {
+    TRACE_COLUMN("rpm", rpm, false),
+    TRACE_COLUMN("speed", speed, false),
+    TRACE_COLUMN("coolant", coolant_temp, false),
+    TRACE_COLUMN("intake", intake_temp, false),
+    TRACE_COLUMN("throttle", throttle, false),
+    TRACE_COLUMN("maf", maf, false),
+    TRACE_COLUMN("fuel", fuel_level, false),
+    TRACE_COLUMN("baro", barometric, false),
+    TRACE_COLUMN("stft", short_fuel_trim, true),
+    TRACE_COLUMN("ltft", long_fuel_trim, true),
+    TRACE_COLUMN("map", map, false),
+    TRACE_COLUMN("timing", timing_advance, true),
+    TRACE_COLUMN("o2", o2_voltage, false),
+    TRACE_COLUMN("fuel_pressure", fuel_pressure, false),
+    TRACE_COLUMN("egr", egr, false),
+    TRACE_COLUMN("distance", distance_mil_clear, false),
+    TRACE_COLUMN("battery", battery_voltage, false),
+    TRACE_COLUMN("ambient", ambient_temp, false),
+    TRACE_COLUMN("oil", oil_temp, false),
+};
+
+#undef TRACE_COLUMN
+
+static constexpr uint8_t TRACE_COLUMN_COUNT = sizeof(TRACE_COLUMNS) / sizeof(TRACE_COLUMNS[0]);
+static constexpr uint8_t TRACE_COLUMN_NONE = 0xFF;  // Column the emulator doesn't know
+static constexpr char TRACE_BINARY_MAGIC[] = "MSTR";
+
+static_assert(TRACE_INDEX_ENTRIES >= 2, "TRACE_INDEX_ENTRIES too small");
+
+// A TRACE_COLUMNS field of a car state
+static inline int32_t readTraceField(const CarState& state, uint8_t column) {
+    const uint8_t* field = (const uint8_t*)&state + pgm_read_byte(&TRACE_COLUMNS[column].offset);
+    if (pgm_read_byte(&TRACE_COLUMNS[column].size) == 2) {
+        uint16_t word;
+        memcpy(&word, field, 2);
+        return word;
+    }
+    return pgm_read_byte(&TRACE_COLUMNS[column].isSigned) ? *(const int8_t*)field : *field;
+}
+
+// Set a TRACE_COLUMNS field, clamped to its range
+static inline void writeTraceField(CarState& state, uint8_t column, int32_t value) {
+    uint8_t* field = (uint8_t*)&state + pgm_read_byte(&TRACE_COLUMNS[column].offset);
+    if (pgm_read_byte(&TRACE_COLUMNS[column].size) == 2) {
+        uint16_t word = value < 0 ? 0 : value > 0xFFFF ? 0xFFFF : value;
+        memcpy(field, &word, 2);
+    } else if (pgm_read_byte(&TRACE_COLUMNS[column].isSigned)) {
+        *(int8_t*)field = value < -128 ? -128 : value > 127 ? 127 : value;
+    } else {
+        *field = value < 0 ? 0 : value > 0xFF ? 0xFF : value;
+    }
+}
+
+struct TraceSample {
+    uint32_t ms;
+    int32_t values[TRACE_MAX_COLUMNS];
+};
+
+struct TraceIndexEntry {
+    uint32_t ms;
+    uint32_t offset;   // File offset of the sample
+};
+
+class TraceReplay {
+private:
+    File file;
+    bool loaded;
+    bool binary;
+    uint8_t columnCount;
+    uint8_t columns[TRACE_MAX_COLUMNS];  // TRACE_COLUMNS index per column
+    uint32_t dataStart;                  // First sample
+    uint32_t dataEnd;                    // Past the last valid sample
+    uint32_t sampleCount;
+    uint32_t firstMs;
+    uint32_t lastMs;
+
+    TraceIndexEntry index[TRACE_INDEX_ENTRIES];
+    uint16_t indexCount;
+    uint32_t indexStride;                // Samples from one index point to the next
+
+    uint8_t chunk[TRACE_CHUNK_BYTES];
+    uint32_t chunkOffset;                // File offset of chunk[0]
+    uint16_t chunkLength;
+    uint16_t chunkPos;
+
+    // Samples around the play position; after the last one prev holds
+    TraceSample prev;
+    TraceSample next;
+    bool hasNext;
+    uint32_t positionMs;                 // Trace time of the values
+
+    // Play position: trace time (from the first sample) at a wall time
+    uint32_t anchorMs;
+    uint32_t anchorPosition;
+    uint16_t speedPercent;
+    bool looping;
+
+    void seekFile(uint32_t offset) {
+        file.seek(offset);
+        chunkOffset = offset;
+        chunkLength = 0;
+        chunkPos = 0;
+    }
+
+    int readByte() {
+        if (chunkPos == chunkLength) {
+            chunkOffset += chunkLength;
+            chunkPos = 0;
+            chunkLength = file.read(chunk, sizeof(chunk));
+            if (chunkLength == 0) return -1;
+        }
+        return chunk[chunkPos++];
+    }
+
+    uint32_t tell() const { return chunkOffset + chunkPos; }
+
+    // One text line without the line end; false at the end of the file.
+    // Longer lines come back empty.
+    bool readLine(char* line, uint16_t size) {
+        uint16_t length = 0;
+        bool tooLong = false;
+        int c;
+        while ((c = readByte()) >= 0 && c != '\n') {
+            if (c == '\r') continue;
+            if (length < size - 1) {
+                line[length++] = c;
+            } else {
+                tooLong = true;
+            }
+        }
+        line[tooLong ? 0 : length] = '\0';
+        return c >= 0 || length > 0;
+    }
+
+    static int8_t findColumn(const char* name) {
+        for (uint8_t i = 0; i < TRACE_COLUMN_COUNT; i++) {
+            if (strcmp_P(name, TRACE_COLUMNS[i].name) == 0) return i;
+        }
+        return -1;
+    }
+
+    // Column names after the time; false if there is no time column
+    bool parseHeader(char* line) {
+        char* save;
+        char* field = strtok_r(line, ",", &save);
+        if (field == nullptr || (strcmp(field, "ms") != 0 && strcmp(field, "time_ms") != 0)) return false;
+        columnCount = 0;
+        while ((field = strtok_r(nullptr, ",", &save)) != nullptr) {
+            if (columnCount == TRACE_MAX_COLUMNS) return false;
+            while (*field == ' ') field++;
+            char* end = field + strlen(field);
+            while (end > field && end[-1] == ' ') *--end = '\0';
+            int8_t column = findColumn(field);
+            columns[columnCount++] = column < 0 ? TRACE_COLUMN_NONE : column;
+        }
+        return true;
+    }
+
+    // A CSV row with a value for every column
+    bool parseRow(char* line, TraceSample& sample) const {
+        char* end;
+        if (*line < '0' || *line > '9') return false;
+        sample.ms = strtoul(line, &end, 10);
+        for (uint8_t c = 0; c < columnCount; c++) {
+            if (*end != ',') return false;
+            char* text = end + 1;
+            sample.values[c] = strtol(text, &end, 10);
+            if (end == text) return false;
+            while (*end != ',' && *end != '\0') end++;  // Decimals of ignored columns
+        }
+        return *end == '\0';
+    }
+
+    // Next sample in the file; false at the end of the trace
+    bool readSample(TraceSample& sample) {
+        while (tell() < dataEnd) {
+            if (binary) {
+                uint8_t record[4 + 2 * TRACE_MAX_COLUMNS];
+                uint8_t size = 4 + 2 * columnCount;
+                for (uint8_t i = 0; i < size; i++) {
+                    int c = readByte();
+                    if (c < 0) return false;
+                    record[i] = c;
+                }
+                sample.ms = record[0] | (record[1] << 8) | ((uint32_t)record[2] << 16) | ((uint32_t)record[3] << 24);
+                for (uint8_t c = 0; c < columnCount; c++) {
+                    uint16_t raw = record[4 + 2 * c] | (record[5 + 2 * c] << 8);
+                    uint8_t column = columns[c];
+                    bool isSigned = column != TRACE_COLUMN_NONE && pgm_read_byte(&TRACE_COLUMNS[column].isSigned);
+                    sample.values[c] = isSigned ? (int32_t)(int16_t)raw : (int32_t)raw;
+                }
+                return true;
+            }
+            char line[TRACE_LINE_MAX];
+            if (!readLine(line, sizeof(line))) return false;
+            if (parseRow(line, sample)) return true;
+        }
+        return false;
+    }
+
+    // Read the whole trace once: count the samples, find where it ends and
+    // keep every indexStride-th sample as a seek point, doubling the stride
+    // whenever the index fills up
+    void buildIndex() {
+        sampleCount = 0;
+        indexCount = 0;
+        indexStride = 1;
+        dataEnd = 0xFFFFFFFFUL;
+        seekFile(dataStart);
+        uint32_t offset = tell();
+        while (readSample(next)) {
+            if (sampleCount > 0 && next.ms < lastMs) {
+                Serial.printf("Trace: time goes back at sample %lu, ending there\n", (unsigned long)sampleCount);
+                break;
+            }
+            if (sampleCount == 0) firstMs = next.ms;
+            if (sampleCount % indexStride == 0) {
+                if (indexCount == TRACE_INDEX_ENTRIES) {
+                    for (uint16_t i = 0; i < TRACE_INDEX_ENTRIES / 2; i++) index[i] = index[2 * i];
+                    indexCount = TRACE_INDEX_ENTRIES / 2;
+                    indexStride *= 2;
+                }
+                if (sampleCount % indexStride == 0) index[indexCount++] = {next.ms, offset};
+            }
+            lastMs = next.ms;
+            sampleCount++;
+            offset = tell();
+        }
+        dataEnd = offset;
+    }
+
+    // Last index point at or before a trace time
+    uint16_t indexFor(uint32_t ms) const {
+        uint16_t low = 0, high = indexCount;
+        while (high - low > 1) {
+            uint16_t middle = (low + high) / 2;
+            if (index[middle].ms <= ms) {
+                low = middle;
+            } else {
+                high = middle;
+            }
+        }
+        return low;
+    }
+
+    // Make prev and next the samples around a trace time
+    void moveTo(uint32_t ms) {
+        const TraceIndexEntry& nearest = index[indexFor(ms)];
+        if (ms < prev.ms || (hasNext && nearest.ms > next.ms)) {
+            seekFile(nearest.offset);
+            readSample(prev);
+            hasNext = readSample(next);
+        }
+        while (hasNext && next.ms <= ms) {
+            prev = next;
+            hasNext = readSample(next);
+        }
+    }
+
+    // Trace time from the first sample at a wall time
+    uint32_t playedAt(uint32_t nowMs) const {
+        uint32_t played = anchorPosition + (uint64_t)(nowMs - anchorMs) * speedPercent / 100;
+        uint32_t duration = lastMs - firstMs;
+        if (played <= duration) return played;
+        return looping && duration > 0 ? played % duration : duration;
+    }
+
+    void reanchor(uint32_t nowMs) {
+        anchorPosition = playedAt(nowMs);
+        anchorMs = nowMs;
+    }
+
+public:
+    TraceReplay() : loaded(false), binary(false), columnCount(0), sampleCount(0), firstMs(0), lastMs(0),
+                    indexCount(0), hasNext(false), positionMs(0), anchorMs(0), anchorPosition(0),
+                    speedPercent(100), looping(true) {}
+
+    // Open TRACE_PATH and index it (call after LittleFS is available);
+    // false if there is no usable trace
+    bool load() {
+        close();
+        if (LittleFS.begin()) file = LittleFS.open(TRACE_PATH, "r");
+        if (!file) {
+            Serial.printf("%s not found, no trace to replay\n", TRACE_PATH);
+            return false;
+        }
+
+        char line[TRACE_LINE_MAX];
+        seekFile(0);
+        binary = true;
+        for (uint8_t i = 0; i < 4; i++) {
+            if (readByte() != TRACE_BINARY_MAGIC[i]) binary = false;
+        }
+        if (!binary) seekFile(0);
+        if (!readLine(line, sizeof(line)) || !parseHeader(line)) {
+            Serial.printf("%s: no ms,... header line\n", TRACE_PATH);
+            close();
+            return false;
+        }
+        dataStart = tell();
+        buildIndex();
+        if (sampleCount == 0) {
+            Serial.printf("%s: no samples\n", TRACE_PATH);
+            close();
+            return false;
+        }
+
+        loaded = true;
+        Serial.printf("Trace %s: %lu samples over %lu s, %u columns (%s), %u seek points\n", TRACE_PATH,
+                      (unsigned long)sampleCount, (unsigned long)((lastMs - firstMs) / 1000), columnCount,
+                      binary ? "binary" : "CSV", indexCount);
+        return true;
+    }
+
+    // Let go of the file (before it is replaced)
+    void close() {
+        if (file) file.close();
+        loaded = false;
+    }
+
+    bool available() const { return loaded; }
+    uint32_t durationMs() const { return loaded ? lastMs - firstMs : 0; }
+
+    // Play from the start
+    void start(uint32_t nowMs) {
+        anchorMs = nowMs;
+        anchorPosition = 0;
+        prev.ms = 0xFFFFFFFFUL;  // Seek on the first update
+        update(nowMs);
+    }
+
+    // Trace ms per 100 ms of real time x 100
+    void setSpeed(uint16_t percent, uint32_t nowMs) {
+        reanchor(nowMs);
+        speedPercent = percent < TRACE_SPEED_MIN_PERCENT ? TRACE_SPEED_MIN_PERCENT
+                     : percent > TRACE_SPEED_MAX_PERCENT ? TRACE_SPEED_MAX_PERCENT : percent;
+    }
+
+    // Start over at the end, or stay at the last sample
+    void setLooping(bool on, uint32_t nowMs) {
+        reanchor(nowMs);
+        looping = on;
+    }
+
+    // Jump to a time from the start of the trace
+    void seek(uint32_t ms, uint32_t nowMs) {
+        anchorPosition = ms < durationMs() ? ms : durationMs();
+        anchorMs = nowMs;
+    }
+
+    uint16_t getSpeed() const { return speedPercent; }
+    bool getLooping() const { return looping; }
+    uint32_t getPosition() const { return positionMs - firstMs; }
+
+    // Move the play position to a wall time
+    void update(uint32_t nowMs) {
+        if (!loaded) return;
+        positionMs = firstMs + playedAt(nowMs);
+        moveTo(positionMs);
+    }
+
+    // Write the trace's fields, interpolated at the play position
+    void apply(CarState& state) const {
+        if (!loaded) return;
+        uint32_t span = hasNext ? next.ms - prev.ms : 0;
+        for (uint8_t c = 0; c < columnCount; c++) {
+            uint8_t column = columns[c];
+            if (column == TRACE_COLUMN_NONE) continue;
+            int32_t value = prev.values[c];
+            if (span > 0) value += (int64_t)(next.values[c] - value) * (positionMs - prev.ms) / span;
+            writeTraceField(state, column, value);
+        }
+    }
+};
+
+#endif // TRACE_REPLAY_H
@@ -0,0 +1,229 @@
+#ifndef VEHICLE_MODEL_H
+#define VEHICLE_MODEL_H
+
+#include <Arduino.h>
+#include "config.h"
+#include "pid_registry.h"
+#include "waveform.h"
+
+/**
+ * Drivetrain model behind the driving simulator
+ *
+ * A 1700 kg coupe with the 5.0 V8 (torque curve and airflow in
+ * pid_registry.h), a 6-speed manual gearbox (GEAR_RATIOS, 3.55 final drive,
+ * 2.1 m tyres) and aero and rolling drag. It advances in fixed SIM_TICK_MS
+ * steps in integer arithmetic only, so the FPU-less ESP8266 steps it in a
+ * few microseconds:
+ *
+ *   driver     throttle and brake from the DriveMode's profile: launch
+ *              throttle, speed held at the cruise target, braking from a
+ *              set time until the car stops
+ *   gearbox    up at the profile's shift RPM, down when the engine lugs,
+ *              clutch out while shifting and below walking pace
+ *   engine     MAP from the throttle, torque and MAF from the air charge,
+ *              fuel cut on the overrun and at the rev limiter
+ *   car        wheel force (traction limited) less drag and brakes
+ *              accelerates the mass; engine RPM follows the wheels when
+ *              the clutch is in, slips at launch
+ *
+ * RPM, speed, MAF and MAP therefore always agree: the gear and load PIDs
+ * work them back out of the state.
+ */
+
+// How a DriveMode drives
+struct DriverProfile {
+    uint8_t throttle;       // Pedal while accelerating (%)
+    uint8_t cruiseKmh;      // Speed held once reached, 0 = flat out
+    uint16_t brakeAtSec;    // Brake to a stop from here on, 0 = never
+    uint8_t brakePercent;   // Of 1 g
+    uint16_t upshiftRpm;
+    uint16_t shiftMs;       // Clutch out per gear change
+    uint8_t noisePercent;   // Pedal wobble, +/-
+    uint16_t noisePeriodMs; // A new wobble target this often
+};
+
+// Indexed by DriveMode
+static constexpr DriverProfile DRIVER_PROFILES[] PROGMEM = {
+    {0, 0, 0, 0, 0, 0, 0, 0},                // DRIVE_OFF
+    {30, 50, 0, 0, 2500, 400, 4, 3000},      // DRIVE_GENTLE
+    {50, 80, 17, 45, 3000, 300, 3, 4000},    // DRIVE_NORMAL
+    {85, 120, 16, 85, 5500, 150, 5, 2000},   // DRIVE_SPORT
+    {100, 0, 12, 85, 6800, 80, 0, 1000},     // DRIVE_DRAG
+};
+
+static_assert(sizeof(DRIVER_PROFILES) / sizeof(DRIVER_PROFILES[0]) == DRIVE_DRAG + 1,
+              "One driver profile per DriveMode");
+
+class VehicleModel {
+private:
+    static constexpr uint16_t MASS_KG = 1700;
+    static constexpr uint16_t IDLE_RPM = 850;
+    static constexpr uint16_t FRICTION_NM = 57;        // PID 8E: 10% of the reference
+    static constexpr uint16_t TRACTION_N = 11000;      // About 0.65 g on the driven rear wheels
+    static constexpr uint16_t ROLLING_N = 200;         // 0.012 * m * g
+    static constexpr uint16_t BRAKE_N_PER_PERCENT = 167;  // 1% of m * g
+    static constexpr uint16_t WHEEL_FORCE = 957;       // 3.55 final * 0.9 efficiency / 0.334 m, * 100
+    static constexpr uint16_t AERO_N_PER_M2S2 = 46;    // 0.5 * rho * Cd * A, * 100
+    static constexpr uint16_t CLUTCH_SLIP_RPM = 25;    // Launch RPM per % throttle above idle
+    static constexpr uint16_t LUG_RPM = 1200;          // Downshift below this under power
+    static constexpr uint8_t LIGHT_THROTTLE = 25;      // Below this, shift up early...
+    static constexpr uint16_t CRUISE_UPSHIFT_RPM = 2500;  // ...at this RPM
+    static constexpr uint16_t DECLUTCH_RPM = 1000;     // Downshift / clutch out on the overrun
+    static constexpr uint8_t DECLUTCH_KMH = 20;
+    static constexpr uint8_t WARMUP_MILLIDEG_PER_TICK = 4 * SIM_TICK_MS;  // 4 °C/s
+    static constexpr int32_t THERMOSTAT_MILLIDEG = 90000;
+
+    DriverProfile profile;
+    uint32_t seed;          // Pedal noise sequence
+    uint32_t timeMs;        // Since the drive started
+    uint32_t velocity;      // µm/s
+    uint16_t rpm;
+    uint8_t gear;           // 0 = neutral / clutch down
+    uint16_t shiftLeftMs;   // Clutch out until the gear change is done
+    uint8_t throttle;
+    uint8_t brake;
+    uint8_t map;
+    uint8_t baro;
+    int32_t coolant;        // m°C
+
+    uint8_t kmh() const { return velocity / 277778 > 255 ? 255 : velocity / 277778; }
+
+    // Engine speed with the clutch in, as PID A4's gear detection expects
+    // (28.2 rpm per km/h per unit of ratio)
+    uint16_t wheelRpm(uint8_t g) const {
+        if (g == 0) return 0;
+        uint32_t r = (velocity / 1000) * GEAR_RATIOS[g - 1] / 9850;
+        return r > 0xFFFF ? 0xFFFF : r;
+    }
+
+    void changeGear(uint8_t g) {
+        gear = g;
+        shiftLeftMs = g == 0 ? 0 : profile.shiftMs;
+    }
+
+    void drive() {
+        bool braking = profile.brakeAtSec && timeMs >= profile.brakeAtSec * 1000UL;
+        brake = braking && velocity > 0 ? profile.brakePercent : 0;
+        if (braking) {
+            throttle = 0;
+            return;
+        }
+        int16_t pedal = profile.throttle;
+        if (profile.cruiseKmh) {
+            // Hold the cruise speed: 10% plus 10% per km/h short
+            int32_t short10 = (int32_t)profile.cruiseKmh * 10 - (int32_t)(velocity / 27778);
+            int32_t hold = 10 + short10;
+            if (hold < pedal) pedal = hold < 0 ? 0 : hold;
+        }
+        if (pedal > 0) pedal += Waveform::noise(seed, timeMs, profile.noisePeriodMs, profile.noisePercent);
+        throttle = pedal < 0 ? 0 : pedal > 100 ? 100 : pedal;
+    }
+
+    void shift() {
+        if (shiftLeftMs > 0) {
+            shiftLeftMs = shiftLeftMs > SIM_TICK_MS ? shiftLeftMs - SIM_TICK_MS : 0;
+            return;
+        }
+        if (gear == 0) {
+            if (throttle > 0) changeGear(1);  // Launch
+            return;
+        }
+        uint16_t locked = wheelRpm(gear);
+        uint16_t upshift = throttle < LIGHT_THROTTLE && profile.upshiftRpm > CRUISE_UPSHIFT_RPM
+                               ? CRUISE_UPSHIFT_RPM : profile.upshiftRpm;
+        if (throttle == 0) {
+            if (locked < DECLUTCH_RPM) changeGear(gear > 1 && kmh() > DECLUTCH_KMH ? gear - 1 : 0);
+        } else if (locked > upshift && gear < 6) {
+            changeGear(gear + 1);
+        } else if (locked < LUG_RPM && gear > 1) {
+            changeGear(gear - 1);
+        }
+    }
+
+public:
+    VehicleModel() : seed(SIM_NOISE_SEED), timeMs(0), velocity(0), rpm(IDLE_RPM), gear(0), shiftLeftMs(0), throttle(0),
+                     brake(0), map(35), baro(101), coolant(THERMOSTAT_MILLIDEG) {
+        memset(&profile, 0, sizeof(profile));
+    }
+
+    // Start a drive from standstill at idle
+    void start(DriveMode mode, uint8_t coolantTemp, uint8_t barometric) {
+        memcpy_P(&profile, &DRIVER_PROFILES[mode], sizeof(DriverProfile));
+        seed = SIM_NOISE_SEED + mode;
+        timeMs = 0;
+        velocity = 0;
+        rpm = IDLE_RPM;
+        gear = 0;
+        shiftLeftMs = 0;
+        throttle = 0;
+        brake = 0;
+        baro = barometric;
+        map = 35;
+        coolant = (int32_t)coolantTemp * 1000;
+    }
+
+    // Advance one SIM_TICK_MS
+    void step() {
+        timeMs += SIM_TICK_MS;
+        drive();
+        shift();
+
+        bool engaged = gear > 0 && shiftLeftMs == 0;
+        uint16_t locked = wheelRpm(gear);
+        if (engaged) {
+            // Slip the clutch until the wheels catch up with the launch RPM
+            uint16_t slip = IDLE_RPM + throttle * CLUTCH_SLIP_RPM;
+            rpm = gear == 1 && locked < slip ? slip : locked;
+        } else {
+            // Clutch out: the engine settles to idle, or to the new gear's speed
+            uint16_t target = gear ? locked : IDLE_RPM;
+            if (target < IDLE_RPM) target = IDLE_RPM;
+            int32_t gap = (int32_t)target - rpm;
+            rpm = gap > -4 && gap < 4 ? target : rpm + gap / 4;
+        }
+
+        // Closed throttle above idle cuts the fuel; the manifold is near
+        // the residual pressure and the engine only drags
+        bool overrun = throttle == 0 && rpm > IDLE_RPM + 250;
+
+        // Closed, the throttle lets through less per revolution the faster
+        // the engine turns: 35 kPa at idle, down to 25
+        uint8_t closed = rpm > IDLE_RPM + 1500 ? 25 : 35 - (rpm - IDLE_RPM) / 150;
+        map = overrun ? RESIDUAL_KPA + 2 : closed + throttle * (baro > closed ? baro - closed : 0) / 100;
+        int32_t torque = -(int32_t)FRICTION_NM;
+        if (!overrun && rpm < REV_LIMIT_RPM && baro > RESIDUAL_KPA) {
+            torque += (int32_t)wotTorqueNm(rpm) * (map - RESIDUAL_KPA) / (baro - RESIDUAL_KPA);
+        }
+
+        int32_t force = 0;
+        if (engaged) {
+            force = torque * GEAR_RATIOS[gear - 1] / 100 * WHEEL_FORCE / 1000;
+            if (force > TRACTION_N) force = TRACTION_N;
+        }
+        if (velocity > 0) {
+            uint32_t cmPerSec = velocity / 10000;
+            force -= cmPerSec * cmPerSec / 1000 * AERO_N_PER_M2S2 / 1000 + ROLLING_N;
+            force -= (int32_t)brake * BRAKE_N_PER_PERCENT;
+        }
+
+        // mm/s² times the step in ms is µm/s
+        int32_t dv = force * 1000 / MASS_KG * SIM_TICK_MS;
+        velocity = dv < 0 && (uint32_t)-dv > velocity ? 0 : velocity + dv;
+
+        if (coolant < THERMOSTAT_MILLIDEG) coolant += WARMUP_MILLIDEG_PER_TICK;
+    }
+
+    // Write the model's signals into the car state
+    void apply(CarState& state) const {
+        state.rpm = rpm;
+        state.speed = kmh();
+        state.throttle = throttle;
+        state.map = map;
+        state.maf = engineAirflow(rpm, map, baro);
+        state.coolant_temp = coolant / 1000;
+    }
+
+    uint32_t elapsedMs() const { return timeMs; }
+};
+
+#endif // VEHICLE_MODEL_H
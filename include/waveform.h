@@ -0,0 +1,98 @@
+#ifndef WAVEFORM_H
+#define WAVEFORM_H
+
+#include <Arduino.h>
+
+/**
+ * Integer waveforms and noise for the driving simulator
+ *
+ * No floating point: the ESP8266 has no FPU, and every sin() or fmod() is
+ * a soft-float routine of thousands of cycles.
+ *
+ *   sine()     16-bit phase (65536 = one turn) to +/-32767, from a
+ *              quarter-wave table in flash (65 points, linearly
+ *              interpolated; within 0.02% of sin())
+ *   wave()     a sine of a period and amplitude at a time in ms
+ *   Xorshift32 Marsaglia's generator; the same seed gives the same
+ *              sequence
+ *   noise()    smooth noise: pseudo-random knots every period, joined by
+ *              straight lines. Each knot is hashed from the seed and its
+ *              index, so any moment of the sequence can be computed
+ *              directly and is always the same for a seed.
+ */
+
+static constexpr int16_t SINE_QUARTER[65] PROGMEM = {
+        0,   804,  1608,  2410,  3212,  4011,  4808,  5602,
+     6393,  7179,  7962,  8739,  9512, 10278, 11039, 11793,
+    12539, 13279, 14010, 14732, 15446, 16151, 16846, 17530,
+    18204, 18868, 19519, 20159, 20787, 21403, 22005, 22594,
+    23170, 23731, 24279, 24811, 25329, 25832, 26319, 26790,
+    27245, 27683, 28105, 28510, 28898, 29268, 29621, 29956,
+    30273, 30571, 30852, 31113, 31356, 31580, 31785, 31971,
+    32137, 32285, 32412, 32521, 32609, 32678, 32728, 32757,
+    32767,
+};
+
+class Xorshift32 {
+private:
+    uint32_t state;
+
+public:
+    explicit Xorshift32(uint32_t seed) : state(seed ? seed : 1) {}  // 0 would stick
+
+    uint32_t next() {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+
+    // Uniform in [-amplitude, amplitude]
+    int16_t spread(int16_t amplitude) {
+        return (int32_t)(next() % (2 * (uint32_t)amplitude + 1)) - amplitude;
+    }
+};
+
+class Waveform {
+private:
+    // Knot `index` of a noise sequence, in [-amplitude, amplitude]
+    static int16_t knot(uint32_t seed, uint32_t index, int16_t amplitude) {
+        Xorshift32 rng(seed ^ (index * 2654435761UL));
+        rng.next();  // Neighbouring indexes start close together
+        return rng.spread(amplitude);
+    }
+
+public:
+    static int16_t sine(uint16_t phase) {
+        uint16_t x = phase & 0x3FFF;
+        if (phase & 0x4000) x = 0x4000 - x;  // Falling quarter mirrors the rising one
+        uint8_t i = x >> 8;
+        int32_t value = (int16_t)pgm_read_word(&SINE_QUARTER[i]);
+        if (i < 64) {
+            int32_t next = (int16_t)pgm_read_word(&SINE_QUARTER[i + 1]);
+            value += (next - value) * (x & 0xFF) / 256;
+        }
+        return phase & 0x8000 ? -value : value;
+    }
+
+    // Phase of a period (up to 65535 ms) at a time
+    static uint16_t phaseAt(uint32_t ms, uint16_t periodMs) {
+        return ((ms % periodMs) << 16) / periodMs;
+    }
+
+    // amplitude * sin(2 pi ms / periodMs), truncated toward zero
+    static int16_t wave(uint32_t ms, uint16_t periodMs, int16_t amplitude) {
+        return (int32_t)sine(phaseAt(ms, periodMs)) * amplitude / 32767;
+    }
+
+    // Smooth noise in [-amplitude, amplitude], a new knot every periodMs
+    static int16_t noise(uint32_t seed, uint32_t ms, uint16_t periodMs, int16_t amplitude) {
+        if (periodMs == 0 || amplitude == 0) return 0;
+        uint32_t index = ms / periodMs;
+        int32_t from = knot(seed, index, amplitude);
+        int32_t to = knot(seed, index + 1, amplitude);
+        return from + (to - from) * (int32_t)(ms % periodMs) / periodMs;
+    }
+};
+
+#endif // WAVEFORM_H
@@ -81,6 +81,10 @@ button:hover{background:#ff8555}
 </div>
 </div>
 <div style="margin-top:10px;padding:8px;background:#1a1a1a;border-radius:4px">
+<div style="font-size:10px;color:#888">Mode 01 Reply Cache:</div>
+<div style="font-size:11px;color:#4a9eff;font-family:monospace;margin-top:3px"><span id="statsCacheHits">0</span> hits / <span id="statsCacheMisses">0</span> misses</div>
+</div>
+<div style="margin-top:10px;padding:8px;background:#1a1a1a;border-radius:4px">
 <div style="font-size:10px;color:#888">Last Command:</div>
 <div style="font-size:11px;color:#4a9eff;font-family:monospace;margin-top:3px" id="statsLastCommand">--</div>
 </div>
@@ -95,6 +99,29 @@ button:hover{background:#ff8555}
 <button onclick="setDriveMode(2)" id="driveNormal">NORMAL</button>
 <button onclick="setDriveMode(3)" id="driveSport">SPORT</button>
 <button onclick="setDriveMode(4)" id="driveDrag">DRAG RACE</button>
+<button onclick="setDriveMode(5)" id="driveReplay">REPLAY</button>
+<button onclick="setDriveMode(6)" id="driveScenario">SCRIPT</button>
+</div>
+<div style="display:flex;gap:10px;flex-wrap:wrap;align-items:center;margin-top:10px;font-size:12px;color:#aaa">
+<span>Trace: <span id="traceInfo">none</span></span>
+<select id="replaySpeed" onchange="sendReplay('replay_speed',{percent:parseInt(this.value)})">
+<option value="50">0.5x</option><option value="100" selected>1x</option><option value="200">2x</option><option value="500">5x</option><option value="1000">10x</option>
+</select>
+<label><input type="checkbox" id="replayLoop" checked onchange="sendReplay('replay_loop',{value:this.checked})"> Loop</label>
+<input type="number" id="replaySeek" min="0" value="0" style="width:70px"> s
+<button onclick="sendReplay('replay_seek',{ms:parseInt(document.getElementById('replaySeek').value)*1000})">Seek</button>
+<input type="file" id="traceFile" accept=".csv,.dat,.bin">
+<button onclick="uploadTrace()">Upload Trace</button>
+</div>
+<div style="display:flex;gap:10px;flex-wrap:wrap;align-items:center;margin-top:10px;font-size:12px;color:#aaa">
+<span>Script: <span id="scenarioInfo">none</span></span>
+<select id="scenarioPreset">
+<option value="0">Idle</option><option value="1">Cruising</option><option value="2">Highway</option><option value="3">Acceleration</option>
+<option value="4">Cold Start</option><option value="5">Hot Idle</option><option value="6">Fault P0420</option><option value="7">Multiple Faults</option>
+</select>
+<button onclick="loadPreset()">Load Preset</button>
+<input type="file" id="scenarioFile" accept=".txt">
+<button onclick="uploadScenario()">Upload Script</button>
 </div>
 <div id="driveStatus" style="margin-top:15px;padding:10px;background:#1a1a1a;border-radius:4px;font-family:monospace;font-size:12px;color:#888">
 Simulator: OFF
@@ -165,8 +192,18 @@ Simulator: OFF
 <option value="U">U0xxx (Network)</option>
 </select>
 <input type="text" id="dtcCode" placeholder="0420" maxlength="4" style="width:100px;padding:8px;background:#1a1a1a;border:1px solid #444;color:#fff;border-radius:4px">
+<select id="dtcEcu" style="padding:8px;background:#1a1a1a;border:1px solid #444;color:#fff;border-radius:4px">
+<option value="0">Engine</option>
+<option value="1">Transmission</option>
+<option value="2">ABS</option>
+</select>
+<select id="dtcState" style="padding:8px;background:#1a1a1a;border:1px solid #444;color:#fff;border-radius:4px">
+<option value="confirmed">Confirmed</option>
+<option value="pending">Pending</option>
+</select>
 <button onclick="addDTC()">Add Code</button>
 </div>
+<button onclick="endDriveCycle()" style="margin-top:10px">End Drive Cycle</button>
 </div>
 <div id="dtcList" style="margin-top:15px;font-family:monospace"></div>
 </div>
@@ -236,6 +273,12 @@ function initWebSocket(){
       document.getElementById('statsMode03').innerText=msg.mode03Count;
       document.getElementById('statsMode09').innerText=msg.mode09Count;
       document.getElementById('statsAT').innerText=msg.atCommandCount;
+      document.getElementById('statsCacheHits').innerText=msg.cacheHits;
+      document.getElementById('statsCacheMisses').innerText=msg.cacheMisses;
+      traceSeconds=msg.traceSeconds;
+      document.getElementById('traceInfo').innerText=traceSeconds?traceSeconds+' s':'none';
+      scenarioBytes=msg.scenarioBytes;
+      if(!scenarioError) document.getElementById('scenarioInfo').innerText=scenarioBytes?scenarioBytes+' bytes':'none';
       document.getElementById('statsLastCommand').innerText=msg.lastCommand||'--';
       return;
     }
@@ -292,41 +335,62 @@ function toggleMIL(){
   updateMILStatus();
 }
 
+var ecuNames=['Engine','Transmission','ABS'];
+
+function findDTC(code,ecu){
+  for(var i=0;i<dtcs.length;i++){
+    if(dtcs[i].code===code && dtcs[i].ecu===ecu) return i;
+  }
+  return -1;
+}
+
 function addDTC(){
   var type=document.getElementById('dtcType').value;
   var code=document.getElementById('dtcCode').value.trim();
+  var ecu=parseInt(document.getElementById('dtcEcu').value);
+  var state=document.getElementById('dtcState').value;
   if(code.length!==4 || !/^[0-9A-F]+$/i.test(code)){
     alert('Please enter a valid 4-digit hex code (e.g., 0420)');
     return;
   }
   var dtcStr=type.toUpperCase()+code.toUpperCase();
-  if(dtcs.includes(dtcStr)){
-    alert('DTC already exists');
-    return;
-  }
-  if(dtcs.length>=8){
-    alert('Maximum 8 DTCs allowed');
-    return;
+  // Adding a stored code again reports another failure
+  var idx=findDTC(dtcStr,ecu);
+  if(idx<0){
+    dtcs.push({code:dtcStr,ecu:ecu,state:state});
+  }else if(state==='confirmed'){
+    dtcs[idx].state=state;
   }
-  dtcs.push(dtcStr);
-  milState=true;
+  if(ecu===0 && state==='confirmed') milState=true;
   document.getElementById('dtcCode').value='';
   if(ws && ws.readyState===WebSocket.OPEN){
-    ws.send(JSON.stringify({cmd:'add_dtc',dtc:dtcStr}));
+    ws.send(JSON.stringify({cmd:'add_dtc',dtc:dtcStr,ecu:ecu,state:state}));
   }
   updateDTCList();
   updateMILStatus();
 }
 
-function removeDTC(dtc){
-  var idx=dtcs.indexOf(dtc);
-  if(idx>-1){
-    dtcs.splice(idx,1);
-    if(ws && ws.readyState===WebSocket.OPEN){
-      ws.send(JSON.stringify({cmd:'remove_dtc',dtc:dtc}));
-    }
-    updateDTCList();
-    updateMILStatus();
+function removeDTC(idx){
+  var dtc=dtcs[idx];
+  dtcs.splice(idx,1);
+  if(ws && ws.readyState===WebSocket.OPEN){
+    ws.send(JSON.stringify({cmd:'remove_dtc',dtc:dtc.code,ecu:dtc.ecu}));
+  }
+  updateDTCList();
+  updateMILStatus();
+}
+
+function captureFreezeFrame(dtc){
+  if(ws && ws.readyState===WebSocket.OPEN){
+    ws.send(JSON.stringify({cmd:'capture_freeze_frame',dtc:dtc}));
+  }
+}
+
+function endDriveCycle(){
+  // The ECU moves codes on (pending -> confirmed, healing, aging); the
+  // list here shows what was reported, so read Modes 03/07/0A for the rest
+  if(ws && ws.readyState===WebSocket.OPEN){
+    ws.send(JSON.stringify({cmd:'end_drive_cycle'}));
   }
 }
 
@@ -365,10 +429,11 @@ function updateDTCList(){
     list.innerHTML='<div style="color:#888;font-style:italic">No DTCs stored</div>';
   }else{
     var html='<h4 style="margin:10px 0">Stored DTCs:</h4>';
-    dtcs.forEach(function(dtc){
+    dtcs.forEach(function(dtc,idx){
       html+='<div style="padding:5px;background:#1a1a1a;margin:5px 0;border-radius:4px;display:flex;justify-content:space-between;align-items:center">';
-      html+='<span style="color:#ff6b35">'+dtc+'</span>';
-      html+='<button onclick="removeDTC(\''+dtc+'\')" style="padding:5px 10px;font-size:12px">Remove</button>';
+      html+='<span style="color:#ff6b35">'+dtc.code+' <span style="color:#888">'+ecuNames[dtc.ecu]+', '+dtc.state+'</span></span><span>';
+      if(dtc.ecu===0) html+='<button onclick="captureFreezeFrame(\''+dtc.code+'\')" style="padding:5px 10px;font-size:12px">Freeze Frame</button> ';
+      html+='<button onclick="removeDTC('+idx+')" style="padding:5px 10px;font-size:12px">Remove</button></span>';
       html+='</div>';
     });
     html+='<button onclick="clearAllDTCs()" style="margin-top:10px;background:#dc2626">Clear All DTCs</button>';
@@ -377,11 +442,22 @@ function updateDTCList(){
 }
 
 var currentDriveMode=0;
+var traceSeconds=0;
+var scenarioBytes=0;
+var scenarioError='';
 
 function setDriveMode(mode){
+  if(mode===5 && !traceSeconds){
+    document.getElementById('driveStatus').innerText='Simulator: no trace uploaded';
+    return;
+  }
+  if(mode===6 && !scenarioBytes){
+    document.getElementById('driveStatus').innerText='Simulator: no script loaded';
+    return;
+  }
   currentDriveMode=mode;
   // Update button styles
-  var modes=['driveOff','driveGentle','driveNormal','driveSport','driveDrag'];
+  var modes=['driveOff','driveGentle','driveNormal','driveSport','driveDrag','driveReplay','driveScenario'];
   modes.forEach(function(id,idx){
     var btn=document.getElementById(id);
     if(idx===mode){
@@ -391,7 +467,7 @@ function setDriveMode(mode){
     }
   });
   // Update status
-  var modeNames=['OFF','GENTLE (0-50 km/h, 5s, warming up)','NORMAL (0-80 km/h, 7s, cruise, stop)','SPORT (0-120 km/h, 8s, hard accel)','DRAG RACE (0-180 km/h, 12s, full throttle)'];
+  var modeNames=['OFF','GENTLE (0-50 km/h, 5s, warming up)','NORMAL (0-80 km/h, 7s, cruise, stop)','SPORT (0-120 km/h, 8s, hard accel)','DRAG RACE (0-180 km/h, 12s, full throttle)','REPLAY (recorded drive)','SCRIPT (scenario)'];
   document.getElementById('driveStatus').innerText='Simulator: '+modeNames[mode];
   // Send command
   if(ws && ws.readyState===WebSocket.OPEN){
@@ -399,6 +475,50 @@ function setDriveMode(mode){
   }
 }
 
+function sendReplay(cmd,args){
+  if(ws && ws.readyState===WebSocket.OPEN){
+    args.cmd=cmd;
+    ws.send(JSON.stringify(args));
+  }
+}
+
+// The trace goes up as the raw request body, written to flash as it arrives
+function uploadTrace(){
+  var file=document.getElementById('traceFile').files[0];
+  if(!file) return;
+  document.getElementById('traceInfo').innerText='uploading...';
+  fetch('/api/trace',{method:'POST',headers:{'Content-Type':'application/octet-stream'},body:file})
+    .then(r=>r.json())
+    .then(d=>{
+      traceSeconds=d.success?d.seconds:0;
+      document.getElementById('traceInfo').innerText=d.success?d.seconds+' s':'not a valid trace';
+      if(currentDriveMode===5) setDriveMode(0);
+    })
+    .catch(e=>{document.getElementById('traceInfo').innerText='upload failed';});
+}
+
+// Loading a script stops the one running
+function loadPreset(){
+  scenarioError='';
+  sendReplay('scenario_preset',{preset:parseInt(document.getElementById('scenarioPreset').value)});
+  if(currentDriveMode===6) setDriveMode(0);
+}
+
+// The script is compiled once it is on flash; a bad one is refused with the line at fault
+function uploadScenario(){
+  var file=document.getElementById('scenarioFile').files[0];
+  if(!file) return;
+  document.getElementById('scenarioInfo').innerText='uploading...';
+  fetch('/api/scenario',{method:'POST',headers:{'Content-Type':'text/plain'},body:file})
+    .then(r=>r.json())
+    .then(d=>{
+      scenarioError=d.success?'':d.error;
+      document.getElementById('scenarioInfo').innerText=d.success?d.bytes+' bytes':d.error;
+      if(currentDriveMode===6) setDriveMode(0);
+    })
+    .catch(e=>{document.getElementById('scenarioInfo').innerText='upload failed';});
+}
+
 window.onload=function(){
   initWebSocket();
   updateDTCList();
@@ -486,6 +606,14 @@ button.danger:hover{background:#ef4444}
 </div>
 </div>
 
+<div class="card">
+<h3>Adapter</h3>
+<div class="form-group">
+<label><input type="checkbox" id="stnPersonality"> STN/OBDLink Personality</label>
+<small style="color:#888">Answer STN commands (STI, STDI, STPX, STPTO, STCSEGT/R) like an OBDLink adapter</small>
+</div>
+</div>
+
 <div class="card">
 <h3>Default PID Values</h3>
 <small style="color:#888">These values will be used when MockStang starts up</small>
@@ -562,6 +690,7 @@ function loadConfig(){
       document.getElementById('gateway').value=cfg.gateway;
       document.getElementById('vin').value=cfg.vin;
       document.getElementById('deviceId').value=cfg.deviceId;
+      document.getElementById('stnPersonality').checked=cfg.stnPersonality;
       document.getElementById('defaultRPM').value=cfg.defaultRPM;
       document.getElementById('defaultSpeed').value=cfg.defaultSpeed;
       document.getElementById('defaultCoolantTemp').value=cfg.defaultCoolantTemp;
@@ -587,6 +716,7 @@ function saveConfig(){
     gateway:document.getElementById('gateway').value,
     vin:document.getElementById('vin').value.toUpperCase(),
     deviceId:document.getElementById('deviceId').value,
+    stnPersonality:document.getElementById('stnPersonality').checked,
     defaultRPM:parseInt(document.getElementById('defaultRPM').value),
     defaultSpeed:parseInt(document.getElementById('defaultSpeed').value),
     defaultCoolantTemp:parseInt(document.getElementById('defaultCoolantTemp').value),
@@ -2,6 +2,7 @@
 #define WEB_SERVER_H
 
 #include <ESPAsyncWebServer.h>
+#include <LittleFS.h>
 
 // Platform-specific async TCP library
 #ifdef ESP01_BUILD
@@ -12,6 +13,7 @@
 
 #include "web_interface.h"
 #include "pid_handler.h"
+#include "can_monitor.h"
 #include "config_manager.h"
 
 // Connection statistics
@@ -23,7 +25,7 @@ struct ConnectionStats {
     unsigned long lastCommandTime;    // Timestamp of last command
     unsigned long sessionStartTime;   // Current session start time
     unsigned long uptime;             // System uptime in seconds
-    String lastCommand;               // Last command received
+    char lastCommand[MAX_COMMAND_LENGTH]; // Last command received
     String clientIP;                  // Current client IP address
     bool clientConnected;             // Is a client currently connected?
 
@@ -42,6 +44,11 @@ private:
     ConfigManager* configManager;
     static WebServer* instance;  // For static callback
     ConnectionStats stats;  // Connection statistics
+    File traceUpload;       // Trace being written by POST /api/trace
+    bool traceUploadOk;
+    File scenarioUpload;    // Script being written by POST /api/scenario
+    bool scenarioUploadOk;
+    String scenarioError;   // Why the last upload was refused
 
     // WebSocket event handler
     static void onWebSocketEvent(AsyncWebSocket *server, AsyncWebSocketClient *client,
@@ -67,7 +74,7 @@ private:
     }
 
 public:
-    WebServer(PIDHandler* handler, ConfigManager* config) : pidHandler(handler), configManager(config) {
+    WebServer(PIDHandler* handler, ConfigManager* config) : pidHandler(handler), configManager(config), traceUploadOk(false), scenarioUploadOk(false) {
         instance = this;  // Set static instance for callback
         server = new AsyncWebServer(WEB_SERVER_PORT);
         ws = new AsyncWebSocket("/ws");
@@ -80,7 +87,7 @@ public:
         stats.lastCommandTime = 0;
         stats.sessionStartTime = 0;
         stats.uptime = 0;
-        stats.lastCommand = "";
+        stats.lastCommand[0] = '\0';
         stats.clientIP = "";
         stats.clientConnected = false;
         stats.mode01Count = 0;
@@ -191,6 +198,13 @@ public:
                     this->configManager->setDeviceId(body.substring(devStart, devEnd).c_str());
                 }
 
+                // Parse adapter personality
+                if (body.indexOf("\"stnPersonality\":true") >= 0) {
+                    this->configManager->setStnPersonality(true);
+                } else {
+                    this->configManager->setStnPersonality(false);
+                }
+
                 // Parse default PID values
                 int rpmIdx = body.indexOf("\"defaultRPM\":");
                 if (rpmIdx >= 0) {
@@ -239,6 +253,80 @@ public:
             }
         );
 
+        // API: Upload a recorded drive for DRIVE_REPLAY (the file is the
+        // request body). Each chunk goes straight to flash as it arrives; the
+        // new trace replaces the old one once complete.
+        server->on("/api/trace", HTTP_POST, [this](AsyncWebServerRequest *request) {
+                if (this->traceUploadOk) {
+                    String json = "{\"success\":true,\"seconds\":" + String(this->pidHandler->getTraceDurationMs() / 1000) + "}";
+                    request->send(200, "application/json", json);
+                } else {
+                    request->send(400, "application/json", "{\"success\":false}");
+                }
+            }, NULL,
+            [this](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+                if (index == 0) {
+                    this->pidHandler->closeTrace();
+                    this->traceUpload = LittleFS.open(TRACE_UPLOAD_PATH, "w");
+                    this->traceUploadOk = (bool)this->traceUpload;
+                }
+                if (this->traceUploadOk && this->traceUpload.write(data, len) != len) {
+                    Serial.println("Trace upload: flash full");
+                    this->traceUploadOk = false;
+                }
+                if (index + len == total) {
+                    if (this->traceUpload) this->traceUpload.close();
+                    if (this->traceUploadOk) {
+                        LittleFS.remove(TRACE_PATH);
+                        this->traceUploadOk = LittleFS.rename(TRACE_UPLOAD_PATH, TRACE_PATH);
+                    } else {
+                        LittleFS.remove(TRACE_UPLOAD_PATH);
+                    }
+                    this->traceUploadOk = this->pidHandler->loadTrace() && this->traceUploadOk;
+                }
+            }
+        );
+
+        // API: Upload a script for DRIVE_SCENARIO (the text is the request
+        // body). It is checked before it replaces the old one, which stays
+        // (and keeps running) if it doesn't compile; ?run starts it at once.
+        server->on("/api/scenario", HTTP_POST, [this](AsyncWebServerRequest *request) {
+                if (this->scenarioUploadOk) {
+                    if (request->hasParam("run")) this->pidHandler->setDriveMode(DRIVE_SCENARIO);
+                    String json = "{\"success\":true,\"bytes\":" + String(this->pidHandler->getScenarioSize()) + "}";
+                    request->send(200, "application/json", json);
+                } else {
+                    request->send(400, "application/json",
+                                  "{\"success\":false,\"error\":\"" + jsonEscape(this->scenarioError) + "\"}");
+                }
+            }, NULL,
+            [this](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+                if (index == 0) {
+                    this->scenarioUpload = LittleFS.open(SCENARIO_UPLOAD_PATH, "w");
+                    this->scenarioUploadOk = (bool)this->scenarioUpload;
+                    this->scenarioError = this->scenarioUploadOk ? "" : "cannot write flash";
+                }
+                if (this->scenarioUploadOk && this->scenarioUpload.write(data, len) != len) {
+                    this->scenarioUploadOk = false;
+                    this->scenarioError = "flash full";
+                }
+                if (index + len == total) {
+                    if (this->scenarioUpload) this->scenarioUpload.close();
+                    if (this->scenarioUploadOk) {
+                        this->scenarioUploadOk = this->pidHandler->checkScenario(SCENARIO_UPLOAD_PATH);
+                        if (!this->scenarioUploadOk) this->scenarioError = this->pidHandler->getScenarioError();
+                    }
+                    if (this->scenarioUploadOk) {
+                        LittleFS.remove(SCENARIO_PATH);
+                        LittleFS.rename(SCENARIO_UPLOAD_PATH, SCENARIO_PATH);
+                        this->pidHandler->loadScenario();
+                    } else {
+                        LittleFS.remove(SCENARIO_UPLOAD_PATH);
+                    }
+                }
+            }
+        );
+
         // API: Factory reset
         server->on("/api/reset", HTTP_POST, [this](AsyncWebServerRequest *request) {
             this->configManager->reset();
@@ -256,9 +344,9 @@ public:
     }
 
     // Broadcast OBD-II command/response to all connected WebSocket clients
-    void broadcastOBDActivity(String command, String response) {
+    void broadcastOBDActivity(const char* command, const char* response) {
         if (ws->count() > 0) {
-            String json = "{\"cmd\":\"" + command + "\",\"resp\":\"" + jsonEscape(response) + "\"}";
+            String json = "{\"cmd\":\"" + String(command) + "\",\"resp\":\"" + jsonEscape(response) + "\"}";
             ws->textAll(json);
         }
     }
@@ -316,6 +404,15 @@ public:
         return code;
     }
 
+    // Optional "ecu":N of a DTC command (index into ECUS), the engine if
+    // missing or out of range
+    uint8_t parseEcu(const String& message) {
+        int ecuStart = message.indexOf("\"ecu\":");
+        if (ecuStart < 0) return PIDHandler::obdEcu();
+        int ecu = message.substring(ecuStart + 6).toInt();
+        return (ecu >= 0 && ecu < ECU_COUNT) ? ecu : PIDHandler::obdEcu();
+    }
+
     // Handle WebSocket message (parameter update from web UI)
     void handleWebSocketMessage(String message) {
         // Simple JSON parsing (format: {"param":"rpm","value":1500})
@@ -354,13 +451,18 @@ public:
             int dtcEnd = message.indexOf("\"", dtcStart);
             String dtcStr = message.substring(dtcStart, dtcEnd);
 
+            // Optional ECU index (default the engine) and state
+            uint8_t ecu = parseEcu(message);
+            bool confirmed = message.indexOf("\"state\":\"pending\"") < 0;
+
             // Convert DTC string to 16-bit code
             uint16_t dtcCode = parseDTC(dtcStr);
             if (dtcCode != 0xFFFF) {
-                if (pidHandler->addDTC(dtcCode)) {
-                    Serial.printf("Added DTC: %s (0x%04X)\n", dtcStr.c_str(), dtcCode);
+                if (pidHandler->addDTC(dtcCode, confirmed, ecu)) {
+                    Serial.printf("DTC %s (0x%04X) failed on %s: status %02X\n", dtcStr.c_str(), dtcCode,
+                                  ECUS[ecu].name, pidHandler->getDTCStatus(dtcCode, ecu));
                 } else {
-                    Serial.printf("Failed to add DTC: %s (full or duplicate)\n", dtcStr.c_str());
+                    Serial.printf("Failed to add DTC: %s (store full)\n", dtcStr.c_str());
                 }
             } else {
                 Serial.printf("Invalid DTC format: %s\n", dtcStr.c_str());
@@ -374,15 +476,33 @@ public:
 
             uint16_t dtcCode = parseDTC(dtcStr);
             if (dtcCode != 0xFFFF) {
-                if (pidHandler->removeDTC(dtcCode)) {
+                if (pidHandler->removeDTC(dtcCode, parseEcu(message))) {
                     Serial.printf("Removed DTC: %s\n", dtcStr.c_str());
                 }
             }
         }
+        else if (message.indexOf("\"cmd\":\"capture_freeze_frame\"") >= 0) {
+            // Record a Mode 02 freeze frame burst for a stored DTC
+            int dtcStart = message.indexOf("\"dtc\":\"") + 7;
+            int dtcEnd = message.indexOf("\"", dtcStart);
+            String dtcStr = message.substring(dtcStart, dtcEnd);
+
+            uint16_t dtcCode = parseDTC(dtcStr);
+            if (dtcCode != 0xFFFF) {
+                pidHandler->captureFreezeFrames(dtcCode);
+                Serial.printf("Freeze frames captured for %s (%u stored)\n", dtcStr.c_str(),
+                              pidHandler->getFreezeFrameCount());
+            }
+        }
         else if (message.indexOf("\"cmd\":\"clear_dtcs\"") >= 0) {
             pidHandler->clearDTCs();
             Serial.println("All DTCs cleared");
         }
+        else if (message.indexOf("\"cmd\":\"end_drive_cycle\"") >= 0) {
+            pidHandler->endDriveCycle();
+            Serial.printf("Drive cycle ended: %u confirmed DTCs, MIL %s\n", pidHandler->getDTCCount(),
+                          pidHandler->getMIL() ? "ON" : "OFF");
+        }
         else if (message.indexOf("\"cmd\":\"set_drive_mode\"") >= 0) {
             // Parse drive mode value
             int modeStart = message.indexOf("\"mode\":") + 7;
@@ -391,10 +511,68 @@ public:
             String modeStr = message.substring(modeStart, modeEnd);
             int mode = modeStr.toInt();
 
-            if (mode >= 0 && mode <= 4) {
-                pidHandler->setDriveMode((DriveMode)mode);
-                const char* modeNames[] = {"OFF", "GENTLE", "NORMAL", "SPORT", "DRAG"};
-                Serial.printf("Drive mode set to: %s\n", modeNames[mode]);
+            if (mode >= 0 && mode <= DRIVE_SCENARIO) {
+                if (pidHandler->setDriveMode((DriveMode)mode)) {
+                    const char* modeNames[] = {"OFF", "GENTLE", "NORMAL", "SPORT", "DRAG", "REPLAY", "SCENARIO"};
+                    Serial.printf("Drive mode set to: %s\n", modeNames[mode]);
+                } else if (mode == DRIVE_REPLAY) {
+                    Serial.printf("No trace to replay (%s)\n", TRACE_PATH);
+                } else {
+                    Serial.println("No scenario loaded");
+                }
+            }
+        }
+        else if (message.indexOf("\"cmd\":\"scenario_preset\"") >= 0) {
+            // Compile a built-in script (format: {"cmd":"scenario_preset","preset":6})
+            int presetStart = message.indexOf("\"preset\":") + 9;
+            int presetEnd = message.indexOf("}", presetStart);
+            int preset = message.substring(presetStart, presetEnd).toInt();
+            if (pidHandler->loadScenarioPreset(preset)) {
+                char name[sizeof(ScenarioPreset::name)];
+                memcpy_P(name, SCENARIO_PRESETS[preset].name, sizeof(name));
+                Serial.printf("Scenario preset %s: %u bytes\n", name, pidHandler->getScenarioSize());
+            } else {
+                Serial.printf("Scenario preset %d: %s\n", preset, pidHandler->getScenarioError());
+            }
+        }
+        else if (message.indexOf("\"cmd\":\"replay_speed\"") >= 0) {
+            // Replay speed in percent of real time (format: {"cmd":"replay_speed","percent":200})
+            int percentStart = message.indexOf("\"percent\":") + 10;
+            int percentEnd = message.indexOf("}", percentStart);
+            pidHandler->setReplaySpeed(message.substring(percentStart, percentEnd).toInt());
+        }
+        else if (message.indexOf("\"cmd\":\"replay_loop\"") >= 0) {
+            pidHandler->setReplayLooping(message.indexOf("\"value\":true") >= 0);
+        }
+        else if (message.indexOf("\"cmd\":\"replay_seek\"") >= 0) {
+            // Jump to a time from the start of the trace (format: {"cmd":"replay_seek","ms":60000})
+            int msStart = message.indexOf("\"ms\":") + 5;
+            int msEnd = message.indexOf("}", msStart);
+            pidHandler->seekReplay(message.substring(msStart, msEnd).toInt());
+        }
+        else if (message.indexOf("\"cmd\":\"set_monitor_rate\"") >= 0) {
+            // Monitor mode bus load in percent (format: {"cmd":"set_monitor_rate","percent":500}).
+            // Above ~100% unfiltered output needs ATCRA/ATCM or set_monitor_uart 0,
+            // or the 115200 baud UART ends it with BUFFER FULL
+            int percentStart = message.indexOf("\"percent\":") + 10;
+            int percentEnd = message.indexOf("}", percentStart);
+            CanMonitor::setRatePercent(message.substring(percentStart, percentEnd).toInt());
+            Serial.printf("Monitor rate set to: %d%%\n", CanMonitor::getRatePercent());
+        }
+        else if (message.indexOf("\"cmd\":\"set_monitor_uart\"") >= 0) {
+            // Adapter UART rate monitor output drains at, 0 = no limit (format: {"cmd":"set_monitor_uart","baud":0})
+            int baudStart = message.indexOf("\"baud\":") + 7;
+            int baudEnd = message.indexOf("}", baudStart);
+            CanMonitor::setUartBaud(message.substring(baudStart, baudEnd).toInt());
+            Serial.printf("Monitor UART set to: %lu baud\n", (unsigned long)CanMonitor::getUartBaud());
+        }
+        else if (message.indexOf("\"cmd\":\"set_protocol\"") >= 0) {
+            // Bus protocol of the simulated car, ATSP numbering (format: {"cmd":"set_protocol","protocol":3})
+            int protocolStart = message.indexOf("\"protocol\":") + 11;
+            int protocolEnd = message.indexOf("}", protocolStart);
+            uint8_t number = message.substring(protocolStart, protocolEnd).toInt();
+            if (pidHandler->setVehicleProtocol(number)) {
+                Serial.printf("Vehicle protocol set to: %s\n", OBD_PROTOCOLS[number].name);
             }
         }
 
@@ -425,19 +603,21 @@ public:
         stats.clientIP = "";
     }
 
-    void trackCommand(String command) {
+    // Command is expected in normalized form (see ELM327Protocol::normalizeCommand)
+    void trackCommand(const char* command) {
         stats.totalCommands++;
         stats.lastCommandTime = millis();
-        stats.lastCommand = command;
+        strncpy(stats.lastCommand, command, sizeof(stats.lastCommand) - 1);
+        stats.lastCommand[sizeof(stats.lastCommand) - 1] = '\0';
 
         // Track command types
-        if (command.startsWith("01")) {
+        if (command[0] == '0' && command[1] == '1') {
             stats.mode01Count++;
-        } else if (command.startsWith("03")) {
+        } else if (command[0] == '0' && command[1] == '3') {
             stats.mode03Count++;
-        } else if (command.startsWith("09")) {
+        } else if (command[0] == '0' && command[1] == '9') {
             stats.mode09Count++;
-        } else if (command.startsWith("AT") || command.startsWith("at")) {
+        } else if (ELM327Protocol::isATCommand(command)) {
             stats.atCommandCount++;
         }
     }
@@ -478,7 +658,11 @@ public:
             json += "\"mode01Count\":" + String(stats.mode01Count) + ",";
             json += "\"mode03Count\":" + String(stats.mode03Count) + ",";
             json += "\"mode09Count\":" + String(stats.mode09Count) + ",";
-            json += "\"atCommandCount\":" + String(stats.atCommandCount) + "}";
+            json += "\"atCommandCount\":" + String(stats.atCommandCount) + ",";
+            json += "\"cacheHits\":" + String(pidHandler->getCacheHits()) + ",";
+            json += "\"cacheMisses\":" + String(pidHandler->getCacheMisses()) + ",";
+            json += "\"traceSeconds\":" + String(pidHandler->getTraceDurationMs() / 1000) + ",";
+            json += "\"scenarioBytes\":" + String(pidHandler->getScenarioSize()) + "}";
 
             ws->textAll(json);
         }
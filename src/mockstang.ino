@@ -20,6 +20,9 @@
 #include "pid_handler.h"
 #include "web_server.h"
 #include "config_manager.h"
+#include "can_monitor.h"
+#include "periodic_scheduler.h"
+#include "benchmark.h"
 
 // ELM327 TCP Server
 WiFiServer elm327Server(ELM327_PORT);
@@ -28,6 +31,8 @@ WiFiClient elm327Client;
 // Protocol handlers
 ELM327Protocol elm327;
 PIDHandler* pidHandler;
+CanMonitor* canMonitor;  // ATMA/ATMR streaming for the TCP client
+PeriodicScheduler* periodic;  // Service 2A frames for the TCP client
 WebServer* webServer;
 ConfigManager* configManager;
 
@@ -41,7 +46,10 @@ ConfigManager* configManager;
 
 // Client connection state
 bool clientConnected = false;
-String inputBuffer = "";
+char inputBuffer[MAX_COMMAND_LENGTH];
+char lastRequest[MAX_COMMAND_LENGTH] = "";  // Repeated by an empty line
+uint8_t inputLength = 0;
+char responseBuffer[MAX_RESPONSE_LENGTH];
 
 // State broadcast timing
 unsigned long lastStateBroadcast = 0;
@@ -65,9 +73,16 @@ void setup() {
     // Load configuration from EEPROM
     configManager = new ConfigManager();
     configManager->load();
+    elm327.setStnEnabled(configManager->getStnPersonality());
 
     // Initialize handlers
     pidHandler = new PIDHandler(&elm327, configManager);
+    pidHandler->loadDids();
+    pidHandler->loadEcuImage();
+    pidHandler->loadTrace();
+    pidHandler->loadScenario();
+    canMonitor = new CanMonitor(&elm327, pidHandler);
+    periodic = new PeriodicScheduler(&elm327, pidHandler);
     webServer = new WebServer(pidHandler, configManager);
 
     // Apply default PID values from config
@@ -80,6 +95,11 @@ void setup() {
     pidHandler->updateFuelLevel(configManager->getDefaultFuelLevel());
     pidHandler->updateBarometric(configManager->getDefaultBarometric());
 
+    #if SIM_TASK
+        // Driving simulator on its own task (ESP32)
+        pidHandler->startSimulatorTask();
+    #endif
+
     #if ENABLE_DISPLAY
         // Initialize TFT display (ESP32 only)
         display = new DisplayManager(pidHandler);
@@ -133,6 +153,10 @@ void setup() {
         bleServer->begin();
     #endif
 
+    #if ENABLE_BENCHMARKS
+        Benchmarks::run(&elm327, pidHandler);
+    #endif
+
     Serial.println("\n=================================");
     Serial.println("System Ready!");
     Serial.printf("Connect to WiFi: %s\n", ssid);
@@ -167,7 +191,7 @@ void loop() {
             elm327Client = elm327Server.accept();
             if (elm327Client) {
                 clientConnected = true;
-                inputBuffer = "";
+                inputLength = 0;
                 Serial.printf("ELM327 client connected from %s\n",
                              elm327Client.remoteIP().toString().c_str());
 
@@ -186,27 +210,52 @@ void loop() {
         while (elm327Client.available()) {
             char c = elm327Client.read();
 
+            // Any byte ends monitor mode and is discarded, like the real chip
+            if (canMonitor->isActive()) {
+                canMonitor->stop(elm327Client);
+                continue;
+            }
+
             // ELM327 protocol uses CR (0x0D) as command terminator
             if (c == '\r' || c == '\n') {
-                if (inputBuffer.length() > 0) {
+                // An empty line (bare CR) repeats the last request
+                if (inputLength > 0 || c == '\r') {
+                    inputBuffer[inputLength] = '\0';
                     processCommand(inputBuffer);
-                    inputBuffer = "";
+                    inputLength = 0;
                 }
             } else if (c >= 32 && c < 127) {  // Printable characters only
-                inputBuffer += c;
-                if (inputBuffer.length() >= MAX_COMMAND_LENGTH) {
+                inputBuffer[inputLength++] = c;
+                if (inputLength >= MAX_COMMAND_LENGTH - 1) {
                     // Buffer overflow protection
-                    inputBuffer = "";
+                    inputLength = 0;
                     elm327Client.print("BUFFER FULL\r\r>");
                 }
             }
         }
+
+        // Stream monitor and periodic output without blocking the loop
+        if (canMonitor->isActive() || periodic->isActive()) {
+            #ifdef ESP01_BUILD
+                size_t room = elm327Client.availableForWrite();
+            #else
+                size_t room = ELM_BUFFER_SIZE;  // write() waits for the TCP stack
+            #endif
+            if (canMonitor->isActive()) {
+                canMonitor->poll(elm327Client, room);
+            } else {
+                periodic->poll(elm327Client, room);
+            }
+        }
     } else if (clientConnected) {
         // Client disconnected
         Serial.println("ELM327 client disconnected");
         elm327Client.stop();
         clientConnected = false;
-        inputBuffer = "";
+        inputLength = 0;
+        canMonitor->cancel();
+        periodic->cancel();
+        pidHandler->endSession();  // Dynamic DIDs, uploads
 
         // Track disconnection
         webServer->trackDisconnection();
@@ -220,14 +269,17 @@ void loop() {
         // This section could be expanded to handle queued messages
     }
 
-    // Update driving simulator
-    pidHandler->updateDrivingSimulator();
+    // The driving simulator runs on its own task, or advances when its
+    // state is read (requests, broadcasts, display); only due freeze
+    // frames need the loop
+    pidHandler->updateFreezeFrames();
 
-    // Broadcast state updates during driving simulation
+    // Broadcast state updates during driving simulation; without a client
+    // don't take a snapshot (or step the simulator) at all
     if (pidHandler->getDriveMode() != DRIVE_OFF) {
         unsigned long now = millis();
         if (now - lastStateBroadcast >= STATE_BROADCAST_INTERVAL) {
-            webServer->broadcastState(pidHandler->getState());
+            if (ws && ws->count() > 0) webServer->broadcastState(pidHandler->getState());
             lastStateBroadcast = now;
         }
     }
@@ -242,40 +294,46 @@ void loop() {
     delay(1);  // Small delay to prevent watchdog timer issues
 }
 
-void processCommand(String command) {
-    command.trim();
-
-    if (command.length() == 0) {
-        return;
+void processCommand(char* command) {
+    // Strip spaces and upper-case in place (no heap allocation)
+    if (ELM327Protocol::normalizeCommand(command) == 0) {
+        // Bare CR: repeat the last OBD request, like a real ELM327
+        if (lastRequest[0] == '\0') return;
+        strcpy(command, lastRequest);
     }
 
     // Track command statistics
     webServer->trackCommand(command);
 
     #if ENABLE_SERIAL_LOGGING
-        Serial.printf("CMD: %s\n", command.c_str());
+        Serial.printf("CMD: %s\n", command);
     #endif
 
-    String response;
+    // Response is streamed to the client as it is produced (multi-frame
+    // replies are paced frame by frame); responseBuffer keeps the text
+    ResponseWriter out(responseBuffer, sizeof(responseBuffer), &elm327Client);
 
-    // Check if it's an AT command or OBD request
-    if (command.startsWith("AT") || command.startsWith("at")) {
-        response = elm327.handleCommand(command);
+    // Check if it's an AT/ST command or OBD request
+    if (ELM327Protocol::isATCommand(command) || ELM327Protocol::isSTCommand(command)) {
+        elm327.handleCommand(command, out);
+        canMonitor->startIfRequested();  // ATMA/ATMR: output continues from loop()
+        pidHandler->runQueuedRequest(out);  // STPX: send it and stream the replies
     } else {
-        // OBD-II request - simulate ECU query delay
-        // Real ELM327 adapters have 20-100ms delay for CAN bus communication
-        delay(35);
-        response = pidHandler->handleRequest(command);
+        // OBD-II request - ECU latency and ATST/ATAT wait are emulated inside
+        strcpy(lastRequest, command);
+        pidHandler->handleRequest(command, out);
     }
+    periodic->applyRequests();  // Service 2A: frames follow from loop()
 
-    // Send response to client
-    elm327Client.print(response);
+    // Send the rest of the response to the client
+    out.flush();
+    const char* response = out.c_str();
 
     // Track response
     webServer->trackResponse();
 
     #if ENABLE_SERIAL_LOGGING
-        Serial.printf("RESP: %s\n", response.c_str());
+        Serial.printf("RESP: %s\n", response);
     #endif
 
     // Broadcast to web interface